@@ -8,8 +8,36 @@ MULTI_CONF = False
 
 # Définir les modes de sortie audio
 CONF_AUDIO_OUTPUT_MODE = "audio_output_mode"
+CONF_IDLE_SUSPEND_TIMEOUT = "idle_suspend_timeout"
+CONF_AUDIO_METER = "audio_meter"
+CONF_TRACE = "trace"
+CONF_SINK_PROFILE = "sink_profile"
+CONF_MIXER = "mixer"
+CONF_DUCK_LEVEL = "duck_level"
+CONF_DUCK_ATTACK = "duck_attack"
+CONF_DUCK_RELEASE = "duck_release"
+CONF_UAC_BUFFER_SIZE = "uac_buffer_size"
+CONF_UAC_BUFFER_THRESHOLD = "uac_buffer_threshold"
+CONF_LATENCY_PROBE = "latency_probe"
+CONF_THRESHOLD = "threshold"
+CONF_INTERVAL = "interval"
+CONF_TIMEOUT = "timeout"
+CONF_SCHEDULER = "scheduler"
+CONF_OUTPUT_LATENCY = "output_latency"
+CONF_ASSETS = "assets"
+CONF_PARTITION = "partition"
+CONF_MIC_FEED = "mic_feed"
+CONF_HID_CONTROLS = "hid_controls"
+CONF_VOLUME_STEP = "volume_step"
+CONF_RESUME = "resume"
+CONF_CHECKPOINT_INTERVAL = "checkpoint_interval"
+CONF_SEEK_INTERVAL = "seek_interval"
+# usb_headset garde le repli sur le haut-parleur qu'il avait avant le choix de la sortie à la compilation
 AUDIO_OUTPUT_MODES = {
-    "usb_headset": "USB_HEADSET",
+    "usb_headset": "USBAUDIO_SINK_USB_I2S_FALLBACK",
+    "usb_headset_only": "USBAUDIO_SINK_USB",
+    "speaker": "USBAUDIO_SINK_I2S",
+    "usb_headset_with_speaker_fallback": "USBAUDIO_SINK_USB_I2S_FALLBACK",
 }
 
 usbaudio_ns = cg.esphome_ns.namespace('usbaudio')
@@ -24,6 +52,38 @@ def validate_audio_output_mode(value):
 CONFIG_SCHEMA = cv.Schema({
     cv.Required(CONF_ID): cv.declare_id(USBAudioComponent),
     cv.Required(CONF_AUDIO_OUTPUT_MODE): validate_audio_output_mode,
+    cv.Optional(CONF_IDLE_SUSPEND_TIMEOUT, default="2s"): cv.positive_time_period_milliseconds,
+    cv.Optional(CONF_AUDIO_METER, default=True): cv.boolean,
+    cv.Optional(CONF_TRACE, default=False): cv.boolean,
+    cv.Optional(CONF_SINK_PROFILE, default=False): cv.boolean,
+    cv.Optional(CONF_MIXER): cv.Schema({
+        cv.Optional(CONF_DUCK_LEVEL, default=-12.0): cv.float_range(max=0.0),
+        cv.Optional(CONF_DUCK_ATTACK, default="50ms"): cv.positive_time_period_milliseconds,
+        cv.Optional(CONF_DUCK_RELEASE, default="300ms"): cv.positive_time_period_milliseconds,
+    }),
+    cv.Optional(CONF_UAC_BUFFER_SIZE, default=16000): cv.int_range(min=1024),
+    cv.Optional(CONF_UAC_BUFFER_THRESHOLD, default=4000): cv.int_range(min=256),
+    cv.Optional(CONF_LATENCY_PROBE): cv.Schema({
+        cv.Optional(CONF_THRESHOLD, default=0.1): cv.float_range(min=0.0, max=1.0, min_included=False),
+        cv.Optional(CONF_INTERVAL, default="1s"): cv.positive_time_period_milliseconds,
+        cv.Optional(CONF_TIMEOUT, default="500ms"): cv.positive_time_period_milliseconds,
+    }),
+    cv.Optional(CONF_SCHEDULER): cv.Schema({
+        cv.Optional(CONF_OUTPUT_LATENCY, default="0ms"): cv.positive_time_period_microseconds,
+    }),
+    cv.Optional(CONF_MIC_FEED, default=False): cv.boolean,
+    cv.Optional(CONF_HID_CONTROLS): cv.Schema({
+        cv.Optional(CONF_VOLUME_STEP, default=5): cv.int_range(min=1, max=50),
+    }),
+    cv.Optional(CONF_RESUME): cv.Schema({
+        cv.Optional(CONF_CHECKPOINT_INTERVAL, default="30s"): cv.All(
+            cv.positive_time_period_seconds, cv.Range(min=cv.TimePeriod(seconds=5))),
+    }),
+    cv.Optional(CONF_SEEK_INTERVAL, default="1s"): cv.All(
+        cv.positive_time_period_milliseconds, cv.Range(min=cv.TimePeriod(milliseconds=100))),
+    cv.Optional(CONF_ASSETS): cv.Schema({
+        cv.Optional(CONF_PARTITION, default="assets"): cv.string_strict,
+    }),
 }).extend(cv.COMPONENT_SCHEMA)
 
 def to_code(config):
@@ -32,7 +92,68 @@ def to_code(config):
     # Enregistrer le composant
     yield cg.register_component(var, config)
     
-    # Définir le mode de sortie audio
+    # Définir le mode de sortie audio, la sortie est choisie à la compilation
     audio_output_mode = config[CONF_AUDIO_OUTPUT_MODE]
-    cg.add(var.set_audio_output_mode(AUDIO_OUTPUT_MODES[audio_output_mode]))
+    cg.add_define(AUDIO_OUTPUT_MODES[audio_output_mode])
+    if config[CONF_SINK_PROFILE]:
+        cg.add_define("USBAUDIO_SINK_PROFILE")
 
+    # Délai d'inactivité avant la mise en veille du périphérique UAC
+    cg.add_define("USBAUDIO_IDLE_SUSPEND_MS", config[CONF_IDLE_SUSPEND_TIMEOUT].total_milliseconds)
+
+    # Niveaux et spectre pour l'interface LVGL
+    if config[CONF_AUDIO_METER]:
+        cg.add_define("USBAUDIO_METER")
+
+    # Points de trace par étape, une piste par tâche, exportés par dump_trace() au format Chrome trace-event
+    if config[CONF_TRACE]:
+        cg.add_define("USBAUDIO_TRACE")
+
+    # Mélangeur multi-source avec atténuation (ducking) des flux moins prioritaires
+    if CONF_MIXER in config:
+        mixer = config[CONF_MIXER]
+        cg.add_define("USBAUDIO_MIXER")
+        cg.add_define("USBAUDIO_MIXER_DUCK_DB", f"{mixer[CONF_DUCK_LEVEL]}f")
+        cg.add_define("USBAUDIO_MIXER_ATTACK_MS", mixer[CONF_DUCK_ATTACK].total_milliseconds)
+        cg.add_define("USBAUDIO_MIXER_RELEASE_MS", mixer[CONF_DUCK_RELEASE].total_milliseconds)
+
+    # Tampon du pilote UAC, à faire varier pour comparer les latences
+    cg.add_define("USBAUDIO_UAC_BUFFER_SIZE", config[CONF_UAC_BUFFER_SIZE])
+    cg.add_define("USBAUDIO_UAC_BUFFER_THRESHOLD", config[CONF_UAC_BUFFER_THRESHOLD])
+
+    # Mesure de latence aller-retour par impulsion captée au micro
+    if CONF_LATENCY_PROBE in config:
+        probe = config[CONF_LATENCY_PROBE]
+        cg.add_define("USBAUDIO_LATENCY")
+        cg.add_define("USBAUDIO_LATENCY_THRESHOLD", f"{probe[CONF_THRESHOLD]}f")
+        cg.add_define("USBAUDIO_LATENCY_INTERVAL_MS", probe[CONF_INTERVAL].total_milliseconds)
+        cg.add_define("USBAUDIO_LATENCY_TIMEOUT_MS", probe[CONF_TIMEOUT].total_milliseconds)
+
+    # Lecture programmée à l'échantillon près, latence de sortie mesurée avec latency_probe
+    if CONF_SCHEDULER in config:
+        cg.add_define("USBAUDIO_SCHEDULE")
+        cg.add_define("USBAUDIO_SCHEDULE_LATENCY_US", config[CONF_SCHEDULER][CONF_OUTPUT_LATENCY].total_microseconds)
+
+    # Clips lus directement depuis une partition projetée en mémoire (image créée par tools/mkassets.py)
+    if CONF_ASSETS in config:
+        cg.add_define("USBAUDIO_ASSETS")
+        cg.add_define("USBAUDIO_ASSETS_PARTITION", f'"{config[CONF_ASSETS][CONF_PARTITION]}"')
+        if CONF_SCHEDULER not in config:
+            cg.add_define("USBAUDIO_SCHEDULE")
+
+    # Micro du casque en 16 kHz mono pour les pipelines vocaux
+    if config[CONF_MIC_FEED]:
+        cg.add_define("USBAUDIO_MIC_FEED")
+
+    # Touches volume / muet / lecture-pause du casque (interface HID consumer control)
+    if CONF_HID_CONTROLS in config:
+        cg.add_define("USBAUDIO_HID")
+        cg.add_define("USBAUDIO_VOLUME_STEP", config[CONF_HID_CONTROLS][CONF_VOLUME_STEP])
+
+    # Index de recherche MP3 (fichier .idx, aussi créé sur l'hôte par tools/mkseek.py)
+    cg.add_define("USBAUDIO_SEEK_INTERVAL_MS", config[CONF_SEEK_INTERVAL].total_milliseconds)
+
+    # Reprise après redémarrage ou reconnexion : état sauvegardé en NVS, position via l'index de recherche
+    if CONF_RESUME in config:
+        cg.add_define("USBAUDIO_RESUME")
+        cg.add_define("USBAUDIO_STATE_INTERVAL_S", config[CONF_RESUME][CONF_CHECKPOINT_INTERVAL].total_seconds)
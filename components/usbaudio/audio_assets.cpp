@@ -0,0 +1,241 @@
+#include "audio_assets.h"
+
+#include <string.h>
+#ifdef ESP_PLATFORM
+#include "esphome/core/log.h"
+#include "esp_partition.h"
+#endif
+
+namespace esphome {
+namespace usbaudio {
+
+static const uint8_t *s_image = NULL;
+static size_t s_image_size = 0;
+static uint16_t s_count = 0;
+static uint32_t s_index_offset = 0;
+
+static void _audio_assets_entry(size_t index, audio_asset_entry_t *entry)
+{
+    memcpy(entry, s_image + s_index_offset + index * sizeof(*entry), sizeof(*entry));
+}
+
+static bool _audio_assets_entry_valid(const audio_asset_entry_t *e, size_t image_size)
+{
+    if (memchr(e->name, '\0', sizeof(e->name)) == NULL || e->offset % AUDIO_ASSETS_ALIGN != 0 ||
+            e->offset > image_size || e->size > image_size - e->offset ||
+            (e->channels != 1 && e->channels != 2) || e->sample_rate == 0) {
+        return false;
+    }
+    switch (e->codec) {
+    case AUDIO_ASSET_PCM16:
+        return (uint64_t)e->frames * e->channels * sizeof(int16_t) <= e->size;
+    case AUDIO_ASSET_IMA_ADPCM: {
+        // a header per channel, then groups of 4 bytes per channel
+        uint32_t header = 4 * e->channels;
+        if (e->block_align <= header || (e->block_align - header) % header != 0) {
+            return false;
+        }
+        if (e->frames == 0) {
+            return true;
+        }
+        // the last block may be cut after its last group of samples
+        uint32_t block_frames = (e->block_align - header) * 2 / e->channels + 1;
+        uint32_t blocks = (e->frames + block_frames - 1) / block_frames;
+        uint32_t last_frames = e->frames - (blocks - 1) * block_frames;
+        uint64_t needed = (uint64_t)(blocks - 1) * e->block_align + header + (last_frames - 1 + 7) / 8 * header;
+        return needed <= e->size;
+    }
+    default:
+        return false;
+    }
+}
+
+esp_err_t audio_assets_attach(const void *image, size_t size)
+{
+    audio_assets_header_t header;
+    // nothing stays attached when the image is refused
+    s_image = NULL;
+    s_count = 0;
+    if (image == NULL || size < sizeof(header)) {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    memcpy(&header, image, sizeof(header));
+    if (memcmp(header.magic, AUDIO_ASSETS_MAGIC, sizeof(header.magic)) != 0) {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    if (header.version != AUDIO_ASSETS_VERSION) {
+        return ESP_ERR_INVALID_VERSION;
+    }
+    if (header.image_size > size || header.index_offset > header.image_size ||
+            (uint64_t)header.count * sizeof(audio_asset_entry_t) > header.image_size - header.index_offset) {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    s_image = (const uint8_t *)image;
+    s_image_size = header.image_size;
+    s_index_offset = header.index_offset;
+    s_count = header.count;
+    for (size_t i = 0; i < s_count; i++) {
+        audio_asset_entry_t entry;
+        _audio_assets_entry(i, &entry);
+        if (!_audio_assets_entry_valid(&entry, s_image_size)) {
+            s_image = NULL;
+            s_count = 0;
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+    }
+    return ESP_OK;
+}
+
+#ifdef ESP_PLATFORM
+static const char *const TAG = "audio_assets";
+static esp_partition_mmap_handle_t s_mmap_handle;
+
+esp_err_t audio_assets_mount(const char *label)
+{
+    const esp_partition_t *part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+    if (part == NULL) {
+        ESP_LOGE(TAG, "No asset partition '%s'", label);
+        return ESP_ERR_NOT_FOUND;
+    }
+    const void *image = NULL;
+    esp_err_t ret = esp_partition_mmap(part, 0, part->size, ESP_PARTITION_MMAP_DATA, &image, &s_mmap_handle);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Mapping '%s' failed: %s", label, esp_err_to_name(ret));
+        return ret;
+    }
+    ret = audio_assets_attach(image, part->size);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Partition '%s' holds no valid asset image: %s", label, esp_err_to_name(ret));
+        esp_partition_munmap(s_mmap_handle);
+        return ret;
+    }
+    ESP_LOGI(TAG, "Mapped %u clips, %u bytes from '%s'", s_count, (unsigned)s_image_size, label);
+    return ESP_OK;
+}
+#endif
+
+static void _audio_assets_fill(size_t index, const audio_asset_entry_t *entry, audio_asset_t *asset)
+{
+    // points at the name in the index, NUL termination is checked on attach
+    asset->name = (const char *)(s_image + s_index_offset + index * sizeof(*entry));
+    asset->data = s_image + entry->offset;
+    asset->size = entry->size;
+    asset->frames = entry->frames;
+    asset->sample_rate = entry->sample_rate;
+    asset->channels = entry->channels;
+    asset->codec = (audio_asset_codec_t)entry->codec;
+    asset->block_align = entry->block_align;
+}
+
+size_t audio_assets_count(void)
+{
+    return s_image ? s_count : 0;
+}
+
+esp_err_t audio_assets_get(size_t index, audio_asset_t *asset)
+{
+    if (s_image == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (index >= s_count) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    audio_asset_entry_t entry;
+    _audio_assets_entry(index, &entry);
+    _audio_assets_fill(index, &entry, asset);
+    return ESP_OK;
+}
+
+esp_err_t audio_assets_find(const char *name, audio_asset_t *asset)
+{
+    if (s_image == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    for (size_t i = 0; i < s_count; i++) {
+        const char *entry_name = (const char *)(s_image + s_index_offset + i * sizeof(audio_asset_entry_t));
+        if (strncmp(entry_name, name, AUDIO_ASSETS_NAME_LEN) == 0) {
+            return audio_assets_get(i, asset);
+        }
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+static const int16_t s_ima_step[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+    253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+    1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+    3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487,
+    12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+static const int8_t s_ima_index[16] = {
+    -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+typedef struct {
+    int32_t predictor;
+    int32_t index;
+} ima_state_t;
+
+static inline int16_t _ima_decode(ima_state_t *st, uint8_t nibble)
+{
+    int32_t step = s_ima_step[st->index];
+    int32_t diff = step >> 3;
+    if (nibble & 4) {
+        diff += step;
+    }
+    if (nibble & 2) {
+        diff += step >> 1;
+    }
+    if (nibble & 1) {
+        diff += step >> 2;
+    }
+    st->predictor += (nibble & 8) ? -diff : diff;
+    if (st->predictor > INT16_MAX) {
+        st->predictor = INT16_MAX;
+    } else if (st->predictor < INT16_MIN) {
+        st->predictor = INT16_MIN;
+    }
+    st->index += s_ima_index[nibble];
+    st->index = st->index < 0 ? 0 : (st->index > 88 ? 88 : st->index);
+    return (int16_t)st->predictor;
+}
+
+esp_err_t audio_asset_decode(const audio_asset_t *asset, int16_t *out)
+{
+    const uint32_t ch = asset->channels;
+    const uint32_t header = 4 * ch;
+    if (asset->codec != AUDIO_ASSET_IMA_ADPCM || asset->block_align <= header) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    const size_t block_frames = (asset->block_align - header) * 2 / ch + 1;
+    const uint8_t *block = asset->data;
+    size_t done = 0;
+
+    while (done < asset->frames) {
+        ima_state_t st[2];
+        for (uint32_t c = 0; c < ch; c++) {
+            st[c].predictor = (int16_t)(block[4 * c] | (block[4 * c + 1] << 8));
+            st[c].index = block[4 * c + 2] > 88 ? 88 : block[4 * c + 2];
+            out[done * ch + c] = (int16_t)st[c].predictor;
+        }
+        size_t frames = asset->frames - done < block_frames ? asset->frames - done : block_frames;
+        // groups of 8 samples, 4 bytes per channel, low nibble first
+        const uint8_t *p = block + header;
+        for (size_t f = 1; f < frames; f += 8) {
+            for (uint32_t c = 0; c < ch; c++) {
+                for (size_t k = 0; k < 8 && f + k < frames; k++) {
+                    uint8_t byte = p[k / 2];
+                    out[(done + f + k) * ch + c] = _ima_decode(&st[c], (k & 1) ? byte >> 4 : byte & 0x0F);
+                }
+                p += 4;
+            }
+        }
+        done += frames;
+        block += asset->block_align;
+    }
+    return ESP_OK;
+}
+
+} // namespace usbaudio
+} // namespace esphome
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+namespace esphome {
+namespace usbaudio {
+
+/*
+ * Asset image, built on the host by tools/mkassets.py and flashed to its own data partition
+ *
+ *   header   "UAAS", version, clip count, index offset, image size (16 bytes)
+ *   index    one audio_asset_entry_t per clip (44 bytes each)
+ *   data     clip payloads, each aligned to AUDIO_ASSETS_ALIGN
+ *
+ * All fields are little endian. The partition is mapped once, clip data is used in place.
+ */
+#define AUDIO_ASSETS_MAGIC      "UAAS"
+#define AUDIO_ASSETS_VERSION    1
+#define AUDIO_ASSETS_ALIGN      4
+#define AUDIO_ASSETS_NAME_LEN   24
+
+enum audio_asset_codec_t {
+    AUDIO_ASSET_PCM16 = 0,      /*!< interleaved 16-bit samples */
+    AUDIO_ASSET_IMA_ADPCM,      /*!< 4-bit IMA ADPCM, WAV block layout */
+};
+
+struct audio_assets_header_t {
+    char magic[4];
+    uint16_t version;
+    uint16_t count;
+    uint32_t index_offset;
+    uint32_t image_size;
+};
+
+struct audio_asset_entry_t {
+    char name[AUDIO_ASSETS_NAME_LEN];   /*!< NUL terminated */
+    uint32_t offset;                    /*!< from the start of the image */
+    uint32_t size;                      /*!< payload bytes */
+    uint32_t frames;
+    uint32_t sample_rate;
+    uint8_t channels;                   /*!< 1 or 2 */
+    uint8_t codec;                      /*!< audio_asset_codec_t */
+    uint16_t block_align;               /*!< ADPCM block size in bytes, 0 for PCM */
+};
+
+/**
+ * @brief A clip in the mapped image
+ */
+typedef struct {
+    const char *name;
+    const uint8_t *data;                /*!< points into the mapped partition, read-only */
+    size_t size;
+    size_t frames;
+    uint32_t sample_rate;
+    uint8_t channels;
+    audio_asset_codec_t codec;
+    uint16_t block_align;
+} audio_asset_t;
+
+/**
+ * @brief Map the asset partition and check its index
+ *
+ * @param label: partition label in the partition table
+ *
+ * @return
+ *    - ESP_OK: Success
+ *    - ESP_ERR_NOT_FOUND: no data partition with this label
+ *    - ESP_ERR_INVALID_VERSION: image built for another format version
+ *    - ESP_ERR_INVALID_RESPONSE: not an asset image or index out of bounds
+ *    - Others: mapping failed
+ */
+esp_err_t audio_assets_mount(const char *label);
+
+/**
+ * @brief Use an image that is already in memory, e.g. a host side mapping of the image file
+ *
+ * Has no ESP-IDF dependency so that host tools can check images with the same code.
+ */
+esp_err_t audio_assets_attach(const void *image, size_t size);
+
+/**
+ * @brief Look up a clip by name
+ *
+ * @return
+ *    - ESP_OK: Success
+ *    - ESP_ERR_INVALID_STATE: no image mounted
+ *    - ESP_ERR_NOT_FOUND: no clip with this name
+ */
+esp_err_t audio_assets_find(const char *name, audio_asset_t *asset);
+
+size_t audio_assets_count(void);
+esp_err_t audio_assets_get(size_t index, audio_asset_t *asset);
+
+/**
+ * @brief Decode an IMA ADPCM clip to 16-bit PCM
+ *
+ * @param asset: ADPCM clip
+ * @param out: asset->frames * asset->channels samples
+ *
+ * @return
+ *    - ESP_OK: Success
+ *    - ESP_ERR_INVALID_ARG: not an ADPCM clip or bad block size
+ */
+esp_err_t audio_asset_decode(const audio_asset_t *asset, int16_t *out);
+
+} // namespace usbaudio
+} // namespace esphome
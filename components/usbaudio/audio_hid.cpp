@@ -0,0 +1,439 @@
+#include "audio_hid.h"
+
+#include <string.h>
+#ifdef ESP_PLATFORM
+#include <atomic>
+#include "esphome/core/log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "usb/hid_host.h"
+#endif
+
+namespace esphome {
+namespace usbaudio {
+
+#define HID_USAGE_PAGE_CONSUMER     0x0C
+#define HID_MAX_USAGES              16
+#define HID_MAX_REPORTS             16
+#define HID_STACK_DEPTH             4
+
+/* Consumer page usages, indexed by audio_hid_key_t */
+static const uint16_t s_key_usage[AUDIO_HID_KEY_MAX] = {
+    0xE9,   // Volume Increment
+    0xEA,   // Volume Decrement
+    0xE2,   // Mute
+    0xCD,   // Play/Pause
+};
+
+typedef struct {
+    uint16_t usage_page;
+    int32_t logical_min;
+    uint8_t report_size;
+    uint8_t report_id;
+    uint16_t report_count;
+} hid_global_t;
+
+typedef struct {
+    uint32_t usages[HID_MAX_USAGES];    /*!< bit 31: page given in the item, else in the low 16 bits only */
+    uint8_t usage_count;
+    uint32_t usage_min;
+    uint32_t usage_max;
+    bool range;
+} hid_local_t;
+
+#define HID_USAGE_EXTENDED          0x80000000u
+
+static int _hid_key(uint32_t usage)
+{
+    if ((usage >> 16) != HID_USAGE_PAGE_CONSUMER) {
+        return -1;
+    }
+    for (int k = 0; k < AUDIO_HID_KEY_MAX; k++) {
+        if ((usage & 0xFFFF) == s_key_usage[k]) {
+            return k;
+        }
+    }
+    return -1;
+}
+
+/* Apply the current usage page to usages that didn't carry one */
+static uint32_t _hid_full_usage(uint32_t usage, uint16_t page)
+{
+    if (usage & HID_USAGE_EXTENDED) {
+        return usage & ~HID_USAGE_EXTENDED;
+    }
+    return ((uint32_t)page << 16) | (usage & 0xFFFF);
+}
+
+static void _hid_add_field(audio_hid_map_t *map, const audio_hid_field_t *field)
+{
+    if (map->field_count < AUDIO_HID_MAX_FIELDS) {
+        map->fields[map->field_count++] = *field;
+    }
+}
+
+static void _hid_parse_input(audio_hid_map_t *map, uint32_t flags, const hid_global_t *g,
+                             const hid_local_t *l, uint16_t offset)
+{
+    const bool constant = flags & 0x01;
+    const bool variable = flags & 0x02;
+    if (constant || g->report_size == 0 || g->report_size > 32) {
+        return;
+    }
+    audio_hid_field_t field = {};
+    field.report_id = g->report_id;
+    field.size = g->report_size;
+
+    if (variable) {
+        for (uint32_t i = 0; i < g->report_count; i++) {
+            uint32_t usage;
+            if (i < l->usage_count) {
+                usage = l->usages[i];
+            } else if (l->range && l->usage_min + i <= l->usage_max) {
+                usage = l->usage_min + i;
+            } else if (l->usage_count > 0) {
+                usage = l->usages[l->usage_count - 1];
+            } else {
+                break;
+            }
+            int key = _hid_key(_hid_full_usage(usage, g->usage_page));
+            if (key >= 0) {
+                field.array = 0;
+                field.key = (uint8_t)key;
+                field.offset = offset + i * g->report_size;
+                _hid_add_field(map, &field);
+            }
+        }
+        return;
+    }
+
+    // selector arrays, each element holds the index of a pressed usage in the range
+    if (!l->range) {
+        return;
+    }
+    uint32_t usage_min = _hid_full_usage(l->usage_min, g->usage_page);
+    uint32_t usage_max = _hid_full_usage(l->usage_max, g->usage_page);
+    if ((usage_min >> 16) != HID_USAGE_PAGE_CONSUMER || (usage_max >> 16) != HID_USAGE_PAGE_CONSUMER) {
+        return;
+    }
+    for (int k = 0; k < AUDIO_HID_KEY_MAX; k++) {
+        if (s_key_usage[k] >= (usage_min & 0xFFFF) && s_key_usage[k] <= (usage_max & 0xFFFF)) {
+            field.array = 1;
+            field.count = g->report_count;
+            field.offset = offset;
+            field.logical_min = g->logical_min;
+            field.usage_min = usage_min & 0xFFFF;
+            field.usage_max = usage_max & 0xFFFF;
+            _hid_add_field(map, &field);
+            return;
+        }
+    }
+}
+
+esp_err_t audio_hid_parse_descriptor(const uint8_t *desc, size_t len, audio_hid_map_t *map)
+{
+    hid_global_t g = {};
+    hid_global_t stack[HID_STACK_DEPTH];
+    int depth = 0;
+    hid_local_t l = {};
+    // input bit offsets per report ID
+    uint8_t report_ids[HID_MAX_REPORTS];
+    uint16_t report_bits[HID_MAX_REPORTS];
+    int reports = 0;
+
+    memset(map, 0, sizeof(*map));
+    size_t pos = 0;
+    while (pos < len) {
+        uint8_t prefix = desc[pos++];
+        if (prefix == 0xFE) {
+            // long item, never used for anything we read
+            if (pos + 2 > len) {
+                break;
+            }
+            pos += 2 + desc[pos];
+            continue;
+        }
+        uint8_t size = prefix & 0x03;
+        size = size == 3 ? 4 : size;
+        uint8_t type = (prefix >> 2) & 0x03;
+        uint8_t tag = prefix >> 4;
+        if (pos + size > len) {
+            break;
+        }
+        uint32_t value = 0;
+        for (uint8_t i = 0; i < size; i++) {
+            value |= (uint32_t)desc[pos + i] << (8 * i);
+        }
+        int32_t svalue = size == 1 ? (int8_t)value : (size == 2 ? (int16_t)value : (int32_t)value);
+        pos += size;
+
+        switch (type) {
+        case 0: // main
+            if (tag == 0x8) {
+                int r = 0;
+                while (r < reports && report_ids[r] != g.report_id) {
+                    r++;
+                }
+                if (r == reports && reports < HID_MAX_REPORTS) {
+                    report_ids[reports] = g.report_id;
+                    report_bits[reports++] = 0;
+                }
+                // past HID_MAX_REPORTS report IDs the field is skipped, its locals are not kept
+                if (r < reports) {
+                    _hid_parse_input(map, value, &g, &l, report_bits[r]);
+                    report_bits[r] += (uint16_t)(g.report_size * g.report_count);
+                }
+            }
+            // locals only last until the next main item
+            memset(&l, 0, sizeof(l));
+            break;
+        case 1: // global
+            switch (tag) {
+            case 0x0: g.usage_page = (uint16_t)value; break;
+            case 0x1: g.logical_min = svalue; break;
+            case 0x7: g.report_size = (uint8_t)value; break;
+            case 0x8: g.report_id = (uint8_t)value; break;
+            case 0x9: g.report_count = (uint16_t)value; break;
+            case 0xA:
+                if (depth < HID_STACK_DEPTH) {
+                    stack[depth++] = g;
+                }
+                break;
+            case 0xB:
+                if (depth > 0) {
+                    g = stack[--depth];
+                }
+                break;
+            default: break;
+            }
+            break;
+        case 2: // local
+            if (size == 4) {
+                value |= HID_USAGE_EXTENDED;
+            }
+            switch (tag) {
+            case 0x0:
+                if (l.usage_count < HID_MAX_USAGES) {
+                    l.usages[l.usage_count++] = value;
+                }
+                break;
+            case 0x1: l.usage_min = value; l.range = true; break;
+            case 0x2: l.usage_max = value; l.range = true; break;
+            default: break;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    return map->field_count > 0 ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+static bool _hid_bits(const uint8_t *data, size_t len, uint32_t offset, uint8_t size, uint32_t *value)
+{
+    if (offset + size > len * 8) {
+        return false;
+    }
+    uint32_t v = 0;
+    for (uint8_t i = 0; i < size; i++) {
+        uint32_t bit = offset + i;
+        v |= (uint32_t)((data[bit / 8] >> (bit % 8)) & 1) << i;
+    }
+    *value = v;
+    return true;
+}
+
+uint32_t audio_hid_decode(const audio_hid_map_t *map, const uint8_t *report, size_t len)
+{
+    bool ids = false;
+    for (uint8_t i = 0; i < map->field_count; i++) {
+        ids |= map->fields[i].report_id != 0;
+    }
+    uint8_t id = 0;
+    if (ids) {
+        if (len == 0) {
+            return 0;
+        }
+        id = report[0];
+        report++;
+        len--;
+    }
+
+    uint32_t keys = 0;
+    for (uint8_t i = 0; i < map->field_count; i++) {
+        const audio_hid_field_t *f = &map->fields[i];
+        if (f->report_id != id) {
+            continue;
+        }
+        uint32_t value;
+        if (!f->array) {
+            if (_hid_bits(report, len, f->offset, f->size, &value) && value != 0) {
+                keys |= 1u << f->key;
+            }
+            continue;
+        }
+        for (uint16_t e = 0; e < f->count; e++) {
+            if (!_hid_bits(report, len, f->offset + e * f->size, f->size, &value)) {
+                break;
+            }
+            // sign extend, logical ranges may start below zero
+            int32_t index = f->size < 32 && (f->logical_min < 0) && (value >> (f->size - 1)) ?
+                            (int32_t)(value | (~0u << f->size)) : (int32_t)value;
+            int32_t usage = f->usage_min + (index - f->logical_min);
+            if (index < f->logical_min || usage > f->usage_max) {
+                continue;
+            }
+            for (int k = 0; k < AUDIO_HID_KEY_MAX; k++) {
+                if (s_key_usage[k] == usage) {
+                    keys |= 1u << k;
+                }
+            }
+        }
+    }
+    return keys;
+}
+
+#ifdef ESP_PLATFORM
+static const char *const TAG = "audio_hid";
+
+#define AUDIO_HID_MAX_INTERFACES    2
+#define AUDIO_HID_REPORT_MAX        64
+
+struct audio_hid_iface_t {
+    std::atomic<hid_host_device_handle_t> handle;
+    audio_hid_map_t map;
+    uint32_t held;                          /*!< keys down in the last report */
+};
+
+static audio_hid_config_t s_config;
+static QueueHandle_t s_connect_queue = NULL;
+static audio_hid_iface_t s_ifaces[AUDIO_HID_MAX_INTERFACES];
+
+/* HID driver task: reports and disconnection */
+static void _hid_interface_cb(hid_host_device_handle_t handle, const hid_host_interface_event_t event, void *arg)
+{
+    audio_hid_iface_t *iface = (audio_hid_iface_t *)arg;
+    switch (event) {
+    case HID_HOST_INTERFACE_EVENT_INPUT_REPORT: {
+        int64_t now = esp_timer_get_time();
+        uint8_t data[AUDIO_HID_REPORT_MAX];
+        size_t len = 0;
+        if (hid_host_device_get_raw_input_report_data(handle, data, sizeof(data), &len) != ESP_OK) {
+            break;
+        }
+        uint32_t keys = audio_hid_decode(&iface->map, data, len);
+        uint32_t pressed = keys & ~iface->held;
+        iface->held = keys;
+        for (int k = 0; k < AUDIO_HID_KEY_MAX; k++) {
+            if ((pressed & (1u << k)) && s_config.key_cb) {
+                s_config.key_cb((audio_hid_key_t)k, now);
+            }
+        }
+        break;
+    }
+    case HID_HOST_INTERFACE_EVENT_DISCONNECTED:
+        ESP_LOGI(TAG, "HID controls disconnected");
+        hid_host_device_close(handle);
+        iface->handle.store(NULL);
+        break;
+    case HID_HOST_INTERFACE_EVENT_TRANSFER_ERROR:
+        ESP_LOGW(TAG, "HID transfer error");
+        break;
+    default:
+        break;
+    }
+}
+
+/* HID driver task: hand new interfaces over to ours, opening from the driver callback isn't allowed */
+static void _hid_driver_cb(hid_host_device_handle_t handle, const hid_host_driver_event_t event, void *arg)
+{
+    if (event == HID_HOST_DRIVER_EVENT_CONNECTED) {
+        xQueueSend(s_connect_queue, &handle, 0);
+    }
+}
+
+static void _hid_open(hid_host_device_handle_t handle)
+{
+    audio_hid_iface_t *iface = NULL;
+    for (int i = 0; i < AUDIO_HID_MAX_INTERFACES; i++) {
+        hid_host_device_handle_t expected = NULL;
+        if (s_ifaces[i].handle.compare_exchange_strong(expected, handle)) {
+            iface = &s_ifaces[i];
+            break;
+        }
+    }
+    if (iface == NULL) {
+        ESP_LOGW(TAG, "No free slot for a HID interface");
+        return;
+    }
+    hid_host_device_config_t dev_config = {};
+    dev_config.callback = _hid_interface_cb;
+    dev_config.callback_arg = iface;
+    esp_err_t ret = hid_host_device_open(handle, &dev_config);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Opening HID interface failed: %s", esp_err_to_name(ret));
+        iface->handle.store(NULL);
+        return;
+    }
+    size_t desc_len = 0;
+    const uint8_t *desc = hid_host_get_report_descriptor(handle, &desc_len);
+    if (desc == NULL || audio_hid_parse_descriptor(desc, desc_len, &iface->map) != ESP_OK) {
+        // keyboards, mice and vendor interfaces
+        ESP_LOGD(TAG, "HID interface has no consumer controls");
+        hid_host_device_close(handle);
+        iface->handle.store(NULL);
+        return;
+    }
+    iface->held = 0;
+    ret = hid_host_device_start(handle);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Starting HID interface failed: %s", esp_err_to_name(ret));
+        hid_host_device_close(handle);
+        iface->handle.store(NULL);
+        return;
+    }
+    ESP_LOGI(TAG, "HID controls connected, %u fields", iface->map.field_count);
+}
+
+static void audio_hid_task(void *arg)
+{
+    hid_host_device_handle_t handle;
+    while (1) {
+        if (xQueueReceive(s_connect_queue, &handle, portMAX_DELAY) == pdTRUE) {
+            _hid_open(handle);
+        }
+    }
+}
+
+esp_err_t audio_hid_start(const audio_hid_config_t *config)
+{
+    s_config = *config;
+    s_connect_queue = xQueueCreate(4, sizeof(hid_host_device_handle_t));
+    if (s_connect_queue == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    hid_host_driver_config_t driver_config = {};
+    driver_config.create_background_task = true;
+    driver_config.task_priority = config->task_priority;
+    driver_config.stack_size = 4096;
+    driver_config.core_id = config->task_core;
+    driver_config.callback = _hid_driver_cb;
+    driver_config.callback_arg = NULL;
+    esp_err_t ret = hid_host_install(&driver_config);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "HID host install failed: %s", esp_err_to_name(ret));
+        return ret;
+    }
+    if (xTaskCreatePinnedToCore(audio_hid_task, "audio_hid", 3072, NULL, config->task_priority, NULL,
+                                config->task_core) != pdTRUE) {
+        hid_host_uninstall();
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+#endif
+
+} // namespace usbaudio
+} // namespace esphome
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+namespace esphome {
+namespace usbaudio {
+
+/**
+ * @brief Consumer control keys handled on headsets
+ */
+enum audio_hid_key_t {
+    AUDIO_HID_KEY_VOLUME_UP = 0,
+    AUDIO_HID_KEY_VOLUME_DOWN,
+    AUDIO_HID_KEY_MUTE,
+    AUDIO_HID_KEY_PLAY_PAUSE,
+    AUDIO_HID_KEY_MAX
+};
+
+#define AUDIO_HID_MAX_FIELDS    8
+
+/**
+ * @brief Where the handled keys are in the input reports, built from the report descriptor
+ */
+struct audio_hid_field_t {
+    uint8_t report_id;          /*!< 0 when the device doesn't use report IDs */
+    uint8_t array;              /*!< 1: selector array, 0: one bit field per key */
+    uint8_t size;               /*!< bits per element */
+    uint16_t count;             /*!< elements, arrays only */
+    uint16_t offset;            /*!< bit offset after the report ID */
+    uint8_t key;                /*!< audio_hid_key_t, variable fields only */
+    int32_t logical_min;        /*!< arrays only */
+    uint16_t usage_min;         /*!< arrays only, consumer page usage of logical_min */
+    uint16_t usage_max;         /*!< arrays only */
+};
+
+struct audio_hid_map_t {
+    uint8_t field_count;
+    audio_hid_field_t fields[AUDIO_HID_MAX_FIELDS];
+};
+
+/**
+ * @brief Called on key press from the HID driver task
+ *
+ * @param key: pressed key
+ * @param pressed_us: esp_timer time the input report arrived
+ */
+typedef void (*audio_hid_key_cb_t)(audio_hid_key_t key, int64_t pressed_us);
+
+typedef struct {
+    audio_hid_key_cb_t key_cb;
+    int task_priority;
+    int task_core;
+} audio_hid_config_t;
+
+/**
+ * @brief Find the volume, mute and play/pause keys in a HID report descriptor
+ *
+ * Has no ESP-IDF dependency.
+ *
+ * @return
+ *    - ESP_OK: at least one key found
+ *    - ESP_ERR_NOT_FOUND: no consumer control keys we handle
+ */
+esp_err_t audio_hid_parse_descriptor(const uint8_t *desc, size_t len, audio_hid_map_t *map);
+
+/**
+ * @brief Keys held down in an input report, bit n set for audio_hid_key_t n
+ *
+ * @param report: raw report, starting with the report ID when the device uses them
+ */
+uint32_t audio_hid_decode(const audio_hid_map_t *map, const uint8_t *report, size_t len);
+
+/**
+ * @brief Install the HID host driver and handle consumer control interfaces
+ *
+ * The USB host library must be installed first.
+ */
+esp_err_t audio_hid_start(const audio_hid_config_t *config);
+
+} // namespace usbaudio
+} // namespace esphome
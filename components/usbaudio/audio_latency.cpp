@@ -0,0 +1,269 @@
+#include "audio_latency.h"
+
+#include <atomic>
+#include <string.h>
+#include "esphome/core/log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+namespace esphome {
+namespace usbaudio {
+static const char *const TAG = "audio_latency";
+
+/*
+ * The impulse is one period of a 1 kHz square wave at half scale, short enough to be
+ * placed at the start of any sink buffer and with enough energy in the band every
+ * headset speaker and microphone pass.
+ */
+#define AUDIO_LATENCY_IMPULSE_HZ        1000
+#define AUDIO_LATENCY_IMPULSE_LEVEL     0.5f
+#define AUDIO_LATENCY_CAPTURE_FRAMES    256
+#define AUDIO_LATENCY_READ_TIMEOUT_MS   20
+
+static audio_latency_config_t s_config = {0};
+static std::atomic<bool> s_running(false);
+static TaskHandle_t s_task = NULL;
+static TaskHandle_t s_stopper = NULL;
+
+/* esp_timer time of the pending impulse truncated to 32 bits, 0 when none is pending */
+static std::atomic<uint32_t> s_pending_us(0);
+/* Sink task only */
+static int64_t s_next_inject_us = 0;
+
+static SemaphoreHandle_t s_result_lock = NULL;
+static audio_latency_result_t s_result = {0};
+static uint64_t s_sum_us = 0;
+static uint8_t s_capture_buf[AUDIO_LATENCY_CAPTURE_FRAMES * 2 * sizeof(int32_t)];
+
+static void _audio_latency_record(uint32_t latency_us)
+{
+    xSemaphoreTake(s_result_lock, portMAX_DELAY);
+    s_result.detected++;
+    s_sum_us += latency_us;
+    if (s_result.min_us == 0 || latency_us < s_result.min_us) {
+        s_result.min_us = latency_us;
+    }
+    if (latency_us > s_result.max_us) {
+        s_result.max_us = latency_us;
+    }
+    uint32_t bucket = latency_us / 1000;
+    s_result.histogram[bucket < AUDIO_LATENCY_BUCKETS ? bucket : AUDIO_LATENCY_BUCKETS - 1]++;
+    xSemaphoreGive(s_result_lock);
+}
+
+static void _audio_latency_lost(void)
+{
+    xSemaphoreTake(s_result_lock, portMAX_DELAY);
+    s_result.lost++;
+    xSemaphoreGive(s_result_lock);
+}
+
+/**
+ * @brief Look for the first sample above the threshold that was captured after the impulse was sent
+ *
+ * @return true when the impulse was detected
+ */
+static bool _audio_latency_detect(size_t frames, int64_t read_done_us, uint32_t pending_us)
+{
+    const size_t step = (s_config.capture_bits / 8) * s_config.capture_channels;
+    const int64_t level = (int64_t)(s_config.threshold * 2147483648.0f);
+    for (size_t i = 0; i < frames; i++) {
+        const uint8_t *p = s_capture_buf + i * step;
+        int32_t v;
+        if (s_config.capture_bits == 16) {
+            int16_t s;
+            memcpy(&s, p, sizeof(s));
+            v = (int32_t)((uint32_t)s << 16);
+        } else {
+            memcpy(&v, p, sizeof(v));
+        }
+        int64_t a = v < 0 ? -(int64_t)v : v;
+        if (a < level) {
+            continue;
+        }
+        // the read returned when the last frame was captured
+        uint32_t sample_us = (uint32_t)(read_done_us - (int64_t)(frames - i) * 1000000 / s_config.capture_rate);
+        int32_t latency_us = (int32_t)(sample_us - pending_us);
+        if (latency_us <= 0) {
+            // captured before the impulse left, noise
+            continue;
+        }
+        _audio_latency_record((uint32_t)latency_us);
+        return true;
+    }
+    return false;
+}
+
+static void audio_latency_task(void *arg)
+{
+    const size_t frame_bytes = (s_config.capture_bits / 8) * s_config.capture_channels;
+    const size_t read_len = AUDIO_LATENCY_CAPTURE_FRAMES * frame_bytes;
+
+    while (s_running.load(std::memory_order_acquire)) {
+        size_t bytes_read = 0;
+        esp_err_t ret = s_config.read_fn(s_capture_buf, read_len, &bytes_read, AUDIO_LATENCY_READ_TIMEOUT_MS);
+        int64_t now = esp_timer_get_time();
+        uint32_t pending_us = s_pending_us.load(std::memory_order_acquire);
+        if (pending_us == 0) {
+            continue;
+        }
+        if (ret == ESP_OK && bytes_read >= frame_bytes &&
+                _audio_latency_detect(bytes_read / frame_bytes, now, pending_us)) {
+            s_pending_us.store(0, std::memory_order_release);
+        } else if ((uint32_t)now - pending_us > s_config.timeout_ms * 1000) {
+            _audio_latency_lost();
+            s_pending_us.store(0, std::memory_order_release);
+        }
+    }
+
+    xTaskNotifyGive(s_stopper);
+    vTaskDelete(NULL);
+}
+
+esp_err_t audio_latency_start(const audio_latency_config_t *config)
+{
+    if (config->read_fn == NULL || config->capture_rate == 0 ||
+            (config->capture_bits != 16 && config->capture_bits != 32) ||
+            (config->capture_channels != 1 && config->capture_channels != 2)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (s_running.load(std::memory_order_acquire)) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (s_result_lock == NULL) {
+        s_result_lock = xSemaphoreCreateMutex();
+        if (s_result_lock == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    s_config = *config;
+    s_pending_us.store(0, std::memory_order_relaxed);
+    s_next_inject_us = 0;
+    s_running.store(true, std::memory_order_release);
+    BaseType_t ret = xTaskCreatePinnedToCore(audio_latency_task, "audio_latency", 3072, NULL,
+                                             config->task_priority, &s_task, config->task_core);
+    if (ret != pdTRUE) {
+        s_running.store(false, std::memory_order_release);
+        return ESP_ERR_NO_MEM;
+    }
+    ESP_LOGI(TAG, "Latency measurement started: every %"PRIu32" ms, threshold %.2f",
+             config->interval_ms, config->threshold);
+    return ESP_OK;
+}
+
+void audio_latency_stop(void)
+{
+    if (!s_running.load(std::memory_order_acquire)) {
+        return;
+    }
+    s_stopper = xTaskGetCurrentTaskHandle();
+    s_running.store(false, std::memory_order_release);
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    s_task = NULL;
+
+    audio_latency_result_t result;
+    audio_latency_get_result(&result);
+    ESP_LOGI(TAG, "Latency: %"PRIu32" sent, %"PRIu32" detected, %"PRIu32" lost, min %"PRIu32" us, "
+             "mean %"PRIu32" us, p50 %"PRIu32" us, p95 %"PRIu32" us, max %"PRIu32" us",
+             result.sent, result.detected, result.lost, result.min_us, result.mean_us,
+             result.p50_us, result.p95_us, result.max_us);
+}
+
+bool audio_latency_is_running(void)
+{
+    return s_running.load(std::memory_order_acquire);
+}
+
+void audio_latency_reset(void)
+{
+    if (s_result_lock == NULL) {
+        return;
+    }
+    xSemaphoreTake(s_result_lock, portMAX_DELAY);
+    memset(&s_result, 0, sizeof(s_result));
+    s_sum_us = 0;
+    xSemaphoreGive(s_result_lock);
+}
+
+void audio_latency_process(void *audio_buffer, size_t len, uint32_t bits, uint32_t channels, uint32_t rate)
+{
+    if (!s_running.load(std::memory_order_acquire) || (bits != 16 && bits != 32) || channels == 0 || rate == 0) {
+        return;
+    }
+    // only the impulse must reach the microphone
+    memset(audio_buffer, 0, len);
+
+    int64_t now = esp_timer_get_time();
+    if (s_next_inject_us == 0) {
+        // one interval of silence first, audio queued before the start would count as the impulse
+        s_next_inject_us = now + (int64_t)s_config.interval_ms * 1000;
+        return;
+    }
+    if (s_pending_us.load(std::memory_order_acquire) != 0 || now < s_next_inject_us) {
+        return;
+    }
+    size_t frames = len / ((bits / 8) * channels);
+    size_t half = rate / (2 * AUDIO_LATENCY_IMPULSE_HZ);
+    if (frames < 2 * half) {
+        return;
+    }
+    const int32_t level = (int32_t)(AUDIO_LATENCY_IMPULSE_LEVEL * 2147483647.0f);
+    for (size_t i = 0; i < 2 * half; i++) {
+        int32_t v = i < half ? level : -level;
+        for (uint32_t c = 0; c < channels; c++) {
+            if (bits == 16) {
+                ((int16_t *)audio_buffer)[i * channels + c] = (int16_t)(v >> 16);
+            } else {
+                ((int32_t *)audio_buffer)[i * channels + c] = v;
+            }
+        }
+    }
+    uint32_t sent_us = (uint32_t)now;
+    s_pending_us.store(sent_us != 0 ? sent_us : 1, std::memory_order_release);
+    s_next_inject_us = now + (int64_t)s_config.interval_ms * 1000;
+    xSemaphoreTake(s_result_lock, portMAX_DELAY);
+    s_result.sent++;
+    xSemaphoreGive(s_result_lock);
+}
+
+// Latency of the rank-th detection, interpolated within its bucket and kept within min / max
+static uint32_t _audio_latency_percentile(const audio_latency_result_t *result, uint32_t rank)
+{
+    uint32_t count = 0;
+    for (int b = 0; b < AUDIO_LATENCY_BUCKETS && rank; b++) {
+        uint32_t in_bucket = result->histogram[b];
+        if (count + in_bucket < rank) {
+            count += in_bucket;
+            continue;
+        }
+        uint32_t lo = b * 1000;
+        uint32_t hi = b == AUDIO_LATENCY_BUCKETS - 1 ? result->max_us : lo + 1000;
+        lo = lo > result->min_us ? lo : result->min_us;
+        hi = hi < result->max_us ? hi : result->max_us;
+        if (hi <= lo) {
+            return hi;
+        }
+        return lo + (uint32_t)((uint64_t)(hi - lo) * (rank - count) / in_bucket);
+    }
+    return 0;
+}
+
+void audio_latency_get_result(audio_latency_result_t *result)
+{
+    if (s_result_lock == NULL) {
+        memset(result, 0, sizeof(*result));
+        return;
+    }
+    xSemaphoreTake(s_result_lock, portMAX_DELAY);
+    *result = s_result;
+    result->mean_us = s_result.detected ? (uint32_t)(s_sum_us / s_result.detected) : 0;
+    xSemaphoreGive(s_result_lock);
+
+    result->p50_us = _audio_latency_percentile(result, (result->detected + 1) / 2);
+    result->p95_us = _audio_latency_percentile(result, (result->detected * 95 + 99) / 100);
+}
+
+} // namespace usbaudio
+} // namespace esphome
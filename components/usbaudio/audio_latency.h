@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+namespace esphome {
+namespace usbaudio {
+
+#define AUDIO_LATENCY_BUCKETS       128     /*!< 1 ms histogram buckets, the last one collects everything above */
+
+/**
+ * @brief Capture source, same signature as bsp_i2s_read
+ */
+typedef esp_err_t (*audio_latency_read_fn_t)(void *audio_buffer, size_t len, size_t *bytes_read, uint32_t timeout_ms);
+
+typedef struct {
+    audio_latency_read_fn_t read_fn;    /*!< microphone the impulse is detected on */
+    uint32_t capture_rate;              /*!< sample rate of read_fn */
+    uint8_t capture_bits;               /*!< 16 or 32 */
+    uint8_t capture_channels;           /*!< 1 or 2, channel 0 is used */
+    float threshold;                    /*!< detection level, linear full scale 0.0 - 1.0 */
+    uint32_t interval_ms;               /*!< time between two impulses */
+    uint32_t timeout_ms;                /*!< an impulse not detected within this time counts as lost */
+    int task_priority;
+    int task_core;
+} audio_latency_config_t;
+
+/**
+ * @brief Round-trip latency distribution, from the sink write carrying the impulse to its detection
+ */
+typedef struct {
+    uint32_t sent;
+    uint32_t detected;
+    uint32_t lost;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint32_t mean_us;
+    uint32_t p50_us;                    /*!< interpolated within its 1 ms bucket, min <= p50 <= p95 <= max */
+    uint32_t p95_us;
+    uint32_t histogram[AUDIO_LATENCY_BUCKETS];
+} audio_latency_result_t;
+
+/**
+ * @brief Start the measurement, the sink stage then outputs silence and periodic impulses
+ *
+ * The result is not cleared, call audio_latency_reset() when changing buffer settings.
+ *
+ * @return
+ *    - ESP_OK: Success
+ *    - ESP_ERR_INVALID_ARG: unsupported capture format
+ *    - ESP_ERR_INVALID_STATE: measurement already running
+ *    - ESP_ERR_NO_MEM: task creation failed
+ */
+esp_err_t audio_latency_start(const audio_latency_config_t *config);
+
+/**
+ * @brief Stop the measurement and wait for the capture task to exit
+ */
+void audio_latency_stop(void);
+bool audio_latency_is_running(void);
+
+/**
+ * @brief Clear the result
+ */
+void audio_latency_reset(void);
+
+/**
+ * @brief Sink write path hook, replaces the outgoing buffer with silence or an impulse
+ *
+ * Does nothing while no measurement is running. Called from the sink task only.
+ *
+ * @param audio_buffer: interleaved PCM about to be written to the sink
+ * @param len: buffer length in bytes
+ * @param bits: 16 or 32, other formats are left untouched
+ * @param channels: channels in audio_buffer
+ * @param rate: sample rate of audio_buffer
+ */
+void audio_latency_process(void *audio_buffer, size_t len, uint32_t bits, uint32_t channels, uint32_t rate);
+
+/**
+ * @brief Copy the current result, safe to call while the measurement is running
+ */
+void audio_latency_get_result(audio_latency_result_t *result);
+
+} // namespace usbaudio
+} // namespace esphome
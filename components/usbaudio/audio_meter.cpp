@@ -0,0 +1,263 @@
+#include "audio_meter.h"
+
+#include <atomic>
+#include <math.h>
+#include <string.h>
+#include "esp_cpu.h"
+
+namespace esphome {
+namespace usbaudio {
+
+/*
+ * Input is low-passed and decimated by AUDIO_METER_DECIMATION before a AUDIO_METER_FFT_SIZE
+ * point FFT, at 48 kHz this gives a 12 kHz analysis rate, ~94 Hz bins and one
+ * snapshot every ~10.7 ms.
+ *
+ * The low-pass is a 6th order Butterworth at the top edge of the last band, 3/4 of the
+ * decimated Nyquist. What aliases into the top band is attenuated by ~27 dB, into the
+ * bands below 2 kHz at 48 kHz by more than 40 dB.
+ */
+#define AUDIO_METER_DECIMATION  4
+#define AUDIO_METER_FFT_SIZE    128
+#define AUDIO_METER_FFT_LOG2    7
+#define AUDIO_METER_FLOOR_DB    (-90.0f)
+#define AUDIO_METER_TOP_BIN     48
+#define AUDIO_METER_BIQUADS     3
+
+static float s_window[AUDIO_METER_FFT_SIZE];
+static float s_twiddle_re[AUDIO_METER_FFT_SIZE / 2];
+static float s_twiddle_im[AUDIO_METER_FFT_SIZE / 2];
+static uint8_t s_bitrev[AUDIO_METER_FFT_SIZE];
+/* First FFT bin of each band, the last entry is the end of the last band */
+static const uint8_t s_band_edges[AUDIO_METER_BANDS + 1] = {
+    1, 2, 3, 4, 5, 6, 7, 8, 10, 12, 14, 17, 21, 25, 31, 39, AUDIO_METER_TOP_BIN
+};
+
+/* Anti-alias low-pass, normalized biquad sections (a0 = 1) */
+typedef struct {
+    float b0, b1, b2, a1, a2;
+} audio_meter_biquad_t;
+static audio_meter_biquad_t s_lowpass[AUDIO_METER_BIQUADS];
+
+/* Writer side state, only touched by the sink task */
+static float s_fft_re[AUDIO_METER_FFT_SIZE];
+static float s_fft_im[AUDIO_METER_FFT_SIZE];
+static float s_lowpass_z[AUDIO_METER_BIQUADS][2] = {};
+static uint32_t s_decim_count = 0;
+static uint32_t s_fft_fill = 0;
+static uint32_t s_level_frames = 0;
+static int32_t s_peak[2] = {0};
+static uint64_t s_sum_sq[2] = {0};
+static uint32_t s_cost_avg = 0;
+static uint32_t s_cost_max = 0;
+static uint8_t s_spectrum[AUDIO_METER_BANDS] = {0};
+
+/* Seqlock protected snapshot, odd sequence means a write is in progress */
+static std::atomic<uint32_t> s_seq(0);
+static audio_meter_snapshot_t s_snapshot = {};
+static std::atomic<bool> s_enabled(true);
+static bool s_initialized = false;
+
+void audio_meter_init(void)
+{
+    for (int i = 0; i < AUDIO_METER_FFT_SIZE; i++) {
+        s_window[i] = 0.5f - 0.5f * cosf(2.0f * (float)M_PI * i / (AUDIO_METER_FFT_SIZE - 1));
+        uint8_t r = 0;
+        for (int b = 0; b < AUDIO_METER_FFT_LOG2; b++) {
+            r |= ((i >> b) & 1) << (AUDIO_METER_FFT_LOG2 - 1 - b);
+        }
+        s_bitrev[i] = r;
+    }
+    for (int i = 0; i < AUDIO_METER_FFT_SIZE / 2; i++) {
+        s_twiddle_re[i] = cosf(2.0f * (float)M_PI * i / AUDIO_METER_FFT_SIZE);
+        s_twiddle_im[i] = -sinf(2.0f * (float)M_PI * i / AUDIO_METER_FFT_SIZE);
+    }
+    // Butterworth sections, the cutoff is a fixed fraction of the input rate
+    const float q[AUDIO_METER_BIQUADS] = {0.51764f, 0.70711f, 1.93185f};
+    const float w0 = 2.0f * (float)M_PI * AUDIO_METER_TOP_BIN / (AUDIO_METER_DECIMATION * AUDIO_METER_FFT_SIZE);
+    for (int i = 0; i < AUDIO_METER_BIQUADS; i++) {
+        float alpha = sinf(w0) / (2.0f * q[i]);
+        float a0 = 1.0f + alpha;
+        s_lowpass[i].b0 = (1.0f - cosf(w0)) / 2.0f / a0;
+        s_lowpass[i].b1 = (1.0f - cosf(w0)) / a0;
+        s_lowpass[i].b2 = s_lowpass[i].b0;
+        s_lowpass[i].a1 = -2.0f * cosf(w0) / a0;
+        s_lowpass[i].a2 = (1.0f - alpha) / a0;
+    }
+    s_initialized = true;
+}
+
+void audio_meter_set_enabled(bool enable)
+{
+    s_enabled.store(enable, std::memory_order_relaxed);
+}
+
+bool audio_meter_is_enabled(void)
+{
+    return s_enabled.load(std::memory_order_relaxed);
+}
+
+/* Transposed direct form II, runs at the input rate */
+static inline float _audio_meter_lowpass(float x)
+{
+    for (int i = 0; i < AUDIO_METER_BIQUADS; i++) {
+        const audio_meter_biquad_t *f = &s_lowpass[i];
+        float *z = s_lowpass_z[i];
+        float y = f->b0 * x + z[0];
+        z[0] = f->b1 * x - f->a1 * y + z[1];
+        z[1] = f->b2 * x - f->a2 * y;
+        x = y;
+    }
+    return x;
+}
+
+uint32_t audio_meter_band_edge_hz(int edge, uint32_t sample_rate)
+{
+    if (edge < 0 || edge > AUDIO_METER_BANDS) {
+        return 0;
+    }
+    const uint32_t bins_per_rate = AUDIO_METER_DECIMATION * AUDIO_METER_FFT_SIZE;
+    return (uint32_t)(((uint64_t)s_band_edges[edge] * sample_rate + bins_per_rate / 2) / bins_per_rate);
+}
+
+static void _audio_meter_fft(void)
+{
+    for (int i = 0; i < AUDIO_METER_FFT_SIZE; i++) {
+        int j = s_bitrev[i];
+        if (j > i) {
+            float t = s_fft_re[i];
+            s_fft_re[i] = s_fft_re[j];
+            s_fft_re[j] = t;
+        }
+    }
+    memset(s_fft_im, 0, sizeof(s_fft_im));
+    for (int len = 2; len <= AUDIO_METER_FFT_SIZE; len <<= 1) {
+        int half = len >> 1;
+        int step = AUDIO_METER_FFT_SIZE / len;
+        for (int i = 0; i < AUDIO_METER_FFT_SIZE; i += len) {
+            for (int k = 0; k < half; k++) {
+                float wr = s_twiddle_re[k * step];
+                float wi = s_twiddle_im[k * step];
+                int a = i + k;
+                int b = a + half;
+                float tr = s_fft_re[b] * wr - s_fft_im[b] * wi;
+                float ti = s_fft_re[b] * wi + s_fft_im[b] * wr;
+                s_fft_re[b] = s_fft_re[a] - tr;
+                s_fft_im[b] = s_fft_im[a] - ti;
+                s_fft_re[a] += tr;
+                s_fft_im[a] += ti;
+            }
+        }
+    }
+    /* Normalize so that a full-scale sine reads ~0 dBFS with the Hann window */
+    const float norm = 4.0f / AUDIO_METER_FFT_SIZE;
+    for (int band = 0; band < AUDIO_METER_BANDS; band++) {
+        float power = 0;
+        for (int k = s_band_edges[band]; k < s_band_edges[band + 1]; k++) {
+            float re = s_fft_re[k] * norm;
+            float im = s_fft_im[k] * norm;
+            float p = re * re + im * im;
+            if (p > power) {
+                power = p;
+            }
+        }
+        float db = power > 1e-12f ? 10.0f * log10f(power) : AUDIO_METER_FLOOR_DB;
+        if (db < AUDIO_METER_FLOOR_DB) {
+            db = AUDIO_METER_FLOOR_DB;
+        } else if (db > 0) {
+            db = 0;
+        }
+        s_spectrum[band] = (uint8_t)((db - AUDIO_METER_FLOOR_DB) * (255.0f / -AUDIO_METER_FLOOR_DB));
+    }
+}
+
+static void _audio_meter_publish(uint8_t channels)
+{
+    uint32_t seq = s_seq.load(std::memory_order_relaxed);
+    s_seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    s_snapshot.frame++;
+    for (int c = 0; c < 2; c++) {
+        int src = channels == 1 ? 0 : c;
+        s_snapshot.peak[c] = s_peak[src] / 32768.0f;
+        s_snapshot.rms[c] = s_level_frames ? sqrtf((float)s_sum_sq[src] / s_level_frames) / 32768.0f : 0;
+    }
+    memcpy(s_snapshot.spectrum, s_spectrum, sizeof(s_spectrum));
+    s_snapshot.cost_cycles_avg = s_cost_avg;
+    s_snapshot.cost_cycles_max = s_cost_max;
+
+    std::atomic_thread_fence(std::memory_order_release);
+    s_seq.store(seq + 2, std::memory_order_relaxed);
+
+    s_peak[0] = s_peak[1] = 0;
+    s_sum_sq[0] = s_sum_sq[1] = 0;
+    s_level_frames = 0;
+}
+
+void audio_meter_feed(const int16_t *samples, size_t frames, uint8_t channels)
+{
+    if (!s_initialized || !s_enabled.load(std::memory_order_relaxed) || (channels != 1 && channels != 2)) {
+        return;
+    }
+    uint32_t start = esp_cpu_get_cycle_count();
+    bool fft_done = false;
+
+    for (size_t i = 0; i < frames; i++) {
+        int32_t l = samples[i * channels];
+        int32_t r = channels == 2 ? samples[i * channels + 1] : l;
+        int32_t al = l < 0 ? -l : l;
+        int32_t ar = r < 0 ? -r : r;
+        if (al > s_peak[0]) {
+            s_peak[0] = al;
+        }
+        if (ar > s_peak[1]) {
+            s_peak[1] = ar;
+        }
+        s_sum_sq[0] += (uint64_t)(l * l);
+        s_sum_sq[1] += (uint64_t)(r * r);
+        s_level_frames++;
+
+        float sample = _audio_meter_lowpass((float)((l + r) >> 1) / 32768.0f);
+        if (++s_decim_count < AUDIO_METER_DECIMATION) {
+            continue;
+        }
+        s_decim_count = 0;
+        s_fft_re[s_fft_fill] = sample * s_window[s_fft_fill];
+        if (++s_fft_fill < AUDIO_METER_FFT_SIZE) {
+            continue;
+        }
+        s_fft_fill = 0;
+        /* Bound the cost per call: extra windows in a large buffer only update the levels */
+        if (!fft_done) {
+            _audio_meter_fft();
+            fft_done = true;
+            _audio_meter_publish(channels);
+        }
+    }
+
+    uint32_t cycles = esp_cpu_get_cycle_count() - start;
+    s_cost_avg = s_cost_avg - (s_cost_avg >> 4) + (cycles >> 4);
+    if (cycles > s_cost_max) {
+        s_cost_max = cycles;
+    }
+}
+
+bool audio_meter_read(audio_meter_snapshot_t *out)
+{
+    for (int retry = 0; retry < 4; retry++) {
+        uint32_t seq1 = s_seq.load(std::memory_order_acquire);
+        if (seq1 == 0 || (seq1 & 1)) {
+            continue;
+        }
+        memcpy(out, &s_snapshot, sizeof(*out));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (s_seq.load(std::memory_order_relaxed) == seq1) {
+            return true;
+        }
+    }
+    return false;
+}
+
+} // namespace usbaudio
+} // namespace esphome
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace esphome {
+namespace usbaudio {
+
+#define AUDIO_METER_BANDS   16
+
+/**
+ * @brief Level and spectrum snapshot published by the sink tap
+ *
+ * Levels are linear full-scale values (0.0 - 1.0), the spectrum is in dBFS
+ * clamped to [-90, 0] and scaled to 0 - 255.
+ */
+struct audio_meter_snapshot_t {
+    uint32_t frame;                             /*!< incremented on every publish */
+    float peak[2];                              /*!< left / right peak */
+    float rms[2];                               /*!< left / right RMS */
+    uint8_t spectrum[AUDIO_METER_BANDS];        /*!< log spaced bands, low to high, see audio_meter_band_edge_hz() */
+    uint32_t cost_cycles_avg;                   /*!< average CPU cycles per feed call */
+    uint32_t cost_cycles_max;                   /*!< worst case CPU cycles per feed call */
+};
+
+/**
+ * @brief Prepare the FFT tables, must be called once before the first feed
+ */
+void audio_meter_init(void);
+
+/**
+ * @brief Enable or disable the tap at runtime
+ */
+void audio_meter_set_enabled(bool enable);
+bool audio_meter_is_enabled(void);
+
+/**
+ * @brief Frequency of a spectrum band edge, to label the bands
+ *
+ * Band b spans edges b to b + 1. The bands cover sample_rate / 512 to 3 / 32 of the
+ * sample rate, at 48 kHz 94, 188, 281, 375, 469, 563, 656, 750, 938, 1125, 1313, 1594,
+ * 1969, 2344, 2906, 3656 and 4500 Hz. The meter is blind above the last edge.
+ *
+ * @param edge: 0 - AUDIO_METER_BANDS
+ * @param sample_rate: rate of the fed samples
+ */
+uint32_t audio_meter_band_edge_hz(int edge, uint32_t sample_rate);
+
+/**
+ * @brief Feed interleaved 16-bit PCM from the sink stage
+ *
+ * Never blocks and never allocates. At most one FFT is computed per call.
+ *
+ * @param samples: interleaved samples
+ * @param frames: number of frames in samples
+ * @param channels: 1 or 2
+ */
+void audio_meter_feed(const int16_t *samples, size_t frames, uint8_t channels);
+
+/**
+ * @brief Read the latest snapshot, safe to call from any task
+ *
+ * @return
+ *    - true: snapshot copied
+ *    - false: no consistent snapshot available (writer busy or nothing published yet)
+ */
+bool audio_meter_read(audio_meter_snapshot_t *out);
+
+} // namespace usbaudio
+} // namespace esphome
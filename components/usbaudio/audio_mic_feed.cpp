@@ -0,0 +1,211 @@
+#include "audio_mic_feed.h"
+
+#include <atomic>
+#include <math.h>
+#include <string.h>
+#include "esp_cpu.h"
+#include "freertos/semphr.h"
+
+namespace esphome {
+namespace usbaudio {
+
+/*
+ * 3:1 decimation with a 60 tap Hamming windowed sinc, cutoff 6.8 kHz. Only every third
+ * output of the filter is computed, which is the polyphase form with 3 phases of 20 taps
+ * summed. The group delay is 29.5 input samples (~615 us).
+ */
+#define MIC_FEED_DECIMATION     (AUDIO_MIC_FEED_INPUT_RATE / AUDIO_MIC_FEED_RATE)
+#define MIC_FEED_TAPS           60
+#define MIC_FEED_CUTOFF_HZ      6800.0f
+#define MIC_FEED_DELAY_US       ((MIC_FEED_TAPS - 1) * 1000000 / (2 * AUDIO_MIC_FEED_INPUT_RATE))
+
+static int16_t s_taps[MIC_FEED_TAPS];
+
+/*
+ * History of the mono input, every sample is stored twice (at idx and idx + TAPS) so that
+ * the last MIC_FEED_TAPS samples are always contiguous at s_hist + s_hist_idx.
+ */
+static int16_t s_hist[2 * MIC_FEED_TAPS];
+static uint32_t s_hist_idx = 0;
+static uint32_t s_phase = 0;
+
+/* Single producer / single consumer frame queue, indexes only grow */
+static audio_mic_frame_t s_queue[AUDIO_MIC_FEED_QUEUE_DEPTH];
+static std::atomic<uint32_t> s_head(0);
+static std::atomic<uint32_t> s_tail(0);
+static std::atomic<TaskHandle_t> s_consumer(NULL);
+
+/* Producer side state */
+static audio_mic_frame_t s_overflow_frame;
+static audio_mic_frame_t *s_frame = NULL;
+static uint32_t s_fill = 0;
+static uint32_t s_sequence = 0;
+static uint32_t s_produced = 0;
+static uint32_t s_dropped = 0;
+
+/* Published by the producer once per process call, copied out by any task */
+static SemaphoreHandle_t s_stats_lock = NULL;
+static audio_mic_feed_stats_t s_stats = {0};
+
+void audio_mic_feed_init(void)
+{
+    float taps[MIC_FEED_TAPS];
+    float sum = 0;
+    const float fc = MIC_FEED_CUTOFF_HZ / AUDIO_MIC_FEED_INPUT_RATE;
+    for (int i = 0; i < MIC_FEED_TAPS; i++) {
+        float n = i - (MIC_FEED_TAPS - 1) / 2.0f;
+        float sinc = n == 0 ? 2.0f * fc : sinf(2.0f * (float)M_PI * fc * n) / ((float)M_PI * n);
+        float window = 0.54f - 0.46f * cosf(2.0f * (float)M_PI * i / (MIC_FEED_TAPS - 1));
+        taps[i] = sinc * window;
+        sum += taps[i];
+    }
+    // unity gain at DC in Q15
+    for (int i = 0; i < MIC_FEED_TAPS; i++) {
+        s_taps[i] = (int16_t)lrintf(taps[i] / sum * 32768.0f);
+    }
+    if (s_stats_lock == NULL) {
+        s_stats_lock = xSemaphoreCreateMutex();
+    }
+    audio_mic_feed_reset();
+    s_stats.latency_us = MIC_FEED_DELAY_US + AUDIO_MIC_FEED_FRAME_SAMPLES * 1000000 / AUDIO_MIC_FEED_RATE;
+}
+
+void audio_mic_feed_reset(void)
+{
+    memset(s_hist, 0, sizeof(s_hist));
+    s_hist_idx = 0;
+    s_phase = 0;
+    s_fill = 0;
+    s_frame = NULL;
+}
+
+static inline int16_t _mic_feed_fir(const int16_t *x)
+{
+    // sum(|taps|) stays well below 2 in Q15, the accumulator can't overflow
+    int32_t acc0 = 0, acc1 = 0, acc2 = 0, acc3 = 0;
+    for (int k = 0; k < MIC_FEED_TAPS; k += 4) {
+        acc0 += x[k] * s_taps[k];
+        acc1 += x[k + 1] * s_taps[k + 1];
+        acc2 += x[k + 2] * s_taps[k + 2];
+        acc3 += x[k + 3] * s_taps[k + 3];
+    }
+    int32_t acc = (acc0 + acc1 + acc2 + acc3 + (1 << 14)) >> 15;
+    return acc > INT16_MAX ? INT16_MAX : (acc < INT16_MIN ? INT16_MIN : (int16_t)acc);
+}
+
+/* Queue a filtered sample, a frame is published once full */
+static inline void _mic_feed_emit(int16_t sample, int64_t sample_us)
+{
+    if (s_frame == NULL) {
+        uint32_t head = s_head.load(std::memory_order_relaxed);
+        if (head - s_tail.load(std::memory_order_acquire) < AUDIO_MIC_FEED_QUEUE_DEPTH) {
+            s_frame = &s_queue[head & (AUDIO_MIC_FEED_QUEUE_DEPTH - 1)];
+        } else {
+            // fill a scratch frame so that the timeline continues, it is dropped when complete
+            s_frame = &s_overflow_frame;
+        }
+        s_frame->timestamp_us = sample_us - MIC_FEED_DELAY_US;
+        s_frame->sequence = s_sequence++;
+        s_fill = 0;
+    }
+    s_frame->samples[s_fill++] = sample;
+    if (s_fill < AUDIO_MIC_FEED_FRAME_SAMPLES) {
+        return;
+    }
+    if (s_frame == &s_overflow_frame) {
+        s_dropped++;
+    } else {
+        s_head.store(s_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        s_produced++;
+        TaskHandle_t consumer = s_consumer.load(std::memory_order_relaxed);
+        if (consumer != NULL) {
+            xTaskNotifyGive(consumer);
+        }
+    }
+    s_frame = NULL;
+}
+
+void audio_mic_feed_process(const int16_t *samples, size_t frames, uint8_t channels, int64_t capture_us)
+{
+    uint32_t start = esp_cpu_get_cycle_count();
+    uint32_t idx = s_hist_idx;
+    uint32_t phase = s_phase;
+    // stereo frames are read as one word, L in the low half
+    const bool words = channels == 2 && ((uintptr_t)samples & 3) == 0;
+    const uint32_t *in_words = (const uint32_t *)samples;
+
+    /* Downmix, history update and decimating filter in one pass over the input */
+    for (size_t i = 0; i < frames; i++) {
+        int16_t mono;
+        if (words) {
+            uint32_t w = in_words[i];
+            mono = (int16_t)(((int32_t)(int16_t)w + (int32_t)(int16_t)(w >> 16)) >> 1);
+        } else if (channels == 2) {
+            mono = (int16_t)((samples[2 * i] + samples[2 * i + 1]) >> 1);
+        } else {
+            mono = samples[i * channels];
+        }
+        s_hist[idx] = mono;
+        s_hist[idx + MIC_FEED_TAPS] = mono;
+        if (++idx == MIC_FEED_TAPS) {
+            idx = 0;
+        }
+        if (++phase < MIC_FEED_DECIMATION) {
+            continue;
+        }
+        phase = 0;
+        // oldest to newest sample at s_hist + idx, the filter is symmetric
+        _mic_feed_emit(_mic_feed_fir(s_hist + idx),
+                       capture_us + (int64_t)i * 1000000 / AUDIO_MIC_FEED_INPUT_RATE);
+    }
+    s_hist_idx = idx;
+    s_phase = phase;
+
+    uint32_t cycles = esp_cpu_get_cycle_count() - start;
+    xSemaphoreTake(s_stats_lock, portMAX_DELAY);
+    s_stats.frames_produced = s_produced;
+    s_stats.frames_dropped = s_dropped;
+    s_stats.input_frames += frames;
+    s_stats.cost_cycles_total += cycles;
+    if (cycles > s_stats.cost_cycles_max) {
+        s_stats.cost_cycles_max = cycles;
+    }
+    xSemaphoreGive(s_stats_lock);
+}
+
+const audio_mic_frame_t *audio_mic_feed_acquire(void)
+{
+    uint32_t tail = s_tail.load(std::memory_order_relaxed);
+    if (s_head.load(std::memory_order_acquire) == tail) {
+        return NULL;
+    }
+    return &s_queue[tail & (AUDIO_MIC_FEED_QUEUE_DEPTH - 1)];
+}
+
+void audio_mic_feed_release(void)
+{
+    uint32_t tail = s_tail.load(std::memory_order_relaxed);
+    if (s_head.load(std::memory_order_acquire) != tail) {
+        s_tail.store(tail + 1, std::memory_order_release);
+    }
+}
+
+void audio_mic_feed_set_consumer(TaskHandle_t task)
+{
+    s_consumer.store(task, std::memory_order_relaxed);
+}
+
+void audio_mic_feed_get_stats(audio_mic_feed_stats_t *stats)
+{
+    if (s_stats_lock == NULL) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    // the 64-bit counters would tear if copied while the producer updates them
+    xSemaphoreTake(s_stats_lock, portMAX_DELAY);
+    *stats = s_stats;
+    xSemaphoreGive(s_stats_lock);
+}
+
+} // namespace usbaudio
+} // namespace esphome
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+namespace esphome {
+namespace usbaudio {
+
+#define AUDIO_MIC_FEED_INPUT_RATE       48000
+#define AUDIO_MIC_FEED_RATE             16000
+#define AUDIO_MIC_FEED_FRAME_SAMPLES    320     /*!< 20 ms per frame */
+#define AUDIO_MIC_FEED_QUEUE_DEPTH      8       /*!< frames, must be a power of two */
+
+/**
+ * @brief One block of 16 kHz mono capture
+ */
+struct audio_mic_frame_t {
+    int64_t timestamp_us;                           /*!< esp_timer time the first sample was captured */
+    uint32_t sequence;                              /*!< increments per frame produced, gaps mean dropped frames */
+    int16_t samples[AUDIO_MIC_FEED_FRAME_SAMPLES];
+};
+
+struct audio_mic_feed_stats_t {
+    uint32_t frames_produced;
+    uint32_t frames_dropped;                        /*!< queue full, the consumer fell behind */
+    uint64_t input_frames;                          /*!< 48 kHz frames processed */
+    uint64_t cost_cycles_total;                     /*!< CPU cycles spent in audio_mic_feed_process */
+    uint32_t cost_cycles_max;                       /*!< worst case per call */
+    uint32_t latency_us;                            /*!< added by the feed: filter delay + one frame */
+};
+
+/**
+ * @brief Prepare the decimation filter, must be called once before the first process call
+ */
+void audio_mic_feed_init(void);
+
+/**
+ * @brief Forget the filter history, call when the capture stream restarts
+ */
+void audio_mic_feed_reset(void);
+
+/**
+ * @brief Downmix and decimate 48 kHz 16-bit capture into the frame queue
+ *
+ * Producer side, one task only. Never blocks, frames that don't fit are dropped.
+ *
+ * @param samples: interleaved 48 kHz samples
+ * @param frames: number of frames in samples
+ * @param channels: 1 or 2
+ * @param capture_us: esp_timer time the first frame was captured
+ */
+void audio_mic_feed_process(const int16_t *samples, size_t frames, uint8_t channels, int64_t capture_us);
+
+/**
+ * @brief Oldest queued frame, NULL when the queue is empty
+ *
+ * Consumer side, one task only. The frame stays valid until audio_mic_feed_release().
+ */
+const audio_mic_frame_t *audio_mic_feed_acquire(void);
+void audio_mic_feed_release(void);
+
+/**
+ * @brief Task notified (xTaskNotifyGive) for every frame queued, NULL to stop
+ */
+void audio_mic_feed_set_consumer(TaskHandle_t task);
+
+/**
+ * @brief Copy the counters, from any task. All zero before audio_mic_feed_init()
+ */
+void audio_mic_feed_get_stats(audio_mic_feed_stats_t *stats);
+
+} // namespace usbaudio
+} // namespace esphome
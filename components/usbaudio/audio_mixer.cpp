@@ -0,0 +1,425 @@
+#include "audio_mixer.h"
+#include "pcm_convert.h"
+
+#include <atomic>
+#include <math.h>
+#include <string.h>
+#include "esphome/core/log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/stream_buffer.h"
+
+namespace esphome {
+namespace usbaudio {
+static const char *const TAG = "audio_mixer";
+
+/* Gain ramps are applied in steps of this many frames, the gain is constant inside a step */
+#define AUDIO_MIXER_RAMP_CHUNK      32
+/* How long a partially filled period is held back waiting for more data */
+#define AUDIO_MIXER_PARTIAL_WAIT_MS 5
+#define AUDIO_MIXER_UNITY_Q15       32768
+
+typedef enum {
+    MIXER_STREAM_FREE = 0,
+    MIXER_STREAM_OPENING,
+    MIXER_STREAM_OPEN,
+    MIXER_STREAM_CLOSING,
+} mixer_stream_state_t;
+
+typedef struct {
+    std::atomic<uint8_t> state;
+    std::atomic<uint8_t> writers;   /*!< in audio_mixer_stream_write(), the buffer stays until they leave */
+    StreamBufferHandle_t buffer;
+    uint8_t priority;
+    std::atomic<int32_t> gain_q15;
+    std::atomic<uint8_t> channels;
+    std::atomic<uint8_t> bits;
+    int32_t env_q15;                /*!< ducking envelope, mixer task only */
+    pcm_dither_t dither;            /*!< under s_lock */
+} mixer_stream_t;
+
+static audio_mixer_config_t s_config = {0};
+static mixer_stream_t s_streams[AUDIO_MIXER_MAX_STREAMS];
+static std::atomic<uint32_t> s_sample_rate(0);
+static TaskHandle_t s_mixer_task = NULL;
+/*
+ * Held by the mixer task while it reads and converts the streams, a format change waits for
+ * it. A writer takes it to join a stream, a drained stream is freed under it.
+ */
+static SemaphoreHandle_t s_lock = NULL;
+static int32_t s_duck_q15 = AUDIO_MIXER_UNITY_Q15;
+static int32_t s_attack_q15 = AUDIO_MIXER_UNITY_Q15;
+static int32_t s_release_q15 = AUDIO_MIXER_UNITY_Q15;
+
+/* Mixer task work buffers, one period each, aligned for the pcm_convert vector kernels */
+static uint32_t s_raw[AUDIO_MIXER_PERIOD_FRAMES * 2] __attribute__((aligned(16)));
+static int16_t s_conv[AUDIO_MIXER_PERIOD_FRAMES * 2] __attribute__((aligned(16)));
+static int32_t s_acc[AUDIO_MIXER_PERIOD_FRAMES * 2];
+static int16_t s_out[AUDIO_MIXER_PERIOD_FRAMES * 2];
+
+static inline pcm_format_t _stream_format(const mixer_stream_t *st)
+{
+    switch (st->bits.load(std::memory_order_relaxed)) {
+    case 24:
+        return PCM_FORMAT_S24_PACKED;
+    case 32:
+        return PCM_FORMAT_S32;
+    default:
+        return PCM_FORMAT_S16;
+    }
+}
+
+static inline size_t _stream_frame_bytes(const mixer_stream_t *st)
+{
+    return pcm_format_bytes(_stream_format(st)) * st->channels.load(std::memory_order_relaxed);
+}
+
+static inline bool _stream_active(const mixer_stream_t *st)
+{
+    uint8_t state = st->state.load(std::memory_order_acquire);
+    return state == MIXER_STREAM_OPEN || state == MIXER_STREAM_CLOSING;
+}
+
+static inline size_t _stream_frames_available(const mixer_stream_t *st)
+{
+    return xStreamBufferBytesAvailable(st->buffer) / _stream_frame_bytes(st);
+}
+
+/* Linear gain to Q15, outside 0.0 - 1.0 (or NaN) clamped so the Q15 products can't overflow */
+static int32_t _audio_mixer_gain_q15(float gain)
+{
+    if (!(gain > 0.0f)) {
+        return 0;
+    }
+    return gain >= 1.0f ? AUDIO_MIXER_UNITY_Q15 : (int32_t)(gain * AUDIO_MIXER_UNITY_Q15);
+}
+
+/* Release the streams closed, drained and left by their writers, a tail shorter than a frame is dropped */
+static void _audio_mixer_free_drained(void)
+{
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (int i = 0; i < AUDIO_MIXER_MAX_STREAMS; i++) {
+        mixer_stream_t *st = &s_streams[i];
+        if (st->state.load(std::memory_order_acquire) == MIXER_STREAM_CLOSING && st->writers == 0 &&
+                _stream_frames_available(st) == 0) {
+            vStreamBufferDelete(st->buffer);
+            st->buffer = NULL;
+            st->state.store(MIXER_STREAM_FREE, std::memory_order_release);
+        }
+    }
+    xSemaphoreGive(s_lock);
+}
+
+/* One pole smoothing coefficient for a time constant, per mixer period */
+static int32_t _audio_mixer_coef_q15(uint32_t tau_ms, uint32_t sample_rate)
+{
+    if (tau_ms == 0 || sample_rate == 0) {
+        return AUDIO_MIXER_UNITY_Q15;
+    }
+    float period_ms = AUDIO_MIXER_PERIOD_FRAMES * 1000.0f / sample_rate;
+    return (int32_t)((1.0f - expf(-period_ms / tau_ms)) * AUDIO_MIXER_UNITY_Q15);
+}
+
+/**
+ * @brief Read up to frames from a stream and convert them to interleaved 16-bit stereo in s_conv
+ */
+static size_t _audio_mixer_read_stream(mixer_stream_t *st, size_t frames)
+{
+    size_t frame_bytes = _stream_frame_bytes(st);
+    size_t n = _stream_frames_available(st);
+    if (n > frames) {
+        n = frames;
+    }
+    if (n == 0) {
+        return 0;
+    }
+    n = xStreamBufferReceive(st->buffer, s_raw, n * frame_bytes, 0) / frame_bytes;
+
+    uint8_t channels = st->channels.load(std::memory_order_relaxed);
+    pcm_convert(s_conv, PCM_FORMAT_S16, s_raw, _stream_format(st), n * channels, channels, &st->dither);
+    if (channels == 1) {
+        pcm_mono_to_stereo(s_conv, s_conv, n, PCM_FORMAT_S16);
+    }
+    return n;
+}
+
+/**
+ * @brief acc += s_conv * gain, gain ramped from g_start to g_end in AUDIO_MIXER_RAMP_CHUNK steps
+ *
+ * The gain is constant inside a chunk so the inner loop is a plain Q15 multiply-accumulate
+ * over contiguous samples.
+ */
+static void _audio_mixer_accumulate(int32_t *acc, size_t frames, int32_t g_start, int32_t g_end)
+{
+    size_t chunks = (frames + AUDIO_MIXER_RAMP_CHUNK - 1) / AUDIO_MIXER_RAMP_CHUNK;
+    for (size_t c = 0; c < chunks; c++) {
+        int32_t g = g_start + (int32_t)((int64_t)(g_end - g_start) * (int64_t)(c + 1) / (int64_t)chunks);
+        size_t first = c * AUDIO_MIXER_RAMP_CHUNK * 2;
+        size_t count = (frames - c * AUDIO_MIXER_RAMP_CHUNK) * 2;
+        if (count > AUDIO_MIXER_RAMP_CHUNK * 2) {
+            count = AUDIO_MIXER_RAMP_CHUNK * 2;
+        }
+        const int16_t *src = s_conv + first;
+        int32_t *dst = acc + first;
+        for (size_t i = 0; i < count; i++) {
+            dst[i] += (src[i] * g) >> 15;
+        }
+    }
+}
+
+/**
+ * @brief Wait until a full period is available, or a partial one has been held long enough
+ *
+ * @return number of frames to mix in this period
+ */
+static size_t _audio_mixer_wait_data(void)
+{
+    TickType_t partial_since = 0;
+    while (true) {
+        // on every pass, a slot must not stay taken while the other streams keep playing
+        _audio_mixer_free_drained();
+        size_t best = 0;
+        bool flush = false;
+        for (int i = 0; i < AUDIO_MIXER_MAX_STREAMS; i++) {
+            mixer_stream_t *st = &s_streams[i];
+            uint8_t state = st->state.load(std::memory_order_acquire);
+            if (state != MIXER_STREAM_OPEN && state != MIXER_STREAM_CLOSING) {
+                continue;
+            }
+            size_t avail = _stream_frames_available(st);
+            if (avail > best) {
+                best = avail;
+            }
+            // a closing stream won't get more data, play its tail right away
+            flush |= state == MIXER_STREAM_CLOSING && avail > 0;
+        }
+        if (best >= AUDIO_MIXER_PERIOD_FRAMES) {
+            return AUDIO_MIXER_PERIOD_FRAMES;
+        }
+        if (best > 0) {
+            if (partial_since == 0) {
+                partial_since = xTaskGetTickCount() | 1;
+            } else if (flush || xTaskGetTickCount() - partial_since >= pdMS_TO_TICKS(AUDIO_MIXER_PARTIAL_WAIT_MS)) {
+                return best;
+            }
+            ulTaskNotifyTake(pdTRUE, 1);
+        } else {
+            partial_since = 0;
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+        }
+    }
+}
+
+static void _audio_mixer_clip(int16_t *out, const int32_t *acc, size_t samples)
+{
+    for (size_t i = 0; i < samples; i++) {
+        int32_t v = acc[i];
+        out[i] = v > INT16_MAX ? INT16_MAX : (v < INT16_MIN ? INT16_MIN : (int16_t)v);
+    }
+}
+
+static void audio_mixer_task(void *arg)
+{
+    while (true) {
+        size_t frames = _audio_mixer_wait_data();
+
+        xSemaphoreTake(s_lock, portMAX_DELAY);
+        int top_priority = -1;
+        for (int i = 0; i < AUDIO_MIXER_MAX_STREAMS; i++) {
+            mixer_stream_t *st = &s_streams[i];
+            if (_stream_active(st) && st->priority > top_priority && _stream_frames_available(st) > 0) {
+                top_priority = st->priority;
+            }
+        }
+
+        memset(s_acc, 0, frames * 2 * sizeof(int32_t));
+        for (int i = 0; i < AUDIO_MIXER_MAX_STREAMS; i++) {
+            mixer_stream_t *st = &s_streams[i];
+            if (!_stream_active(st)) {
+                continue;
+            }
+            int32_t target = st->priority < top_priority ? s_duck_q15 : AUDIO_MIXER_UNITY_Q15;
+            int32_t coef = target < st->env_q15 ? s_attack_q15 : s_release_q15;
+            int32_t env_end = st->env_q15 + (int32_t)(((int64_t)(target - st->env_q15) * coef) >> 15);
+            int32_t gain = st->gain_q15.load(std::memory_order_relaxed);
+
+            size_t n = _audio_mixer_read_stream(st, frames);
+            if (n > 0) {
+                _audio_mixer_accumulate(s_acc, n, (st->env_q15 * gain) >> 15, (env_end * gain) >> 15);
+            }
+            st->env_q15 = env_end;
+        }
+        xSemaphoreGive(s_lock);
+
+        // held until the sink takes all of it, e.g. across a USB stream recovery; the sink
+        // processes the buffer in place, so each attempt is clipped again from s_acc
+        size_t samples = frames * 2;
+        size_t done = 0;
+        while (done < samples) {
+            _audio_mixer_clip(s_out, s_acc + done, samples - done);
+            size_t written = 0;
+            esp_err_t ret = s_config.write_fn(s_out, (samples - done) * sizeof(int16_t), &written, 1000);
+            done += written / sizeof(int16_t);
+            if (ret != ESP_OK || written == 0) {
+                // no sink (e.g. during a reconnect), retry at real-time pace
+                uint32_t rate = s_sample_rate.load(std::memory_order_relaxed);
+                vTaskDelay(pdMS_TO_TICKS(frames * 1000 / (rate ? rate : 48000)) + 1);
+            }
+        }
+    }
+}
+
+esp_err_t audio_mixer_new(const audio_mixer_config_t *config)
+{
+    if (s_mixer_task != NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (config == NULL || config->write_fn == NULL || config->sample_rate == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (s_lock == NULL) {
+        s_lock = xSemaphoreCreateMutex();
+        if (s_lock == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    s_config = *config;
+    s_duck_q15 = (int32_t)(powf(10.0f, config->duck_level_db / 20.0f) * AUDIO_MIXER_UNITY_Q15);
+    audio_mixer_set_sample_rate(config->sample_rate);
+
+    BaseType_t ret = xTaskCreatePinnedToCore(audio_mixer_task, "audio_mixer", 4096, NULL,
+                                             config->task_priority, &s_mixer_task, config->task_core);
+    if (ret != pdTRUE) {
+        s_mixer_task = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    ESP_LOGI(TAG, "Mixer started: %"PRIu32" Hz, duck %.1f dB, attack %"PRIu32" ms, release %"PRIu32" ms",
+             config->sample_rate, config->duck_level_db, config->attack_ms, config->release_ms);
+    return ESP_OK;
+}
+
+void audio_mixer_set_sample_rate(uint32_t sample_rate)
+{
+    s_sample_rate.store(sample_rate, std::memory_order_relaxed);
+    s_attack_q15 = _audio_mixer_coef_q15(s_config.attack_ms, sample_rate);
+    s_release_q15 = _audio_mixer_coef_q15(s_config.release_ms, sample_rate);
+}
+
+uint32_t audio_mixer_get_sample_rate(void)
+{
+    return s_sample_rate.load(std::memory_order_relaxed);
+}
+
+static bool _stream_valid(audio_mixer_stream_t stream)
+{
+    return stream >= 0 && stream < AUDIO_MIXER_MAX_STREAMS &&
+           s_streams[stream].state.load(std::memory_order_acquire) == MIXER_STREAM_OPEN;
+}
+
+static bool _format_valid(uint8_t channels, uint8_t bits)
+{
+    return (channels == 1 || channels == 2) && (bits == 16 || bits == 24 || bits == 32);
+}
+
+esp_err_t audio_mixer_stream_open(const audio_mixer_stream_config_t *config, audio_mixer_stream_t *stream)
+{
+    if (config == NULL || stream == NULL || !_format_valid(config->channels, config->bits)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    for (int i = 0; i < AUDIO_MIXER_MAX_STREAMS; i++) {
+        mixer_stream_t *st = &s_streams[i];
+        uint8_t expected = MIXER_STREAM_FREE;
+        // claim the slot, the mixer task ignores it until it is OPEN
+        if (!st->state.compare_exchange_strong(expected, MIXER_STREAM_OPENING)) {
+            continue;
+        }
+        st->buffer = xStreamBufferCreate(config->buffer_size, 1);
+        if (st->buffer == NULL) {
+            st->state.store(MIXER_STREAM_FREE, std::memory_order_release);
+            return ESP_ERR_NO_MEM;
+        }
+        st->priority = config->priority;
+        st->gain_q15.store(_audio_mixer_gain_q15(config->gain), std::memory_order_relaxed);
+        st->channels.store(config->channels, std::memory_order_relaxed);
+        st->bits.store(config->bits, std::memory_order_relaxed);
+        st->env_q15 = AUDIO_MIXER_UNITY_Q15;
+        st->writers = 0;
+        pcm_dither_init(&st->dither, false);
+        st->state.store(MIXER_STREAM_OPEN, std::memory_order_release);
+        *stream = i;
+        return ESP_OK;
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+void audio_mixer_stream_close(audio_mixer_stream_t stream)
+{
+    if (!_stream_valid(stream)) {
+        return;
+    }
+    s_streams[stream].state.store(MIXER_STREAM_CLOSING, std::memory_order_release);
+    xTaskNotifyGive(s_mixer_task);
+}
+
+esp_err_t audio_mixer_stream_set_format(audio_mixer_stream_t stream, uint8_t channels, uint8_t bits)
+{
+    if (!_stream_valid(stream) || !_format_valid(channels, bits)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (s_lock == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    mixer_stream_t *st = &s_streams[stream];
+    if (st->channels.load(std::memory_order_relaxed) == channels && st->bits.load(std::memory_order_relaxed) == bits) {
+        return ESP_OK;
+    }
+    // let the data queued in the previous format play out first
+    for (int i = 0; i < 50 && !xStreamBufferIsEmpty(st->buffer); i++) {
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    // not while the mixer task reads this stream in the old format
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    xStreamBufferReset(st->buffer);
+    st->channels.store(channels, std::memory_order_relaxed);
+    st->bits.store(bits, std::memory_order_relaxed);
+    pcm_dither_init(&st->dither, false);
+    xSemaphoreGive(s_lock);
+    return ESP_OK;
+}
+
+esp_err_t audio_mixer_stream_set_gain(audio_mixer_stream_t stream, float gain)
+{
+    if (!_stream_valid(stream)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_streams[stream].gain_q15.store(_audio_mixer_gain_q15(gain), std::memory_order_relaxed);
+    return ESP_OK;
+}
+
+esp_err_t audio_mixer_stream_write(audio_mixer_stream_t stream, const void *data, size_t len, size_t *bytes_written, uint32_t timeout_ms)
+{
+    if (s_lock == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    // not past the check while the stream is freed, the buffer stays until the writer leaves
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (!_stream_valid(stream)) {
+        xSemaphoreGive(s_lock);
+        return ESP_ERR_INVALID_ARG;
+    }
+    mixer_stream_t *st = &s_streams[stream];
+    st->writers++;
+    xSemaphoreGive(s_lock);
+    // may block on a full buffer, without the lock the mixer task needs to drain it
+    size_t sent = xStreamBufferSend(st->buffer, data, len, pdMS_TO_TICKS(timeout_ms));
+    st->writers--;
+    xTaskNotifyGive(s_mixer_task);
+    if (bytes_written != NULL) {
+        *bytes_written = sent;
+    }
+    return sent == len ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+} // namespace usbaudio
+} // namespace esphome
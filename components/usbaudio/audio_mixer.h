@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+namespace esphome {
+namespace usbaudio {
+
+#define AUDIO_MIXER_MAX_STREAMS     4
+#define AUDIO_MIXER_PERIOD_FRAMES   480     /*!< 10 ms at 48 kHz */
+
+/**
+ * @brief Sink the mixer output is written to, same signature as the audio player write_fn
+ */
+typedef esp_err_t (*audio_mixer_write_fn_t)(void *audio_buffer, size_t len, size_t *bytes_written, uint32_t timeout_ms);
+
+typedef struct {
+    audio_mixer_write_fn_t write_fn;    /*!< receives interleaved 16-bit stereo */
+    uint32_t sample_rate;               /*!< output rate, all streams must use it */
+    float duck_level_db;                /*!< gain applied to ducked streams, <= 0 */
+    uint32_t attack_ms;                 /*!< time constant to reach the ducked level */
+    uint32_t release_ms;                /*!< time constant to recover full level */
+    int task_priority;
+    int task_core;
+} audio_mixer_config_t;
+
+typedef struct {
+    uint8_t priority;                   /*!< streams below the highest active priority are ducked */
+    float gain;                         /*!< linear gain, 0.0 - 1.0, clamped to it */
+    uint8_t channels;                   /*!< 1 or 2 */
+    uint8_t bits;                       /*!< 16, 24 (packed) or 32 */
+    size_t buffer_size;                 /*!< stream buffer size in bytes */
+} audio_mixer_stream_config_t;
+
+typedef int audio_mixer_stream_t;
+
+/**
+ * @brief Create the mixer and its task
+ *
+ * @return
+ *    - ESP_OK: Success
+ *    - ESP_ERR_INVALID_STATE: mixer already created
+ *    - ESP_ERR_NO_MEM: task creation failed
+ */
+esp_err_t audio_mixer_new(const audio_mixer_config_t *config);
+
+/**
+ * @brief Change the output sample rate, the sink must be re-configured by the caller
+ */
+void audio_mixer_set_sample_rate(uint32_t sample_rate);
+uint32_t audio_mixer_get_sample_rate(void);
+
+/**
+ * @brief Open an input stream
+ *
+ * @return
+ *    - ESP_OK: Success
+ *    - ESP_ERR_NOT_FOUND: all AUDIO_MIXER_MAX_STREAMS are in use
+ *    - ESP_ERR_NO_MEM: buffer allocation failed
+ */
+esp_err_t audio_mixer_stream_open(const audio_mixer_stream_config_t *config, audio_mixer_stream_t *stream);
+
+/**
+ * @brief Close a stream, data already written is still played out
+ */
+void audio_mixer_stream_close(audio_mixer_stream_t stream);
+
+/**
+ * @brief Change the sample format of the data written from now on
+ */
+esp_err_t audio_mixer_stream_set_format(audio_mixer_stream_t stream, uint8_t channels, uint8_t bits);
+esp_err_t audio_mixer_stream_set_gain(audio_mixer_stream_t stream, float gain);
+
+/**
+ * @brief Queue PCM data on a stream, blocks up to timeout_ms while the stream buffer is full
+ */
+esp_err_t audio_mixer_stream_write(audio_mixer_stream_t stream, const void *data, size_t len, size_t *bytes_written, uint32_t timeout_ms);
+
+} // namespace usbaudio
+} // namespace esphome
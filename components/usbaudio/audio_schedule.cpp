@@ -0,0 +1,401 @@
+#include "audio_schedule.h"
+
+#include <atomic>
+#include <string.h>
+#include "esphome/core/log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+namespace esphome {
+namespace usbaudio {
+static const char *const TAG = "audio_schedule";
+
+/* A sink write later than the timeline by more than this restarts it (underrun, idle gap) */
+#define AUDIO_SCHEDULE_REANCHOR_US      20000
+/* The player counts as idle when it hasn't written for this long */
+#define AUDIO_SCHEDULE_IDLE_MS          50
+/* While idle, silence is fed from this long before a clip so that the sink is in steady state */
+#define AUDIO_SCHEDULE_PREROLL_MS       100
+#define AUDIO_SCHEDULE_FEED_FRAMES      480
+
+typedef enum {
+    CLIP_FREE = 0,
+    CLIP_FILLING,
+    CLIP_PENDING,
+    CLIP_PLAYING,
+    CLIP_CANCELLED,
+} clip_state_t;
+
+/* The slot tag packs a generation (high byte) with the state (low byte) so that ids of finished clips go stale */
+#define CLIP_TAG(gen, state)    ((uint16_t)(((gen) << 8) | (state)))
+#define CLIP_TAG_GEN(tag)       ((uint8_t)((tag) >> 8))
+#define CLIP_TAG_STATE(tag)     ((uint8_t)((tag) & 0xFF))
+
+typedef struct {
+    std::atomic<uint16_t> tag;
+    audio_clip_t clip;
+    bool at_time;
+    int64_t start_us;
+    uint64_t start_sample;          /*!< fixed once the clip plays */
+} clip_slot_t;
+
+/* Linear sink timeline: sample anchor_sample reaches the speaker at anchor_us */
+typedef struct {
+    uint64_t anchor_sample;
+    int64_t anchor_us;
+    uint32_t rate;
+} schedule_timeline_t;
+
+static audio_schedule_config_t s_config = {0};
+static clip_slot_t s_slots[AUDIO_SCHEDULE_MAX_CLIPS];
+static TaskHandle_t s_feeder_task = NULL;
+static std::atomic<uint32_t> s_last_player_ms(0);
+
+/* Protects the timeline, the position, the sink format and the stats */
+static SemaphoreHandle_t s_clock_lock = NULL;
+static schedule_timeline_t s_timeline = {0};
+static bool s_anchored = false;
+static uint64_t s_position = 0;
+static uint32_t s_bits = 16;
+static uint32_t s_channels = 2;
+static audio_schedule_stats_t s_stats = {0};
+
+/* Feeder task only, large enough for one period of 32-bit stereo */
+static uint32_t s_silence[AUDIO_SCHEDULE_FEED_FRAMES * 2];
+
+/* Divide rounding to nearest, so that sample -> time -> sample is exact */
+static inline int64_t _div_round(int64_t num, int64_t den)
+{
+    return num >= 0 ? (num + den / 2) / den : -((-num + den / 2) / den);
+}
+
+static uint64_t _timeline_to_sample(const schedule_timeline_t *tl, int64_t time_us)
+{
+    int64_t delta = _div_round((time_us - tl->anchor_us) * tl->rate, 1000000);
+    if (delta < 0 && (uint64_t)-delta > tl->anchor_sample) {
+        return 0;
+    }
+    return tl->anchor_sample + delta;
+}
+
+static int64_t _timeline_to_time(const schedule_timeline_t *tl, uint64_t sample)
+{
+    return tl->anchor_us + _div_round(((int64_t)sample - (int64_t)tl->anchor_sample) * 1000000, tl->rate ? tl->rate : 48000);
+}
+
+uint64_t audio_schedule_time_to_sample(int64_t time_us)
+{
+    xSemaphoreTake(s_clock_lock, portMAX_DELAY);
+    uint64_t sample = s_anchored ? _timeline_to_sample(&s_timeline, time_us) : s_position;
+    xSemaphoreGive(s_clock_lock);
+    return sample;
+}
+
+int64_t audio_schedule_sample_to_time(uint64_t sample)
+{
+    xSemaphoreTake(s_clock_lock, portMAX_DELAY);
+    int64_t time_us = s_anchored ? _timeline_to_time(&s_timeline, sample) : esp_timer_get_time() + s_config.output_latency_us;
+    xSemaphoreGive(s_clock_lock);
+    return time_us;
+}
+
+static esp_err_t _audio_schedule_add(const audio_clip_t *clip, bool at_time, int64_t start_us, uint64_t sample,
+                                     audio_schedule_id_t *id)
+{
+    if (clip == NULL || clip->pcm == NULL || clip->frames == 0 || (clip->channels != 1 && clip->channels != 2)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    for (int i = 0; i < AUDIO_SCHEDULE_MAX_CLIPS; i++) {
+        clip_slot_t *slot = &s_slots[i];
+        uint16_t tag = slot->tag.load(std::memory_order_acquire);
+        if (CLIP_TAG_STATE(tag) != CLIP_FREE ||
+                !slot->tag.compare_exchange_strong(tag, CLIP_TAG(CLIP_TAG_GEN(tag), CLIP_FILLING))) {
+            continue;
+        }
+        slot->clip = *clip;
+        slot->at_time = at_time;
+        slot->start_us = start_us;
+        slot->start_sample = sample;
+        slot->tag.store(CLIP_TAG(CLIP_TAG_GEN(tag), CLIP_PENDING), std::memory_order_release);
+        if (id) {
+            *id = (CLIP_TAG_GEN(tag) << 8) | i;
+        }
+        if (s_feeder_task) {
+            xTaskNotifyGive(s_feeder_task);
+        }
+        return ESP_OK;
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t audio_schedule_clip_at_time(const audio_clip_t *clip, int64_t start_us, audio_schedule_id_t *id)
+{
+    return _audio_schedule_add(clip, true, start_us, 0, id);
+}
+
+esp_err_t audio_schedule_clip_at_sample(const audio_clip_t *clip, uint64_t sample, audio_schedule_id_t *id)
+{
+    return _audio_schedule_add(clip, false, 0, sample, id);
+}
+
+void audio_schedule_cancel(audio_schedule_id_t id)
+{
+    int index = id & 0xFF;
+    uint8_t gen = (uint8_t)(id >> 8);
+    if (index >= AUDIO_SCHEDULE_MAX_CLIPS) {
+        return;
+    }
+    // the sink task frees the slot and calls done_cb
+    clip_slot_t *slot = &s_slots[index];
+    uint16_t expected = CLIP_TAG(gen, CLIP_PENDING);
+    if (!slot->tag.compare_exchange_strong(expected, CLIP_TAG(gen, CLIP_CANCELLED))) {
+        expected = CLIP_TAG(gen, CLIP_PLAYING);
+        slot->tag.compare_exchange_strong(expected, CLIP_TAG(gen, CLIP_CANCELLED));
+    }
+}
+
+static void _audio_schedule_finish(clip_slot_t *slot, uint16_t tag)
+{
+    void (*done_cb)(void *) = slot->clip.done_cb;
+    void *done_arg = slot->clip.done_arg;
+    slot->tag.store(CLIP_TAG(CLIP_TAG_GEN(tag) + 1, CLIP_FREE), std::memory_order_release);
+    if (done_cb) {
+        done_cb(done_arg);
+    }
+}
+
+/* Saturating add of clip frames into the sink buffer, mono clips go to every channel */
+static void _audio_schedule_mix(void *audio_buffer, size_t offset, const audio_clip_t *clip, size_t clip_index,
+                                size_t count, uint32_t bits, uint32_t channels)
+{
+    const int16_t *in = clip->pcm + clip_index * clip->channels;
+    for (size_t i = 0; i < count; i++) {
+        for (uint32_t c = 0; c < channels; c++) {
+            int32_t s;
+            if (clip->channels == 1) {
+                s = in[i];
+            } else if (channels == 1) {
+                s = (in[2 * i] + in[2 * i + 1]) >> 1;
+            } else {
+                s = in[2 * i + (c & 1)];
+            }
+            size_t k = (offset + i) * channels + c;
+            if (bits == 16) {
+                int32_t v = ((int16_t *)audio_buffer)[k] + s;
+                ((int16_t *)audio_buffer)[k] = v > INT16_MAX ? INT16_MAX : (v < INT16_MIN ? INT16_MIN : (int16_t)v);
+            } else {
+                int64_t v = (int64_t)((int32_t *)audio_buffer)[k] + (int64_t)s * 65536;
+                ((int32_t *)audio_buffer)[k] = v > INT32_MAX ? INT32_MAX : (v < INT32_MIN ? INT32_MIN : (int32_t)v);
+            }
+        }
+    }
+}
+
+bool audio_schedule_process(void *audio_buffer, size_t len, uint32_t bits, uint32_t channels, uint32_t rate)
+{
+    if (s_clock_lock == NULL || rate == 0 || channels == 0 || bits < 8) {
+        return false;
+    }
+    size_t frames = len / ((bits / 8) * channels);
+    int64_t now = esp_timer_get_time();
+    if (xTaskGetCurrentTaskHandle() != s_feeder_task) {
+        s_last_player_ms.store((uint32_t)(now / 1000), std::memory_order_relaxed);
+    }
+
+    /*
+     * With a blocking sink, data handed over now is heard output_latency_us later. Late
+     * writes mean the sink ran dry and restart the timeline, early ones (the sink buffer
+     * filling up) keep the prediction, small deviations are smoothed out.
+     */
+    xSemaphoreTake(s_clock_lock, portMAX_DELAY);
+    uint64_t first = s_position;
+    int64_t measured = now + s_config.output_latency_us;
+    if (!s_anchored || rate != s_timeline.rate) {
+        if (s_anchored) {
+            s_stats.reanchor_count++;
+        }
+        s_timeline.anchor_sample = first;
+        s_timeline.anchor_us = measured;
+        s_timeline.rate = rate;
+        s_anchored = true;
+    } else {
+        int64_t err = measured - _timeline_to_time(&s_timeline, first);
+        if (err > AUDIO_SCHEDULE_REANCHOR_US) {
+            s_stats.reanchor_count++;
+            s_timeline.anchor_sample = first;
+            s_timeline.anchor_us = measured;
+        } else if (err > -AUDIO_SCHEDULE_REANCHOR_US) {
+            s_timeline.anchor_us += err / 16;
+        }
+    }
+    schedule_timeline_t timeline = s_timeline;
+    s_position += frames;
+    s_bits = bits;
+    s_channels = channels;
+    xSemaphoreGive(s_clock_lock);
+
+    audio_schedule_stats_t delta = {0};
+    bool mixable = bits == 16 || bits == 32;
+    bool mixed = false;
+    for (int i = 0; i < AUDIO_SCHEDULE_MAX_CLIPS; i++) {
+        clip_slot_t *slot = &s_slots[i];
+        uint16_t tag = slot->tag.load(std::memory_order_acquire);
+        uint8_t state = CLIP_TAG_STATE(tag);
+        if (state == CLIP_CANCELLED) {
+            _audio_schedule_finish(slot, tag);
+            continue;
+        }
+        if (state == CLIP_PENDING) {
+            uint64_t start = slot->at_time ? _timeline_to_sample(&timeline, slot->start_us) : slot->start_sample;
+            if (start >= first + frames) {
+                continue;
+            }
+            if (!mixable || slot->clip.sample_rate != rate || start + slot->clip.frames <= first) {
+                ESP_LOGW(TAG, "Clip %d dropped", i);
+                delta.dropped++;
+                _audio_schedule_finish(slot, tag);
+                continue;
+            }
+            slot->start_sample = start;
+            uint16_t playing = CLIP_TAG(CLIP_TAG_GEN(tag), CLIP_PLAYING);
+            if (!slot->tag.compare_exchange_strong(tag, playing)) {
+                // cancelled meanwhile, freed on the next buffer
+                continue;
+            }
+            tag = playing;
+            if (start < first) {
+                delta.late++;
+            } else {
+                delta.played++;
+            }
+        } else if (state != CLIP_PLAYING) {
+            continue;
+        }
+
+        size_t offset = slot->start_sample > first ? (size_t)(slot->start_sample - first) : 0;
+        size_t clip_index = (size_t)(first + offset - slot->start_sample);
+        size_t count = frames - offset;
+        if (count > slot->clip.frames - clip_index) {
+            count = slot->clip.frames - clip_index;
+        }
+        if (mixable && count > 0) {
+            _audio_schedule_mix(audio_buffer, offset, &slot->clip, clip_index, count, bits, channels);
+            mixed = true;
+        }
+        if (clip_index + count >= slot->clip.frames) {
+            _audio_schedule_finish(slot, tag);
+        }
+    }
+
+    if (delta.played || delta.late || delta.dropped) {
+        xSemaphoreTake(s_clock_lock, portMAX_DELAY);
+        s_stats.played += delta.played;
+        s_stats.late += delta.late;
+        s_stats.dropped += delta.dropped;
+        xSemaphoreGive(s_clock_lock);
+    }
+    return mixed;
+}
+
+/**
+ * @brief Earliest speaker time a scheduled clip needs the sink, INT64_MAX when nothing is scheduled
+ */
+static int64_t _audio_schedule_next_due(void)
+{
+    int64_t next = INT64_MAX;
+    for (int i = 0; i < AUDIO_SCHEDULE_MAX_CLIPS; i++) {
+        clip_slot_t *slot = &s_slots[i];
+        uint8_t state = CLIP_TAG_STATE(slot->tag.load(std::memory_order_acquire));
+        int64_t due;
+        if (state == CLIP_PLAYING || state == CLIP_CANCELLED) {
+            due = 0;
+        } else if (state == CLIP_PENDING) {
+            due = slot->at_time ? slot->start_us : audio_schedule_sample_to_time(slot->start_sample);
+        } else {
+            continue;
+        }
+        if (due < next) {
+            next = due;
+        }
+    }
+    return next;
+}
+
+/**
+ * @brief Keep the sink running with silence while clips are due and the player is idle
+ *
+ * Clips are only placed by the sink write path, with nothing playing it would not run.
+ */
+static void audio_schedule_task(void *arg)
+{
+    while (true) {
+        int64_t next = _audio_schedule_next_due();
+        if (next == INT64_MAX) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+        int64_t now = esp_timer_get_time();
+        if ((uint32_t)(now / 1000) - s_last_player_ms.load(std::memory_order_relaxed) < AUDIO_SCHEDULE_IDLE_MS) {
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(AUDIO_SCHEDULE_IDLE_MS));
+            continue;
+        }
+        int64_t feed_at = next - s_config.output_latency_us - AUDIO_SCHEDULE_PREROLL_MS * 1000;
+        if (feed_at > now) {
+            int64_t wait_ms = (feed_at - now) / 1000;
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wait_ms < 100 ? wait_ms : 100) + 1);
+            continue;
+        }
+
+        xSemaphoreTake(s_clock_lock, portMAX_DELAY);
+        uint32_t bits = s_bits == 32 ? 32 : 16;
+        uint32_t channels = s_channels == 1 ? 1 : 2;
+        uint32_t rate = s_anchored ? s_timeline.rate : 48000;
+        xSemaphoreGive(s_clock_lock);
+        size_t len = AUDIO_SCHEDULE_FEED_FRAMES * (bits / 8) * channels;
+        memset(s_silence, 0, len);
+        size_t written = 0;
+        if (s_config.write_fn(s_silence, len, &written, 100) != ESP_OK) {
+            // no sink, keep real-time pace
+            vTaskDelay(pdMS_TO_TICKS(AUDIO_SCHEDULE_FEED_FRAMES * 1000 / rate) + 1);
+        }
+    }
+}
+
+esp_err_t audio_schedule_init(const audio_schedule_config_t *config)
+{
+    if (s_feeder_task != NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (config == NULL || config->write_fn == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_config = *config;
+    s_clock_lock = xSemaphoreCreateMutex();
+    if (s_clock_lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    BaseType_t ret = xTaskCreatePinnedToCore(audio_schedule_task, "audio_schedule", 3072, NULL,
+                                             config->task_priority, &s_feeder_task, config->task_core);
+    if (ret != pdTRUE) {
+        s_feeder_task = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    ESP_LOGI(TAG, "Scheduler started, output latency %"PRIu32" us", config->output_latency_us);
+    return ESP_OK;
+}
+
+void audio_schedule_get_stats(audio_schedule_stats_t *stats)
+{
+    if (s_clock_lock == NULL) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    xSemaphoreTake(s_clock_lock, portMAX_DELAY);
+    *stats = s_stats;
+    xSemaphoreGive(s_clock_lock);
+}
+
+} // namespace usbaudio
+} // namespace esphome
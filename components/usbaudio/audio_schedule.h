@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+namespace esphome {
+namespace usbaudio {
+
+#define AUDIO_SCHEDULE_MAX_CLIPS    4
+
+/**
+ * @brief Sink the scheduler writes silence to while the player is idle, same signature as the audio player write_fn
+ */
+typedef esp_err_t (*audio_schedule_write_fn_t)(void *audio_buffer, size_t len, size_t *bytes_written, uint32_t timeout_ms);
+
+typedef struct {
+    audio_schedule_write_fn_t write_fn; /*!< keeps the sink running for clips scheduled while nothing plays */
+    uint32_t output_latency_us;         /*!< sink write to sound, e.g. measured with audio_latency */
+    int task_priority;
+    int task_core;
+} audio_schedule_config_t;
+
+/**
+ * @brief A pre-decoded clip, the PCM data must stay valid until done_cb is called
+ */
+typedef struct {
+    const int16_t *pcm;                 /*!< interleaved 16-bit samples */
+    size_t frames;
+    uint8_t channels;                   /*!< 1 or 2 */
+    uint32_t sample_rate;               /*!< must match the sink rate when the clip starts */
+    void (*done_cb)(void *arg);         /*!< called from the sink task when played, dropped or cancelled, may be NULL */
+    void *done_arg;
+} audio_clip_t;
+
+typedef int audio_schedule_id_t;
+
+typedef struct {
+    uint32_t played;                    /*!< started on the exact sample */
+    uint32_t late;                      /*!< onset already played out when first seen, started mid-clip */
+    uint32_t dropped;                   /*!< entirely in the past or in a format that doesn't match the sink */
+    uint32_t reanchor_count;            /*!< sink timeline restarts (gaps, rate changes) */
+} audio_schedule_stats_t;
+
+/**
+ * @brief Create the scheduler and its idle feeder task
+ *
+ * @return
+ *    - ESP_OK: Success
+ *    - ESP_ERR_INVALID_STATE: already created
+ *    - ESP_ERR_NO_MEM: task creation failed
+ */
+esp_err_t audio_schedule_init(const audio_schedule_config_t *config);
+
+/**
+ * @brief Start a clip when its first sample reaches the speaker at start_us (esp_timer time)
+ *
+ * @return
+ *    - ESP_OK: Success
+ *    - ESP_ERR_INVALID_ARG: empty clip or unsupported channel count
+ *    - ESP_ERR_NOT_FOUND: all AUDIO_SCHEDULE_MAX_CLIPS are in use
+ */
+esp_err_t audio_schedule_clip_at_time(const audio_clip_t *clip, int64_t start_us, audio_schedule_id_t *id);
+
+/**
+ * @brief Start a clip on a sink sample position, see audio_schedule_time_to_sample()
+ */
+esp_err_t audio_schedule_clip_at_sample(const audio_clip_t *clip, uint64_t sample, audio_schedule_id_t *id);
+
+/**
+ * @brief Cancel a clip that is pending or playing, done_cb is still called
+ */
+void audio_schedule_cancel(audio_schedule_id_t id);
+
+/**
+ * @brief Map between esp_timer time at the speaker and sink sample positions
+ *
+ * Positions count the frames written to the sink since boot. The mapping follows the sink
+ * and is restarted after gaps, the result is only meaningful for times in the near future.
+ */
+uint64_t audio_schedule_time_to_sample(int64_t time_us);
+int64_t audio_schedule_sample_to_time(uint64_t sample);
+
+/**
+ * @brief Sink write path hook, mixes the clips due in this buffer and advances the position
+ *
+ * Must be called once for every buffer written to the sink, from one task at a time.
+ *
+ * @param audio_buffer: interleaved PCM about to be written to the sink
+ * @param len: buffer length in bytes
+ * @param bits: 16 or 32, clips are not mixed into other formats
+ * @param channels: channels in audio_buffer
+ * @param rate: sample rate of audio_buffer
+ *
+ * @return true when a clip was mixed into audio_buffer
+ */
+bool audio_schedule_process(void *audio_buffer, size_t len, uint32_t bits, uint32_t channels, uint32_t rate);
+
+void audio_schedule_get_stats(audio_schedule_stats_t *stats);
+
+} // namespace usbaudio
+} // namespace esphome
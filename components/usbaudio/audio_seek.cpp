@@ -0,0 +1,252 @@
+#include "audio_seek.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+namespace esphome {
+namespace usbaudio {
+
+#define AUDIO_SEEK_CHUNK            4096
+#define AUDIO_SEEK_MAX_ENTRIES      (1u << 20)
+
+typedef struct {
+    uint32_t length;                /*!< bytes including the header */
+    uint32_t sample_rate;
+    uint16_t samples;               /*!< per frame */
+} mp3_frame_t;
+
+static const uint16_t s_bitrate_v1[16] = {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0};
+static const uint16_t s_bitrate_v2[16] = {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0};
+static const uint32_t s_rate_v1[4] = {44100, 48000, 32000, 0};
+
+/* Layer III frame header, free format is not supported */
+static bool _mp3_parse_header(const uint8_t *h, mp3_frame_t *frame)
+{
+    if (h[0] != 0xFF || (h[1] & 0xE0) != 0xE0) {
+        return false;
+    }
+    uint8_t version = (h[1] >> 3) & 3;      // 0: 2.5, 2: 2, 3: 1
+    uint8_t layer = (h[1] >> 1) & 3;        // 1: Layer III
+    uint8_t bitrate_idx = h[2] >> 4;
+    uint8_t rate_idx = (h[2] >> 2) & 3;
+    if (version == 1 || layer != 1 || bitrate_idx == 0 || bitrate_idx == 15 || rate_idx == 3) {
+        return false;
+    }
+    bool mpeg1 = version == 3;
+    uint32_t bitrate = (mpeg1 ? s_bitrate_v1 : s_bitrate_v2)[bitrate_idx] * 1000;
+    uint32_t rate = s_rate_v1[rate_idx] >> (mpeg1 ? 0 : (version == 2 ? 1 : 2));
+    frame->sample_rate = rate;
+    frame->samples = mpeg1 ? 1152 : 576;
+    frame->length = (mpeg1 ? 144 : 72) * bitrate / rate + ((h[2] >> 1) & 1);
+    return true;
+}
+
+/* Sequential reads with a window over the file, the scan mostly moves forward */
+typedef struct {
+    FILE *fp;
+    uint32_t file_size;
+    uint32_t start;                 /*!< file offset of buf[0] */
+    uint32_t len;
+    uint8_t buf[AUDIO_SEEK_CHUNK];
+} seek_reader_t;
+
+/* Bytes [pos, pos + n) in the buffer, NULL past the end of the file */
+static const uint8_t *_reader_get(seek_reader_t *r, uint32_t pos, uint32_t n)
+{
+    if (pos + n > r->file_size) {
+        return NULL;
+    }
+    if (pos < r->start || pos + n > r->start + r->len) {
+        if (fseek(r->fp, pos, SEEK_SET) != 0) {
+            return NULL;
+        }
+        r->start = pos;
+        r->len = fread(r->buf, 1, sizeof(r->buf), r->fp);
+        if (r->len < n) {
+            return NULL;
+        }
+    }
+    return r->buf + (pos - r->start);
+}
+
+/* A header followed by another valid one, to tell real frames from sync-like data */
+static bool _mp3_frame_at(seek_reader_t *r, uint32_t pos, mp3_frame_t *frame)
+{
+    const uint8_t *h = _reader_get(r, pos, 4);
+    if (h == NULL || !_mp3_parse_header(h, frame)) {
+        return false;
+    }
+    mp3_frame_t next;
+    const uint8_t *n = _reader_get(r, pos + frame->length, 4);
+    // the last frame has nothing after it
+    return n == NULL || (_mp3_parse_header(n, &next) && next.sample_rate == frame->sample_rate);
+}
+
+static uint32_t _id3v2_size(seek_reader_t *r)
+{
+    const uint8_t *h = _reader_get(r, 0, 10);
+    if (h == NULL || memcmp(h, "ID3", 3) != 0) {
+        return 0;
+    }
+    // sync-safe size, plus the footer when present
+    uint32_t size = ((h[6] & 0x7F) << 21) | ((h[7] & 0x7F) << 14) | ((h[8] & 0x7F) << 7) | (h[9] & 0x7F);
+    return 10 + size + ((h[5] & 0x10) ? 10 : 0);
+}
+
+static uint32_t _frames_per_entry(const audio_seek_header_t *h)
+{
+    uint64_t frames = (uint64_t)h->interval_ms * h->sample_rate / (1000ull * h->samples_per_frame);
+    return frames ? (uint32_t)frames : 1;
+}
+
+esp_err_t audio_seek_build(FILE *fp, uint32_t interval_ms, audio_seek_index_t *index)
+{
+    if (fseek(fp, 0, SEEK_END) != 0) {
+        return ESP_FAIL;
+    }
+    long size = ftell(fp);
+    if (size <= 0) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    seek_reader_t *r = (seek_reader_t *)malloc(sizeof(seek_reader_t));
+    if (r == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    r->fp = fp;
+    r->file_size = (uint32_t)size;
+    r->start = 0;
+    r->len = 0;
+
+    memset(index, 0, sizeof(*index));
+    audio_seek_header_t *h = &index->header;
+    memcpy(h->magic, AUDIO_SEEK_MAGIC, sizeof(h->magic));
+    h->version = AUDIO_SEEK_VERSION;
+    h->interval_ms = interval_ms;
+    h->file_size = r->file_size;
+
+    esp_err_t ret = ESP_OK;
+    uint32_t capacity = 0;
+    uint32_t frames_per_entry = 0;
+    uint32_t pos = _id3v2_size(r);
+    mp3_frame_t frame;
+    bool synced = false;
+    while (pos < r->file_size) {
+        // right after a frame the header alone is trusted, e.g. the last one before an ID3v1 tag
+        const uint8_t *hdr = synced ? _reader_get(r, pos, 4) : NULL;
+        synced = hdr != NULL ? _mp3_parse_header(hdr, &frame) : _mp3_frame_at(r, pos, &frame);
+        if (!synced) {
+            pos++;
+            continue;
+        }
+        if (h->frames == 0) {
+            h->sample_rate = frame.sample_rate;
+            h->samples_per_frame = frame.samples;
+            frames_per_entry = _frames_per_entry(h);
+        }
+        if (h->frames % frames_per_entry == 0) {
+            if (h->count == capacity) {
+                // grow by the estimate from the average frame size seen so far
+                uint32_t estimate = pos > 0 && h->frames > 0 ?
+                                    (uint32_t)((uint64_t)r->file_size * h->frames / pos / frames_per_entry) + 16 : 256;
+                capacity = estimate > capacity * 2 ? estimate : capacity * 2;
+                capacity = capacity > AUDIO_SEEK_MAX_ENTRIES ? AUDIO_SEEK_MAX_ENTRIES : capacity;
+                uint32_t *offsets = (uint32_t *)realloc(index->offsets, capacity * sizeof(uint32_t));
+                if (offsets == NULL || h->count == capacity) {
+                    free(offsets ? offsets : index->offsets);
+                    index->offsets = NULL;
+                    ret = ESP_ERR_NO_MEM;
+                    break;
+                }
+                index->offsets = offsets;
+            }
+            index->offsets[h->count++] = pos;
+        }
+        h->frames++;
+        pos += frame.length;
+    }
+    free(r);
+    if (ret == ESP_OK && h->frames == 0) {
+        ret = ESP_ERR_NOT_SUPPORTED;
+    }
+    if (ret != ESP_OK) {
+        audio_seek_free(index);
+    }
+    return ret;
+}
+
+esp_err_t audio_seek_load(const char *index_path, uint32_t file_size, audio_seek_index_t *index)
+{
+    memset(index, 0, sizeof(*index));
+    FILE *fp = fopen(index_path, "rb");
+    if (fp == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    esp_err_t ret = ESP_OK;
+    audio_seek_header_t *h = &index->header;
+    if (fread(h, 1, sizeof(*h), fp) != sizeof(*h) || memcmp(h->magic, AUDIO_SEEK_MAGIC, sizeof(h->magic)) != 0 ||
+            h->samples_per_frame == 0 || h->sample_rate == 0 || h->count == 0 || h->count > AUDIO_SEEK_MAX_ENTRIES) {
+        ret = ESP_ERR_INVALID_RESPONSE;
+    } else if (h->version != AUDIO_SEEK_VERSION) {
+        ret = ESP_ERR_INVALID_VERSION;
+    } else if (h->file_size != file_size) {
+        ret = ESP_ERR_INVALID_STATE;
+    }
+    if (ret == ESP_OK) {
+        index->offsets = (uint32_t *)malloc(h->count * sizeof(uint32_t));
+        if (index->offsets == NULL) {
+            ret = ESP_ERR_NO_MEM;
+        } else if (fread(index->offsets, sizeof(uint32_t), h->count, fp) != h->count) {
+            ret = ESP_ERR_INVALID_SIZE;
+        }
+    }
+    fclose(fp);
+    if (ret != ESP_OK) {
+        audio_seek_free(index);
+    }
+    return ret;
+}
+
+esp_err_t audio_seek_save(const char *index_path, const audio_seek_index_t *index)
+{
+    FILE *fp = fopen(index_path, "wb");
+    if (fp == NULL) {
+        return ESP_FAIL;
+    }
+    bool ok = fwrite(&index->header, 1, sizeof(index->header), fp) == sizeof(index->header) &&
+              fwrite(index->offsets, sizeof(uint32_t), index->header.count, fp) == index->header.count;
+    ok &= fclose(fp) == 0;
+    if (!ok) {
+        // don't leave a truncated index behind
+        remove(index_path);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+void audio_seek_free(audio_seek_index_t *index)
+{
+    free(index->offsets);
+    index->offsets = NULL;
+    index->header.count = 0;
+}
+
+void audio_seek_lookup(const audio_seek_index_t *index, uint32_t position_ms, audio_seek_point_t *point)
+{
+    const audio_seek_header_t *h = &index->header;
+    uint32_t frames_per_entry = _frames_per_entry(h);
+    uint64_t frame = (uint64_t)position_ms * h->sample_rate / (1000ull * h->samples_per_frame);
+    uint32_t entry = (uint32_t)(frame / frames_per_entry);
+    entry = entry < h->count ? entry : h->count - 1;
+    point->offset = index->offsets[entry];
+    point->frame = entry * frames_per_entry;
+    point->time_ms = (uint32_t)((uint64_t)point->frame * h->samples_per_frame * 1000 / h->sample_rate);
+}
+
+uint32_t audio_seek_duration_ms(const audio_seek_index_t *index)
+{
+    const audio_seek_header_t *h = &index->header;
+    return (uint32_t)((uint64_t)h->frames * h->samples_per_frame * 1000 / h->sample_rate);
+}
+
+} // namespace usbaudio
+} // namespace esphome
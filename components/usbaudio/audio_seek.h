@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "esp_err.h"
+
+namespace esphome {
+namespace usbaudio {
+
+/*
+ * Seek index of an MP3 file: the byte offset of one frame every interval_ms. Layer III
+ * frames have a fixed number of samples, so the time of an indexed frame is exact even in
+ * VBR files. Stored next to the file as "<file>.idx", little endian:
+ *
+ *   audio_seek_header_t
+ *   uint32_t offsets[count]
+ *
+ * tools/mkseek.py builds the same file on the host, the layout and the frame walk must match.
+ */
+#define AUDIO_SEEK_MAGIC            "UASK"
+#define AUDIO_SEEK_VERSION          1
+#define AUDIO_SEEK_SUFFIX           ".idx"
+
+struct audio_seek_header_t {
+    char magic[4];
+    uint16_t version;
+    uint16_t samples_per_frame;     /*!< 1152 MPEG-1, 576 MPEG-2 / 2.5 */
+    uint32_t sample_rate;
+    uint32_t interval_ms;
+    uint32_t file_size;             /*!< of the indexed file, a mismatch means it changed */
+    uint32_t frames;
+    uint32_t count;                 /*!< offsets that follow */
+};
+
+struct audio_seek_index_t {
+    audio_seek_header_t header;
+    uint32_t *offsets;              /*!< offsets[i]: frame i * frames_per_entry */
+};
+
+/**
+ * @brief Where playback of a position starts
+ */
+struct audio_seek_point_t {
+    uint32_t offset;                /*!< byte offset of a frame header */
+    uint32_t frame;                 /*!< its frame number */
+    uint32_t time_ms;               /*!< its start time, at or before the position asked */
+};
+
+/**
+ * @brief Index a file by walking its frame headers
+ *
+ * Skips an ID3v2 tag at the start and resynchronizes on damaged frames. Reads the whole
+ * file, run it away from the playback path.
+ *
+ * @return
+ *    - ESP_OK: index built, free with audio_seek_free()
+ *    - ESP_ERR_NOT_SUPPORTED: not an MPEG audio Layer III file
+ *    - ESP_ERR_NO_MEM: offsets allocation failed
+ */
+esp_err_t audio_seek_build(FILE *fp, uint32_t interval_ms, audio_seek_index_t *index);
+
+/**
+ * @brief Read the index stored next to a file, checked against the file size
+ */
+esp_err_t audio_seek_load(const char *index_path, uint32_t file_size, audio_seek_index_t *index);
+esp_err_t audio_seek_save(const char *index_path, const audio_seek_index_t *index);
+void audio_seek_free(audio_seek_index_t *index);
+
+/**
+ * @brief Indexed frame at or before a position, constant time
+ */
+void audio_seek_lookup(const audio_seek_index_t *index, uint32_t position_ms, audio_seek_point_t *point);
+
+/**
+ * @brief Duration of the indexed file in ms
+ */
+uint32_t audio_seek_duration_ms(const audio_seek_index_t *index);
+
+} // namespace usbaudio
+} // namespace esphome
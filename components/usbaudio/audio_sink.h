@@ -0,0 +1,105 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include "esp_err.h"
+#include "driver/i2s_std.h"
+#include "usbaudio.h"
+
+namespace esphome {
+namespace usbaudio {
+
+/*
+ * Audio sinks
+ *
+ * A sink is a type with static members only:
+ *
+ *   static bool available();
+ *   static esp_err_t write(void *audio_buffer, size_t len, size_t *bytes_written, uint32_t timeout_ms);
+ *   static esp_err_t mute(AUDIO_PLAYER_MUTE_SETTING setting);
+ *   static esp_err_t set_clock(uint32_t rate, uint32_t bits_cfg, i2s_slot_mode_t ch);
+ *
+ * The output mode selected in the YAML config picks ActiveSink at codegen time, so a
+ * single sink build calls its sink directly without any runtime dispatch. New outputs
+ * implement the same members and can be combined with FallbackSink.
+ */
+
+// USB Audio Class speaker
+struct UsbSink {
+    static bool available();
+    static esp_err_t write(void *audio_buffer, size_t len, size_t *bytes_written, uint32_t timeout_ms);
+    static esp_err_t mute(AUDIO_PLAYER_MUTE_SETTING setting);
+    static esp_err_t set_clock(uint32_t rate, uint32_t bits_cfg, i2s_slot_mode_t ch);
+};
+
+// On-board codec through I2S
+struct I2sSink {
+    static bool available()
+    {
+        return true;
+    }
+    static esp_err_t write(void *audio_buffer, size_t len, size_t *bytes_written, uint32_t timeout_ms);
+    static esp_err_t mute(AUDIO_PLAYER_MUTE_SETTING setting);
+    static esp_err_t set_clock(uint32_t rate, uint32_t bits_cfg, i2s_slot_mode_t ch);
+};
+
+/*
+ * Primary while it is available, Fallback otherwise. A clock set while Primary plays only
+ * reaches Primary, Fallback gets the last one before its first write after the switch.
+ */
+template<typename Primary, typename Fallback>
+struct FallbackSink {
+    static bool available()
+    {
+        return Primary::available() || Fallback::available();
+    }
+    static esp_err_t write(void *audio_buffer, size_t len, size_t *bytes_written, uint32_t timeout_ms)
+    {
+        if (Primary::available()) {
+            return Primary::write(audio_buffer, len, bytes_written, timeout_ms);
+        }
+        uint64_t clock = s_fallback_clock.load(std::memory_order_relaxed) != 0 ? s_fallback_clock.exchange(0) : 0;
+        if (clock != 0) {
+            esp_err_t ret = Fallback::set_clock((uint32_t)(clock >> 16), (uint32_t)(clock >> 8) & 0xFF,
+                                                (i2s_slot_mode_t)(clock & 0xFF));
+            if (ret != ESP_OK) {
+                // try again on the next write, unless a newer clock came in the meantime
+                uint64_t none = 0;
+                s_fallback_clock.compare_exchange_strong(none, clock);
+                return ret;
+            }
+        }
+        return Fallback::write(audio_buffer, len, bytes_written, timeout_ms);
+    }
+    static esp_err_t mute(AUDIO_PLAYER_MUTE_SETTING setting)
+    {
+        return Primary::available() ? Primary::mute(setting) : Fallback::mute(setting);
+    }
+    static esp_err_t set_clock(uint32_t rate, uint32_t bits_cfg, i2s_slot_mode_t ch)
+    {
+        if (Primary::available()) {
+            // rate, bits and channels in one word, so that a write never sees half of it
+            s_fallback_clock = ((uint64_t)rate << 16) | ((bits_cfg & 0xFF) << 8) | ((uint32_t)ch & 0xFF);
+            return Primary::set_clock(rate, bits_cfg, ch);
+        }
+        s_fallback_clock = 0;
+        return Fallback::set_clock(rate, bits_cfg, ch);
+    }
+
+private:
+    /* Clock Fallback has not been set to yet, 0 when it is up to date */
+    static inline std::atomic<uint64_t> s_fallback_clock{0};
+};
+
+// Selected by audio_output_mode in __init__.py, USB with I2S fallback when not set
+#if defined(USBAUDIO_SINK_USB)
+using ActiveSink = UsbSink;
+#elif defined(USBAUDIO_SINK_I2S)
+using ActiveSink = I2sSink;
+#else
+using ActiveSink = FallbackSink<UsbSink, I2sSink>;
+#endif
+
+} // namespace usbaudio
+} // namespace esphome
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+
+namespace esphome {
+namespace usbaudio {
+
+/*
+ * Playback state kept in NVS across reboots, one blob in the "usbaudio" namespace. The
+ * resume point is an indexed frame (see audio_seek.h), so restarting there needs neither
+ * the index nor a scan of the file.
+ */
+#define AUDIO_STATE_VERSION         1
+#define AUDIO_STATE_SOURCE_LEN      64
+#define AUDIO_STATE_VOLUME_SYSTEM   0xFF    /*!< volume follows get_sys_volume() */
+
+enum audio_state_play_t {
+    AUDIO_STATE_STOPPED = 0,
+    AUDIO_STATE_PLAYING,
+    AUDIO_STATE_PAUSED,
+};
+
+struct audio_state_t {
+    uint16_t version;
+    uint8_t play;                           /*!< audio_state_play_t */
+    uint8_t volume;                         /*!< 0 - 100 or AUDIO_STATE_VOLUME_SYSTEM */
+    uint8_t muted;
+    uint8_t bits;                           /*!< source PCM format, as set by the player */
+    uint8_t channels;
+    uint8_t reserved;
+    uint32_t sample_rate;
+    uint32_t file_size;                     /*!< of the source, a mismatch means it changed */
+    uint32_t offset;                        /*!< frame header to restart from */
+    uint32_t offset_ms;                     /*!< its time */
+    uint32_t position_ms;                   /*!< where playback was, offset_ms <= position_ms */
+    char source[AUDIO_STATE_SOURCE_LEN];    /*!< NUL terminated */
+};
+
+/**
+ * @brief Write rate limits
+ */
+typedef struct {
+    uint32_t checkpoint_interval_ms;        /*!< position only changes, while playing */
+    uint32_t min_interval_ms;               /*!< any other change: pause, volume, mute, ... */
+} audio_state_config_t;
+
+typedef struct {
+    uint32_t writes;
+    uint32_t failed;
+} audio_state_stats_t;
+
+/**
+ * @brief Initialize NVS and read the stored state
+ *
+ * The NVS partition is erased when it is full or from a newer NVS format.
+ *
+ * @return
+ *    - ESP_OK: state read
+ *    - ESP_ERR_NOT_FOUND: nothing stored yet, or from another state version
+ *    - others: NVS not available, audio_state_save() does nothing then
+ */
+esp_err_t audio_state_init(const audio_state_config_t *config, audio_state_t *state);
+
+/**
+ * @brief Store the state if the rate limits allow it
+ *
+ * Call periodically with the current state, from a single task. Identical content is never
+ * written again. A change of the position alone waits for the checkpoint interval, any
+ * other change or an urgent save (e.g. on disconnect) only for the minimum interval.
+ *
+ * @return true when the state was written
+ */
+bool audio_state_save(const audio_state_t *state, bool urgent);
+
+void audio_state_get_stats(audio_state_stats_t *stats);
+
+} // namespace usbaudio
+} // namespace esphome
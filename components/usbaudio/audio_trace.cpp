@@ -0,0 +1,162 @@
+#include "audio_trace.h"
+
+#include <atomic>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef USBAUDIO_TRACE
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#endif
+
+namespace esphome {
+namespace usbaudio {
+
+static const char *const s_stage_names[AUDIO_TRACE_STAGE_MAX] = {
+    "decode",
+    "file_read",
+    "sink_write",
+    "clk_set",
+    "usb_tx_done",
+    "usb_error",
+};
+
+void audio_trace_write_json(const audio_trace_record_t *records, size_t count, const audio_trace_tasks_t *tasks,
+                            FILE *out)
+{
+    static const char s_phase_chars[] = {'B', 'E', 'i'};
+    // timestamps are 32-bit, rebase on the oldest record so that a wrap stays monotonic
+    uint32_t base = count ? records[0].ts_us : 0;
+    bool first = true;
+
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", out);
+    // one track per task, named after it
+    for (size_t t = 0; tasks != NULL && t < tasks->count && t < AUDIO_TRACE_MAX_TASKS; t++) {
+        fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%.*s\"}}",
+                first ? "" : ",\n", (unsigned)t, AUDIO_TRACE_TASK_NAME_LEN, tasks->names[t]);
+        first = false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        const audio_trace_record_t *rec = &records[i];
+        uint8_t phase = rec->flags & 0x03;
+        if (rec->stage >= AUDIO_TRACE_STAGE_MAX || phase > AUDIO_TRACE_PHASE_INSTANT) {
+            continue;
+        }
+        fprintf(out, "%s{\"name\":\"%s\",\"cat\":\"audio\",\"ph\":\"%c\",\"ts\":%" PRIu32 ",\"pid\":1,\"tid\":%u%s"
+                ",\"args\":{\"arg\":%u,\"core\":%u}}",
+                first ? "" : ",\n", s_stage_names[rec->stage], s_phase_chars[phase], rec->ts_us - base,
+                (rec->flags >> 2) & 0x1F, phase == AUDIO_TRACE_PHASE_INSTANT ? ",\"s\":\"t\"" : "",
+                rec->arg, rec->flags >> 7);
+        first = false;
+    }
+    fputs("\n]}\n", out);
+}
+
+#ifdef USBAUDIO_TRACE
+
+static_assert((USBAUDIO_TRACE_DEPTH & (USBAUDIO_TRACE_DEPTH - 1)) == 0, "USBAUDIO_TRACE_DEPTH must be a power of two");
+
+/* Task bits of the records of tasks past AUDIO_TRACE_MAX_TASKS */
+#define AUDIO_TRACE_TASK_OTHER  AUDIO_TRACE_MAX_TASKS
+/* Bit 0 of s_head, set while audio_trace_dump() copies the ring */
+#define AUDIO_TRACE_PAUSED      1
+
+static audio_trace_record_t s_ring[USBAUDIO_TRACE_DEPTH];
+/* Records claimed, counted in steps of 2 above AUDIO_TRACE_PAUSED */
+static std::atomic<uint32_t> s_head(0);
+/* Records written, releases them to the dump */
+static std::atomic<uint32_t> s_done(0);
+/* A task's name is written before its handle is published */
+static std::atomic<TaskHandle_t> s_task_handles[AUDIO_TRACE_MAX_TASKS];
+static std::atomic<uint32_t> s_task_count(0);
+static char s_task_names[AUDIO_TRACE_MAX_TASKS][AUDIO_TRACE_TASK_NAME_LEN];
+
+/* Track of the calling task, claimed on its first record */
+static uint32_t _audio_trace_task(void)
+{
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    uint32_t count = s_task_count.load(std::memory_order_relaxed);
+    for (uint32_t i = 0; i < count && i < AUDIO_TRACE_MAX_TASKS; i++) {
+        if (s_task_handles[i].load(std::memory_order_relaxed) == task) {
+            return i;
+        }
+    }
+    // only this task claims a slot for itself, no other one can be looking for it
+    uint32_t i = s_task_count.fetch_add(1, std::memory_order_relaxed);
+    if (i >= AUDIO_TRACE_MAX_TASKS) {
+        s_task_count.store(AUDIO_TRACE_MAX_TASKS, std::memory_order_relaxed);
+        return AUDIO_TRACE_TASK_OTHER;
+    }
+    strncpy(s_task_names[i], pcTaskGetName(task), AUDIO_TRACE_TASK_NAME_LEN - 1);
+    s_task_handles[i].store(task, std::memory_order_release);
+    return i;
+}
+
+void audio_trace_record(audio_trace_stage_t stage, audio_trace_phase_t phase, uint32_t arg)
+{
+    if (s_head.load(std::memory_order_relaxed) & AUDIO_TRACE_PAUSED) {
+        return;
+    }
+    uint32_t head = s_head.fetch_add(2, std::memory_order_acquire);
+    if (head & AUDIO_TRACE_PAUSED) {
+        // the dump started in the meantime, it gives the claims made since back
+        return;
+    }
+    audio_trace_record_t *rec = &s_ring[(head >> 1) & (USBAUDIO_TRACE_DEPTH - 1)];
+    rec->ts_us = (uint32_t)esp_timer_get_time();
+    rec->arg = arg > UINT16_MAX ? UINT16_MAX : (uint16_t)arg;
+    rec->stage = (uint8_t)stage;
+    rec->flags = (uint8_t)phase | (uint8_t)(_audio_trace_task() << 2) | (uint8_t)(xPortGetCoreID() << 7);
+    s_done.fetch_add(1, std::memory_order_release);
+}
+
+void audio_trace_dump(FILE *out)
+{
+    // claims from now on are dropped, the ones before are waited for
+    uint32_t head = s_head.fetch_or(AUDIO_TRACE_PAUSED, std::memory_order_relaxed);
+    uint32_t claimed = head >> 1;
+    while ((s_done.load(std::memory_order_acquire) & 0x7FFFFFFF) != claimed) {
+        vTaskDelay(1);
+    }
+
+    size_t count = claimed < USBAUDIO_TRACE_DEPTH ? claimed : USBAUDIO_TRACE_DEPTH;
+    audio_trace_record_t *copy = (audio_trace_record_t *)malloc(count * sizeof(audio_trace_record_t));
+    if (copy != NULL) {
+        for (size_t i = 0; i < count; i++) {
+            copy[i] = s_ring[(claimed - count + i) & (USBAUDIO_TRACE_DEPTH - 1)];
+        }
+    }
+    audio_trace_tasks_t *tasks = (audio_trace_tasks_t *)calloc(1, sizeof(audio_trace_tasks_t));
+    if (tasks != NULL) {
+        uint32_t task_count = s_task_count.load(std::memory_order_relaxed);
+        tasks->count = task_count < AUDIO_TRACE_MAX_TASKS ? task_count : AUDIO_TRACE_MAX_TASKS;
+        for (size_t t = 0; t < tasks->count; t++) {
+            if (s_task_handles[t].load(std::memory_order_acquire) != NULL) {
+                memcpy(tasks->names[t], s_task_names[t], AUDIO_TRACE_TASK_NAME_LEN);
+            }
+        }
+    }
+    s_head.store(head, std::memory_order_release);
+
+    audio_trace_write_json(copy, copy != NULL ? count : 0, tasks, out);
+    free(tasks);
+    free(copy);
+}
+
+#else
+
+void audio_trace_record(audio_trace_stage_t stage, audio_trace_phase_t phase, uint32_t arg)
+{
+}
+
+void audio_trace_dump(FILE *out)
+{
+    audio_trace_write_json(NULL, 0, NULL, out);
+}
+
+#endif // USBAUDIO_TRACE
+
+} // namespace usbaudio
+} // namespace esphome
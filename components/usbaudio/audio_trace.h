@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+namespace esphome {
+namespace usbaudio {
+
+#ifndef USBAUDIO_TRACE_DEPTH
+#define USBAUDIO_TRACE_DEPTH    1024    /*!< records in the ring, must be a power of two */
+#endif
+#define AUDIO_TRACE_MAX_TASKS   31      /*!< tasks with their own track, later ones share the last */
+#define AUDIO_TRACE_TASK_NAME_LEN 16
+
+enum audio_trace_stage_t {
+    AUDIO_TRACE_DECODE = 0,     /*!< player between two writes of decoded PCM (decode + file read) */
+    AUDIO_TRACE_FILE_READ,      /*!< fread on the source file, arg = bytes */
+    AUDIO_TRACE_SINK_WRITE,     /*!< _audio_sink_write from the player, mixer or scheduler task, arg = bytes */
+    AUDIO_TRACE_CLK_SET,        /*!< _audio_player_std_clock, arg = sample rate / 100 */
+    AUDIO_TRACE_USB_TX_DONE,    /*!< UAC TX completion from the driver */
+    AUDIO_TRACE_USB_ERROR,      /*!< UAC transfer error from the driver */
+    AUDIO_TRACE_STAGE_MAX
+};
+
+enum audio_trace_phase_t {
+    AUDIO_TRACE_PHASE_BEGIN = 0,
+    AUDIO_TRACE_PHASE_END,
+    AUDIO_TRACE_PHASE_INSTANT,
+};
+
+/**
+ * @brief One trace point, 8 bytes
+ */
+struct audio_trace_record_t {
+    uint32_t ts_us;     /*!< esp_timer time, truncated to 32 bits */
+    uint16_t arg;       /*!< stage specific argument */
+    uint8_t stage;      /*!< audio_trace_stage_t */
+    uint8_t flags;      /*!< bits 0-1: audio_trace_phase_t, bits 2-6: task, bit 7: core id */
+};
+
+/**
+ * @brief Tasks that recorded, indexed by the task bits of the records
+ */
+struct audio_trace_tasks_t {
+    size_t count;
+    char names[AUDIO_TRACE_MAX_TASKS][AUDIO_TRACE_TASK_NAME_LEN];
+};
+
+/**
+ * @brief Append a record to the ring, lock-free and safe from any task or core
+ */
+void audio_trace_record(audio_trace_stage_t stage, audio_trace_phase_t phase, uint32_t arg);
+
+/**
+ * @brief Export the ring content as Chrome trace-event JSON (chrome://tracing, Perfetto)
+ *
+ * Recording is paused while the ring is copied out. Each task gets its own track, so that
+ * the begin/end pairs of a stage recorded by several tasks nest per task.
+ */
+void audio_trace_dump(FILE *out);
+
+/**
+ * @brief Write records as Chrome trace-event JSON
+ *
+ * Has no ESP-IDF dependency so that host tools can emit the same format.
+ *
+ * @param records: records in chronological order
+ * @param count: number of records
+ * @param tasks: names of the tracks, NULL to number them
+ * @param out: output stream
+ */
+void audio_trace_write_json(const audio_trace_record_t *records, size_t count, const audio_trace_tasks_t *tasks,
+                            FILE *out);
+
+#ifdef USBAUDIO_TRACE
+#define AUDIO_TRACE_BEGIN(stage, arg)   audio_trace_record((stage), AUDIO_TRACE_PHASE_BEGIN, (arg))
+#define AUDIO_TRACE_END(stage, arg)     audio_trace_record((stage), AUDIO_TRACE_PHASE_END, (arg))
+#define AUDIO_TRACE_INSTANT(stage, arg) audio_trace_record((stage), AUDIO_TRACE_PHASE_INSTANT, (arg))
+#else
+#define AUDIO_TRACE_BEGIN(stage, arg)   do {} while (0)
+#define AUDIO_TRACE_END(stage, arg)     do {} while (0)
+#define AUDIO_TRACE_INSTANT(stage, arg) do {} while (0)
+#endif
+
+} // namespace usbaudio
+} // namespace esphome
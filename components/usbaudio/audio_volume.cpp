@@ -0,0 +1,325 @@
+#include "audio_volume.h"
+
+#include <math.h>
+#ifdef ESP_PLATFORM
+#include "esphome/core/log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "usb/usb_host.h"
+#endif
+
+namespace esphome {
+namespace usbaudio {
+
+#define AUDIO_VOLUME_RANGE_DB       60.0    /*!< 100 down to 10 */
+#define AUDIO_VOLUME_STEPS          101
+
+/* Natural log usable in constant expressions, x > 0 */
+static constexpr double _ce_ln(double x)
+{
+    int k = 0;
+    while (x > 1.5) {
+        x /= 2;
+        k++;
+    }
+    while (x < 0.75) {
+        x *= 2;
+        k--;
+    }
+    // ln(x) = 2 atanh((x - 1) / (x + 1)), |y| < 0.2 here
+    double y = (x - 1) / (x + 1);
+    double term = y;
+    double sum = 0;
+    for (int n = 1; n < 30; n += 2) {
+        sum += term / n;
+        term *= y * y;
+    }
+    return 2 * sum + k * 0.69314718055994530942;
+}
+
+static constexpr double _ce_curve_db(int volume)
+{
+    double x = volume / 100.0;
+    double db = AUDIO_VOLUME_RANGE_DB * (x - 1.0);
+    if (x < 0.1) {
+        // fade the bottom decade linearly in amplitude so that 1 is close to silent
+        db += 20.0 * _ce_ln(10.0 * x) / _ce_ln(10.0);
+    }
+    return db;
+}
+
+struct audio_volume_lut_t {
+    int16_t db[AUDIO_VOLUME_STEPS];
+};
+
+static constexpr audio_volume_lut_t _make_volume_lut()
+{
+    audio_volume_lut_t lut = {};
+    lut.db[0] = AUDIO_VOLUME_SILENT;
+    for (int v = 1; v < AUDIO_VOLUME_STEPS; v++) {
+        double q8 = _ce_curve_db(v) * 256.0;
+        lut.db[v] = (int16_t)(q8 < 0 ? q8 - 0.5 : q8 + 0.5);
+    }
+    return lut;
+}
+
+static constexpr audio_volume_lut_t s_volume_lut = _make_volume_lut();
+static_assert(s_volume_lut.db[100] == 0, "volume 100 must be 0 dB");
+static_assert(s_volume_lut.db[50] == AUDIO_VOLUME_DB(-30), "curve is 60 dB over the volume range");
+
+int16_t audio_volume_to_db(uint8_t volume)
+{
+    return s_volume_lut.db[volume > 100 ? 100 : volume];
+}
+
+static int32_t _audio_volume_gain_q15(int32_t db)
+{
+    if (db >= 0) {
+        return AUDIO_VOLUME_UNITY_Q15;
+    }
+    return (int32_t)lrintf(powf(10.0f, db / (256.0f * 20.0f)) * AUDIO_VOLUME_UNITY_Q15);
+}
+
+void audio_volume_split(uint8_t volume, const audio_volume_range_t *range, audio_volume_split_t *split)
+{
+    int32_t target = audio_volume_to_db(volume);
+    split->target_db = (int16_t)target;
+    if (range == NULL) {
+        split->hw_db = 0;
+        split->sw_gain_q15 = target == AUDIO_VOLUME_SILENT ? 0 : _audio_volume_gain_q15(target);
+        return;
+    }
+    if (target == AUDIO_VOLUME_SILENT) {
+        split->hw_db = range->min_db;
+        split->sw_gain_q15 = 0;
+        return;
+    }
+    int32_t hw = target;
+    if (hw <= range->min_db) {
+        hw = range->min_db;
+    } else if (hw >= range->max_db) {
+        hw = range->max_db;
+    } else {
+        // next grid point at or above the target
+        int32_t steps = (hw - range->min_db + range->res_db - 1) / range->res_db;
+        hw = range->min_db + steps * range->res_db;
+        hw = hw > range->max_db ? range->max_db : hw;
+    }
+    split->hw_db = (int16_t)hw;
+    split->sw_gain_q15 = _audio_volume_gain_q15(target - hw);
+}
+
+#ifdef ESP_PLATFORM
+static const char *const TAG = "audio_volume";
+
+#define UAC_CS_INTERFACE            0x24
+#define UAC_AC_INPUT_TERMINAL       0x02
+#define UAC_AC_FEATURE_UNIT         0x06
+#define UAC_TERMINAL_USB_STREAMING  0x0101
+#define UAC_FU_VOLUME               0x02    /*!< control selector, bit 1 in bmaControls */
+#define UAC_GET_MIN                 0x82
+#define UAC_GET_MAX                 0x83
+#define UAC_GET_RES                 0x84
+#define AUDIO_VOLUME_XFER_TIMEOUT_MS    100
+
+typedef struct {
+    uint8_t ac_iface;
+    uint8_t unit_id;
+    uint8_t channel;            /*!< 0: master */
+} audio_volume_fu_t;
+
+/*
+ * The host library doesn't time out control transfers. One that didn't complete within
+ * AUDIO_VOLUME_XFER_TIMEOUT_MS can't be freed, nor its device closed, until its callback
+ * ran: both are kept here and released by a later call.
+ */
+static volatile bool s_xfer_done = false;
+static usb_transfer_t *s_stuck_xfer = NULL;
+static usb_device_handle_t s_stuck_dev = NULL;
+
+/*
+ * Find the feature unit right after the USB streaming input terminal in the audio control
+ * interface, the one the speaker volume is set on.
+ */
+static bool _audio_volume_find_fu(const uint8_t *desc, size_t len, audio_volume_fu_t *fu)
+{
+    uint8_t streaming_terminals[8];
+    int terminal_count = 0;
+    int ac_iface = -1;
+
+    // terminals may come after the units, collect them first
+    for (size_t pos = 0; pos + 2 <= len && desc[pos] >= 2; pos += desc[pos]) {
+        const uint8_t *d = desc + pos;
+        if (pos + d[0] > len) {
+            break;
+        }
+        if (d[1] == USB_B_DESCRIPTOR_TYPE_INTERFACE && d[0] >= 7) {
+            ac_iface = (d[5] == USB_CLASS_AUDIO && d[6] == 0x01) ? d[2] : -1;
+        } else if (ac_iface >= 0 && d[1] == UAC_CS_INTERFACE && d[2] == UAC_AC_INPUT_TERMINAL && d[0] >= 6 &&
+                   (d[4] | (d[5] << 8)) == UAC_TERMINAL_USB_STREAMING && terminal_count < 8) {
+            streaming_terminals[terminal_count++] = d[3];
+        }
+    }
+    for (size_t pos = 0; pos + 2 <= len && desc[pos] >= 2; pos += desc[pos]) {
+        const uint8_t *d = desc + pos;
+        if (pos + d[0] > len) {
+            break;
+        }
+        if (d[1] == USB_B_DESCRIPTOR_TYPE_INTERFACE && d[0] >= 7) {
+            ac_iface = (d[5] == USB_CLASS_AUDIO && d[6] == 0x01) ? d[2] : -1;
+            continue;
+        }
+        if (ac_iface < 0 || d[1] != UAC_CS_INTERFACE || d[2] != UAC_AC_FEATURE_UNIT || d[0] < 7) {
+            continue;
+        }
+        bool from_stream = false;
+        for (int i = 0; i < terminal_count; i++) {
+            from_stream |= d[4] == streaming_terminals[i];
+        }
+        uint8_t control_size = d[5];
+        if (!from_stream || control_size == 0) {
+            continue;
+        }
+        // bmaControls for the master channel, then channel 1, ...
+        size_t channels = (d[0] - 7) / control_size;
+        for (size_t ch = 0; ch < channels && ch < 2; ch++) {
+            if (d[6 + ch * control_size] & (1 << (UAC_FU_VOLUME - 1))) {
+                fu->ac_iface = (uint8_t)ac_iface;
+                fu->unit_id = d[3];
+                fu->channel = (uint8_t)ch;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static void _audio_volume_xfer_cb(usb_transfer_t *transfer)
+{
+    s_xfer_done = true;
+}
+
+static void _audio_volume_client_cb(const usb_host_client_event_msg_t *event_msg, void *arg)
+{
+    // device arrival / removal is handled by the class drivers
+}
+
+static esp_err_t _audio_volume_get(usb_host_client_handle_t client, usb_device_handle_t dev,
+                                   usb_transfer_t *xfer, const audio_volume_fu_t *fu,
+                                   uint8_t request, int16_t *value)
+{
+    s_xfer_done = false;
+    usb_setup_packet_t *setup = (usb_setup_packet_t *)xfer->data_buffer;
+    setup->bmRequestType = USB_BM_REQUEST_TYPE_DIR_IN | USB_BM_REQUEST_TYPE_TYPE_CLASS | USB_BM_REQUEST_TYPE_RECIP_INTERFACE;
+    setup->bRequest = request;
+    setup->wValue = (UAC_FU_VOLUME << 8) | fu->channel;
+    setup->wIndex = (fu->unit_id << 8) | fu->ac_iface;
+    setup->wLength = 2;
+    xfer->num_bytes = sizeof(usb_setup_packet_t) + 2;
+    xfer->device_handle = dev;
+    xfer->bEndpointAddress = 0;
+    xfer->callback = _audio_volume_xfer_cb;
+    xfer->context = NULL;
+    xfer->timeout_ms = AUDIO_VOLUME_XFER_TIMEOUT_MS;
+    esp_err_t ret = usb_host_transfer_submit_control(client, xfer);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    // the completion callback runs from here, the caller's task isn't held up for longer
+    TickType_t start = xTaskGetTickCount();
+    while (!s_xfer_done) {
+        if (xTaskGetTickCount() - start >= pdMS_TO_TICKS(AUDIO_VOLUME_XFER_TIMEOUT_MS)) {
+            return ESP_ERR_TIMEOUT;
+        }
+        usb_host_client_handle_events(client, pdMS_TO_TICKS(10));
+    }
+    if (xfer->status != USB_TRANSFER_STATUS_COMPLETED || xfer->actual_num_bytes < (int)sizeof(usb_setup_packet_t) + 2) {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    const uint8_t *data = xfer->data_buffer + sizeof(usb_setup_packet_t);
+    *value = (int16_t)(data[0] | (data[1] << 8));
+    return ESP_OK;
+}
+
+esp_err_t audio_volume_read_range(uint8_t dev_addr, audio_volume_range_t *range)
+{
+    static usb_host_client_handle_t s_client = NULL;
+    if (s_client == NULL) {
+        usb_host_client_config_t client_config = {};
+        client_config.is_synchronous = false;
+        client_config.max_num_event_msg = 5;
+        client_config.async.client_event_callback = _audio_volume_client_cb;
+        client_config.async.callback_arg = NULL;
+        esp_err_t ret = usb_host_client_register(&client_config, &s_client);
+        if (ret != ESP_OK) {
+            return ret;
+        }
+    }
+
+    if (s_stuck_xfer != NULL) {
+        usb_host_client_handle_events(s_client, 0);
+        if (!s_xfer_done) {
+            return ESP_ERR_TIMEOUT;
+        }
+        usb_host_transfer_free(s_stuck_xfer);
+        usb_host_device_close(s_client, s_stuck_dev);
+        s_stuck_xfer = NULL;
+        s_stuck_dev = NULL;
+    }
+
+    usb_device_handle_t dev = NULL;
+    esp_err_t ret = usb_host_device_open(s_client, dev_addr, &dev);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    const usb_config_desc_t *config_desc = NULL;
+    audio_volume_fu_t fu;
+    usb_transfer_t *xfer = NULL;
+    ret = usb_host_get_active_config_descriptor(dev, &config_desc);
+    if (ret == ESP_OK && !_audio_volume_find_fu((const uint8_t *)config_desc, config_desc->wTotalLength, &fu)) {
+        ret = ESP_ERR_NOT_SUPPORTED;
+    }
+    if (ret == ESP_OK) {
+        ret = usb_host_transfer_alloc(sizeof(usb_setup_packet_t) + 2, 0, &xfer);
+    }
+    int16_t min_db = 0, max_db = 0, res_db = 0;
+    if (ret == ESP_OK) {
+        ret = _audio_volume_get(s_client, dev, xfer, &fu, UAC_GET_MIN, &min_db);
+    }
+    if (ret == ESP_OK) {
+        ret = _audio_volume_get(s_client, dev, xfer, &fu, UAC_GET_MAX, &max_db);
+    }
+    if (ret == ESP_OK) {
+        ret = _audio_volume_get(s_client, dev, xfer, &fu, UAC_GET_RES, &res_db);
+    }
+    if (ret == ESP_ERR_TIMEOUT) {
+        ESP_LOGW(TAG, "Feature unit request not answered in %d ms", AUDIO_VOLUME_XFER_TIMEOUT_MS);
+        s_stuck_xfer = xfer;
+        s_stuck_dev = dev;
+        return ret;
+    }
+    if (xfer) {
+        usb_host_transfer_free(xfer);
+    }
+    usb_host_device_close(s_client, dev);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    // 0x8000 is -inf as a minimum, some devices report a zero or negative resolution
+    if (min_db == INT16_MIN) {
+        min_db = INT16_MIN + 1;
+    }
+    if (max_db <= min_db) {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    range->min_db = min_db;
+    range->max_db = max_db;
+    range->res_db = res_db > 0 ? res_db : 1;
+    ESP_LOGI(TAG, "Feature unit %u ch %u: %.2f to %.2f dB, %.3f dB steps", fu.unit_id, fu.channel,
+             min_db / 256.0f, max_db / 256.0f, range->res_db / 256.0f);
+    return ESP_OK;
+}
+#endif
+
+} // namespace usbaudio
+} // namespace esphome
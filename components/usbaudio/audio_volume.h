@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+namespace esphome {
+namespace usbaudio {
+
+/*
+ * Levels are in 1/256 dB, the unit of the UAC feature unit volume control, so hardware
+ * values go to the device as they are.
+ */
+#define AUDIO_VOLUME_DB(db)         ((int16_t)((db) * 256))
+#define AUDIO_VOLUME_SILENT         INT16_MIN       /*!< volume 0 */
+#define AUDIO_VOLUME_UNITY_Q15      32768
+
+/**
+ * @brief Volume control range of an output
+ */
+struct audio_volume_range_t {
+    int16_t min_db;
+    int16_t max_db;
+    int16_t res_db;             /*!< step size, > 0 */
+};
+
+/**
+ * @brief How a volume is shared between the output and the software gain stage
+ */
+struct audio_volume_split_t {
+    int16_t target_db;          /*!< from the volume curve, AUDIO_VOLUME_SILENT for 0 */
+    int16_t hw_db;              /*!< on the output's grid, within its range */
+    int32_t sw_gain_q15;        /*!< rest of the attenuation, AUDIO_VOLUME_UNITY_Q15 when none */
+};
+
+/**
+ * @brief Level of a user volume on the perceptual curve
+ *
+ * 100 is 0 dB, 60 dB of range down to 10, and a steeper fade to about -80 dB at 1.
+ *
+ * @param volume: 0 - 100, 0 is silent
+ */
+int16_t audio_volume_to_db(uint8_t volume);
+
+/**
+ * @brief Split a user volume between hardware attenuation and software gain
+ *
+ * The hardware takes as much of the attenuation as its grid allows, rounded up so that
+ * the software part only attenuates. Below the hardware minimum, or for outputs without
+ * a volume control (range NULL), the software stage takes the rest.
+ */
+void audio_volume_split(uint8_t volume, const audio_volume_range_t *range, audio_volume_split_t *split);
+
+/**
+ * @brief Read the speaker volume range from the device's feature unit
+ *
+ * Opens the device as a second USB host client and sends GET_MIN, GET_MAX and GET_RES
+ * (UAC 1.0) to the feature unit fed by the USB streaming terminal. Call from a task while
+ * the USB host library runs, before streaming starts. Each of the three requests is
+ * given up after 100 ms, the calling task isn't held up by a device that doesn't answer.
+ *
+ * @return
+ *    - ESP_OK: range read
+ *    - ESP_ERR_NOT_SUPPORTED: no feature unit with a volume control on the playback path
+ *    - ESP_ERR_TIMEOUT: the device didn't answer, or still hasn't answered a previous request
+ *    - others: control transfer failed
+ */
+esp_err_t audio_volume_read_range(uint8_t dev_addr, audio_volume_range_t *range);
+
+} // namespace usbaudio
+} // namespace esphome
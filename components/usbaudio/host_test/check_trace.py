@@ -0,0 +1,53 @@
+#!/usr/bin/env python3
+"""Check a trace written by audio_trace_dump(): Chrome trace-event JSON with a named track
+per task, begin/end pairs nested on each track, and the stages on the tracks expected.
+
+    check_trace.py trace.json
+"""
+import json
+import sys
+from collections import defaultdict
+
+
+def fail(message):
+    print(f"FAIL check_trace.py: {message}")
+    sys.exit(1)
+
+
+def main():
+    with open(sys.argv[1]) as f:
+        trace = json.load(f)
+    events = trace["traceEvents"]
+    names = {e["tid"]: e["args"]["name"] for e in events if e["ph"] == "M" and e["name"] == "thread_name"}
+    stacks = defaultdict(list)
+    tracks = defaultdict(set)
+    for e in events:
+        if e["ph"] == "M":
+            continue
+        tid = e["tid"]
+        if tid not in names:
+            fail(f"'{e['name']}' on track {tid}, which has no thread_name")
+        tracks[e["name"]].add(names[tid])
+        stack = stacks[tid]
+        if e["ph"] == "B":
+            stack.append(e["name"])
+        elif e["ph"] == "E":
+            # the ring may have dropped the begin of the oldest pairs
+            if stack and stack[-1] != e["name"]:
+                fail(f"'{e['name']}' ends inside '{stack[-1]}' on {names[tid]}, ts {e['ts']}")
+            if stack:
+                stack.pop()
+        elif e["ph"] != "i":
+            fail(f"phase '{e['ph']}'")
+    for stage, tasks in sorted(tracks.items()):
+        print(f"{stage:12} {', '.join(sorted(tasks))}")
+    if tracks["decode"] != {"player"}:
+        fail(f"decode on {sorted(tracks['decode'])}, expected the player only")
+    if not {"player", "audio_schedule"} <= tracks["sink_write"]:
+        fail(f"sink_write on {sorted(tracks['sink_write'])}, expected the player and the scheduler")
+    if "file_read" not in tracks:
+        fail("no file_read")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,349 @@
+/*
+ * The firmware around usbaudio.cpp on the host: an audio player task that reads its file
+ * and decodes silence, the BSP codec as a sink that takes 10 ms buffers in 1 ms, and an
+ * empty UI.
+ */
+#include "app_sim.h"
+#include "loopback_sim.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string.h>
+#include <thread>
+
+namespace esphome {
+namespace usbaudio {
+
+#define PLAYER_SIM_BUFFER_BYTES     (480 * 2 * sizeof(int16_t))
+#define PLAYER_SIM_WRITE_TIMEOUT_MS 50
+
+static std::mutex s_player_lock;
+static std::condition_variable s_player_cond;
+static audio_player_config_t s_player_config;
+static audio_player_cb_t s_player_cb = NULL;
+static audio_player_state_t s_player_state = AUDIO_PLAYER_STATE_IDLE;
+static FILE *s_player_fp = NULL;
+static bool s_player_new_file = false;
+static uint32_t s_player_position = 0;
+static std::deque<int> s_player_events;         /*!< callback events, delivered by the player task */
+static std::atomic<uint32_t> s_track_buffers(0);
+static std::atomic<uint32_t> s_player_writes(0);
+static std::atomic<uint32_t> s_player_plays(0);
+static std::atomic<uint32_t> s_player_rate(48000);
+static std::atomic<uint32_t> s_player_bits(16);
+static std::atomic<i2s_slot_mode_t> s_player_ch(I2S_SLOT_MODE_STEREO);
+
+/* Must be called with s_player_lock held */
+static void _player_event_locked(int event)
+{
+    s_player_events.push_back(event);
+    s_player_cond.notify_all();
+}
+
+/* Must be called with s_player_lock held */
+static void _player_close_locked(void)
+{
+    if (s_player_fp != NULL) {
+        fclose(s_player_fp);
+        s_player_fp = NULL;
+    }
+}
+
+static void _player_task(void *arg)
+{
+    (void)arg;
+    static uint8_t buffer[PLAYER_SIM_BUFFER_BYTES];
+    std::unique_lock<std::mutex> lock(s_player_lock);
+    while (true) {
+        s_player_cond.wait_for(lock, std::chrono::milliseconds(5), []() {
+            return !s_player_events.empty() || s_player_state == AUDIO_PLAYER_STATE_PLAYING;
+        });
+        while (!s_player_events.empty()) {
+            audio_player_cb_ctx_t ctx;
+            ctx.audio_event = (decltype(ctx.audio_event))s_player_events.front();
+            s_player_events.pop_front();
+            audio_player_cb_t cb = s_player_cb;
+            lock.unlock();
+            if (cb != NULL) {
+                cb(&ctx);
+            }
+            lock.lock();
+        }
+        if (s_player_state != AUDIO_PLAYER_STATE_PLAYING) {
+            continue;
+        }
+        bool new_file = s_player_new_file;
+        s_player_new_file = false;
+        // read ahead like the decoder, whatever the file holds
+        if (s_player_fp != NULL) {
+            char input[64];
+            if (fread(input, 1, sizeof(input), s_player_fp) < sizeof(input)) {
+                clearerr(s_player_fp);
+                rewind(s_player_fp);
+            }
+        }
+        lock.unlock();
+        if (new_file) {
+            s_player_config.mute_fn(AUDIO_PLAYER_UNMUTE);
+            s_player_config.clk_set_fn(s_player_rate, s_player_bits, s_player_ch);
+        }
+        size_t written = 0;
+        esp_err_t ret = s_player_config.write_fn(buffer, sizeof(buffer), &written, PLAYER_SIM_WRITE_TIMEOUT_MS);
+        if (ret == ESP_OK) {
+            s_player_writes++;
+        } else {
+            // as the player does on a sink error, try the next buffer a bit later
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        lock.lock();
+        uint32_t track_buffers = s_track_buffers;
+        if (s_player_state == AUDIO_PLAYER_STATE_PLAYING && !s_player_new_file && track_buffers != 0 &&
+                ++s_player_position >= track_buffers) {
+            _player_close_locked();
+            s_player_state = AUDIO_PLAYER_STATE_IDLE;
+            _player_event_locked(audio_player_cb_ctx_t::AUDIO_PLAYER_CALLBACK_EVENT_IDLE);
+        }
+    }
+}
+
+esp_err_t audio_player_new(audio_player_config_t config)
+{
+    s_player_config = config;
+    xTaskCreate(_player_task, "player", 4096, NULL, config.priority, NULL);
+    return ESP_OK;
+}
+
+esp_err_t audio_player_play(FILE *fp)
+{
+    std::lock_guard<std::mutex> guard(s_player_lock);
+    _player_close_locked();
+    s_player_fp = fp;
+    s_player_new_file = true;
+    s_player_position = 0;
+    s_player_state = AUDIO_PLAYER_STATE_PLAYING;
+    s_player_plays++;
+    _player_event_locked(audio_player_cb_ctx_t::AUDIO_PLAYER_CALLBACK_EVENT_PLAYING);
+    return ESP_OK;
+}
+
+esp_err_t audio_player_pause(void)
+{
+    std::lock_guard<std::mutex> guard(s_player_lock);
+    if (s_player_state != AUDIO_PLAYER_STATE_PLAYING) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    s_player_state = AUDIO_PLAYER_STATE_PAUSE;
+    _player_event_locked(audio_player_cb_ctx_t::AUDIO_PLAYER_CALLBACK_EVENT_PAUSE);
+    return ESP_OK;
+}
+
+esp_err_t audio_player_resume(void)
+{
+    std::lock_guard<std::mutex> guard(s_player_lock);
+    if (s_player_state != AUDIO_PLAYER_STATE_PAUSE) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    s_player_state = AUDIO_PLAYER_STATE_PLAYING;
+    _player_event_locked(audio_player_cb_ctx_t::AUDIO_PLAYER_CALLBACK_EVENT_PLAYING);
+    return ESP_OK;
+}
+
+esp_err_t audio_player_stop(void)
+{
+    std::lock_guard<std::mutex> guard(s_player_lock);
+    if (s_player_state == AUDIO_PLAYER_STATE_IDLE) {
+        return ESP_OK;
+    }
+    _player_close_locked();
+    s_player_state = AUDIO_PLAYER_STATE_IDLE;
+    _player_event_locked(audio_player_cb_ctx_t::AUDIO_PLAYER_CALLBACK_EVENT_IDLE);
+    return ESP_OK;
+}
+
+audio_player_state_t audio_player_get_state(void)
+{
+    std::lock_guard<std::mutex> guard(s_player_lock);
+    return s_player_state;
+}
+
+esp_err_t audio_player_callback_register(audio_player_cb_t call_back, void *user_ctx)
+{
+    (void)user_ctx;
+    std::lock_guard<std::mutex> guard(s_player_lock);
+    s_player_cb = call_back;
+    return ESP_OK;
+}
+
+struct file_iterator_instance_t {
+    int unused;
+};
+
+file_iterator_instance_t *file_iterator_new(const char *base_path)
+{
+    (void)base_path;
+    static file_iterator_instance_t s_iterator;
+    return &s_iterator;
+}
+
+void ui_audio_start(file_iterator_instance_t *i)
+{
+    (void)i;
+}
+
+uint8_t get_sys_volume(void)
+{
+    return 60;
+}
+
+} // namespace usbaudio
+} // namespace esphome
+
+using namespace esphome::usbaudio;
+
+void player_sim_set_track_buffers(uint32_t track_buffers)
+{
+    s_track_buffers = track_buffers;
+}
+
+void player_sim_set_format(uint32_t rate, uint32_t bits, i2s_slot_mode_t ch)
+{
+    s_player_rate = rate;
+    s_player_bits = bits;
+    s_player_ch = ch;
+}
+
+uint32_t player_sim_writes(void)
+{
+    return s_player_writes;
+}
+
+uint32_t player_sim_plays(void)
+{
+    return s_player_plays;
+}
+
+static std::atomic<uint32_t> s_i2s_writes(0);
+static std::atomic<uint32_t> s_codec_rate(0);
+static std::atomic<uint32_t> s_codec_bits(0);
+static std::atomic<i2s_slot_mode_t> s_codec_ch(I2S_SLOT_MODE_STEREO);
+static std::atomic<int> s_codec_volume(-1);
+
+extern "C" {
+
+esp_err_t bsp_i2c_init(void)
+{
+    return ESP_OK;
+}
+
+esp_err_t bsp_spiffs_mount(void)
+{
+    return ESP_OK;
+}
+
+esp_err_t bsp_board_init(void)
+{
+    // the codec starts at 16 kHz 32-bit stereo, as on the BOX-3
+    s_codec_rate = 16000;
+    s_codec_bits = 32;
+    s_codec_ch = I2S_SLOT_MODE_STEREO;
+    return ESP_OK;
+}
+
+void *bsp_display_start_with_config(const bsp_display_cfg_t *cfg)
+{
+    (void)cfg;
+    return NULL;
+}
+
+esp_err_t bsp_display_backlight_on(void)
+{
+    return ESP_OK;
+}
+
+bool bsp_display_lock(uint32_t timeout_ms)
+{
+    (void)timeout_ms;
+    return true;
+}
+
+void bsp_display_unlock(void)
+{
+}
+
+esp_err_t bsp_codec_mute_set(bool enable)
+{
+    (void)enable;
+    return ESP_OK;
+}
+
+esp_err_t bsp_codec_volume_set(int volume, int *volume_set)
+{
+    s_codec_volume = volume;
+    if (volume_set != NULL) {
+        *volume_set = volume;
+    }
+    return ESP_OK;
+}
+
+esp_err_t bsp_codec_set_fs(uint32_t rate, uint32_t bits_cfg, i2s_slot_mode_t ch)
+{
+    s_codec_rate = rate;
+    s_codec_bits = bits_cfg;
+    s_codec_ch = ch;
+    return ESP_OK;
+}
+
+/* The codec microphone, 16-bit stereo, hears the speaker when the loopback is enabled */
+esp_err_t bsp_i2s_read(void *audio_buffer, size_t len, size_t *bytes_read, uint32_t timeout_ms)
+{
+    (void)timeout_ms;
+    if (loopback_sim_enabled()) {
+        loopback_sim_capture((int16_t *)audio_buffer, len / (2 * sizeof(int16_t)), 2);
+    } else {
+        memset(audio_buffer, 0, len);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    *bytes_read = len;
+    return ESP_OK;
+}
+
+esp_err_t bsp_i2s_write(void *audio_buffer, size_t len, size_t *bytes_written, uint32_t timeout_ms)
+{
+    (void)audio_buffer;
+    (void)timeout_ms;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    s_i2s_writes++;
+    *bytes_written = len;
+    return ESP_OK;
+}
+
+}
+
+uint32_t bsp_sim_i2s_writes(void)
+{
+    return s_i2s_writes;
+}
+
+uint32_t bsp_sim_codec_rate(void)
+{
+    return s_codec_rate;
+}
+
+uint32_t bsp_sim_codec_bits(void)
+{
+    return s_codec_bits;
+}
+
+i2s_slot_mode_t bsp_sim_codec_ch(void)
+{
+    return s_codec_ch;
+}
+
+int bsp_sim_codec_volume(void)
+{
+    return s_codec_volume;
+}
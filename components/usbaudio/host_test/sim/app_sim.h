@@ -0,0 +1,28 @@
+/*
+ * Controls of the simulated firmware around usbaudio.cpp, see app_sim.cpp.
+ */
+#pragma once
+
+#include <stdint.h>
+#include "usbaudio_env.h"
+
+/*
+ * The player decodes "files" of silence, buffers of 10 ms at 48 kHz 16-bit stereo, as fast
+ * as the sink takes them. A file ends after track_buffers, 0 for never.
+ */
+void player_sim_set_track_buffers(uint32_t track_buffers);
+/* Format announced through clk_set_fn for the next file, 48 kHz 16-bit stereo by default */
+void player_sim_set_format(uint32_t rate, uint32_t bits, i2s_slot_mode_t ch);
+/* write_fn calls that returned ESP_OK */
+uint32_t player_sim_writes(void);
+/* Files handed to audio_player_play() */
+uint32_t player_sim_plays(void);
+/* Buffers written to the codec through bsp_i2s_write() */
+uint32_t bsp_sim_i2s_writes(void);
+/* Last bsp_codec_set_fs() rate */
+uint32_t bsp_sim_codec_rate(void);
+/* Last bsp_codec_set_fs() bit depth and channels */
+uint32_t bsp_sim_codec_bits(void);
+i2s_slot_mode_t bsp_sim_codec_ch(void);
+/* Last bsp_codec_volume_set() volume, -1 before the first */
+int bsp_sim_codec_volume(void);
@@ -0,0 +1,318 @@
+/*
+ * FreeRTOS on the host: tasks are detached std::threads, queues, semaphores, event groups
+ * and notifications a mutex and a condition variable each, so ThreadSanitizer sees every
+ * handoff. Priorities and cores are ignored. One tick is 1 ms.
+ */
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock sim_clock;
+
+struct sim_task {
+    std::string name;
+    std::mutex lock;
+    std::condition_variable cond;
+    uint32_t notify = 0;
+};
+
+struct sim_queue {
+    std::mutex lock;
+    std::condition_variable cond;
+    std::deque<std::vector<uint8_t>> items;
+    size_t length;
+    size_t item_size;
+};
+
+struct sim_semaphore {
+    std::mutex lock;
+    std::condition_variable cond;
+    UBaseType_t count;
+    UBaseType_t max_count;
+};
+
+struct sim_event_group {
+    std::mutex lock;
+    std::condition_variable cond;
+    EventBits_t bits = 0;
+};
+
+/* Thrown by vTaskDelete(NULL), caught where the task's thread starts */
+struct sim_task_exit {
+};
+
+static const sim_clock::time_point s_start = sim_clock::now();
+static thread_local sim_task *s_current = NULL;
+
+/* Wait on cond until done() or the ticks elapsed, portMAX_DELAY waits forever */
+template<typename F>
+static bool _wait(std::condition_variable &cond, std::unique_lock<std::mutex> &lock, TickType_t ticks, F done)
+{
+    if (ticks == portMAX_DELAY) {
+        cond.wait(lock, done);
+        return true;
+    }
+    return cond.wait_until(lock, sim_clock::now() + std::chrono::milliseconds(ticks), done);
+}
+
+int64_t esp_timer_get_time(void)
+{
+    // never 0, the component uses 0 for "not set"
+    return std::chrono::duration_cast<std::chrono::microseconds>(sim_clock::now() - s_start).count() + 1000;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack_depth, void *arg,
+                                   UBaseType_t priority, TaskHandle_t *handle, BaseType_t core_id)
+{
+    (void)stack_depth;
+    (void)priority;
+    (void)core_id;
+    sim_task *task = new sim_task;
+    task->name = name;
+    if (handle != NULL) {
+        *handle = task;
+    }
+    std::thread([task, fn, arg]() {
+        s_current = task;
+        try {
+            fn(arg);
+            fprintf(stderr, "task %s returned\n", task->name.c_str());
+            abort();
+        } catch (const sim_task_exit &) {
+        }
+    }).detach();
+    return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack_depth, void *arg,
+                       UBaseType_t priority, TaskHandle_t *handle)
+{
+    return xTaskCreatePinnedToCore(fn, name, stack_depth, arg, priority, handle, tskNO_AFFINITY);
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    if (task != NULL && task != s_current) {
+        fprintf(stderr, "vTaskDelete of another task is not simulated\n");
+        abort();
+    }
+    throw sim_task_exit();
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ticks));
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return (TickType_t)std::chrono::duration_cast<std::chrono::milliseconds>(sim_clock::now() - s_start).count();
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    if (s_current == NULL) {
+        // a thread of the test, give it a notification slot as well
+        s_current = new sim_task;
+        s_current->name = "host";
+    }
+    return s_current;
+}
+
+char *pcTaskGetName(TaskHandle_t task)
+{
+    if (task == NULL) {
+        task = xTaskGetCurrentTaskHandle();
+    }
+    return (char *)task->name.c_str();
+}
+
+BaseType_t xPortGetCoreID(void)
+{
+    return 0;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    std::lock_guard<std::mutex> guard(task->lock);
+    task->notify++;
+    task->cond.notify_all();
+    return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks)
+{
+    sim_task *task = xTaskGetCurrentTaskHandle();
+    std::unique_lock<std::mutex> lock(task->lock);
+    auto notified = [task]() {
+        return task->notify > 0;
+    };
+    _wait(task->cond, lock, ticks, notified);
+    uint32_t value = task->notify;
+    if (value > 0) {
+        task->notify = clear_on_exit ? 0 : value - 1;
+    }
+    return value;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    sim_queue *queue = new sim_queue;
+    queue->length = length;
+    queue->item_size = item_size;
+    return queue;
+}
+
+void vQueueDelete(QueueHandle_t queue)
+{
+    delete queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks)
+{
+    std::unique_lock<std::mutex> lock(queue->lock);
+    auto has_space = [queue]() {
+        return queue->items.size() < queue->length;
+    };
+    if (!_wait(queue->cond, lock, ticks, has_space)) {
+        return pdFALSE;
+    }
+    const uint8_t *bytes = (const uint8_t *)item;
+    queue->items.emplace_back(bytes, bytes + queue->item_size);
+    queue->cond.notify_all();
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks)
+{
+    std::unique_lock<std::mutex> lock(queue->lock);
+    auto has_item = [queue]() {
+        return !queue->items.empty();
+    };
+    if (!_wait(queue->cond, lock, ticks, has_item)) {
+        return pdFALSE;
+    }
+    memcpy(item, queue->items.front().data(), queue->item_size);
+    queue->items.pop_front();
+    queue->cond.notify_all();
+    return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+    std::lock_guard<std::mutex> guard(queue->lock);
+    return (UBaseType_t)queue->items.size();
+}
+
+static SemaphoreHandle_t _semaphore_new(UBaseType_t max_count, UBaseType_t initial_count)
+{
+    sim_semaphore *semaphore = new sim_semaphore;
+    semaphore->count = initial_count;
+    semaphore->max_count = max_count;
+    return semaphore;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    return _semaphore_new(1, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return _semaphore_new(1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max_count, UBaseType_t initial_count)
+{
+    return _semaphore_new(max_count, initial_count);
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore)
+{
+    delete semaphore;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks)
+{
+    std::unique_lock<std::mutex> lock(semaphore->lock);
+    auto available = [semaphore]() {
+        return semaphore->count > 0;
+    };
+    if (!_wait(semaphore->cond, lock, ticks, available)) {
+        return pdFALSE;
+    }
+    semaphore->count--;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+    std::lock_guard<std::mutex> guard(semaphore->lock);
+    if (semaphore->count >= semaphore->max_count) {
+        return pdFALSE;
+    }
+    semaphore->count++;
+    semaphore->cond.notify_one();
+    return pdTRUE;
+}
+
+EventGroupHandle_t xEventGroupCreate(void)
+{
+    return new sim_event_group;
+}
+
+void vEventGroupDelete(EventGroupHandle_t group)
+{
+    delete group;
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits)
+{
+    std::lock_guard<std::mutex> guard(group->lock);
+    group->bits |= bits;
+    group->cond.notify_all();
+    return group->bits;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits)
+{
+    std::lock_guard<std::mutex> guard(group->lock);
+    EventBits_t before = group->bits;
+    group->bits &= ~bits;
+    return before;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group)
+{
+    std::lock_guard<std::mutex> guard(group->lock);
+    return group->bits;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear_on_exit,
+                                BaseType_t wait_for_all, TickType_t ticks)
+{
+    std::unique_lock<std::mutex> lock(group->lock);
+    auto done = [group, bits, wait_for_all]() {
+        return wait_for_all ? (group->bits & bits) == bits : (group->bits & bits) != 0;
+    };
+    bool met = _wait(group->cond, lock, ticks, done);
+    EventBits_t value = group->bits;
+    if (met && clear_on_exit) {
+        group->bits &= ~bits;
+    }
+    return value;
+}
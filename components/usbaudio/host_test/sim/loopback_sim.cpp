@@ -0,0 +1,112 @@
+/*
+ * The loopback keeps the time every non-silent frame reaches the microphone, and a capture
+ * picks up the ones falling in its window. The output is a queue draining at the sample
+ * rate, like the UAC driver ring or the I2S DMA buffers.
+ */
+#include "loopback_sim.h"
+#include "esp_timer.h"
+
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+struct loopback_sample {
+    int64_t heard_us;
+    int16_t value;
+};
+
+static std::mutex s_lock;
+static bool s_enabled = false;
+static uint32_t s_rate = 48000;
+static int64_t s_buffer_us = 0;
+static int64_t s_acoustic_us = 0;
+static int64_t s_play_end_us = 0;       /*!< when the output queue runs empty */
+static int64_t s_capture_next_us = 0;   /*!< time of the next frame captured */
+static std::deque<loopback_sample> s_heard;
+
+static int64_t _frames_us(size_t frames)
+{
+    return (int64_t)frames * 1000000 / s_rate;
+}
+
+void loopback_sim_config(uint32_t rate, uint32_t buffer_ms, uint32_t acoustic_us)
+{
+    std::lock_guard<std::mutex> guard(s_lock);
+    s_enabled = true;
+    s_rate = rate;
+    s_buffer_us = (int64_t)buffer_ms * 1000;
+    s_acoustic_us = acoustic_us;
+    s_play_end_us = 0;
+    s_capture_next_us = 0;
+    s_heard.clear();
+}
+
+void loopback_sim_disable(void)
+{
+    std::lock_guard<std::mutex> guard(s_lock);
+    s_enabled = false;
+    s_heard.clear();
+}
+
+bool loopback_sim_enabled(void)
+{
+    std::lock_guard<std::mutex> guard(s_lock);
+    return s_enabled;
+}
+
+void loopback_sim_play(const int16_t *pcm, size_t frames, uint32_t channels)
+{
+    std::unique_lock<std::mutex> guard(s_lock);
+    int64_t duration_us = _frames_us(frames);
+    int64_t now = esp_timer_get_time();
+    while (s_play_end_us - now + duration_us > s_buffer_us) {
+        int64_t wait_us = s_play_end_us - now + duration_us - s_buffer_us;
+        guard.unlock();
+        std::this_thread::sleep_for(std::chrono::microseconds(wait_us));
+        guard.lock();
+        now = esp_timer_get_time();
+    }
+    // an underrun restarts the output right away
+    int64_t start_us = s_play_end_us > now ? s_play_end_us : now;
+    for (size_t i = 0; i < frames; i++) {
+        if (pcm[i * channels] != 0) {
+            s_heard.push_back({start_us + _frames_us(i) + s_acoustic_us, pcm[i * channels]});
+        }
+    }
+    s_play_end_us = start_us + duration_us;
+}
+
+void loopback_sim_capture(int16_t *pcm, size_t frames, uint32_t channels)
+{
+    std::unique_lock<std::mutex> guard(s_lock);
+    int64_t now = esp_timer_get_time();
+    int64_t duration_us = _frames_us(frames);
+    if (s_capture_next_us == 0 || now - s_capture_next_us > s_buffer_us + duration_us) {
+        // first read, or the reader fell behind and the DMA buffers overflowed
+        s_capture_next_us = now;
+    }
+    int64_t start_us = s_capture_next_us;
+    int64_t end_us = start_us + duration_us;
+    s_capture_next_us = end_us;
+    if (end_us > now) {
+        guard.unlock();
+        std::this_thread::sleep_for(std::chrono::microseconds(end_us - now));
+        guard.lock();
+    }
+    for (size_t i = 0; i < frames * channels; i++) {
+        pcm[i] = 0;
+    }
+    while (!s_heard.empty() && s_heard.front().heard_us < end_us) {
+        loopback_sample sample = s_heard.front();
+        s_heard.pop_front();
+        int64_t frame = (sample.heard_us - start_us) * s_rate / 1000000;
+        if (frame < 0) {
+            // before this window, nobody was listening
+            continue;
+        }
+        for (uint32_t c = 0; c < channels; c++) {
+            pcm[frame * channels + c] = sample.value;
+        }
+    }
+}
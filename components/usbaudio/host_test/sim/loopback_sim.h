@@ -0,0 +1,26 @@
+/*
+ * Acoustic loopback from a speaker to a microphone, for the audio_latency tests. What is
+ * played comes back on the microphone once the output buffer ahead of it has drained and
+ * after a fixed acoustic delay. Both sides run in real time, 16-bit interleaved PCM.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Enable the loopback, the speaker and the codec microphone of the simulation go through
+ * it from now on.
+ *
+ * @param rate: of both sides
+ * @param buffer_ms: output buffering, a play blocks while it is full
+ * @param acoustic_us: speaker to microphone
+ */
+void loopback_sim_config(uint32_t rate, uint32_t buffer_ms, uint32_t acoustic_us);
+void loopback_sim_disable(void);
+bool loopback_sim_enabled(void);
+
+/* Queue frames for output, returns once they fit in the output buffer */
+void loopback_sim_play(const int16_t *pcm, size_t frames, uint32_t channels);
+/* Capture frames, returns when the last one was captured */
+void loopback_sim_capture(int16_t *pcm, size_t frames, uint32_t channels);
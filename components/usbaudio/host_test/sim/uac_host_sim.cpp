@@ -0,0 +1,526 @@
+/*
+ * Simulated UAC host driver and USB host library, see uac_host_sim.h.
+ */
+#include "uac_host_sim.h"
+#include "loopback_sim.h"
+#include "usb/usb_host.h"
+#include "audio_volume.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+using namespace esphome::usbaudio;
+
+#define SIM_TX_IFACE    1
+#define SIM_RX_IFACE    2
+#define SIM_ALT_MAX     4
+
+struct sim_device {
+    uint8_t addr;
+    bool gone;
+    uint8_t alt_num[UAC_STREAM_MAX];
+    uac_host_dev_alt_param_t alt[UAC_STREAM_MAX][SIM_ALT_MAX];
+};
+
+struct uac_interface {
+    sim_device *dev;
+    uac_host_stream_t type;
+    uint8_t iface_num;
+    bool open;
+    bool started;
+    bool suspended;
+    uac_host_stream_config_t config;
+    uac_host_device_event_cb_t callback;
+    void *callback_arg;
+    std::atomic<int> in_flight;
+};
+
+static std::mutex s_lock;
+static uac_host_driver_config_t s_driver;
+static sim_device *s_device = NULL;             /*!< plugged headset, NULL if none */
+static std::vector<uac_interface *> s_ifaces;   /*!< every handle ever opened, never freed */
+static uint8_t s_next_addr = 1;
+static int s_fail_starts = 0;
+static uint32_t s_stall_ms = 0;
+static bool s_range_supported = true;
+static uint32_t s_range_delay_ms = 0;
+static uac_sim_stats_t s_stats;
+static uac_host_stream_config_t s_last_config[UAC_STREAM_MAX];
+static bool s_has_config[UAC_STREAM_MAX];
+
+static uint8_t s_alt_num[UAC_STREAM_MAX] = {2, 0};
+static uac_host_dev_alt_param_t s_alt[UAC_STREAM_MAX][SIM_ALT_MAX] = {
+    {
+        {.format = 1, .channels = 2, .bit_resolution = 16, .sample_freq_type = 2, .sample_freq = {44100, 48000}},
+        {.format = 1, .channels = 2, .bit_resolution = 24, .sample_freq_type = 1, .sample_freq = {48000}},
+    },
+};
+
+static void _violation(const char *what, uac_interface *iface)
+{
+    fprintf(stderr, "uac_sim: %s (handle %p)\n", what, (void *)iface);
+    s_stats.violations++;
+}
+
+/* Must be called with s_lock held, NULL if the handle can't be used */
+static uac_interface *_iface_locked(uac_host_device_handle_t handle, const char *call)
+{
+    if (handle == NULL || !handle->open) {
+        char what[64];
+        snprintf(what, sizeof(what), "%s on a closed handle", call);
+        _violation(what, handle);
+        return NULL;
+    }
+    return handle;
+}
+
+static uac_interface *_find_open_locked(sim_device *dev, uac_host_stream_t type)
+{
+    for (uac_interface *iface : s_ifaces) {
+        if (iface->open && iface->dev == dev && iface->type == type) {
+            return iface;
+        }
+    }
+    return NULL;
+}
+
+void uac_sim_connect(bool with_mic)
+{
+    uac_host_driver_event_cb_t callback;
+    void *arg;
+    uint8_t addr;
+    bool mic;
+    {
+        std::lock_guard<std::mutex> guard(s_lock);
+        if (s_device != NULL) {
+            s_device->gone = true;
+        }
+        s_device = new sim_device;
+        s_device->addr = addr = s_next_addr;
+        s_next_addr = s_next_addr % 127 + 1;
+        s_device->gone = false;
+        memcpy(s_device->alt_num, s_alt_num, sizeof(s_alt_num));
+        memcpy(s_device->alt, s_alt, sizeof(s_alt));
+        mic = with_mic && s_alt_num[UAC_STREAM_RX] > 0;
+        callback = s_driver.callback;
+        arg = s_driver.callback_arg;
+    }
+    if (callback == NULL) {
+        return;
+    }
+    callback(addr, SIM_TX_IFACE, UAC_HOST_DRIVER_EVENT_TX_CONNECTED, arg);
+    if (mic) {
+        callback(addr, SIM_RX_IFACE, UAC_HOST_DRIVER_EVENT_RX_CONNECTED, arg);
+    }
+}
+
+void uac_sim_connect_again(void)
+{
+    uac_host_driver_event_cb_t callback;
+    void *arg;
+    uint8_t addr;
+    {
+        std::lock_guard<std::mutex> guard(s_lock);
+        if (s_device == NULL) {
+            return;
+        }
+        addr = s_device->addr;
+        callback = s_driver.callback;
+        arg = s_driver.callback_arg;
+    }
+    callback(addr, SIM_TX_IFACE, UAC_HOST_DRIVER_EVENT_TX_CONNECTED, arg);
+}
+
+void uac_sim_disconnect(void)
+{
+    std::vector<uac_interface *> notify;
+    {
+        std::lock_guard<std::mutex> guard(s_lock);
+        if (s_device == NULL) {
+            return;
+        }
+        s_device->gone = true;
+        for (uac_interface *iface : s_ifaces) {
+            if (iface->open && iface->dev == s_device) {
+                notify.push_back(iface);
+            }
+        }
+        s_device = NULL;
+    }
+    for (uac_interface *iface : notify) {
+        iface->callback(iface, UAC_HOST_DRIVER_EVENT_DISCONNECTED, iface->callback_arg);
+    }
+}
+
+void uac_sim_transfer_error(void)
+{
+    uac_interface *iface;
+    {
+        std::lock_guard<std::mutex> guard(s_lock);
+        iface = s_device != NULL ? _find_open_locked(s_device, UAC_STREAM_TX) : NULL;
+    }
+    if (iface != NULL) {
+        iface->callback(iface, UAC_HOST_DEVICE_EVENT_TRANSFER_ERROR, iface->callback_arg);
+    }
+}
+
+void uac_sim_stall_next_write(uint32_t ms)
+{
+    std::lock_guard<std::mutex> guard(s_lock);
+    s_stall_ms = ms;
+}
+
+void uac_sim_fail_starts(int count)
+{
+    std::lock_guard<std::mutex> guard(s_lock);
+    s_fail_starts = count;
+}
+
+void uac_sim_set_alt_params(uac_host_stream_t type, const uac_host_dev_alt_param_t *params, uint8_t count)
+{
+    std::lock_guard<std::mutex> guard(s_lock);
+    count = count < SIM_ALT_MAX ? count : SIM_ALT_MAX;
+    memcpy(s_alt[type], params, count * sizeof(*params));
+    s_alt_num[type] = count;
+}
+
+void uac_sim_set_volume_range(bool supported, uint32_t delay_ms)
+{
+    std::lock_guard<std::mutex> guard(s_lock);
+    s_range_supported = supported;
+    s_range_delay_ms = delay_ms;
+}
+
+bool uac_sim_stream_config(uac_host_stream_t type, uac_host_stream_config_t *config)
+{
+    std::lock_guard<std::mutex> guard(s_lock);
+    *config = s_last_config[type];
+    return s_has_config[type];
+}
+
+void uac_sim_get_stats(uac_sim_stats_t *stats)
+{
+    std::lock_guard<std::mutex> guard(s_lock);
+    *stats = s_stats;
+}
+
+esp_err_t uac_host_install(const uac_host_driver_config_t *config)
+{
+    std::lock_guard<std::mutex> guard(s_lock);
+    s_driver = *config;
+    return ESP_OK;
+}
+
+esp_err_t uac_host_uninstall(void)
+{
+    std::lock_guard<std::mutex> guard(s_lock);
+    memset(&s_driver, 0, sizeof(s_driver));
+    return ESP_OK;
+}
+
+esp_err_t uac_host_device_open(const uac_host_device_config_t *config, uac_host_device_handle_t *uac_dev_handle)
+{
+    std::lock_guard<std::mutex> guard(s_lock);
+    if (s_device == NULL || s_device->addr != config->addr) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    uac_host_stream_t type = config->iface_num == SIM_TX_IFACE ? UAC_STREAM_TX : UAC_STREAM_RX;
+    if (_find_open_locked(s_device, type) != NULL) {
+        _violation("open of an interface already open, the previous handle leaked", NULL);
+        return ESP_ERR_INVALID_STATE;
+    }
+    uac_interface *iface = new uac_interface;
+    iface->dev = s_device;
+    iface->type = type;
+    iface->iface_num = config->iface_num;
+    iface->open = true;
+    iface->started = false;
+    iface->suspended = false;
+    iface->callback = config->callback;
+    iface->callback_arg = config->callback_arg;
+    iface->in_flight = 0;
+    s_ifaces.push_back(iface);
+    s_stats.opens++;
+    s_stats.open_handles++;
+    *uac_dev_handle = iface;
+    return ESP_OK;
+}
+
+esp_err_t uac_host_device_close(uac_host_device_handle_t uac_dev_handle)
+{
+    std::lock_guard<std::mutex> guard(s_lock);
+    uac_interface *iface = _iface_locked(uac_dev_handle, "close");
+    if (iface == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (iface->in_flight != 0) {
+        _violation("close while a transfer is in the driver", iface);
+    }
+    iface->open = false;
+    s_stats.closes++;
+    s_stats.open_handles--;
+    return ESP_OK;
+}
+
+esp_err_t uac_host_get_device_info(uac_host_device_handle_t uac_dev_handle, uac_host_dev_info_t *uac_dev_info)
+{
+    std::lock_guard<std::mutex> guard(s_lock);
+    uac_interface *iface = _iface_locked(uac_dev_handle, "get_device_info");
+    if (iface == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    memset(uac_dev_info, 0, sizeof(*uac_dev_info));
+    uac_dev_info->type = iface->type;
+    uac_dev_info->iface_num = iface->iface_num;
+    uac_dev_info->iface_alt_num = iface->dev->alt_num[iface->type];
+    uac_dev_info->VID = 0x303A;
+    uac_dev_info->PID = 0x4002;
+    return ESP_OK;
+}
+
+esp_err_t uac_host_get_device_alt_param(uac_host_device_handle_t uac_dev_handle, uint8_t iface_alt, uac_host_dev_alt_param_t *uac_alt_param)
+{
+    std::lock_guard<std::mutex> guard(s_lock);
+    uac_interface *iface = _iface_locked(uac_dev_handle, "get_device_alt_param");
+    if (iface == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (iface_alt == 0 || iface_alt > iface->dev->alt_num[iface->type]) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    *uac_alt_param = iface->dev->alt[iface->type][iface_alt - 1];
+    return ESP_OK;
+}
+
+esp_err_t uac_host_printf_device_param(uac_host_device_handle_t uac_dev_handle)
+{
+    std::lock_guard<std::mutex> guard(s_lock);
+    return _iface_locked(uac_dev_handle, "printf_device_param") != NULL ? ESP_OK : ESP_ERR_INVALID_STATE;
+}
+
+esp_err_t uac_host_device_start(uac_host_device_handle_t uac_dev_handle, const uac_host_stream_config_t *stream_config)
+{
+    std::lock_guard<std::mutex> guard(s_lock);
+    uac_interface *iface = _iface_locked(uac_dev_handle, "start");
+    if (iface == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (iface->dev->gone || iface->started) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (s_fail_starts > 0) {
+        s_fail_starts--;
+        return ESP_FAIL;
+    }
+    bool supported = false;
+    for (uint8_t i = 0; i < iface->dev->alt_num[iface->type]; i++) {
+        const uac_host_dev_alt_param_t *alt = &iface->dev->alt[iface->type][i];
+        if (alt->channels != stream_config->channels || alt->bit_resolution != stream_config->bit_resolution) {
+            continue;
+        }
+        if (alt->sample_freq_type == 0) {
+            supported |= stream_config->sample_freq >= alt->sample_freq_lower && stream_config->sample_freq <= alt->sample_freq_upper;
+            continue;
+        }
+        for (uint8_t j = 0; j < alt->sample_freq_type && j < UAC_FREQ_NUM_MAX; j++) {
+            supported |= alt->sample_freq[j] == stream_config->sample_freq;
+        }
+    }
+    if (!supported) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    iface->started = true;
+    iface->suspended = false;
+    iface->config = *stream_config;
+    s_last_config[iface->type] = *stream_config;
+    s_has_config[iface->type] = true;
+    s_stats.starts++;
+    return ESP_OK;
+}
+
+esp_err_t uac_host_device_stop(uac_host_device_handle_t uac_dev_handle)
+{
+    std::lock_guard<std::mutex> guard(s_lock);
+    uac_interface *iface = _iface_locked(uac_dev_handle, "stop");
+    if (iface == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    iface->started = false;
+    iface->suspended = false;
+    return iface->dev->gone ? ESP_ERR_INVALID_STATE : ESP_OK;
+}
+
+esp_err_t uac_host_device_suspend(uac_host_device_handle_t uac_dev_handle)
+{
+    std::lock_guard<std::mutex> guard(s_lock);
+    uac_interface *iface = _iface_locked(uac_dev_handle, "suspend");
+    if (iface == NULL || iface->dev->gone || !iface->started) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    iface->suspended = true;
+    return ESP_OK;
+}
+
+esp_err_t uac_host_device_resume(uac_host_device_handle_t uac_dev_handle)
+{
+    std::lock_guard<std::mutex> guard(s_lock);
+    uac_interface *iface = _iface_locked(uac_dev_handle, "resume");
+    if (iface == NULL || iface->dev->gone || !iface->started) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    iface->suspended = false;
+    return ESP_OK;
+}
+
+/*
+ * A transfer of size bytes: checked under the lock, then the bus time outside of it. Speaker
+ * data goes through the loopback when it is enabled, in real time.
+ */
+static esp_err_t _transfer(uac_host_device_handle_t uac_dev_handle, const char *call, uac_host_stream_t type,
+                           const uint8_t *data, uint32_t size)
+{
+    uint32_t bytes_per_ms;
+    uac_host_stream_config_t config;
+    uint32_t stall_ms = 0;
+    {
+        std::lock_guard<std::mutex> guard(s_lock);
+        uac_interface *iface = _iface_locked(uac_dev_handle, call);
+        if (iface == NULL) {
+            return ESP_ERR_INVALID_STATE;
+        }
+        if (iface->type != type || iface->dev->gone || !iface->started || iface->suspended) {
+            return ESP_ERR_INVALID_STATE;
+        }
+        iface->in_flight++;
+        if (type == UAC_STREAM_TX && s_stall_ms != 0) {
+            stall_ms = s_stall_ms;
+            s_stall_ms = 0;
+            s_stats.stalls++;
+        }
+        config = iface->config;
+        bytes_per_ms = iface->config.sample_freq / 1000 * iface->config.channels * iface->config.bit_resolution / 8;
+    }
+    if (type == UAC_STREAM_TX && config.bit_resolution == 16 && loopback_sim_enabled()) {
+        loopback_sim_play((const int16_t *)data, size / (2 * config.channels), config.channels);
+    } else {
+        // a tenth of real time, enough for the other tasks to run into the transfer
+        std::this_thread::sleep_for(std::chrono::microseconds(size * 100 / (bytes_per_ms ? bytes_per_ms : 1)));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(stall_ms));
+    std::lock_guard<std::mutex> guard(s_lock);
+    uac_dev_handle->in_flight--;
+    if (uac_dev_handle->dev->gone) {
+        return ESP_FAIL;
+    }
+    if (type == UAC_STREAM_TX) {
+        s_stats.writes++;
+        s_stats.write_bytes += size;
+    }
+    return ESP_OK;
+}
+
+esp_err_t uac_host_device_read(uac_host_device_handle_t uac_dev_handle, uint8_t *data, uint32_t size, uint32_t *bytes_read, uint32_t timeout)
+{
+    (void)timeout;
+    *bytes_read = 0;
+    esp_err_t ret = _transfer(uac_dev_handle, "read", UAC_STREAM_RX, NULL, size);
+    if (ret == ESP_OK) {
+        memset(data, 0, size);
+        *bytes_read = size;
+    }
+    return ret;
+}
+
+esp_err_t uac_host_device_write(uac_host_device_handle_t uac_dev_handle, uint8_t *data, uint32_t size, uint32_t timeout)
+{
+    (void)timeout;
+    return _transfer(uac_dev_handle, "write", UAC_STREAM_TX, data, size);
+}
+
+static esp_err_t _control(uac_host_device_handle_t uac_dev_handle, const char *call)
+{
+    std::lock_guard<std::mutex> guard(s_lock);
+    uac_interface *iface = _iface_locked(uac_dev_handle, call);
+    if (iface == NULL || iface->dev->gone) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    return ESP_OK;
+}
+
+esp_err_t uac_host_device_set_mute(uac_host_device_handle_t uac_dev_handle, bool mute)
+{
+    (void)mute;
+    return _control(uac_dev_handle, "set_mute");
+}
+
+esp_err_t uac_host_device_set_volume(uac_host_device_handle_t uac_dev_handle, uint8_t volume)
+{
+    (void)volume;
+    return _control(uac_dev_handle, "set_volume");
+}
+
+esp_err_t uac_host_device_set_volume_db(uac_host_device_handle_t uac_dev_handle, int32_t volume_db)
+{
+    (void)volume_db;
+    return _control(uac_dev_handle, "set_volume_db");
+}
+
+/* The USB host library has nothing to do on the host, the driver events come from the test */
+esp_err_t usb_host_install(const usb_host_config_t *config)
+{
+    (void)config;
+    return ESP_OK;
+}
+
+esp_err_t usb_host_uninstall(void)
+{
+    return ESP_OK;
+}
+
+esp_err_t usb_host_lib_handle_events(TickType_t timeout_ticks, uint32_t *event_flags_ret)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ticks == portMAX_DELAY ? 1000 : timeout_ticks));
+    *event_flags_ret = 0;
+    return ESP_ERR_TIMEOUT;
+}
+
+esp_err_t usb_host_device_free_all(void)
+{
+    return ESP_OK;
+}
+
+namespace esphome {
+namespace usbaudio {
+
+/* The feature unit of the simulated speaker: -60 to 0 dB in 1 dB steps */
+esp_err_t audio_volume_read_range(uint8_t dev_addr, audio_volume_range_t *range)
+{
+    bool supported;
+    uint32_t delay_ms;
+    bool present;
+    {
+        std::lock_guard<std::mutex> guard(s_lock);
+        supported = s_range_supported;
+        delay_ms = s_range_delay_ms;
+        present = s_device != NULL && s_device->addr == dev_addr;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+    if (!present) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (!supported) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    range->min_db = AUDIO_VOLUME_DB(-60);
+    range->max_db = 0;
+    range->res_db = AUDIO_VOLUME_DB(1);
+    return ESP_OK;
+}
+
+} // namespace usbaudio
+} // namespace esphome
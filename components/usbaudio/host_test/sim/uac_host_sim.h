@@ -0,0 +1,44 @@
+/*
+ * Simulated UAC host driver behind stubs/usb/uac_host.h: one headset at a time, a speaker
+ * interface and optionally a microphone. The calls below play the driver task, the device
+ * and driver callbacks run on the calling thread as they run on the driver task on target.
+ *
+ * Misuse of the driver API is counted in violations instead of crashing: a call on a
+ * closed handle, a close while a write is still inside the driver, opening an interface
+ * that is already open (the previous handle leaked).
+ */
+#pragma once
+
+#include <stdint.h>
+#include "usb/uac_host.h"
+
+struct uac_sim_stats_t {
+    uint32_t opens;
+    uint32_t closes;
+    uint32_t open_handles;          /*!< opened and not closed yet */
+    uint32_t starts;
+    uint32_t writes;                /*!< accepted by a running stream */
+    uint64_t write_bytes;
+    uint32_t stalls;                /*!< writes held by uac_sim_stall_next_write() so far */
+    uint32_t violations;
+};
+
+/* Plug a headset: TX_CONNECTED, then RX_CONNECTED if it has a microphone */
+void uac_sim_connect(bool with_mic);
+/* TX_CONNECTED again for the plugged headset, without a disconnect in between */
+void uac_sim_connect_again(void);
+/* Unplug: DISCONNECTED to each open interface, their calls fail from now on */
+void uac_sim_disconnect(void);
+/* TRANSFER_ERROR on the open speaker interface */
+void uac_sim_transfer_error(void);
+/* The next speaker write stays ms in the driver, whether the headset goes away or not */
+void uac_sim_stall_next_write(uint32_t ms);
+/* The next count stream starts fail */
+void uac_sim_fail_starts(int count);
+/* Alt settings of the next headset plugged, type UAC_STREAM_TX or UAC_STREAM_RX */
+void uac_sim_set_alt_params(uac_host_stream_t type, const uac_host_dev_alt_param_t *params, uint8_t count);
+/* Time audio_volume_read_range() takes, and whether the speaker has a volume control */
+void uac_sim_set_volume_range(bool supported, uint32_t delay_ms);
+/* Format the speaker or microphone stream was last started in */
+bool uac_sim_stream_config(uac_host_stream_t type, uac_host_stream_config_t *config);
+void uac_sim_get_stats(uac_sim_stats_t *stats);
@@ -0,0 +1,91 @@
+/*
+ * What usbaudio.cpp gets from the rest of the firmware: the audio player, the BSP, the UI
+ * and the task priorities. Force-included when the component is built on the host,
+ * implemented in sim/app_sim.cpp.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "esp_err.h"
+#include "driver/i2s_std.h"
+#include "usbaudio.h"
+
+#define USER_TASK_PRIORITY          2
+#define USB_HOST_TASK_PRIORITY      5
+#define UAC_TASK_PRIORITY           5
+#define SPIFFS_BASE                 "/tmp/usbaudio_host_test"
+#define MP3_FILE_NAME               "/music.mp3"
+
+/* BSP, as in bsp_board.h */
+typedef struct {
+    int task_priority;
+} lvgl_port_cfg_t;
+
+#define ESP_LVGL_PORT_INIT_CONFIG() {.task_priority = 4}
+#define BSP_LCD_H_RES               320
+#define CONFIG_BSP_LCD_DRAW_BUF_HEIGHT  50
+
+typedef struct {
+    lvgl_port_cfg_t lvgl_port_cfg;
+    uint32_t buffer_size;
+    bool double_buffer;
+    struct {
+        unsigned int buff_dma: 1;
+    } flags;
+} bsp_display_cfg_t;
+
+extern "C" {
+esp_err_t bsp_i2c_init(void);
+esp_err_t bsp_spiffs_mount(void);
+esp_err_t bsp_board_init(void);
+void *bsp_display_start_with_config(const bsp_display_cfg_t *cfg);
+esp_err_t bsp_display_backlight_on(void);
+bool bsp_display_lock(uint32_t timeout_ms);
+void bsp_display_unlock(void);
+esp_err_t bsp_codec_mute_set(bool enable);
+esp_err_t bsp_codec_volume_set(int volume, int *volume_set);
+esp_err_t bsp_codec_set_fs(uint32_t rate, uint32_t bits_cfg, i2s_slot_mode_t ch);
+esp_err_t bsp_i2s_read(void *audio_buffer, size_t len, size_t *bytes_read, uint32_t timeout_ms);
+esp_err_t bsp_i2s_write(void *audio_buffer, size_t len, size_t *bytes_written, uint32_t timeout_ms);
+}
+
+namespace esphome {
+namespace usbaudio {
+
+/* Audio player */
+typedef esp_err_t (*audio_player_mute_fn)(AUDIO_PLAYER_MUTE_SETTING setting);
+typedef esp_err_t (*audio_player_write_fn)(void *audio_buffer, size_t len, size_t *bytes_written, uint32_t timeout_ms);
+typedef esp_err_t (*audio_player_clk_set_fn)(uint32_t rate, uint32_t bits_cfg, i2s_slot_mode_t ch);
+typedef void (*audio_player_cb_t)(audio_player_cb_ctx_t *ctx);
+
+struct audio_player_config_t {
+    audio_player_mute_fn mute_fn;
+    audio_player_write_fn write_fn;
+    audio_player_clk_set_fn clk_set_fn;
+    int priority;
+};
+
+enum audio_player_state_t {
+    AUDIO_PLAYER_STATE_IDLE = 0,
+    AUDIO_PLAYER_STATE_PLAYING,
+    AUDIO_PLAYER_STATE_PAUSE,
+    AUDIO_PLAYER_STATE_SHUTDOWN,
+};
+
+esp_err_t audio_player_new(audio_player_config_t config);
+esp_err_t audio_player_play(FILE *fp);
+esp_err_t audio_player_pause(void);
+esp_err_t audio_player_resume(void);
+esp_err_t audio_player_stop(void);
+audio_player_state_t audio_player_get_state(void);
+esp_err_t audio_player_callback_register(audio_player_cb_t call_back, void *user_ctx);
+
+/* UI */
+struct file_iterator_instance_t;
+file_iterator_instance_t *file_iterator_new(const char *base_path);
+void ui_audio_start(file_iterator_instance_t *i);
+
+} // namespace usbaudio
+} // namespace esphome
@@ -0,0 +1,4 @@
+/* Host stand-in for the GPIO driver header, the component includes it for the BSP */
+#pragma once
+
+typedef int gpio_num_t;
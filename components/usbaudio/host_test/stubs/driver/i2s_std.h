@@ -0,0 +1,7 @@
+/* Host stand-in for the I2S driver header, only the types the component uses */
+#pragma once
+
+typedef enum {
+    I2S_SLOT_MODE_MONO = 1,
+    I2S_SLOT_MODE_STEREO = 2,
+} i2s_slot_mode_t;
@@ -0,0 +1,12 @@
+/* Host stand-in for esp_cpu.h, cycles are nanoseconds of the monotonic clock */
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+static inline uint32_t esp_cpu_get_cycle_count(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000000000ull + ts.tv_nsec);
+}
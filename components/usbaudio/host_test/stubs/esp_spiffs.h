@@ -0,0 +1,4 @@
+/* Host stand-in for esp_spiffs.h, the component only mounts through the BSP */
+#pragma once
+
+#include "esp_err.h"
@@ -0,0 +1,2 @@
+/* Host stand-in, usbaudio.h doesn't use the media player types yet */
+#pragma once
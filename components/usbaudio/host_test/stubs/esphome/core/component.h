@@ -0,0 +1,14 @@
+/* Host stand-in for the ESPHome component base */
+#pragma once
+
+namespace esphome {
+
+class Component {
+public:
+    virtual ~Component() = default;
+    virtual void setup() {}
+    virtual void loop() {}
+    virtual void dump_config() {}
+};
+
+} // namespace esphome
@@ -0,0 +1,17 @@
+/* Host stand-in for the ESPHome log macros, info and debug only with HOST_TEST_VERBOSE */
+#pragma once
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#define HOST_LOG(level, tag, format, ...) fprintf(stderr, level " (%s) " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGE(tag, format, ...) HOST_LOG("E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) HOST_LOG("W", tag, format, ##__VA_ARGS__)
+#ifdef HOST_TEST_VERBOSE
+#define ESP_LOGI(tag, format, ...) HOST_LOG("I", tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) HOST_LOG("D", tag, format, ##__VA_ARGS__)
+#else
+#define ESP_LOGI(tag, format, ...) do { if (0) HOST_LOG("I", tag, format, ##__VA_ARGS__); } while (0)
+#define ESP_LOGD(tag, format, ...) do { if (0) HOST_LOG("D", tag, format, ##__VA_ARGS__); } while (0)
+#endif
+#define ESP_LOGV(tag, format, ...) do { if (0) HOST_LOG("V", tag, format, ##__VA_ARGS__); } while (0)
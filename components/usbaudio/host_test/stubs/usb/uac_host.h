@@ -0,0 +1,103 @@
+/*
+ * Host stand-in for the esp-usb UAC host driver, same types and calls. The driver behind it
+ * is simulated in sim/uac_host_sim.cpp, the test plugs and unplugs through sim/uac_host_sim.h.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "usb/usb_host.h"
+
+#define UAC_FREQ_NUM_MAX    4
+
+typedef struct uac_interface *uac_host_device_handle_t;
+
+typedef enum {
+    UAC_HOST_DRIVER_EVENT_RX_CONNECTED = 0x00,
+    UAC_HOST_DRIVER_EVENT_TX_CONNECTED,
+    UAC_HOST_DRIVER_EVENT_MAX,
+} uac_host_driver_event_t;
+
+typedef enum {
+    UAC_HOST_DRIVER_EVENT_DISCONNECTED = UAC_HOST_DRIVER_EVENT_MAX,
+    UAC_HOST_DEVICE_EVENT_RX_DONE,
+    UAC_HOST_DEVICE_EVENT_TX_DONE,
+    UAC_HOST_DEVICE_EVENT_TRANSFER_ERROR,
+    UAC_HOST_DEVICE_EVENT_MAX,
+} uac_host_device_event_t;
+
+typedef enum {
+    UAC_STREAM_TX = 0,
+    UAC_STREAM_RX,
+    UAC_STREAM_MAX,
+} uac_host_stream_t;
+
+typedef void (*uac_host_driver_event_cb_t)(uint8_t addr, uint8_t iface_num, const uac_host_driver_event_t event, void *arg);
+typedef void (*uac_host_device_event_cb_t)(uac_host_device_handle_t uac_device_handle, const uac_host_device_event_t event, void *arg);
+
+typedef struct {
+    bool create_background_task;
+    size_t task_priority;
+    size_t stack_size;
+    BaseType_t core_id;
+    uac_host_driver_event_cb_t callback;
+    void *callback_arg;
+} uac_host_driver_config_t;
+
+typedef struct {
+    uint8_t addr;
+    uint8_t iface_num;
+    uint32_t buffer_size;
+    uint32_t buffer_threshold;
+    uac_host_device_event_cb_t callback;
+    void *callback_arg;
+} uac_host_device_config_t;
+
+typedef struct {
+    uint8_t channels;
+    uint8_t bit_resolution;
+    uint32_t sample_freq;
+    uint16_t flags;
+} uac_host_stream_config_t;
+
+typedef struct {
+    uac_host_stream_t type;
+    uint8_t iface_num;
+    uint8_t iface_alt_num;
+    uint16_t VID;
+    uint16_t PID;
+} uac_host_dev_info_t;
+
+typedef struct {
+    uint16_t format;
+    uint8_t channels;
+    uint8_t bit_resolution;
+    uint8_t sample_freq_type;
+    union {
+        uint32_t sample_freq[UAC_FREQ_NUM_MAX];
+        struct {
+            uint32_t sample_freq_lower;
+            uint32_t sample_freq_upper;
+        };
+    };
+} uac_host_dev_alt_param_t;
+
+esp_err_t uac_host_install(const uac_host_driver_config_t *config);
+esp_err_t uac_host_uninstall(void);
+esp_err_t uac_host_device_open(const uac_host_device_config_t *config, uac_host_device_handle_t *uac_dev_handle);
+esp_err_t uac_host_device_close(uac_host_device_handle_t uac_dev_handle);
+esp_err_t uac_host_get_device_info(uac_host_device_handle_t uac_dev_handle, uac_host_dev_info_t *uac_dev_info);
+esp_err_t uac_host_get_device_alt_param(uac_host_device_handle_t uac_dev_handle, uint8_t iface_alt, uac_host_dev_alt_param_t *uac_alt_param);
+esp_err_t uac_host_printf_device_param(uac_host_device_handle_t uac_dev_handle);
+esp_err_t uac_host_device_start(uac_host_device_handle_t uac_dev_handle, const uac_host_stream_config_t *stream_config);
+esp_err_t uac_host_device_stop(uac_host_device_handle_t uac_dev_handle);
+esp_err_t uac_host_device_suspend(uac_host_device_handle_t uac_dev_handle);
+esp_err_t uac_host_device_resume(uac_host_device_handle_t uac_dev_handle);
+esp_err_t uac_host_device_read(uac_host_device_handle_t uac_dev_handle, uint8_t *data, uint32_t size, uint32_t *bytes_read, uint32_t timeout);
+esp_err_t uac_host_device_write(uac_host_device_handle_t uac_dev_handle, uint8_t *data, uint32_t size, uint32_t timeout);
+esp_err_t uac_host_device_set_mute(uac_host_device_handle_t uac_dev_handle, bool mute);
+esp_err_t uac_host_device_set_volume(uac_host_device_handle_t uac_dev_handle, uint8_t volume);
+esp_err_t uac_host_device_set_volume_db(uac_host_device_handle_t uac_dev_handle, int32_t volume_db);
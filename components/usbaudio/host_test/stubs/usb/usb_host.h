@@ -0,0 +1,21 @@
+/* Host stand-in for the USB host library, the part the component's host task uses */
+#pragma once
+
+#include <stdbool.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+#define ESP_INTR_FLAG_LEVEL2                    (1 << 2)
+#define USB_HOST_LIB_EVENT_FLAGS_NO_CLIENTS     0x01
+#define USB_HOST_LIB_EVENT_FLAGS_ALL_FREE       0x02
+
+typedef struct {
+    bool skip_phy_setup;
+    int intr_flags;
+} usb_host_config_t;
+
+esp_err_t usb_host_install(const usb_host_config_t *config);
+esp_err_t usb_host_uninstall(void);
+/* Never reports an event, returns after timeout_ticks */
+esp_err_t usb_host_lib_handle_events(TickType_t timeout_ticks, uint32_t *event_flags_ret);
+esp_err_t usb_host_device_free_all(void);
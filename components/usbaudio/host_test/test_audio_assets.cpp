@@ -0,0 +1,300 @@
+/*
+ * Asset image round trip: WAV files through tools/mkassets.py, the image mapped read-only
+ * as the device maps the partition, then read back with audio_assets. PCM clips must come
+ * back bit for bit, ADPCM clips exact at every block start and close to the source in
+ * between. The reader runs a second time on a copy that ends at an inaccessible page, so
+ * that reading past the image faults, and on corrupted copies that attach must refuse.
+ */
+#include "audio_assets.h"
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace esphome::usbaudio;
+
+#ifndef MKASSETS_PY
+#define MKASSETS_PY "../tools/mkassets.py"
+#endif
+
+/* mkassets.py --block-align, per channel */
+#define BLOCK_ALIGN     256
+
+static int s_failures = 0;
+
+#define CHECK(cond, ...) do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+            s_failures++; \
+        } \
+    } while (0)
+
+struct test_clip {
+    const char *name;
+    uint32_t rate;
+    uint8_t channels;
+    uint32_t frames;
+    bool adpcm;
+    std::vector<int16_t> samples;
+};
+
+static uint32_t _block_frames(uint8_t channels)
+{
+    return (BLOCK_ALIGN * channels - 4 * channels) * 2 / channels + 1;
+}
+
+/* A sine per channel, at a different pitch each */
+static void _synth(test_clip *clip)
+{
+    clip->samples.resize((size_t)clip->frames * clip->channels);
+    for (uint32_t f = 0; f < clip->frames; f++) {
+        for (uint8_t c = 0; c < clip->channels; c++) {
+            double phase = 2.0 * M_PI * (440.0 * (c + 1)) * f / clip->rate;
+            clip->samples[(size_t)f * clip->channels + c] = (int16_t)lrint(12000.0 * sin(phase));
+        }
+    }
+}
+
+static bool _write_wav(const std::string &path, const test_clip *clip)
+{
+    FILE *fp = fopen(path.c_str(), "wb");
+    if (fp == NULL) {
+        return false;
+    }
+    uint32_t data_size = (uint32_t)(clip->samples.size() * sizeof(int16_t));
+    uint16_t block = clip->channels * sizeof(int16_t);
+    uint32_t byte_rate = clip->rate * block;
+    uint32_t riff_size = 36 + data_size;
+    uint32_t fmt_size = 16;
+    uint16_t format = 1;
+    uint16_t channels = clip->channels;
+    uint16_t bits = 16;
+    fwrite("RIFF", 1, 4, fp);
+    fwrite(&riff_size, 4, 1, fp);
+    fwrite("WAVEfmt ", 1, 8, fp);
+    fwrite(&fmt_size, 4, 1, fp);
+    fwrite(&format, 2, 1, fp);
+    fwrite(&channels, 2, 1, fp);
+    fwrite(&clip->rate, 4, 1, fp);
+    fwrite(&byte_rate, 4, 1, fp);
+    fwrite(&block, 2, 1, fp);
+    fwrite(&bits, 2, 1, fp);
+    fwrite("data", 1, 4, fp);
+    fwrite(&data_size, 4, 1, fp);
+    fwrite(clip->samples.data(), sizeof(int16_t), clip->samples.size(), fp);
+    return fclose(fp) == 0;
+}
+
+static void _check_clip(const test_clip *clip, const audio_asset_t *asset)
+{
+    CHECK(strcmp(asset->name, clip->name) == 0, "name '%s'", asset->name);
+    CHECK(asset->frames == clip->frames, "%s: %zu frames", clip->name, asset->frames);
+    CHECK(asset->sample_rate == clip->rate, "%s: %u Hz", clip->name, asset->sample_rate);
+    CHECK(asset->channels == clip->channels, "%s: %u channels", clip->name, asset->channels);
+    CHECK(((uintptr_t)asset->data % AUDIO_ASSETS_ALIGN) == 0, "%s: payload not aligned", clip->name);
+    if (!clip->adpcm) {
+        CHECK(asset->codec == AUDIO_ASSET_PCM16, "%s: codec %d", clip->name, asset->codec);
+        CHECK(asset->size == clip->samples.size() * sizeof(int16_t), "%s: %zu bytes", clip->name, asset->size);
+        CHECK(asset->size == clip->samples.size() * sizeof(int16_t) &&
+              memcmp(asset->data, clip->samples.data(), asset->size) == 0, "%s: PCM differs", clip->name);
+        int16_t out;
+        CHECK(audio_asset_decode(asset, &out) == ESP_ERR_INVALID_ARG, "%s: decoded as ADPCM", clip->name);
+        return;
+    }
+
+    CHECK(asset->codec == AUDIO_ASSET_IMA_ADPCM, "%s: codec %d", clip->name, asset->codec);
+    CHECK(asset->block_align == BLOCK_ALIGN * clip->channels, "%s: block_align %u", clip->name, asset->block_align);
+    std::vector<int16_t> out(clip->samples.size() + 1, 0x5A5A);
+    CHECK(audio_asset_decode(asset, out.data()) == ESP_OK, "%s: decode", clip->name);
+    CHECK(out.back() == 0x5A5A, "%s: decoded past the end", clip->name);
+    uint32_t block_frames = _block_frames(clip->channels);
+    double signal = 0;
+    double noise = 0;
+    for (size_t i = 0; i < clip->samples.size(); i++) {
+        size_t frame = i / clip->channels;
+        if (frame % block_frames == 0) {
+            // the block header carries the sample as is
+            CHECK(out[i] == clip->samples[i], "%s: block start %zu is %d, not %d", clip->name, frame, out[i],
+                  clip->samples[i]);
+        }
+        double err = (double)out[i] - clip->samples[i];
+        signal += (double)clip->samples[i] * clip->samples[i];
+        noise += err * err;
+    }
+    if (clip->frames > 64) {
+        double snr_db = 10.0 * log10(signal / (noise > 0 ? noise : 1));
+        CHECK(snr_db > 25.0, "%s: SNR %.1f dB", clip->name, snr_db);
+    }
+}
+
+static void _check_image(const char *what, const uint8_t *image, size_t size, std::vector<test_clip> &clips)
+{
+    esp_err_t ret = audio_assets_attach(image, size);
+    CHECK(ret == ESP_OK, "%s: attach %d", what, ret);
+    if (ret != ESP_OK) {
+        return;
+    }
+    CHECK(audio_assets_count() == clips.size(), "%s: %zu clips", what, audio_assets_count());
+    for (size_t i = 0; i < clips.size(); i++) {
+        audio_asset_t asset;
+        CHECK(audio_assets_get(i, &asset) == ESP_OK, "%s: get %zu", what, i);
+        _check_clip(&clips[i], &asset);
+        // lookups by name, in reverse to not just hit the first entry
+        const test_clip &clip = clips[clips.size() - 1 - i];
+        CHECK(audio_assets_find(clip.name, &asset) == ESP_OK && strcmp(asset.name, clip.name) == 0,
+              "%s: find '%s'", what, clip.name);
+    }
+    audio_asset_t asset;
+    CHECK(audio_assets_find("missing", &asset) == ESP_ERR_NOT_FOUND, "%s: found a missing clip", what);
+    CHECK(audio_assets_get(clips.size(), &asset) == ESP_ERR_NOT_FOUND, "%s: get past the end", what);
+}
+
+/* The image right before an inaccessible page, read-only */
+static uint8_t *_map_guarded(const uint8_t *image, size_t size, size_t *mapped)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t pages = (size + page - 1) / page;
+    *mapped = (pages + 1) * page;
+    uint8_t *base = (uint8_t *)mmap(NULL, *mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    // payloads stay aligned, the image ends at most 3 bytes before the guard
+    uint8_t *copy = base + ((pages * page - size) & ~(size_t)(AUDIO_ASSETS_ALIGN - 1));
+    memcpy(copy, image, size);
+    mprotect(base, pages * page, PROT_READ);
+    mprotect(base + pages * page, page, PROT_NONE);
+    return copy;
+}
+
+/* Attach must refuse a copy of the image with len bytes at offset replaced */
+static void _check_corrupt(const char *what, const uint8_t *image, size_t size, size_t offset, const void *bytes,
+                           size_t len, esp_err_t expected)
+{
+    std::vector<uint8_t> copy(image, image + size);
+    memcpy(copy.data() + offset, bytes, len);
+    esp_err_t ret = audio_assets_attach(copy.data(), copy.size());
+    CHECK(ret == expected, "%s: attach %d instead of %d", what, ret, expected);
+    CHECK(audio_assets_count() == 0, "%s: clips left attached", what);
+}
+
+static void _check_refused(const uint8_t *image, size_t size)
+{
+    const size_t entry0 = sizeof(audio_assets_header_t);
+    const uint16_t version = AUDIO_ASSETS_VERSION + 1;
+    const uint32_t too_big = (uint32_t)size + 1;
+    const uint32_t misaligned = 2;
+    const uint32_t past_end = (uint32_t)size;
+    const uint8_t channels = 3;
+    const uint32_t payload = 4;
+    const char unterminated[AUDIO_ASSETS_NAME_LEN] = {'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x',
+                                                      'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'};
+    _check_corrupt("magic", image, size, 0, "UAAX", 4, ESP_ERR_INVALID_RESPONSE);
+    _check_corrupt("version", image, size, offsetof(audio_assets_header_t, version), &version, sizeof(version),
+                   ESP_ERR_INVALID_VERSION);
+    _check_corrupt("image size", image, size, offsetof(audio_assets_header_t, image_size), &too_big,
+                   sizeof(too_big), ESP_ERR_INVALID_RESPONSE);
+    _check_corrupt("name", image, size, entry0 + offsetof(audio_asset_entry_t, name), unterminated,
+                   sizeof(unterminated), ESP_ERR_INVALID_RESPONSE);
+    _check_corrupt("offset", image, size, entry0 + offsetof(audio_asset_entry_t, offset), &misaligned,
+                   sizeof(misaligned), ESP_ERR_INVALID_RESPONSE);
+    _check_corrupt("offset", image, size, entry0 + offsetof(audio_asset_entry_t, offset), &past_end,
+                   sizeof(past_end), ESP_ERR_INVALID_RESPONSE);
+    _check_corrupt("channels", image, size, entry0 + offsetof(audio_asset_entry_t, channels), &channels,
+                   sizeof(channels), ESP_ERR_INVALID_RESPONSE);
+    // the first clip is PCM, the second ADPCM, neither fits in 4 bytes
+    _check_corrupt("PCM size", image, size, entry0 + offsetof(audio_asset_entry_t, size), &payload,
+                   sizeof(payload), ESP_ERR_INVALID_RESPONSE);
+    _check_corrupt("ADPCM size", image, size, entry0 + sizeof(audio_asset_entry_t) + offsetof(audio_asset_entry_t, size),
+                   &payload, sizeof(payload), ESP_ERR_INVALID_RESPONSE);
+    CHECK(audio_assets_attach(image, sizeof(audio_assets_header_t) - 1) == ESP_ERR_INVALID_RESPONSE, "short image");
+    CHECK(audio_assets_attach(image, size - 1) == ESP_ERR_INVALID_RESPONSE, "truncated image");
+}
+
+int main(void)
+{
+    static_assert(sizeof(audio_assets_header_t) == 16, "header layout of mkassets.py");
+    static_assert(sizeof(audio_asset_entry_t) == 44, "entry layout of mkassets.py");
+
+    char dir_template[] = "/tmp/usbaudio_assets_XXXXXX";
+    const char *dir = mkdtemp(dir_template);
+    if (dir == NULL) {
+        printf("FAIL: no temporary directory\n");
+        return 1;
+    }
+    std::vector<test_clip> clips = {
+        {"chime", 16000, 1, 1000, false, {}},
+        // blocks cut after a partial group, a single frame, a block exactly, one group
+        {"prompt", 48000, 2, 3 * _block_frames(2) + 5, true, {}},
+        {"tick", 22050, 1, 1, true, {}},
+        {"beep", 16000, 1, _block_frames(1), true, {}},
+        {"click", 16000, 1, 9, true, {}},
+        {"stereo_pcm_odd_frames", 44100, 2, 333, false, {}},
+    };
+    std::string cmd = "python3 " MKASSETS_PY " --block-align " + std::to_string(BLOCK_ALIGN) + " -o " + dir +
+                      "/assets.bin";
+    for (test_clip &clip : clips) {
+        _synth(&clip);
+        std::string wav = std::string(dir) + "/" + clip.name + ".wav";
+        if (!_write_wav(wav, &clip)) {
+            printf("FAIL: can't write %s\n", wav.c_str());
+            return 1;
+        }
+        cmd += std::string(" ") + clip.name + "=" + wav + (clip.adpcm ? ":adpcm" : "");
+    }
+    cmd += " > /dev/null";
+    if (system(cmd.c_str()) != 0) {
+        printf("FAIL: %s\n", cmd.c_str());
+        return 1;
+    }
+
+    std::string path = std::string(dir) + "/assets.bin";
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        printf("FAIL: can't open %s\n", path.c_str());
+        return 1;
+    }
+    size_t size = (size_t)st.st_size;
+    const uint8_t *image = (const uint8_t *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        printf("FAIL: can't map %s\n", path.c_str());
+        return 1;
+    }
+    _check_image("mapped", image, size, clips);
+
+    size_t mapped;
+    uint8_t *guarded = _map_guarded(image, size, &mapped);
+    CHECK(guarded != NULL, "guarded mapping");
+    if (guarded != NULL) {
+        _check_image("guarded", guarded, size, clips);
+        // the copy starts in the first page of the mapping
+        munmap((void *)((uintptr_t)guarded & ~((uintptr_t)sysconf(_SC_PAGESIZE) - 1)), mapped);
+    }
+    _check_refused(image, size);
+
+    // mkassets.py refuses names that don't fit with their NUL
+    std::string long_name = "python3 " MKASSETS_PY " -o " + std::string(dir) + "/long.bin " +
+                            std::string(AUDIO_ASSETS_NAME_LEN, 'n') + "=" + dir + "/chime.wav > /dev/null 2>&1";
+    CHECK(system(long_name.c_str()) != 0, "mkassets.py took a %d byte name", AUDIO_ASSETS_NAME_LEN);
+
+    munmap((void *)image, size);
+    std::string cleanup = std::string("rm -rf ") + dir;
+    system(cleanup.c_str());
+    if (s_failures) {
+        printf("%d failure(s)\n", s_failures);
+        return 1;
+    }
+    printf("audio_assets: %zu clips, %zu bytes: OK\n", clips.size(), size);
+    return 0;
+}
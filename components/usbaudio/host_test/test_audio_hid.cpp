@@ -0,0 +1,255 @@
+/*
+ * audio_hid_parse_descriptor / audio_hid_decode on the host, with consumer control report
+ * descriptors as headsets and keyboards send them: bit fields, selector arrays over a usage
+ * range, report IDs, long items, and descriptors cut short.
+ *
+ * Built with AddressSanitizer, a read past the descriptor or the report fails the test.
+ */
+#include "audio_hid.h"
+
+#include <stdio.h>
+#include <string.h>
+
+using namespace esphome::usbaudio;
+
+static int s_failures = 0;
+
+#define CHECK(cond, ...) do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+            s_failures++; \
+        } \
+    } while (0)
+
+#define KEY(k)  (1u << AUDIO_HID_KEY_##k)
+
+/* C-Media CM108 headset: no report ID, one bit per key, relative mute, a telephony hook switch */
+static const uint8_t s_cm108[] = {
+    0x05, 0x0C,         // Usage Page (Consumer)
+    0x09, 0x01,         // Usage (Consumer Control)
+    0xA1, 0x01,         // Collection (Application)
+    0x15, 0x00,         //   Logical Minimum (0)
+    0x25, 0x01,         //   Logical Maximum (1)
+    0x09, 0xE9,         //   Usage (Volume Increment)
+    0x09, 0xEA,         //   Usage (Volume Decrement)
+    0x75, 0x01,         //   Report Size (1)
+    0x95, 0x02,         //   Report Count (2)
+    0x81, 0x02,         //   Input (Data, Var, Abs)
+    0x09, 0xE2,         //   Usage (Mute)
+    0x09, 0x00,         //   Usage (Unassigned)
+    0x81, 0x06,         //   Input (Data, Var, Rel)
+    0x05, 0x0B,         //   Usage Page (Telephony)
+    0x09, 0x20,         //   Usage (Hook Switch)
+    0x95, 0x01,         //   Report Count (1)
+    0x81, 0x42,         //   Input (Data, Var, Abs, Null)
+    0x05, 0x0C,         //   Usage Page (Consumer)
+    0x09, 0x00,         //   Usage (Unassigned)
+    0x95, 0x03,         //   Report Count (3)
+    0x81, 0x02,         //   Input (Data, Var, Abs)
+    0x26, 0xFF, 0x00,   //   Logical Maximum (255)
+    0x09, 0x00,         //   Usage (Unassigned)
+    0x75, 0x08,         //   Report Size (8)
+    0x95, 0x03,         //   Report Count (3)
+    0x81, 0x02,         //   Input (Data, Var, Abs)
+    0x09, 0x00,         //   Usage (Unassigned)
+    0x95, 0x04,         //   Report Count (4)
+    0x91, 0x02,         //   Output (Data, Var, Abs)
+    0xC0,               // End Collection
+};
+/* End of the first Input item */
+#define CM108_FIRST_INPUT   20
+
+/* Keyboard with its media keys: report ID 1 the keys, report ID 3 a 16-bit selector over 0 - 0x23C */
+static const uint8_t s_keyboard[] = {
+    0x05, 0x01,         // Usage Page (Generic Desktop)
+    0x09, 0x06,         // Usage (Keyboard)
+    0xA1, 0x01,         // Collection (Application)
+    0x85, 0x01,         //   Report ID (1)
+    0x05, 0x07,         //   Usage Page (Keyboard)
+    0x19, 0xE0,         //   Usage Minimum (Left Control)
+    0x29, 0xE7,         //   Usage Maximum (Right GUI)
+    0x15, 0x00,         //   Logical Minimum (0)
+    0x25, 0x01,         //   Logical Maximum (1)
+    0x75, 0x01,         //   Report Size (1)
+    0x95, 0x08,         //   Report Count (8)
+    0x81, 0x02,         //   Input (Data, Var, Abs)
+    0x95, 0x01,         //   Report Count (1)
+    0x75, 0x08,         //   Report Size (8)
+    0x81, 0x01,         //   Input (Const)
+    0x95, 0x06,         //   Report Count (6)
+    0x75, 0x08,         //   Report Size (8)
+    0x25, 0x65,         //   Logical Maximum (101)
+    0x19, 0x00,         //   Usage Minimum (0)
+    0x29, 0x65,         //   Usage Maximum (101)
+    0x81, 0x00,         //   Input (Data, Array, Abs)
+    0xC0,               // End Collection
+    0xFE, 0x03, 0x10, 0xAA, 0xBB, 0xCC, // Long item, 3 data bytes
+    0x05, 0x0C,         // Usage Page (Consumer)
+    0x09, 0x01,         // Usage (Consumer Control)
+    0xA1, 0x01,         // Collection (Application)
+    0x85, 0x03,         //   Report ID (3)
+    0x19, 0x00,         //   Usage Minimum (0)
+    0x2A, 0x3C, 0x02,   //   Usage Maximum (AC Format)
+    0x15, 0x00,         //   Logical Minimum (0)
+    0x26, 0x3C, 0x02,   //   Logical Maximum (572)
+    0x95, 0x02,         //   Report Count (2)
+    0x75, 0x10,         //   Report Size (16)
+    0x81, 0x00,         //   Input (Data, Array, Abs)
+    0xC0,               // End Collection
+};
+
+/* Report ID 2: 256 vendor bytes ahead of the volume key, the key is at bit 2048 */
+static const uint8_t s_long_report[] = {
+    0x06, 0x00, 0xFF,   // Usage Page (Vendor 0xFF00)
+    0x09, 0x01,         // Usage (1)
+    0xA1, 0x01,         // Collection (Application)
+    0x85, 0x02,         //   Report ID (2)
+    0x09, 0x01,         //   Usage (1)
+    0x75, 0x08,         //   Report Size (8)
+    0x96, 0x00, 0x01,   //   Report Count (256)
+    0x81, 0x02,         //   Input (Data, Var, Abs)
+    0x05, 0x0C,         //   Usage Page (Consumer)
+    0x09, 0xE9,         //   Usage (Volume Increment)
+    0x75, 0x01,         //   Report Size (1)
+    0x95, 0x01,         //   Report Count (1)
+    0x81, 0x02,         //   Input (Data, Var, Abs)
+    0xC0,               // End Collection
+};
+
+/* Parse a copy of exactly len bytes, so that AddressSanitizer sees any read past the end */
+static esp_err_t _parse(const uint8_t *desc, size_t len, audio_hid_map_t *map)
+{
+    uint8_t *copy = new uint8_t[len ? len : 1];
+    memcpy(copy, desc, len);
+    esp_err_t ret = audio_hid_parse_descriptor(copy, len, map);
+    delete[] copy;
+    return ret;
+}
+
+static void test_variable(void)
+{
+    audio_hid_map_t map;
+    CHECK(_parse(s_cm108, sizeof(s_cm108), &map) == ESP_OK, "cm108: not parsed");
+    CHECK(map.field_count == 3, "cm108: %u fields, expected 3", map.field_count);
+    const struct {
+        uint8_t report[4];
+        uint32_t keys;
+    } cases[] = {
+        {{0x00, 0, 0, 0}, 0},
+        {{0x01, 0, 0, 0}, KEY(VOLUME_UP)},
+        {{0x02, 0, 0, 0}, KEY(VOLUME_DOWN)},
+        {{0x04, 0, 0, 0}, KEY(MUTE)},
+        {{0x05, 0, 0, 0}, KEY(VOLUME_UP) | KEY(MUTE)},
+        {{0xF8, 0xFF, 0xFF, 0xFF}, 0},     // hook switch and padding only
+    };
+    for (const auto &c : cases) {
+        uint32_t keys = audio_hid_decode(&map, c.report, sizeof(c.report));
+        CHECK(keys == c.keys, "cm108: report %02x decoded to %#x, expected %#x", c.report[0], keys, c.keys);
+    }
+    CHECK(audio_hid_decode(&map, s_cm108, 0) == 0, "cm108: empty report decoded to keys");
+}
+
+static void test_report_ids(void)
+{
+    audio_hid_map_t map;
+    CHECK(_parse(s_keyboard, sizeof(s_keyboard), &map) == ESP_OK, "keyboard: not parsed");
+    CHECK(map.field_count == 1, "keyboard: %u fields, expected the consumer array only", map.field_count);
+    const audio_hid_field_t *f = &map.fields[0];
+    CHECK(f->report_id == 3 && f->array && f->size == 16 && f->count == 2 && f->offset == 0 &&
+          f->usage_min == 0 && f->usage_max == 0x23C,
+          "keyboard: report %u array %u size %u count %u offset %u usages %#x - %#x", f->report_id, f->array,
+          f->size, f->count, f->offset, f->usage_min, f->usage_max);
+    const struct {
+        uint8_t report[5];
+        size_t len;
+        uint32_t keys;
+    } cases[] = {
+        {{0x03, 0xE9, 0x00, 0x00, 0x00}, 5, KEY(VOLUME_UP)},
+        {{0x03, 0xCD, 0x00, 0xEA, 0x00}, 5, KEY(PLAY_PAUSE) | KEY(VOLUME_DOWN)},
+        {{0x03, 0x00, 0x00, 0xE2, 0x00}, 5, KEY(MUTE)},
+        {{0x03, 0x3D, 0x02, 0x00, 0x00}, 5, 0},           // past Usage Maximum
+        {{0x03, 0xE9, 0x00, 0x00, 0x00}, 3, KEY(VOLUME_UP)}, // second element cut off
+        {{0x01, 0x00, 0x00, 0xE9, 0x00}, 5, 0},           // keyboard report, 0xE9 is a key code
+        {{0x03}, 1, 0},
+    };
+    for (const auto &c : cases) {
+        uint32_t keys = audio_hid_decode(&map, c.report, c.len);
+        CHECK(keys == c.keys, "keyboard: report %02x %02x %02x, %zu bytes, decoded to %#x, expected %#x",
+              c.report[0], c.report[1], c.report[2], c.len, keys, c.keys);
+    }
+}
+
+static void test_report_count(void)
+{
+    audio_hid_map_t map;
+    CHECK(_parse(s_long_report, sizeof(s_long_report), &map) == ESP_OK, "long report: not parsed");
+    CHECK(map.field_count == 1 && map.fields[0].offset == 2048,
+          "long report: %u fields, offset %u, expected 1 at 2048", map.field_count, map.fields[0].offset);
+    uint8_t report[1 + 257] = {0x02};
+    CHECK(audio_hid_decode(&map, report, sizeof(report)) == 0, "long report: keys without a key bit");
+    report[1 + 256] = 0x01;
+    CHECK(audio_hid_decode(&map, report, sizeof(report)) == KEY(VOLUME_UP), "long report: volume up missed");
+}
+
+/* A field past the report ID table is skipped, with its usages */
+static void test_report_table_full(void)
+{
+    uint8_t desc[256];
+    size_t len = 0;
+    const uint8_t vendor[] = {0x06, 0x00, 0xFF, 0x75, 0x08, 0x95, 0x01};
+    memcpy(desc + len, vendor, sizeof(vendor));
+    len += sizeof(vendor);
+    for (uint8_t id = 1; id <= 16; id++) {
+        const uint8_t input[] = {0x85, id, 0x09, 0x01, 0x81, 0x02};
+        memcpy(desc + len, input, sizeof(input));
+        len += sizeof(input);
+    }
+    // report ID 17 has no room, then a field without usages in report ID 1
+    const uint8_t tail[] = {
+        0x85, 0x11, 0x05, 0x0C, 0x09, 0xE9, 0x75, 0x01, 0x81, 0x02,
+        0x85, 0x01, 0x81, 0x02,
+    };
+    memcpy(desc + len, tail, sizeof(tail));
+    len += sizeof(tail);
+    audio_hid_map_t map;
+    esp_err_t ret = _parse(desc, len, &map);
+    CHECK(ret == ESP_ERR_NOT_FOUND && map.field_count == 0,
+          "report table full: %s, %u fields, the skipped usage was kept", esp_err_to_name(ret), map.field_count);
+}
+
+static void test_truncated(void)
+{
+    audio_hid_map_t map;
+    // every length, items and long items cut anywhere
+    for (size_t len = 0; len < sizeof(s_cm108); len++) {
+        esp_err_t ret = _parse(s_cm108, len, &map);
+        bool keys = len >= CM108_FIRST_INPUT;
+        CHECK((ret == ESP_OK) == keys, "cm108 cut at %zu: %s", len, esp_err_to_name(ret));
+    }
+    for (size_t len = 0; len < sizeof(s_keyboard); len++) {
+        // only the End Collection after the consumer input missing
+        esp_err_t ret = _parse(s_keyboard, len, &map);
+        bool keys = len == sizeof(s_keyboard) - 1;
+        CHECK((ret == ESP_OK) == keys, "keyboard cut at %zu: %s", len, esp_err_to_name(ret));
+    }
+    // a long item claiming more data than there is
+    const uint8_t long_item[] = {0x05, 0x0C, 0xFE, 0xF0, 0x10, 0x01};
+    CHECK(_parse(long_item, sizeof(long_item), &map) == ESP_ERR_NOT_FOUND, "long item past the end");
+}
+
+int main(void)
+{
+    test_variable();
+    test_report_ids();
+    test_report_count();
+    test_report_table_full();
+    test_truncated();
+    if (s_failures) {
+        printf("%d failure(s)\n", s_failures);
+        return 1;
+    }
+    printf("audio_hid: OK\n");
+    return 0;
+}
@@ -0,0 +1,197 @@
+/*
+ * Round-trip latency measurement on a modelled loopback (sim/loopback_sim.h), where the
+ * latency is known: the output buffer ahead of the impulse plus the acoustic delay.
+ *
+ * First audio_latency alone, fed by a sink task, across output buffer settings, then
+ * start_latency_measurement() of usbaudio.cpp with the headset speaker looped back to the
+ * codec microphone: same result, and the codec back in its playback format after stop.
+ */
+#include "usbaudio.h"
+#include "audio_latency.h"
+#include "sim/app_sim.h"
+#include "sim/loopback_sim.h"
+#include "sim/uac_host_sim.h"
+
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+using namespace esphome::usbaudio;
+
+namespace esphome {
+namespace usbaudio {
+void app_main(void);
+
+/* Defined by the ESPHome side of the component, not needed here */
+void USBAudioComponent::setup() {}
+void USBAudioComponent::loop() {}
+void USBAudioComponent::dump_config() {}
+} // namespace usbaudio
+} // namespace esphome
+
+extern "C" const char *__tsan_default_options()
+{
+    return "halt_on_error=1:second_deadlock_stack=1";
+}
+
+#define RATE                    48000
+#define SINK_FRAMES             480
+#define ACOUSTIC_US             3000
+#define INTERVAL_MS             200
+#define RUN_MS                  2500
+/* One bucket on the median, host scheduling on the extremes: a sink write stamped late by up
+ * to a buffer, a capture returning late */
+#define MEDIAN_TOLERANCE_US     1000
+#define EARLY_US                (SINK_FRAMES * 1000000 / RATE + 2000)
+#define LATE_US                 5000
+#define WATCHDOG_S              60
+
+static int s_failures = 0;
+static std::atomic<bool> s_sink_running(false);
+
+#define CHECK(cond, ...) do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+            s_failures++; \
+        } \
+    } while (0)
+
+static esp_err_t _loopback_read(void *audio_buffer, size_t len, size_t *bytes_read, uint32_t timeout_ms)
+{
+    (void)timeout_ms;
+    loopback_sim_capture((int16_t *)audio_buffer, len / (2 * sizeof(int16_t)), 2);
+    *bytes_read = len;
+    return ESP_OK;
+}
+
+/* The player's write path: 10 ms buffers through the probe into the output */
+static void _sink_thread(void)
+{
+    static int16_t buffer[SINK_FRAMES * 2];
+    while (s_sink_running) {
+        for (size_t i = 0; i < SINK_FRAMES * 2; i++) {
+            buffer[i] = (int16_t)(i * 7);
+        }
+        audio_latency_process(buffer, sizeof(buffer), 16, 2, RATE);
+        loopback_sim_play(buffer, SINK_FRAMES, 2);
+    }
+}
+
+static void _print_result(const char *name, const audio_latency_result_t *result)
+{
+    printf("%-16s %5u %5u %5u %8u %8u %8u %8u %8u\n", name, result->sent, result->detected, result->lost,
+           result->min_us, result->mean_us, result->p50_us, result->p95_us, result->max_us);
+}
+
+static void _check_result(const char *name, const audio_latency_result_t *result, uint32_t expected_us)
+{
+    CHECK(result->detected >= 2, "%s: %u impulses detected", name, result->detected);
+    CHECK(result->lost == 0, "%s: %u impulses lost", name, result->lost);
+    CHECK(result->min_us <= result->p50_us && result->p50_us <= result->p95_us && result->p95_us <= result->max_us,
+          "%s: p50 %u us, p95 %u us out of %u - %u us", name, result->p50_us, result->p95_us, result->min_us,
+          result->max_us);
+    CHECK(result->p50_us + MEDIAN_TOLERANCE_US >= expected_us && result->p50_us <= expected_us + MEDIAN_TOLERANCE_US,
+          "%s: median %u us, expected %u us", name, result->p50_us, expected_us);
+    CHECK(result->min_us + EARLY_US >= expected_us && result->max_us <= expected_us + LATE_US,
+          "%s: %u - %u us, expected %u us", name, result->min_us, result->max_us, expected_us);
+}
+
+static void test_buffer_settings(void)
+{
+    const uint32_t buffers_ms[] = {20, 40, 80};
+    printf("%-16s %5s %5s %5s %8s %8s %8s %8s %8s\n", "output buffer", "sent", "det", "lost",
+           "min us", "mean us", "p50 us", "p95 us", "max us");
+    for (uint32_t buffer_ms : buffers_ms) {
+        loopback_sim_config(RATE, buffer_ms, ACOUSTIC_US);
+        audio_latency_reset();
+        const audio_latency_config_t config = {
+            .read_fn = _loopback_read,
+            .capture_rate = RATE,
+            .capture_bits = 16,
+            .capture_channels = 2,
+            .threshold = 0.1f,
+            .interval_ms = INTERVAL_MS,
+            .timeout_ms = 500,
+            .task_priority = 5,
+            .task_core = 1,
+        };
+        s_sink_running = true;
+        std::thread sink(_sink_thread);
+        CHECK(audio_latency_start(&config) == ESP_OK, "start");
+        std::this_thread::sleep_for(std::chrono::milliseconds(RUN_MS));
+        audio_latency_stop();
+        s_sink_running = false;
+        sink.join();
+
+        char name[16];
+        snprintf(name, sizeof(name), "%u ms", buffer_ms);
+        audio_latency_result_t result;
+        audio_latency_get_result(&result);
+        _print_result(name, &result);
+        _check_result(name, &result, buffer_ms * 1000 + ACOUSTIC_US);
+    }
+    loopback_sim_disable();
+}
+
+static void test_headset_to_codec(void)
+{
+    const uint32_t buffer_ms = 40;
+    mkdir(SPIFFS_BASE, 0755);
+    FILE *fp = fopen(SPIFFS_BASE MP3_FILE_NAME, "wb");
+    if (fp == NULL) {
+        CHECK(false, "can't create %s", SPIFFS_BASE MP3_FILE_NAME);
+        return;
+    }
+    fwrite("ID3", 1, 3, fp);
+    fclose(fp);
+
+    app_main();
+    uac_sim_connect(false);
+    for (int i = 0; i < 300 && !is_headset_connected(); i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    CHECK(is_headset_connected(), "headset not connected");
+    uint32_t playback_rate = bsp_sim_codec_rate();
+
+    loopback_sim_config(RATE, buffer_ms, ACOUSTIC_US);
+    audio_latency_reset();
+    CHECK(start_latency_measurement() == ESP_OK, "start_latency_measurement");
+    CHECK(bsp_sim_codec_rate() == RATE, "codec at %u Hz for the capture", bsp_sim_codec_rate());
+    CHECK(start_latency_measurement() == ESP_ERR_INVALID_STATE, "second start_latency_measurement");
+    std::this_thread::sleep_for(std::chrono::milliseconds(RUN_MS));
+    stop_latency_measurement();
+    CHECK(bsp_sim_codec_rate() == playback_rate, "codec left at %u Hz instead of %u Hz", bsp_sim_codec_rate(),
+          playback_rate);
+
+    audio_latency_result_t result;
+    audio_latency_get_result(&result);
+    _print_result("headset 40 ms", &result);
+    // the probe sends one impulse per USBAUDIO_LATENCY_INTERVAL_MS
+    _check_result("headset", &result, buffer_ms * 1000 + ACOUSTIC_US);
+}
+
+int main(void)
+{
+    std::thread([]() {
+        std::this_thread::sleep_for(std::chrono::seconds(WATCHDOG_S));
+        printf("FAIL: no progress after %d s\n", WATCHDOG_S);
+        fflush(stdout);
+        _exit(2);
+    }).detach();
+
+    test_buffer_settings();
+    test_headset_to_codec();
+    fflush(stdout);
+    if (s_failures) {
+        printf("%d failure(s)\n", s_failures);
+        _exit(1);
+    }
+    printf("audio_latency: OK\n");
+    _exit(0);
+}
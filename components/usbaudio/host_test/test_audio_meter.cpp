@@ -0,0 +1,108 @@
+/*
+ * audio_meter on the host: a tone lands in the band labelled with its frequency, and tones
+ * above the last band, which the decimation folds back onto the bands, stay out of the
+ * spectrum.
+ */
+#include "audio_meter.h"
+
+#include <math.h>
+#include <stdio.h>
+
+using namespace esphome::usbaudio;
+
+static int s_failures = 0;
+
+#define CHECK(cond, ...) do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+            s_failures++; \
+        } \
+    } while (0)
+
+#define RATE            48000
+#define FEED_FRAMES     256
+#define FEED_CALLS      64
+/* Spectrum value of -40 dBFS, 0 - 255 over -90 - 0 dBFS */
+#define ALIAS_MAX       ((uint8_t)(50 * 255 / 90))
+
+static double s_phase = 0;
+
+/* Stereo 16-bit tone at -6 dBFS, then the latest snapshot */
+static bool _tone(uint32_t hz, audio_meter_snapshot_t *snapshot)
+{
+    int16_t buf[FEED_FRAMES * 2];
+    for (int call = 0; call < FEED_CALLS; call++) {
+        for (int i = 0; i < FEED_FRAMES; i++) {
+            buf[i * 2] = buf[i * 2 + 1] = (int16_t)(16384 * sin(s_phase));
+            s_phase += 2 * M_PI * hz / RATE;
+        }
+        audio_meter_feed(buf, FEED_FRAMES, 2);
+    }
+    return audio_meter_read(snapshot);
+}
+
+static int _loudest_band(const audio_meter_snapshot_t *snapshot)
+{
+    int loudest = 0;
+    for (int b = 1; b < AUDIO_METER_BANDS; b++) {
+        loudest = snapshot->spectrum[b] > snapshot->spectrum[loudest] ? b : loudest;
+    }
+    return loudest;
+}
+
+static void test_band_edges(void)
+{
+    CHECK(audio_meter_band_edge_hz(0, 48000) == 94, "first edge %u Hz at 48 kHz", audio_meter_band_edge_hz(0, 48000));
+    CHECK(audio_meter_band_edge_hz(AUDIO_METER_BANDS, 48000) == 4500, "last edge %u Hz at 48 kHz",
+          audio_meter_band_edge_hz(AUDIO_METER_BANDS, 48000));
+    CHECK(audio_meter_band_edge_hz(AUDIO_METER_BANDS, 44100) == 4134, "last edge %u Hz at 44.1 kHz",
+          audio_meter_band_edge_hz(AUDIO_METER_BANDS, 44100));
+    for (int e = 0; e < AUDIO_METER_BANDS; e++) {
+        CHECK(audio_meter_band_edge_hz(e, RATE) < audio_meter_band_edge_hz(e + 1, RATE), "edges %d and %d out of order",
+              e, e + 1);
+    }
+}
+
+static void test_in_band(void)
+{
+    const uint32_t tones[] = {200, 1000, 3000};
+    for (uint32_t hz : tones) {
+        audio_meter_snapshot_t snapshot;
+        CHECK(_tone(hz, &snapshot), "%u Hz: no snapshot", hz);
+        int band = _loudest_band(&snapshot);
+        uint32_t low = audio_meter_band_edge_hz(band, RATE);
+        uint32_t high = audio_meter_band_edge_hz(band + 1, RATE);
+        // a tone on an edge may show in the band below it, the window spreads it over 2 bins
+        CHECK(hz + 100 >= low && hz <= high + 100, "%u Hz loudest in band %d, %u - %u Hz", hz, band, low, high);
+        CHECK(snapshot.spectrum[band] > ALIAS_MAX, "%u Hz: band %d at %u only", hz, band, snapshot.spectrum[band]);
+    }
+}
+
+static void test_above_band(void)
+{
+    // 10 kHz folds onto 2 kHz, 14 kHz onto 2 kHz, 20 kHz onto 4 kHz
+    const uint32_t tones[] = {10000, 14000, 20000};
+    for (uint32_t hz : tones) {
+        audio_meter_snapshot_t snapshot;
+        CHECK(_tone(hz, &snapshot), "%u Hz: no snapshot", hz);
+        int band = _loudest_band(&snapshot);
+        CHECK(snapshot.spectrum[band] <= ALIAS_MAX, "%u Hz folded onto band %d at %u, above -40 dBFS (%u)", hz, band,
+              snapshot.spectrum[band], ALIAS_MAX);
+    }
+}
+
+int main(void)
+{
+    audio_meter_init();
+    test_band_edges();
+    test_in_band();
+    test_above_band();
+    if (s_failures) {
+        printf("%d failure(s)\n", s_failures);
+        return 1;
+    }
+    printf("audio_meter: OK\n");
+    return 0;
+}
@@ -0,0 +1,150 @@
+/*
+ * Trace export: usbaudio.cpp built with trace: true and the scheduler, on the simulation of
+ * sim/. The player writes to the headset, then stops while a clip is due, so that the
+ * scheduler writes to the sink from its own task. The dump of dump_trace() is checked by
+ * check_trace.py: Chrome trace-event JSON, a named track per task, begin/end pairs nested
+ * on each track, decode on the player's track only and sink writes on both writers'.
+ */
+#include "usbaudio.h"
+#include "audio_schedule.h"
+#include "esp_timer.h"
+#include "sim/app_sim.h"
+#include "sim/uac_host_sim.h"
+
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+using namespace esphome::usbaudio;
+
+namespace esphome {
+namespace usbaudio {
+void app_main(void);
+
+/* Defined by the ESPHome side of the component, not needed here */
+void USBAudioComponent::setup() {}
+void USBAudioComponent::loop() {}
+void USBAudioComponent::dump_config() {}
+} // namespace usbaudio
+} // namespace esphome
+
+extern "C" const char *__tsan_default_options()
+{
+    return "halt_on_error=1:second_deadlock_stack=1";
+}
+
+#ifndef CHECK_TRACE_PY
+#define CHECK_TRACE_PY "check_trace.py"
+#endif
+
+#define TRACE_FILE          SPIFFS_BASE "/trace.json"
+#define CLIP_FRAMES         4800
+#define CLIP_DELAY_MS       300
+#define SETTLE_TIMEOUT_MS   3000
+#define WATCHDOG_S          60
+
+static int s_failures = 0;
+static std::atomic<bool> s_clip_done(false);
+
+#define CHECK(cond, ...) do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+            s_failures++; \
+        } \
+    } while (0)
+
+static bool _wait_for(bool (*cond)(void), uint32_t timeout_ms)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (!cond()) {
+        if (std::chrono::steady_clock::now() > deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    return true;
+}
+
+static bool _usb_playing(void)
+{
+    uac_sim_stats_t sim;
+    uac_sim_get_stats(&sim);
+    return sim.writes > 20;
+}
+
+static bool _clip_done(void)
+{
+    return s_clip_done;
+}
+
+int main(void)
+{
+    std::thread([]() {
+        std::this_thread::sleep_for(std::chrono::seconds(WATCHDOG_S));
+        printf("FAIL: no progress after %d s\n", WATCHDOG_S);
+        fflush(stdout);
+        _exit(2);
+    }).detach();
+
+    mkdir(SPIFFS_BASE, 0755);
+    FILE *fp = fopen(SPIFFS_BASE MP3_FILE_NAME, "wb");
+    if (fp == NULL) {
+        printf("FAIL: can't create %s\n", SPIFFS_BASE MP3_FILE_NAME);
+        return 1;
+    }
+    fwrite("ID3", 1, 3, fp);
+    fclose(fp);
+
+    app_main();
+    uac_sim_connect(false);
+    CHECK(_wait_for(_usb_playing, SETTLE_TIMEOUT_MS), "no audio on the headset");
+
+    // the player goes idle, the scheduler keeps the sink running for the clip
+    USBAudioComponent().stop();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    static int16_t pcm[CLIP_FRAMES * 2];
+    const audio_clip_t clip = {
+        .pcm = pcm,
+        .frames = CLIP_FRAMES,
+        .channels = 2,
+        .sample_rate = 48000,
+        .done_cb = [](void *arg) {
+            (void)arg;
+            s_clip_done = true;
+        },
+        .done_arg = NULL,
+    };
+    audio_schedule_id_t id;
+    CHECK(audio_schedule_clip_at_time(&clip, esp_timer_get_time() + CLIP_DELAY_MS * 1000, &id) == ESP_OK,
+          "clip not scheduled");
+    CHECK(_wait_for(_clip_done, SETTLE_TIMEOUT_MS), "clip not played");
+    audio_schedule_stats_t stats;
+    audio_schedule_get_stats(&stats);
+    CHECK(stats.played == 1, "clip played %u, late %u, dropped %u", stats.played, stats.late, stats.dropped);
+
+    fp = fopen(TRACE_FILE, "w");
+    if (fp == NULL) {
+        printf("FAIL: can't create %s\n", TRACE_FILE);
+        return 1;
+    }
+    USBAudioComponent().dump_trace(fp);
+    fclose(fp);
+    fflush(stdout);
+    std::string cmd = "python3 " CHECK_TRACE_PY " " TRACE_FILE;
+    CHECK(system(cmd.c_str()) == 0, "%s", cmd.c_str());
+
+    fflush(stdout);
+    if (s_failures) {
+        printf("%d failure(s)\n", s_failures);
+        _exit(1);
+    }
+    printf("audio_trace: OK\n");
+    _exit(0);
+}
@@ -0,0 +1,420 @@
+/*
+ * Speaker hotplug under stress: usbaudio.cpp as it is, on the simulated UAC driver and
+ * FreeRTOS of sim/, built with ThreadSanitizer. While the player writes, a driver thread
+ * plugs, unplugs, re-announces the headset, injects transfer errors and failing stream
+ * starts, and a control thread changes the volume, seeks, plays, pauses and stops a file
+ * that ends and loops every few hundred ms.
+ *
+ * Checked: no data race (TSan halts on the first one), no driver call on a closed handle
+ * nor a close with a write still in the driver, every open handle closed once the headset
+ * is gone, recovery time bounded, and audio flowing on a plug after the storm, where a seek
+ * lands on its position. Last, a
+ * write stuck in the driver across an unplug: the close waits for it without holding up
+ * uac_lib_task. With the codec as fallback, a volume set on the headset is the codec's
+ * once the headset is gone, and so is the format of a file started on the headset, on an
+ * unplug as on a recovery given up. A 32-bit file on the headset feeds the level meter.
+ */
+#include "usbaudio.h"
+#include "audio_meter.h"
+#include "audio_seek.h"
+#include "audio_volume.h"
+#include "sim/app_sim.h"
+#include "sim/uac_host_sim.h"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+using namespace esphome::usbaudio;
+
+namespace esphome {
+namespace usbaudio {
+void app_main(void);
+
+/* Defined by the ESPHome side of the component, not needed here */
+void USBAudioComponent::setup() {}
+void USBAudioComponent::loop() {}
+void USBAudioComponent::dump_config() {}
+} // namespace usbaudio
+} // namespace esphome
+
+extern "C" const char *__tsan_default_options()
+{
+    return "halt_on_error=1:second_deadlock_stack=1";
+}
+
+#define STRESS_MS               3000
+#define SETTLE_TIMEOUT_MS       3000
+#define MAX_RECOVERY_US         2000000
+#define WATCHDOG_S              60
+#define STALL_MS                1500
+#define CONTROL_LATENCY_US      200000
+#define TRACK_BUFFERS           30          /*!< the file ends after 300 ms during the storm */
+#define FILE_BYTES              4096
+#define INDEX_ENTRIES           60          /*!< one per 984 ms at 48 kHz */
+#define SEEK_POSITION_MS        20000
+
+static int s_failures = 0;
+static std::atomic<bool> s_stress(true);
+
+#define CHECK(cond, ...) do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+            s_failures++; \
+        } \
+    } while (0)
+
+static uint32_t _rand(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+/* Poll until cond holds, false after timeout_ms */
+static bool _wait_for(std::function<bool()> cond, uint32_t timeout_ms)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (!cond()) {
+        if (std::chrono::steady_clock::now() > deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+    return true;
+}
+
+static uint32_t _usb_writes(void)
+{
+    uac_sim_stats_t sim;
+    uac_sim_get_stats(&sim);
+    return sim.writes;
+}
+
+static bool _handles_settled(uint32_t open_expected)
+{
+    uac_sim_stats_t sim;
+    usbaudio_hotplug_stats_t hotplug;
+    uac_sim_get_stats(&sim);
+    get_hotplug_stats(&hotplug);
+    return sim.open_handles == open_expected && hotplug.opened_count - hotplug.closed_count == open_expected &&
+           hotplug.opened_count == sim.opens;
+}
+
+static void _driver_thread(void)
+{
+    uint32_t seed = 0x5EED1234;
+    bool plugged = true;
+    while (s_stress) {
+        switch (_rand(&seed) % 8) {
+        case 0:
+        case 1:
+            uac_sim_disconnect();
+            plugged = false;
+            break;
+        case 2:
+        case 3:
+            if (!plugged) {
+                uac_sim_connect(false);
+                plugged = true;
+            }
+            break;
+        case 4:
+            uac_sim_connect_again();
+            break;
+        case 5:
+        case 6:
+            uac_sim_transfer_error();
+            break;
+        default:
+            uac_sim_fail_starts(_rand(&seed) % 12);
+            uac_sim_transfer_error();
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(_rand(&seed) % 20000));
+    }
+}
+
+static void _control_thread(void)
+{
+    uint32_t seed = 0xC0FFEE;
+    USBAudioComponent component;
+    while (s_stress) {
+        switch (_rand(&seed) % 8) {
+        case 0:
+            component.seek(_rand(&seed) % (INDEX_ENTRIES * 900));
+            break;
+        case 1:
+            component.play();
+            break;
+        case 2:
+            component.pause();
+            break;
+        case 3:
+            component.stop();
+            break;
+        default:
+            component.set_volume((float)(_rand(&seed) % 101) / 100.0f);
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(_rand(&seed) % 10000));
+    }
+}
+
+/* The "MP3" file and a seek index of it, as tools/mkseek.py would store it */
+static bool _write_files(void)
+{
+    mkdir(SPIFFS_BASE, 0755);
+    FILE *fp = fopen(SPIFFS_BASE MP3_FILE_NAME, "wb");
+    if (fp == NULL) {
+        return false;
+    }
+    static uint8_t data[FILE_BYTES];
+    memcpy(data, "ID3", 3);
+    fwrite(data, 1, sizeof(data), fp);
+    fclose(fp);
+
+    static uint32_t offsets[INDEX_ENTRIES];
+    audio_seek_index_t index = {};
+    memcpy(index.header.magic, AUDIO_SEEK_MAGIC, sizeof(index.header.magic));
+    index.header.version = AUDIO_SEEK_VERSION;
+    index.header.samples_per_frame = 1152;
+    index.header.sample_rate = 48000;
+    index.header.interval_ms = 1000;
+    index.header.file_size = FILE_BYTES;
+    index.header.frames = INDEX_ENTRIES * 41;
+    index.header.count = INDEX_ENTRIES;
+    for (uint32_t i = 0; i < INDEX_ENTRIES; i++) {
+        offsets[i] = i * (FILE_BYTES / INDEX_ENTRIES);
+    }
+    index.offsets = offsets;
+    return audio_seek_save(SPIFFS_BASE MP3_FILE_NAME AUDIO_SEEK_SUFFIX, &index) == ESP_OK;
+}
+
+/* Played from the position, counted once, the position counters not mixed with the run before */
+static void test_seek(void)
+{
+    usbaudio_seek_stats_t before;
+    get_seek_stats(&before);
+    CHECK(USBAudioComponent().seek(SEEK_POSITION_MS) == ESP_OK, "seek refused");
+    CHECK(_wait_for([]() {
+        uint32_t position_ms = USBAudioComponent().get_position_ms();
+        return position_ms >= SEEK_POSITION_MS && position_ms < SEEK_POSITION_MS + 1000;
+    }, SETTLE_TIMEOUT_MS), "at %u ms after a seek to %u ms", USBAudioComponent().get_position_ms(), SEEK_POSITION_MS);
+    usbaudio_seek_stats_t after;
+    get_seek_stats(&after);
+    CHECK(after.count == before.count + 1 && after.failed == before.failed, "seek counted %u / %u failed",
+          after.count - before.count, after.failed - before.failed);
+    CHECK(after.last_latency_us > 0 && after.last_latency_us < CONTROL_LATENCY_US, "seek latency %u us",
+          after.last_latency_us);
+}
+
+#ifndef USBAUDIO_SINK_USB
+/* bsp_codec_volume_set() value for a volume, on the codec range of usbaudio.cpp */
+static int _codec_percent(uint8_t volume)
+{
+    const audio_volume_range_t range = {
+        .min_db = AUDIO_VOLUME_DB(-50),
+        .max_db = 0,
+        .res_db = AUDIO_VOLUME_DB(50) / 100,
+    };
+    audio_volume_split_t split;
+    audio_volume_split(volume, &range, &split);
+    return (split.hw_db - range.min_db) / range.res_db;
+}
+
+static void test_codec_volume_on_unplug(void)
+{
+    uac_sim_connect(false);
+    uint32_t usb_writes = _usb_writes();
+    CHECK(_wait_for([usb_writes]() {
+        return _handles_settled(1) && _usb_writes() > usb_writes + 10;
+    }, SETTLE_TIMEOUT_MS), "no audio on the headset for the volume check");
+    usbaudio_control_stats_t before;
+    get_control_stats(&before);
+    USBAudioComponent().set_volume(0.2f);
+    CHECK(_wait_for([before]() {
+        usbaudio_control_stats_t now;
+        get_control_stats(&now);
+        return now.transfers > before.transfers;
+    }, SETTLE_TIMEOUT_MS), "volume not sent to the headset");
+    CHECK(bsp_sim_codec_volume() != _codec_percent(20), "codec volume set while the headset plays");
+
+    uac_sim_disconnect();
+    CHECK(_wait_for([]() {
+        return _handles_settled(0) && bsp_sim_codec_volume() == _codec_percent(20);
+    }, SETTLE_TIMEOUT_MS), "codec at %d instead of %d after the unplug", bsp_sim_codec_volume(), _codec_percent(20));
+}
+
+/* Plug, start a file in the format on the headset, the codec still in another one */
+static bool _play_on_headset(uint32_t rate, uint32_t bits, i2s_slot_mode_t ch)
+{
+    uac_sim_connect(false);
+    if (!_wait_for([]() {
+        return _handles_settled(1);
+    }, SETTLE_TIMEOUT_MS)) {
+        return false;
+    }
+    player_sim_set_format(rate, bits, ch);
+    USBAudioComponent().seek(0);
+    uint32_t usb_writes = _usb_writes();
+    return _wait_for([rate, usb_writes]() {
+        uac_host_stream_config_t config;
+        return uac_sim_stream_config(UAC_STREAM_TX, &config) && config.sample_freq == rate &&
+               _usb_writes() > usb_writes + 10;
+    }, SETTLE_TIMEOUT_MS) && bsp_sim_codec_rate() != rate;
+}
+
+static bool _codec_in(uint32_t rate, uint32_t bits, i2s_slot_mode_t ch)
+{
+    return bsp_sim_codec_rate() == rate && bsp_sim_codec_bits() == bits && bsp_sim_codec_ch() == ch;
+}
+
+static void test_codec_format_on_fallback(void)
+{
+    CHECK(_play_on_headset(44100, 32, I2S_SLOT_MODE_MONO), "no 44.1 kHz file on the headset");
+    // 32-bit samples at the sink, the meter gets them narrowed to 16-bit
+    audio_meter_snapshot_t meter;
+    uint32_t meter_frame = audio_meter_read(&meter) ? meter.frame : 0;
+    CHECK(_wait_for([meter_frame]() {
+        audio_meter_snapshot_t now;
+        return audio_meter_read(&now) && now.frame > meter_frame + 2;
+    }, SETTLE_TIMEOUT_MS), "meter not fed while a 32-bit file plays");
+    uac_sim_disconnect();
+    CHECK(_wait_for([]() {
+        return _handles_settled(0) && _codec_in(44100, 32, I2S_SLOT_MODE_MONO);
+    }, SETTLE_TIMEOUT_MS), "codec at %u Hz %u-bit %d ch after the unplug, the file is 44100 Hz 32-bit mono",
+    bsp_sim_codec_rate(), bsp_sim_codec_bits(), (int)bsp_sim_codec_ch());
+
+    // the headset only takes 44.1 and 48 kHz
+    CHECK(_play_on_headset(48000, 16, I2S_SLOT_MODE_STEREO), "no 48 kHz file on the headset");
+    usbaudio_recovery_stats_t before;
+    get_recovery_stats(&before);
+    uac_sim_fail_starts(1000);
+    uac_sim_transfer_error();
+    CHECK(_wait_for([before]() {
+        usbaudio_recovery_stats_t now;
+        get_recovery_stats(&now);
+        return now.failed_count > before.failed_count && _codec_in(48000, 16, I2S_SLOT_MODE_STEREO);
+    }, SETTLE_TIMEOUT_MS), "codec at %u Hz %u-bit %d ch after the recovery gave up, the file is 48000 Hz 16-bit stereo",
+    bsp_sim_codec_rate(), bsp_sim_codec_bits(), (int)bsp_sim_codec_ch());
+    uac_sim_fail_starts(0);
+    uac_sim_disconnect();
+    CHECK(_wait_for([]() {
+        return _handles_settled(0);
+    }, SETTLE_TIMEOUT_MS), "handles still open after the recovery test");
+}
+#endif
+
+int main(void)
+{
+    std::thread([]() {
+        std::this_thread::sleep_for(std::chrono::seconds(WATCHDOG_S));
+        printf("FAIL: no progress after %d s\n", WATCHDOG_S);
+        fflush(stdout);
+        _exit(2);
+    }).detach();
+
+    if (!_write_files()) {
+        printf("FAIL: can't create %s\n", SPIFFS_BASE MP3_FILE_NAME);
+        return 1;
+    }
+
+    app_main();
+    uac_sim_connect(false);
+    CHECK(_wait_for([]() {
+        return _usb_writes() > 10;
+    }, SETTLE_TIMEOUT_MS), "no audio on the headset after the first plug");
+
+    uint32_t writes_before = player_sim_writes();
+    std::thread driver(_driver_thread);
+    player_sim_set_track_buffers(TRACK_BUFFERS);
+    std::thread control(_control_thread);
+    std::this_thread::sleep_for(std::chrono::milliseconds(STRESS_MS));
+    s_stress = false;
+    driver.join();
+    control.join();
+    uac_sim_fail_starts(0);
+    player_sim_set_track_buffers(0);
+    // the storm may have ended on a pause or a stop
+    USBAudioComponent().play();
+    uint32_t stress_writes = player_sim_writes() - writes_before;
+
+    // whatever state the storm left, a fresh plug must play and leave exactly one handle open
+    uac_sim_disconnect();
+    CHECK(_wait_for([]() {
+        return _handles_settled(0);
+    }, SETTLE_TIMEOUT_MS), "handles still open after the unplug");
+    uac_sim_connect(false);
+    uint32_t usb_writes = _usb_writes();
+    CHECK(_wait_for([usb_writes]() {
+        return _usb_writes() > usb_writes + 10;
+    }, SETTLE_TIMEOUT_MS), "no audio on the headset after the storm");
+    CHECK(_wait_for([]() {
+        return _handles_settled(1);
+    }, SETTLE_TIMEOUT_MS), "not exactly one handle open with the headset plugged");
+    test_seek();
+
+    uac_sim_stall_next_write(STALL_MS);
+    CHECK(_wait_for([]() {
+        uac_sim_stats_t sim;
+        uac_sim_get_stats(&sim);
+        return sim.stalls == 1;
+    }, SETTLE_TIMEOUT_MS), "no write reached the stall");
+    auto unplugged = std::chrono::steady_clock::now();
+    uac_sim_disconnect();
+    // past the close timeout, the close is deferred and uac_lib_task back to its events
+    std::this_thread::sleep_until(unplugged + std::chrono::milliseconds(STALL_MS / 2));
+    USBAudioComponent().set_volume(0.5f);
+    CHECK(_wait_for([]() {
+        return _handles_settled(0);
+    }, STALL_MS + SETTLE_TIMEOUT_MS), "handles still open after the last unplug");
+    usbaudio_control_stats_t control_stats;
+    get_control_stats(&control_stats);
+    CHECK(control_stats.last_latency_us < CONTROL_LATENCY_US, "uac_lib_task held up %u us by the stalled write",
+          control_stats.last_latency_us);
+
+#ifndef USBAUDIO_SINK_USB
+    test_codec_volume_on_unplug();
+    test_codec_format_on_fallback();
+#endif
+
+    uac_sim_stats_t sim;
+    usbaudio_hotplug_stats_t hotplug;
+    usbaudio_recovery_stats_t recovery;
+    uac_sim_get_stats(&sim);
+    get_hotplug_stats(&hotplug);
+    get_recovery_stats(&recovery);
+    printf("opens %u, closes %u, starts %u, usb writes %u, player writes during the storm %u\n",
+           sim.opens, sim.closes, sim.starts, sim.writes, stress_writes);
+    printf("faults %u, recovered %u, given up %u, max recovery %u us, dropped events %u\n",
+           recovery.error_count, recovery.recovered_count, recovery.failed_count, recovery.max_recovery_us,
+           hotplug.dropped_events);
+    CHECK(sim.violations == 0, "%u driver API violation(s)", sim.violations);
+    CHECK(sim.opens > 10, "only %u opens, the storm didn't happen", sim.opens);
+    CHECK(recovery.recovered_count > 0, "no recovery ran");
+    CHECK(recovery.max_recovery_us <= MAX_RECOVERY_US, "recovery took %u us", recovery.max_recovery_us);
+    CHECK(stress_writes > 0, "the player stalled during the storm");
+
+    fflush(stdout);
+    if (s_failures) {
+        printf("%d failure(s)\n", s_failures);
+        fflush(stdout);
+        _exit(1);
+    }
+    printf("hotplug stress: OK\n");
+    fflush(stdout);
+    // the component's tasks never return
+    _exit(0);
+}
@@ -0,0 +1,233 @@
+/*
+ * pcm_convert on the host: the optimized paths against the *_ref functions, bit for bit,
+ * then the throughput of both.
+ */
+#include "pcm_convert.h"
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace esphome::usbaudio;
+
+static int s_failures = 0;
+
+#define CHECK(cond, ...) do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+            s_failures++; \
+        } \
+    } while (0)
+
+static const pcm_format_t s_formats[] = {
+    PCM_FORMAT_S16, PCM_FORMAT_S24_PACKED, PCM_FORMAT_S24_IN_32, PCM_FORMAT_S32,
+};
+static const char *const s_format_names[] = {"s16", "s24_packed", "s24_in_32", "s32"};
+
+#define MAX_SAMPLES     200
+#define MAX_BYTES       (MAX_SAMPLES * 4 * 2)
+
+static uint8_t s_src[MAX_BYTES + 16] __attribute__((aligned(16)));
+static uint8_t s_out[MAX_BYTES + 16] __attribute__((aligned(16)));
+static uint8_t s_ref[MAX_BYTES + 16] __attribute__((aligned(16)));
+
+static uint32_t _rand(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+/* Random bytes, with full scale values mixed in */
+static void _fill(uint8_t *p, size_t bytes, uint32_t *seed)
+{
+    for (size_t i = 0; i < bytes; i++) {
+        uint32_t r = _rand(seed);
+        p[i] = (r & 0x700) == 0 ? ((r & 1) ? 0x7F : 0x80) : (uint8_t)r;
+    }
+}
+
+static void test_convert(void)
+{
+    uint32_t seed = 0x12345678;
+    // offsets: the vector path (0), word only (4, 8), byte access (2, 3)
+    const size_t offsets[] = {0, 2, 3, 4, 8};
+    for (pcm_format_t src_format : s_formats) {
+        for (pcm_format_t dst_format : s_formats) {
+            for (size_t off : offsets) {
+                for (size_t samples = 0; samples <= 70; samples++) {
+                    for (int dithered = 0; dithered < 2; dithered++) {
+                        size_t src_bytes = samples * pcm_format_bytes(src_format);
+                        size_t dst_bytes = samples * pcm_format_bytes(dst_format);
+                        _fill(s_src + off, src_bytes, &seed);
+                        memset(s_out, 0xA5, sizeof(s_out));
+                        memset(s_ref, 0xA5, sizeof(s_ref));
+                        pcm_dither_t d_out, d_ref;
+                        pcm_dither_init(&d_out, samples & 1);
+                        pcm_dither_init(&d_ref, samples & 1);
+                        pcm_convert(s_out + off, dst_format, s_src + off, src_format, samples, 2,
+                                    dithered ? &d_out : NULL);
+                        pcm_convert_ref(s_ref + off, dst_format, s_src + off, src_format, samples, 2,
+                                        dithered ? &d_ref : NULL);
+                        CHECK(memcmp(s_out, s_ref, off + dst_bytes + 16) == 0,
+                              "%s -> %s, %zu samples at +%zu%s", s_format_names[src_format],
+                              s_format_names[dst_format], samples, off, dithered ? ", dithered" : "");
+                        CHECK(memcmp(&d_out, &d_ref, sizeof(d_out)) == 0, "dither state %s -> %s",
+                              s_format_names[src_format], s_format_names[dst_format]);
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void test_s24_in_32_normalized(void)
+{
+    const int32_t in[16] __attribute__((aligned(16))) = {
+        0x123456FF, -1, 0x7FFFFFFF, INT32_MIN, 0x000001AB, 0, 0x00000100, -256,
+        0x123456FF, -1, 0x7FFFFFFF, INT32_MIN, 0x000001AB, 0, 0x00000100, 0x55,
+    };
+    int32_t out[16] __attribute__((aligned(16)));
+    pcm_convert(out, PCM_FORMAT_S24_IN_32, in, PCM_FORMAT_S24_IN_32, 16, 2, NULL);
+    for (int i = 0; i < 16; i++) {
+        CHECK(out[i] == (int32_t)((uint32_t)in[i] & 0xFFFFFF00u), "s24_in_32 sample %d: %08x", i, (unsigned)out[i]);
+    }
+}
+
+static void test_channels(void)
+{
+    uint32_t seed = 0xCAFEF00D;
+    const size_t offsets[] = {0, 2, 4, 8};
+    for (pcm_format_t format : s_formats) {
+        size_t bytes = pcm_format_bytes(format);
+        for (size_t off : offsets) {
+            for (size_t frames = 0; frames <= 70; frames++) {
+                _fill(s_src + off, frames * bytes * 2, &seed);
+                // separate buffers
+                pcm_mono_to_stereo(s_out + off, s_src + off, frames, format);
+                pcm_mono_to_stereo_ref(s_ref + off, s_src + off, frames, format);
+                CHECK(memcmp(s_out + off, s_ref + off, frames * bytes * 2) == 0,
+                      "mono_to_stereo %s, %zu frames at +%zu", s_format_names[format], frames, off);
+                // in place
+                memcpy(s_out + off, s_src + off, frames * bytes);
+                pcm_mono_to_stereo(s_out + off, s_out + off, frames, format);
+                CHECK(memcmp(s_out + off, s_ref + off, frames * bytes * 2) == 0,
+                      "mono_to_stereo in place %s, %zu frames at +%zu", s_format_names[format], frames, off);
+
+                pcm_stereo_to_mono(s_out + off, s_src + off, frames, format);
+                pcm_stereo_to_mono_ref(s_ref + off, s_src + off, frames, format);
+                CHECK(memcmp(s_out + off, s_ref + off, frames * bytes) == 0,
+                      "stereo_to_mono %s, %zu frames at +%zu", s_format_names[format], frames, off);
+                memcpy(s_out + off, s_src + off, frames * bytes * 2);
+                pcm_stereo_to_mono(s_out + off, s_out + off, frames, format);
+                CHECK(memcmp(s_out + off, s_ref + off, frames * bytes) == 0,
+                      "stereo_to_mono in place %s, %zu frames at +%zu", s_format_names[format], frames, off);
+            }
+        }
+    }
+}
+
+static void test_gain(void)
+{
+    uint32_t seed = 0x0BADBEEF;
+    const int32_t gains[] = {0, 1, 12345, 23170, 32767, 32768};
+    const size_t offsets[] = {0, 2, 4};
+    for (int32_t gain : gains) {
+        for (size_t off : offsets) {
+            for (size_t samples = 0; samples <= 70; samples++) {
+                _fill(s_src + off, samples * 2, &seed);
+                memcpy(s_out + off, s_src + off, samples * 2);
+                pcm_apply_gain(s_out + off, samples, PCM_FORMAT_S16, gain);
+                for (size_t i = 0; i < samples; i++) {
+                    int16_t in, out;
+                    memcpy(&in, s_src + off + i * 2, 2);
+                    memcpy(&out, s_out + off + i * 2, 2);
+                    CHECK(out == (int16_t)((in * gain) >> 15), "gain %d, sample %zu of %zu at +%zu",
+                          (int)gain, i, samples, off);
+                }
+            }
+        }
+    }
+}
+
+/* ns per sample of fn over a buffer of 4800 samples, best of 5 runs */
+template<typename F>
+static double _ns_per_sample(F fn)
+{
+    const size_t samples = 4800;
+    const int loops = 400;
+    double best = 1e30;
+    for (int run = 0; run < 5; run++) {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < loops; i++) {
+            fn(samples);
+            __asm__ __volatile__("" : : : "memory");
+        }
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        double ns = elapsed.count() / ((double)samples * loops);
+        best = ns < best ? ns : best;
+    }
+    return best;
+}
+
+static void test_throughput(void)
+{
+    static uint8_t src[4800 * 4 * 2] __attribute__((aligned(16)));
+    static uint8_t dst[4800 * 4 * 2] __attribute__((aligned(16)));
+    uint32_t seed = 1;
+    _fill(src, sizeof(src), &seed);
+    struct {
+        const char *name;
+        pcm_format_t src_format;
+        pcm_format_t dst_format;
+    } pairs[] = {
+        {"s16 -> s32", PCM_FORMAT_S16, PCM_FORMAT_S32},
+        {"s32 -> s16", PCM_FORMAT_S32, PCM_FORMAT_S16},
+        {"s16 -> s24_packed", PCM_FORMAT_S16, PCM_FORMAT_S24_PACKED},
+        {"s24_in_32 -> s24_in_32", PCM_FORMAT_S24_IN_32, PCM_FORMAT_S24_IN_32},
+    };
+    printf("%-24s %10s %10s %8s\n", "", "ref ns/s", "opt ns/s", "speedup");
+    for (auto &p : pairs) {
+        double ref = _ns_per_sample([&](size_t n) {
+            pcm_convert_ref(dst, p.dst_format, src, p.src_format, n, 2, NULL);
+        });
+        double opt = _ns_per_sample([&](size_t n) {
+            pcm_convert(dst, p.dst_format, src, p.src_format, n, 2, NULL);
+        });
+        printf("%-24s %10.3f %10.3f %7.1fx\n", p.name, ref, opt, ref / opt);
+        CHECK(opt <= ref, "%s slower than the reference", p.name);
+    }
+    double ref = _ns_per_sample([&](size_t n) {
+        pcm_mono_to_stereo_ref(dst, src, n, PCM_FORMAT_S16);
+    });
+    double opt = _ns_per_sample([&](size_t n) {
+        pcm_mono_to_stereo(dst, src, n, PCM_FORMAT_S16);
+    });
+    printf("%-24s %10.3f %10.3f %7.1fx\n", "mono -> stereo s16", ref, opt, ref / opt);
+    CHECK(opt <= ref, "mono_to_stereo slower than the reference");
+    opt = _ns_per_sample([&](size_t n) {
+        pcm_apply_gain(dst, n, PCM_FORMAT_S16, 23170);
+    });
+    printf("%-24s %10s %10.3f\n", "gain s16", "-", opt);
+}
+
+int main(void)
+{
+    test_convert();
+    test_s24_in_32_normalized();
+    test_channels();
+    test_gain();
+    test_throughput();
+    if (s_failures) {
+        printf("%d failure(s)\n", s_failures);
+        return 1;
+    }
+    printf("pcm_convert: OK\n");
+    return 0;
+}
@@ -0,0 +1,160 @@
+/*
+ * Per-call cost of the sink dispatch, before and after the codegen time sink selection:
+ *
+ *   before:   runtime switch on audio_player_type in the player's write_fn
+ *   usb:      ActiveSink = UsbSink, usb_headset_only build
+ *   fallback: ActiveSink = FallbackSink<UsbSink, I2sSink>, one available() check per call
+ *
+ * The sinks only touch the buffer, so what is measured is the call path the player goes
+ * through for every buffer. On the device, sink_profile: true counts the same per call.
+ *
+ * Checked first: a clock set while the headset plays reaches the codec on the switch.
+ */
+#include "audio_sink.h"
+
+#include <chrono>
+#include <stdio.h>
+
+using namespace esphome::usbaudio;
+
+/* Not constant to the compiler, as the real one is written by uac_lib_task */
+audio_player_t g_player_type = AUDIO_PLAYER_USB;
+static volatile uint32_t s_sink_sum;
+/* Last I2sSink::set_clock() */
+static uint32_t s_i2s_rate;
+static uint32_t s_i2s_bits;
+static i2s_slot_mode_t s_i2s_ch;
+static uint32_t s_i2s_clocks;
+
+__attribute__((noinline)) bool UsbSink::available()
+{
+    return g_player_type == AUDIO_PLAYER_USB;
+}
+
+__attribute__((noinline)) esp_err_t UsbSink::write(void *audio_buffer, size_t len, size_t *bytes_written, uint32_t timeout_ms)
+{
+    (void)timeout_ms;
+    s_sink_sum = s_sink_sum + ((uint8_t *)audio_buffer)[0];
+    *bytes_written = len;
+    return ESP_OK;
+}
+
+__attribute__((noinline)) esp_err_t I2sSink::write(void *audio_buffer, size_t len, size_t *bytes_written, uint32_t timeout_ms)
+{
+    (void)timeout_ms;
+    s_sink_sum = s_sink_sum + ((uint8_t *)audio_buffer)[1];
+    *bytes_written = len;
+    return ESP_OK;
+}
+
+esp_err_t UsbSink::mute(AUDIO_PLAYER_MUTE_SETTING setting)
+{
+    (void)setting;
+    return ESP_OK;
+}
+
+esp_err_t UsbSink::set_clock(uint32_t rate, uint32_t bits_cfg, i2s_slot_mode_t ch)
+{
+    (void)rate;
+    (void)bits_cfg;
+    (void)ch;
+    return ESP_OK;
+}
+
+esp_err_t I2sSink::mute(AUDIO_PLAYER_MUTE_SETTING setting)
+{
+    (void)setting;
+    return ESP_OK;
+}
+
+esp_err_t I2sSink::set_clock(uint32_t rate, uint32_t bits_cfg, i2s_slot_mode_t ch)
+{
+    s_i2s_rate = rate;
+    s_i2s_bits = bits_cfg;
+    s_i2s_ch = ch;
+    s_i2s_clocks++;
+    return ESP_OK;
+}
+
+typedef esp_err_t (*write_fn_t)(void *audio_buffer, size_t len, size_t *bytes_written, uint32_t timeout_ms);
+
+static esp_err_t _write_before(void *audio_buffer, size_t len, size_t *bytes_written, uint32_t timeout_ms)
+{
+    if (g_player_type == AUDIO_PLAYER_I2S) {
+        return I2sSink::write(audio_buffer, len, bytes_written, timeout_ms);
+    }
+    return UsbSink::write(audio_buffer, len, bytes_written, timeout_ms);
+}
+
+static esp_err_t _write_usb(void *audio_buffer, size_t len, size_t *bytes_written, uint32_t timeout_ms)
+{
+    return UsbSink::write(audio_buffer, len, bytes_written, timeout_ms);
+}
+
+static esp_err_t _write_fallback(void *audio_buffer, size_t len, size_t *bytes_written, uint32_t timeout_ms)
+{
+    return FallbackSink<UsbSink, I2sSink>::write(audio_buffer, len, bytes_written, timeout_ms);
+}
+
+/* The codec gets the clock of the file playing on the headset once the headset is gone, once */
+static bool _check_fallback_clock(void)
+{
+    typedef FallbackSink<UsbSink, I2sSink> sink_t;
+    uint8_t buf[4] = {0};
+    size_t written;
+    g_player_type = AUDIO_PLAYER_I2S;
+    sink_t::set_clock(48000, 16, I2S_SLOT_MODE_STEREO);
+    g_player_type = AUDIO_PLAYER_USB;
+    sink_t::set_clock(44100, 32, I2S_SLOT_MODE_MONO);
+    sink_t::write(buf, sizeof(buf), &written, 0);
+    bool ok = s_i2s_clocks == 1 && s_i2s_rate == 48000;
+    g_player_type = AUDIO_PLAYER_I2S;
+    sink_t::write(buf, sizeof(buf), &written, 0);
+    sink_t::write(buf, sizeof(buf), &written, 0);
+    ok = ok && s_i2s_clocks == 2 && s_i2s_rate == 44100 && s_i2s_bits == 32 && s_i2s_ch == I2S_SLOT_MODE_MONO;
+    if (!ok) {
+        printf("FAIL: codec at %u Hz %u-bit %d ch after %u clock(s), expected 44100 Hz 32-bit mono after 2\n",
+               s_i2s_rate, s_i2s_bits, (int)s_i2s_ch, s_i2s_clocks);
+    }
+    g_player_type = AUDIO_PLAYER_USB;
+    return ok;
+}
+
+/* ns per call through a function pointer, as the player calls write_fn, best of 5 runs */
+static double _ns_per_call(write_fn_t volatile fn)
+{
+    const int calls = 20000000;
+    uint8_t buf[4] = {1, 2, 3, 4};
+    double best = 1e30;
+    for (int run = 0; run < 5; run++) {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < calls; i++) {
+            size_t written;
+            fn(buf, sizeof(buf), &written, 0);
+        }
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        double ns = elapsed.count() / calls;
+        best = ns < best ? ns : best;
+    }
+    return best;
+}
+
+int main(void)
+{
+    if (!_check_fallback_clock()) {
+        return 1;
+    }
+    const struct {
+        const char *name;
+        write_fn_t fn;
+    } paths[] = {
+        {"before (runtime switch)", _write_before},
+        {"usb_headset_only", _write_usb},
+        {"with_speaker_fallback", _write_fallback},
+    };
+    printf("%-26s %10s\n", "", "ns/call");
+    for (const auto &p : paths) {
+        printf("%-26s %10.2f\n", p.name, _ns_per_call(p.fn));
+    }
+    return 0;
+}
@@ -0,0 +1,580 @@
+#include "pcm_convert.h"
+
+#include <atomic>
+#include <string.h>
+
+namespace esphome {
+namespace usbaudio {
+
+size_t pcm_format_bytes(pcm_format_t format)
+{
+    switch (format) {
+    case PCM_FORMAT_S16:
+        return 2;
+    case PCM_FORMAT_S24_PACKED:
+        return 3;
+    default:
+        return 4;
+    }
+}
+
+void pcm_dither_init(pcm_dither_t *dither, bool noise_shaping)
+{
+    dither->seed = 0x1234567;
+    dither->noise_shaping = noise_shaping;
+    dither->error[0] = dither->error[1] = 0;
+}
+
+/* Load one sample as left justified 32-bit */
+static inline int32_t _pcm_load(const uint8_t *p, pcm_format_t format)
+{
+    switch (format) {
+    case PCM_FORMAT_S16: {
+        int16_t v;
+        memcpy(&v, p, sizeof(v));
+        return (int32_t)((uint32_t)v << 16);
+    }
+    case PCM_FORMAT_S24_PACKED:
+        return (int32_t)(((uint32_t)p[0] << 8) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 24));
+    case PCM_FORMAT_S24_IN_32: {
+        int32_t v;
+        memcpy(&v, p, sizeof(v));
+        return (int32_t)((uint32_t)v & 0xFFFFFF00u);
+    }
+    default: {
+        int32_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    }
+}
+
+/* Store a left justified 32-bit sample, truncating */
+static inline void _pcm_store(uint8_t *p, pcm_format_t format, int32_t v)
+{
+    switch (format) {
+    case PCM_FORMAT_S16: {
+        int16_t s = (int16_t)(v >> 16);
+        memcpy(p, &s, sizeof(s));
+        break;
+    }
+    case PCM_FORMAT_S24_PACKED:
+        p[0] = (uint8_t)(v >> 8);
+        p[1] = (uint8_t)(v >> 16);
+        p[2] = (uint8_t)(v >> 24);
+        break;
+    case PCM_FORMAT_S24_IN_32: {
+        int32_t s = (int32_t)((uint32_t)v & 0xFFFFFF00u);
+        memcpy(p, &s, sizeof(s));
+        break;
+    }
+    default:
+        memcpy(p, &v, sizeof(v));
+        break;
+    }
+}
+
+static inline uint32_t _pcm_rand(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+/**
+ * @brief Reduce a left justified 32-bit sample to 16 bits with TPDF dither
+ *
+ * The dither is the sum of two uniform values of +/- 0.5 LSB. With noise shaping the
+ * previous quantization error of the channel is subtracted first (first order, pushes
+ * the noise towards high frequencies).
+ */
+static inline int16_t _pcm_dither_s16(int32_t v, pcm_dither_t *dither, int ch)
+{
+    uint32_t r = _pcm_rand(&dither->seed);
+    int64_t x = v;
+    if (dither->noise_shaping) {
+        x -= dither->error[ch];
+    }
+    int64_t noise = (int64_t)(r & 0xFFFF) + (int64_t)(r >> 16) - 0x10000;
+    int64_t q = (x + noise + 0x8000) >> 16;
+    if (q > INT16_MAX) {
+        q = INT16_MAX;
+    } else if (q < INT16_MIN) {
+        q = INT16_MIN;
+    }
+    if (dither->noise_shaping) {
+        int64_t err = (q << 16) - x;
+        // clamp so that a clipped sample cannot wind up the feedback
+        dither->error[ch] = (int32_t)(err > 0x20000 ? 0x20000 : (err < -0x20000 ? -0x20000 : err));
+    }
+    return (int16_t)q;
+}
+
+void pcm_convert_ref(void *dst, pcm_format_t dst_format, const void *src, pcm_format_t src_format,
+                     size_t samples, uint8_t channels, pcm_dither_t *dither)
+{
+    const uint8_t *in = (const uint8_t *)src;
+    uint8_t *out = (uint8_t *)dst;
+    size_t in_step = pcm_format_bytes(src_format);
+    size_t out_step = pcm_format_bytes(dst_format);
+    bool dithered = dither != NULL && dst_format == PCM_FORMAT_S16 && src_format != PCM_FORMAT_S16;
+
+    for (size_t i = 0; i < samples; i++) {
+        int32_t v = _pcm_load(in + i * in_step, src_format);
+        if (dithered) {
+            int16_t s = _pcm_dither_s16(v, dither, channels == 2 ? (int)(i & 1) : 0);
+            memcpy(out + i * out_step, &s, sizeof(s));
+        } else {
+            _pcm_store(out + i * out_step, dst_format, v);
+        }
+    }
+}
+
+void pcm_mono_to_stereo_ref(void *dst, const void *src, size_t frames, pcm_format_t format)
+{
+    size_t bytes = pcm_format_bytes(format);
+    const uint8_t *in = (const uint8_t *)src;
+    uint8_t *out = (uint8_t *)dst;
+    // backwards so that dst may alias src
+    for (size_t i = frames; i-- > 0;) {
+        uint8_t sample[4];
+        memcpy(sample, in + i * bytes, bytes);
+        memcpy(out + (2 * i) * bytes, sample, bytes);
+        memcpy(out + (2 * i + 1) * bytes, sample, bytes);
+    }
+}
+
+void pcm_stereo_to_mono_ref(void *dst, const void *src, size_t frames, pcm_format_t format)
+{
+    size_t bytes = pcm_format_bytes(format);
+    const uint8_t *in = (const uint8_t *)src;
+    uint8_t *out = (uint8_t *)dst;
+    for (size_t i = 0; i < frames; i++) {
+        int64_t l = _pcm_load(in + (2 * i) * bytes, format);
+        int64_t r = _pcm_load(in + (2 * i + 1) * bytes, format);
+        _pcm_store(out + i * bytes, format, (int32_t)((l + r) >> 1));
+    }
+}
+
+/*
+ * Optimized kernels
+ *
+ * The hot pairs work on whole 32-bit words (two 16-bit samples per load/store) and are
+ * unrolled by four, everything else falls back to the reference. Results are bit-exact
+ * with the *_ref functions. Word access requires 4-byte aligned buffers, unaligned
+ * buffers take the reference path.
+ */
+static inline bool _aligned4(const void *p)
+{
+    return ((uintptr_t)p & 3) == 0;
+}
+
+static void _pcm_s16_to_s32(int32_t *dst, const int16_t *src, size_t samples)
+{
+    size_t i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        dst[i] = (int32_t)((uint32_t)src[i] << 16);
+        dst[i + 1] = (int32_t)((uint32_t)src[i + 1] << 16);
+        dst[i + 2] = (int32_t)((uint32_t)src[i + 2] << 16);
+        dst[i + 3] = (int32_t)((uint32_t)src[i + 3] << 16);
+    }
+    for (; i < samples; i++) {
+        dst[i] = (int32_t)((uint32_t)src[i] << 16);
+    }
+}
+
+static void _pcm_s32_to_s16(int16_t *dst, const int32_t *src, size_t samples)
+{
+    size_t i = 0;
+    uint32_t *out = (uint32_t *)dst;
+    for (; i + 4 <= samples; i += 4) {
+        out[i / 2] = ((uint32_t)src[i] >> 16) | ((uint32_t)src[i + 1] & 0xFFFF0000u);
+        out[i / 2 + 1] = ((uint32_t)src[i + 2] >> 16) | ((uint32_t)src[i + 3] & 0xFFFF0000u);
+    }
+    for (; i < samples; i++) {
+        dst[i] = (int16_t)(src[i] >> 16);
+    }
+}
+
+static void _pcm_s16_to_s24_packed(uint8_t *dst, const int16_t *src, size_t samples)
+{
+    size_t i = 0;
+    // four samples make three words, bytes: 00 L0 H0 00 | L1 H1 00 L2 | H2 00 L3 H3
+    uint32_t *out = (uint32_t *)dst;
+    const uint32_t *in = (const uint32_t *)src;
+    for (; i + 4 <= samples; i += 4) {
+        uint32_t a = in[i / 2];
+        uint32_t b = in[i / 2 + 1];
+        out[i / 4 * 3] = (a & 0xFFFF) << 8;
+        out[i / 4 * 3 + 1] = (a >> 16) | (b & 0xFF) << 24;
+        out[i / 4 * 3 + 2] = ((b >> 8) & 0xFF) | (b & 0xFFFF0000u);
+    }
+    for (; i < samples; i++) {
+        _pcm_store(dst + i * 3, PCM_FORMAT_S24_PACKED, (int32_t)((uint32_t)src[i] << 16));
+    }
+}
+
+/*
+ * Vector kernels
+ *
+ * 16 bytes per step, eight 16-bit or four 32-bit samples. On the ESP32-S3 they use the PIE
+ * 128-bit registers, on a host GCC vector extensions (SSE / NEON), elsewhere there are
+ * none. Buffers must be 16-byte aligned, the tail and other buffers take the word kernels.
+ * The PIE kernels are checked against the reference on first use and left unused if any
+ * of them doesn't match.
+ */
+#define PCM_VEC_SAMPLES16   8       /*!< 16-bit samples per step */
+
+static inline bool _aligned16(const void *p)
+{
+    return ((uintptr_t)p & 15) == 0;
+}
+
+#if CONFIG_IDF_TARGET_ESP32S3
+#define PCM_VEC 1
+#define PCM_VEC_CHECKED 1
+
+static const uint32_t s_s24_mask[4] __attribute__((aligned(16))) = {
+    0xFFFFFF00u, 0xFFFFFF00u, 0xFFFFFF00u, 0xFFFFFF00u,
+};
+
+static void _pcm_vec_s16_to_s32(int32_t *dst, const int16_t *src, size_t steps)
+{
+    for (size_t i = 0; i < steps; i++) {
+        // zip with zero: each sample in the upper half of a word
+        asm volatile(
+            "ee.vld.128.ip q0, %1, 16\n"
+            "ee.zero.q q1\n"
+            "ee.vzip.16 q1, q0\n"
+            "ee.vst.128.ip q1, %0, 16\n"
+            "ee.vst.128.ip q0, %0, 16\n"
+            : "+r"(dst), "+r"(src) : : "memory");
+    }
+}
+
+static void _pcm_vec_s32_to_s16(int16_t *dst, const int32_t *src, size_t steps)
+{
+    for (size_t i = 0; i < steps; i++) {
+        // unzip: the upper halves end up in q1
+        asm volatile(
+            "ee.vld.128.ip q0, %1, 16\n"
+            "ee.vld.128.ip q1, %1, 16\n"
+            "ee.vunzip.16 q0, q1\n"
+            "ee.vst.128.ip q1, %0, 16\n"
+            : "+r"(dst), "+r"(src) : : "memory");
+    }
+}
+
+static void _pcm_vec_s24_in_32(int32_t *dst, const int32_t *src, size_t steps)
+{
+    const uint32_t *mask = s_s24_mask;
+    asm volatile("ee.vld.128.ip q2, %0, 0\n" : : "r"(mask) : "memory");
+    for (size_t i = 0; i < steps * 2; i++) {
+        asm volatile(
+            "ee.vld.128.ip q0, %1, 16\n"
+            "ee.andq q0, q0, q2\n"
+            "ee.vst.128.ip q0, %0, 16\n"
+            : "+r"(dst), "+r"(src) : : "memory");
+    }
+}
+
+/* Backwards, dst may alias src */
+static void _pcm_vec_mono_to_stereo(int16_t *dst, const int16_t *src, size_t steps)
+{
+    for (size_t i = steps; i-- > 0;) {
+        const int16_t *in = src + i * PCM_VEC_SAMPLES16;
+        int16_t *out = dst + i * PCM_VEC_SAMPLES16 * 2;
+        asm volatile(
+            "ee.vld.128.ip q0, %1, 0\n"
+            "ee.orq q1, q0, q0\n"
+            "ee.vzip.16 q0, q1\n"
+            "ee.vst.128.ip q0, %0, 16\n"
+            "ee.vst.128.ip q1, %0, 16\n"
+            : "+r"(out), "+r"(in) : : "memory");
+    }
+}
+
+/* gain_q15 < 32768, it must fit a 16-bit lane */
+static void _pcm_vec_gain_s16(int16_t *buf, size_t steps, int32_t gain_q15)
+{
+    int16_t gain = (int16_t)gain_q15;
+    for (size_t i = 0; i < steps; i++) {
+        // SAR is also used by compiled shifts, set it with the multiply
+        asm volatile(
+            "ssai 15\n"
+            "ee.vldbc.16 q1, %1\n"
+            "ee.vld.128.ip q0, %0, 0\n"
+            "ee.vmul.s16 q2, q0, q1\n"
+            "ee.vst.128.ip q2, %0, 16\n"
+            : "+r"(buf) : "r"(&gain) : "memory", "sar");
+    }
+}
+#elif defined(__SSE2__) || defined(__ARM_NEON)
+#define PCM_VEC 1
+
+typedef int16_t pcm_v8s16_t __attribute__((vector_size(16)));
+typedef int32_t pcm_v4s32_t __attribute__((vector_size(16)));
+typedef int32_t pcm_v8s32_t __attribute__((vector_size(32)));
+
+static void _pcm_vec_s16_to_s32(int32_t *dst, const int16_t *src, size_t steps)
+{
+    const pcm_v8s16_t zero = {0};
+    for (size_t i = 0; i < steps; i++) {
+        pcm_v8s16_t v;
+        memcpy(&v, src + i * 8, sizeof(v));
+        pcm_v8s16_t lo = __builtin_shuffle(zero, v, (pcm_v8s16_t){0, 8, 1, 9, 2, 10, 3, 11});
+        pcm_v8s16_t hi = __builtin_shuffle(zero, v, (pcm_v8s16_t){4, 12, 5, 13, 6, 14, 7, 15});
+        memcpy(dst + i * 8, &lo, sizeof(lo));
+        memcpy(dst + i * 8 + 4, &hi, sizeof(hi));
+    }
+}
+
+static void _pcm_vec_s32_to_s16(int16_t *dst, const int32_t *src, size_t steps)
+{
+    for (size_t i = 0; i < steps; i++) {
+        pcm_v8s16_t a, b;
+        memcpy(&a, src + i * 8, sizeof(a));
+        memcpy(&b, src + i * 8 + 4, sizeof(b));
+        pcm_v8s16_t v = __builtin_shuffle(a, b, (pcm_v8s16_t){1, 3, 5, 7, 9, 11, 13, 15});
+        memcpy(dst + i * 8, &v, sizeof(v));
+    }
+}
+
+static void _pcm_vec_s24_in_32(int32_t *dst, const int32_t *src, size_t steps)
+{
+    const pcm_v4s32_t mask = (pcm_v4s32_t){0, 0, 0, 0} + (int32_t)0xFFFFFF00u;
+    for (size_t i = 0; i < steps * 2; i++) {
+        pcm_v4s32_t v;
+        memcpy(&v, src + i * 4, sizeof(v));
+        v &= mask;
+        memcpy(dst + i * 4, &v, sizeof(v));
+    }
+}
+
+/* Backwards, dst may alias src */
+static void _pcm_vec_mono_to_stereo(int16_t *dst, const int16_t *src, size_t steps)
+{
+    for (size_t i = steps; i-- > 0;) {
+        pcm_v8s16_t v;
+        memcpy(&v, src + i * 8, sizeof(v));
+        pcm_v8s16_t lo = __builtin_shuffle(v, (pcm_v8s16_t){0, 0, 1, 1, 2, 2, 3, 3});
+        pcm_v8s16_t hi = __builtin_shuffle(v, (pcm_v8s16_t){4, 4, 5, 5, 6, 6, 7, 7});
+        memcpy(dst + i * 16, &lo, sizeof(lo));
+        memcpy(dst + i * 16 + 8, &hi, sizeof(hi));
+    }
+}
+
+/* gain_q15 < 32768, same contract as the PIE kernel */
+static void _pcm_vec_gain_s16(int16_t *buf, size_t steps, int32_t gain_q15)
+{
+    for (size_t i = 0; i < steps; i++) {
+        pcm_v8s16_t v;
+        memcpy(&v, buf + i * 8, sizeof(v));
+        pcm_v8s32_t x = __builtin_convertvector(v, pcm_v8s32_t);
+        v = __builtin_convertvector((x * gain_q15) >> 15, pcm_v8s16_t);
+        memcpy(buf + i * 8, &v, sizeof(v));
+    }
+}
+#endif
+
+#ifdef PCM_VEC
+#ifdef PCM_VEC_CHECKED
+/* -1: not checked yet, 0: a kernel is wrong, 1: all kernels match the reference */
+static std::atomic<int8_t> s_vec_state(-1);
+
+static bool _pcm_vec_check(void)
+{
+    static int16_t s16[32] __attribute__((aligned(16)));
+    static int32_t s32[32] __attribute__((aligned(16)));
+    static int32_t out32[32] __attribute__((aligned(16)));
+    static int16_t out16[64] __attribute__((aligned(16)));
+    static uint8_t ref[128];
+    uint32_t seed = 0x2545F491;
+    for (int i = 0; i < 32; i++) {
+        s16[i] = (int16_t)_pcm_rand(&seed);
+        s32[i] = (int32_t)_pcm_rand(&seed);
+    }
+    _pcm_vec_s16_to_s32(out32, s16, 4);
+    pcm_convert_ref(ref, PCM_FORMAT_S32, s16, PCM_FORMAT_S16, 32, 2, NULL);
+    bool ok = memcmp(out32, ref, sizeof(out32)) == 0;
+    _pcm_vec_s32_to_s16(out16, s32, 4);
+    pcm_convert_ref(ref, PCM_FORMAT_S16, s32, PCM_FORMAT_S32, 32, 2, NULL);
+    ok = ok && memcmp(out16, ref, 32 * sizeof(int16_t)) == 0;
+    _pcm_vec_s24_in_32(out32, s32, 4);
+    pcm_convert_ref(ref, PCM_FORMAT_S24_IN_32, s32, PCM_FORMAT_S24_IN_32, 32, 2, NULL);
+    ok = ok && memcmp(out32, ref, sizeof(out32)) == 0;
+    _pcm_vec_mono_to_stereo(out16, s16, 4);
+    pcm_mono_to_stereo_ref(ref, s16, 32, PCM_FORMAT_S16);
+    ok = ok && memcmp(out16, ref, 64 * sizeof(int16_t)) == 0;
+    memcpy(out16, s16, sizeof(s16));
+    _pcm_vec_gain_s16(out16, 4, 23170);
+    for (int i = 0; i < 32 && ok; i++) {
+        ok = out16[i] == (int16_t)((s16[i] * 23170) >> 15);
+    }
+    return ok;
+}
+#endif
+
+static inline bool _pcm_vec_enabled(void)
+{
+#ifdef PCM_VEC_CHECKED
+    int8_t state = s_vec_state.load(std::memory_order_relaxed);
+    if (state < 0) {
+        // two callers may both check, they store the same result
+        state = _pcm_vec_check() ? 1 : 0;
+        s_vec_state.store(state, std::memory_order_relaxed);
+    }
+    return state == 1;
+#else
+    return true;
+#endif
+}
+
+/**
+ * @brief Convert the leading whole steps with the vector kernels
+ *
+ * @return samples converted, the caller converts the rest
+ */
+static size_t _pcm_vec_convert(void *dst, pcm_format_t dst_format, const void *src, pcm_format_t src_format,
+                               size_t samples, const pcm_dither_t *dither)
+{
+    size_t steps = samples / PCM_VEC_SAMPLES16;
+    if (steps == 0 || !_aligned16(dst) || !_aligned16(src) || !_pcm_vec_enabled()) {
+        return 0;
+    }
+    if (src_format == PCM_FORMAT_S16 && (dst_format == PCM_FORMAT_S32 || dst_format == PCM_FORMAT_S24_IN_32)) {
+        _pcm_vec_s16_to_s32((int32_t *)dst, (const int16_t *)src, steps);
+    } else if (dither == NULL && dst_format == PCM_FORMAT_S16 &&
+               (src_format == PCM_FORMAT_S32 || src_format == PCM_FORMAT_S24_IN_32)) {
+        _pcm_vec_s32_to_s16((int16_t *)dst, (const int32_t *)src, steps);
+    } else if (dst_format == PCM_FORMAT_S24_IN_32 && (src_format == PCM_FORMAT_S32 || src_format == PCM_FORMAT_S24_IN_32)) {
+        _pcm_vec_s24_in_32((int32_t *)dst, (const int32_t *)src, steps);
+    } else {
+        return 0;
+    }
+    return steps * PCM_VEC_SAMPLES16;
+}
+#endif
+
+void pcm_convert(void *dst, pcm_format_t dst_format, const void *src, pcm_format_t src_format,
+                 size_t samples, uint8_t channels, pcm_dither_t *dither)
+{
+    if (src_format == dst_format && src_format != PCM_FORMAT_S24_IN_32) {
+        memcpy(dst, src, samples * pcm_format_bytes(src_format));
+        return;
+    }
+#ifdef PCM_VEC
+    size_t done = _pcm_vec_convert(dst, dst_format, src, src_format, samples, dither);
+    if (done > 0) {
+        // the rest keeps the word alignment, the dither state is untouched by the vector kernels
+        dst = (uint8_t *)dst + done * pcm_format_bytes(dst_format);
+        src = (const uint8_t *)src + done * pcm_format_bytes(src_format);
+        samples -= done;
+    }
+#endif
+    if (_aligned4(dst) && _aligned4(src)) {
+        if (src_format == PCM_FORMAT_S16 && (dst_format == PCM_FORMAT_S32 || dst_format == PCM_FORMAT_S24_IN_32)) {
+            _pcm_s16_to_s32((int32_t *)dst, (const int16_t *)src, samples);
+            return;
+        }
+        if (src_format == PCM_FORMAT_S16 && dst_format == PCM_FORMAT_S24_PACKED) {
+            _pcm_s16_to_s24_packed((uint8_t *)dst, (const int16_t *)src, samples);
+            return;
+        }
+        if (dither == NULL && dst_format == PCM_FORMAT_S16 &&
+                (src_format == PCM_FORMAT_S32 || src_format == PCM_FORMAT_S24_IN_32)) {
+            _pcm_s32_to_s16((int16_t *)dst, (const int32_t *)src, samples);
+            return;
+        }
+    }
+    pcm_convert_ref(dst, dst_format, src, src_format, samples, channels, dither);
+}
+
+void pcm_mono_to_stereo(void *dst, const void *src, size_t frames, pcm_format_t format)
+{
+    if (format != PCM_FORMAT_S16 || !_aligned4(dst)) {
+        pcm_mono_to_stereo_ref(dst, src, frames, format);
+        return;
+    }
+    const uint16_t *in = (const uint16_t *)src;
+    uint32_t *out = (uint32_t *)dst;
+    // backwards so that dst may alias src, one word store per output frame
+    size_t i = frames;
+    size_t vec_frames = 0;
+#ifdef PCM_VEC
+    if (_aligned16(dst) && _aligned16(src) && _pcm_vec_enabled()) {
+        vec_frames = frames / PCM_VEC_SAMPLES16 * PCM_VEC_SAMPLES16;
+    }
+    // the tail first, the vector steps then work down from where it starts
+    for (; i > vec_frames; i--) {
+        uint32_t s = in[i - 1];
+        out[i - 1] = s | s << 16;
+    }
+    if (vec_frames > 0) {
+        _pcm_vec_mono_to_stereo((int16_t *)dst, (const int16_t *)src, vec_frames / PCM_VEC_SAMPLES16);
+        return;
+    }
+#endif
+    for (; i >= 4; i -= 4) {
+        uint32_t s3 = in[i - 1], s2 = in[i - 2], s1 = in[i - 3], s0 = in[i - 4];
+        out[i - 1] = s3 | s3 << 16;
+        out[i - 2] = s2 | s2 << 16;
+        out[i - 3] = s1 | s1 << 16;
+        out[i - 4] = s0 | s0 << 16;
+    }
+    for (; i > 0; i--) {
+        uint32_t s = in[i - 1];
+        out[i - 1] = s | s << 16;
+    }
+}
+
+void pcm_stereo_to_mono(void *dst, const void *src, size_t frames, pcm_format_t format)
+{
+    if (format != PCM_FORMAT_S16 || !_aligned4(src)) {
+        pcm_stereo_to_mono_ref(dst, src, frames, format);
+        return;
+    }
+    const uint32_t *in = (const uint32_t *)src;
+    int16_t *out = (int16_t *)dst;
+    size_t i = 0;
+    for (; i + 4 <= frames; i += 4) {
+        for (int k = 0; k < 4; k++) {
+            uint32_t w = in[i + k];
+            out[i + k] = (int16_t)(((int32_t)(int16_t)w + (int32_t)(int16_t)(w >> 16)) >> 1);
+        }
+    }
+    for (; i < frames; i++) {
+        uint32_t w = in[i];
+        out[i] = (int16_t)(((int32_t)(int16_t)w + (int32_t)(int16_t)(w >> 16)) >> 1);
+    }
+}
+
+void pcm_apply_gain(void *buf, size_t samples, pcm_format_t format, int32_t gain_q15)
+{
+    if (format == PCM_FORMAT_S16) {
+        // gain <= unity, the product can't overflow
+        int16_t *p = (int16_t *)buf;
+        size_t i = 0;
+#ifdef PCM_VEC
+        if (gain_q15 < 32768 && _aligned16(buf) && _pcm_vec_enabled()) {
+            i = samples / PCM_VEC_SAMPLES16 * PCM_VEC_SAMPLES16;
+            _pcm_vec_gain_s16(p, i / PCM_VEC_SAMPLES16, gain_q15);
+        }
+#endif
+        for (; i < samples; i++) {
+            p[i] = (int16_t)((p[i] * gain_q15) >> 15);
+        }
+        return;
+    }
+    const size_t bytes = pcm_format_bytes(format);
+    uint8_t *p = (uint8_t *)buf;
+    for (size_t i = 0; i < samples; i++, p += bytes) {
+        _pcm_store(p, format, (int32_t)(((int64_t)_pcm_load(p, format) * gain_q15) >> 15));
+    }
+}
+
+} // namespace usbaudio
+} // namespace esphome
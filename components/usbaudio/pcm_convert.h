@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace esphome {
+namespace usbaudio {
+
+/**
+ * @brief Sample container formats
+ *
+ * Packed 24-bit is 3 bytes little endian per sample (USB audio subslot size 3),
+ * unpacked 24-bit is left justified in 32 bits (subslot size 4, I2S).
+ */
+enum pcm_format_t {
+    PCM_FORMAT_S16 = 0,
+    PCM_FORMAT_S24_PACKED,
+    PCM_FORMAT_S24_IN_32,
+    PCM_FORMAT_S32,
+};
+
+/**
+ * @brief Dither state for bit-depth reduction, one per stream
+ */
+struct pcm_dither_t {
+    uint32_t seed;              /*!< TPDF noise generator state, must not be 0 */
+    bool noise_shaping;         /*!< first order error feedback */
+    int32_t error[2];           /*!< per channel quantization error, for noise shaping */
+};
+
+size_t pcm_format_bytes(pcm_format_t format);
+
+/**
+ * @brief Initialize the dither state
+ */
+void pcm_dither_init(pcm_dither_t *dither, bool noise_shaping);
+
+/**
+ * @brief Convert interleaved samples between formats, channel count is unchanged
+ *
+ * Widening is bit-exact. Narrowing to 16-bit applies TPDF dither when dither is not NULL
+ * and truncates otherwise. Narrowing to 24-bit truncates. PCM_FORMAT_S24_IN_32 output
+ * always has its low byte cleared, also from PCM_FORMAT_S24_IN_32 input.
+ *
+ * 16-byte aligned buffers take the vector kernels where the target has them.
+ *
+ * @param dst: destination buffer, samples * pcm_format_bytes(dst_format) bytes, must not overlap src
+ * @param dst_format: destination format
+ * @param src: source buffer
+ * @param src_format: source format
+ * @param samples: number of samples (frames * channels)
+ * @param channels: channel count, used to keep per channel noise shaping state
+ * @param dither: dither state, NULL to truncate
+ */
+void pcm_convert(void *dst, pcm_format_t dst_format, const void *src, pcm_format_t src_format,
+                 size_t samples, uint8_t channels, pcm_dither_t *dither);
+
+/**
+ * @brief Duplicate a mono channel to interleaved stereo
+ *
+ * dst may alias src, the expansion is then done in place.
+ */
+void pcm_mono_to_stereo(void *dst, const void *src, size_t frames, pcm_format_t format);
+
+/**
+ * @brief Average interleaved stereo to mono, dst may alias src
+ */
+void pcm_stereo_to_mono(void *dst, const void *src, size_t frames, pcm_format_t format);
+
+/**
+ * @brief Scale interleaved samples in place
+ *
+ * @param gain_q15: linear gain, 0 - 32768 (unity)
+ */
+void pcm_apply_gain(void *buf, size_t samples, pcm_format_t format, int32_t gain_q15);
+
+/**
+ * @brief Scalar reference implementations, the optimized kernels must match them bit for bit
+ */
+void pcm_convert_ref(void *dst, pcm_format_t dst_format, const void *src, pcm_format_t src_format,
+                     size_t samples, uint8_t channels, pcm_dither_t *dither);
+void pcm_mono_to_stereo_ref(void *dst, const void *src, size_t frames, pcm_format_t format);
+void pcm_stereo_to_mono_ref(void *dst, const void *src, size_t frames, pcm_format_t format);
+
+} // namespace usbaudio
+} // namespace esphome
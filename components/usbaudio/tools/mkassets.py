@@ -0,0 +1,191 @@
+#!/usr/bin/env python3
+"""Build an audio asset image for the usbaudio asset partition.
+
+Each clip is a 16-bit PCM WAV file, stored as is or encoded to IMA ADPCM:
+
+    mkassets.py -o assets.bin chime=chime.wav prompt=prompt.wav:adpcm
+
+The image is flashed to a data partition, e.g. with an entry
+``assets, data, 0x40, , 1M`` in partitions.csv:
+
+    parttool.py write_partition --partition-name assets --input assets.bin
+
+The layout must match audio_assets.h.
+"""
+
+import argparse
+import struct
+import sys
+import wave
+
+MAGIC = b"UAAS"
+VERSION = 1
+ALIGN = 4
+NAME_LEN = 24
+HEADER = struct.Struct("<4sHHII")
+ENTRY = struct.Struct("<%dsIIIIBBH" % NAME_LEN)
+
+CODEC_PCM16 = 0
+CODEC_IMA_ADPCM = 1
+
+IMA_STEP = [
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+    253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+    1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+    3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487,
+    12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767,
+]
+IMA_INDEX = [-1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8]
+
+
+class ImaEncoder:
+    """IMA ADPCM encoder state for one channel, mirrors _ima_decode on the device"""
+
+    def __init__(self, predictor=0, index=0):
+        self.predictor = predictor
+        self.index = index
+
+    def encode(self, sample):
+        step = IMA_STEP[self.index]
+        diff = sample - self.predictor
+        nibble = 0
+        if diff < 0:
+            nibble = 8
+            diff = -diff
+        if diff >= step:
+            nibble |= 4
+            diff -= step
+        if diff >= step >> 1:
+            nibble |= 2
+            diff -= step >> 1
+        if diff >= step >> 2:
+            nibble |= 1
+        # track the decoder so that errors don't accumulate
+        self.decode(nibble)
+        return nibble
+
+    def decode(self, nibble):
+        step = IMA_STEP[self.index]
+        diff = step >> 3
+        if nibble & 4:
+            diff += step
+        if nibble & 2:
+            diff += step >> 1
+        if nibble & 1:
+            diff += step >> 2
+        self.predictor += -diff if nibble & 8 else diff
+        self.predictor = max(-32768, min(32767, self.predictor))
+        self.index = max(0, min(88, self.index + IMA_INDEX[nibble]))
+
+
+def initial_index(diff):
+    """Step index closest to the first sample difference, rather than adapting up from the smallest step"""
+    return min(range(len(IMA_STEP)), key=lambda i: abs(IMA_STEP[i] - abs(diff)))
+
+
+def encode_ima_adpcm(samples, channels, block_align):
+    """Encode interleaved samples in the WAV IMA ADPCM block layout"""
+    header = 4 * channels
+    block_frames = (block_align - header) * 2 // channels + 1
+    frames = len(samples) // channels
+    encoders = [ImaEncoder(index=initial_index(samples[channels + c] - samples[c]) if frames > 1 else 0)
+                for c in range(channels)]
+    out = bytearray()
+    for start in range(0, frames, block_frames):
+        count = min(block_frames, frames - start)
+        for c, enc in enumerate(encoders):
+            enc.predictor = samples[start * channels + c]
+            out += struct.pack("<hBB", enc.predictor, enc.index, 0)
+        # groups of 8 samples per channel, 4 bytes each, low nibble first
+        for group in range(1, count, 8):
+            for c, enc in enumerate(encoders):
+                nibbles = []
+                for k in range(8):
+                    f = start + group + k
+                    nibbles.append(enc.encode(samples[f * channels + c]) if group + k < count else 0)
+                out += bytes(nibbles[i] | nibbles[i + 1] << 4 for i in range(0, 8, 2))
+    return bytes(out)
+
+
+def read_wav(path):
+    with wave.open(path, "rb") as wav:
+        if wav.getsampwidth() != 2:
+            raise ValueError(f"{path}: only 16-bit PCM WAV is supported")
+        if wav.getnchannels() not in (1, 2):
+            raise ValueError(f"{path}: only mono or stereo is supported")
+        frames = wav.getnframes()
+        data = wav.readframes(frames)
+        samples = list(struct.unpack("<%dh" % (len(data) // 2), data))
+        return samples, wav.getnchannels(), wav.getframerate()
+
+
+def build_image(clips, block_align):
+    """clips: list of (name, path, adpcm)"""
+    index_offset = HEADER.size
+    offset = index_offset + ENTRY.size * len(clips)
+    entries = []
+    payloads = []
+    for name, path, adpcm in clips:
+        encoded = name.encode()
+        if len(encoded) >= NAME_LEN:
+            raise ValueError(f"clip name '{name}' is longer than {NAME_LEN - 1} bytes")
+        samples, channels, rate = read_wav(path)
+        frames = len(samples) // channels
+        if adpcm:
+            align = block_align * channels
+            payload = encode_ima_adpcm(samples, channels, align)
+            codec = CODEC_IMA_ADPCM
+        else:
+            align = 0
+            payload = struct.pack("<%dh" % len(samples), *samples)
+            codec = CODEC_PCM16
+        offset = (offset + ALIGN - 1) // ALIGN * ALIGN
+        entries.append(ENTRY.pack(encoded, offset, len(payload), frames, rate, channels, codec, align))
+        payloads.append((offset, payload))
+        offset += len(payload)
+
+    image = bytearray(offset)
+    image[0:HEADER.size] = HEADER.pack(MAGIC, VERSION, len(clips), index_offset, offset)
+    for i, entry in enumerate(entries):
+        start = index_offset + i * ENTRY.size
+        image[start:start + ENTRY.size] = entry
+    for start, payload in payloads:
+        image[start:start + len(payload)] = payload
+    return bytes(image)
+
+
+def parse_clip(arg):
+    name, sep, rest = arg.partition("=")
+    if not sep or not name:
+        raise argparse.ArgumentTypeError(f"expected name=file.wav[:adpcm], got '{arg}'")
+    path, _, codec = rest.partition(":")
+    if codec not in ("", "pcm", "adpcm"):
+        raise argparse.ArgumentTypeError(f"unknown codec '{codec}'")
+    return name, path, codec == "adpcm"
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("-o", "--output", required=True, help="image file to write")
+    parser.add_argument("--block-align", type=int, default=256,
+                        help="ADPCM block size per channel in bytes (default 256)")
+    parser.add_argument("--partition-size", type=lambda v: int(v, 0),
+                        help="fail if the image doesn't fit in a partition of this size")
+    parser.add_argument("clips", nargs="+", type=parse_clip, help="name=file.wav[:adpcm]")
+    args = parser.parse_args()
+
+    if args.block_align <= 4 or args.block_align % 4:
+        parser.error("--block-align must be a multiple of 4 larger than 4")
+    image = build_image(args.clips, args.block_align)
+    if args.partition_size is not None and len(image) > args.partition_size:
+        print(f"image is {len(image)} bytes, partition is {args.partition_size}", file=sys.stderr)
+        return 1
+    with open(args.output, "wb") as out:
+        out.write(image)
+    print(f"{args.output}: {len(args.clips)} clips, {len(image)} bytes")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,117 @@
+#!/usr/bin/env python3
+"""Build the seek index of MP3 files, as the device does on first use.
+
+    mkseek.py [--interval 1000] track.mp3 [more.mp3 ...]
+
+Writes track.mp3.idx next to each file. Upload both to SPIFFS so that long files can be
+seeked right away instead of being scanned on the device first. The device builds the
+index again if the file size no longer matches.
+
+The layout must match audio_seek.h and the frame walk audio_seek_build().
+"""
+
+import argparse
+import struct
+import sys
+
+MAGIC = b"UASK"
+VERSION = 1
+SUFFIX = ".idx"
+HEADER = struct.Struct("<4sHHIIIII")
+
+BITRATE_V1 = [0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0]
+BITRATE_V2 = [0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0]
+RATE_V1 = [44100, 48000, 32000, 0]
+
+
+def parse_header(data, pos):
+    """(length, sample_rate, samples) of a Layer III frame header at pos, None if not one"""
+    if pos + 4 > len(data):
+        return None
+    h = data[pos:pos + 4]
+    if h[0] != 0xFF or (h[1] & 0xE0) != 0xE0:
+        return None
+    version = (h[1] >> 3) & 3
+    layer = (h[1] >> 1) & 3
+    bitrate_idx = h[2] >> 4
+    rate_idx = (h[2] >> 2) & 3
+    if version == 1 or layer != 1 or bitrate_idx in (0, 15) or rate_idx == 3:
+        return None
+    mpeg1 = version == 3
+    bitrate = (BITRATE_V1 if mpeg1 else BITRATE_V2)[bitrate_idx] * 1000
+    rate = RATE_V1[rate_idx] >> (0 if mpeg1 else (1 if version == 2 else 2))
+    length = (144 if mpeg1 else 72) * bitrate // rate + ((h[2] >> 1) & 1)
+    return length, rate, 1152 if mpeg1 else 576
+
+
+def frame_at(data, pos):
+    """A header followed by another one of the same rate, or by the end of the file"""
+    frame = parse_header(data, pos)
+    if frame is None:
+        return None
+    if pos + frame[0] + 4 > len(data):
+        return frame
+    following = parse_header(data, pos + frame[0])
+    return frame if following is not None and following[1] == frame[1] else None
+
+
+def id3v2_size(data):
+    if len(data) < 10 or data[0:3] != b"ID3":
+        return 0
+    size = (data[6] & 0x7F) << 21 | (data[7] & 0x7F) << 14 | (data[8] & 0x7F) << 7 | (data[9] & 0x7F)
+    return 10 + size + (10 if data[5] & 0x10 else 0)
+
+
+def build_index(data, interval_ms):
+    offsets = []
+    frames = 0
+    rate = samples = per_entry = 0
+    pos = id3v2_size(data)
+    synced = False
+    while pos < len(data):
+        # right after a frame the header alone is trusted, e.g. the last one before an ID3v1 tag
+        frame = parse_header(data, pos) if synced and pos + 4 <= len(data) else frame_at(data, pos)
+        synced = frame is not None
+        if not synced:
+            pos += 1
+            continue
+        if frames == 0:
+            rate, samples = frame[1], frame[2]
+            per_entry = max(interval_ms * rate // (1000 * samples), 1)
+        if frames % per_entry == 0:
+            offsets.append(pos)
+        frames += 1
+        pos += frame[0]
+    if frames == 0:
+        raise ValueError("no MPEG audio Layer III frames")
+    header = HEADER.pack(MAGIC, VERSION, samples, rate, interval_ms, len(data), frames, len(offsets))
+    return header + struct.pack("<%dI" % len(offsets), *offsets), frames * samples * 1000 // rate
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--interval", type=int, default=1000,
+                        help="ms between indexed frames, seek_interval in the config (default 1000)")
+    parser.add_argument("files", nargs="+", help="MP3 files")
+    args = parser.parse_args()
+
+    if args.interval <= 0:
+        parser.error("--interval must be positive")
+    status = 0
+    for path in args.files:
+        with open(path, "rb") as f:
+            data = f.read()
+        try:
+            index, duration_ms = build_index(data, args.interval)
+        except ValueError as e:
+            print(f"{path}: {e}", file=sys.stderr)
+            status = 1
+            continue
+        with open(path + SUFFIX, "wb") as out:
+            out.write(index)
+        print(f"{path}{SUFFIX}: {(len(index) - HEADER.size) // 4} entries, {duration_ms / 1000:.1f} s, {len(index)} bytes")
+    return status
+
+
+if __name__ == "__main__":
+    sys.exit(main())
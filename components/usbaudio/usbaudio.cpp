@@ -1,9 +1,33 @@
 #include "usbaudio.h"
+#include "audio_assets.h"
+#include "audio_hid.h"
+#include "audio_latency.h"
+#include "audio_meter.h"
+#include "audio_mic_feed.h"
+#include "audio_mixer.h"
+#include "audio_schedule.h"
+#include "audio_seek.h"
+#include "audio_sink.h"
+#include "audio_state.h"
+#include "audio_trace.h"
+#include "audio_volume.h"
+#include "pcm_convert.h"
 #include "esphome/core/log.h"
 #include "driver/gpio.h"
 
 #include "usb/uac_host.h"
 #include "esp_spiffs.h"
+#include "esp_timer.h"
+#include <assert.h>
+#include <atomic>
+#include <math.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "esp_cpu.h"
+#include "esp_heap_caps.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
 
 
 #ifdef CONFIG_ESP32_S3_USB_OTG
@@ -17,27 +41,370 @@ static const char *const TAG = "usbaudio";
  */
 
 
-static audio_player_t audio_player_type = AUDIO_PLAYER_I2S;
+static std::atomic<audio_player_t> audio_player_type(AUDIO_PLAYER_I2S);
 static QueueHandle_t s_event_queue = NULL;
-static uac_host_device_handle_t s_audio_player_handle = NULL;
+/*
+ * Handle of the speaker used by the sink. Cleared first on disconnect so new writers back
+ * off, uac_lib_task closes the device once s_handle_users drops to zero.
+ */
+static std::atomic<uac_host_device_handle_t> s_audio_player_handle(NULL);
+static std::atomic<int> s_handle_users(0);
+/* Speaker opened by uac_lib_task, owned by that task */
+static uac_host_device_handle_t s_open_handle = NULL;
+/* Disconnect of a device whose event could not be queued */
+static std::atomic<uac_host_device_handle_t> s_lost_disconnect(NULL);
+/* Speaker still held by a writer after USBAUDIO_CLOSE_TIMEOUT_MS, closed on a later pass */
+static uac_host_device_handle_t s_close_pending = NULL;
+static usbaudio_hotplug_stats_t s_hotplug_stats = {0};
+static std::atomic<uint32_t> s_dropped_events(0);      /*!< counted from the driver task */
+
+#ifndef USBAUDIO_CLOSE_TIMEOUT_MS
+#define USBAUDIO_CLOSE_TIMEOUT_MS   500
+#endif
+
+/*
+ * The stats below are updated from uac_lib_task, the player task and the sink write path,
+ * and copied out from any task: all of it under this lock, never held for longer than that.
+ */
+static SemaphoreHandle_t s_stats_lock = NULL;
+
+/* Headset presence listeners, registered at setup and called from uac_lib_task on edges */
+#define USBAUDIO_PRESENCE_MAX_LISTENERS     4
+static struct {
+    usbaudio_presence_cb_t cb;
+    void *arg;
+} s_presence_listeners[USBAUDIO_PRESENCE_MAX_LISTENERS];
+static std::atomic<int> s_presence_listener_count(0);
+static std::atomic<bool> s_headset_present(false);
+static std::atomic<int64_t> s_plug_us(0);               /*!< speaker connect event, 0 once audio flows */
+static usbaudio_presence_stats_t s_presence_stats = {0};
 static audio_player_config_t player_config = {0};
 static FILE *s_fp = NULL;
 static void uac_device_callback(uac_host_device_handle_t uac_device_handle, const uac_host_device_event_t event, void *arg);
+static void _presence_set(bool present);
+#ifdef USBAUDIO_RESUME
+static void _state_restore_once(void);
+#endif
 static file_iterator_instance_t *file_iterator = NULL;
 
+#ifndef USBAUDIO_IDLE_SUSPEND_MS
+#define USBAUDIO_IDLE_SUSPEND_MS 2000
+#endif
+
+/**
+ * @brief Cached stream state of the UAC speaker
+ *
+ * The stream format and the volume last sent to the device are kept here so that
+ * resuming after an idle suspend is a single resume request, and so that a re-config
+ * to an identical format does not stop/start the stream.
+ * The device is only suspended after USBAUDIO_IDLE_SUSPEND_MS of continuous idle.
+ */
+static SemaphoreHandle_t s_stream_lock = NULL;
+static uac_host_stream_config_t s_stream_config = {0};
+static bool s_stream_started = false;
+static bool s_stream_suspended = false;
+static int32_t s_device_volume = INT32_MIN;      /*!< hardware level last sent in 1/256 dB, INT32_MIN: unknown */
+static audio_volume_range_t s_device_range;
+static bool s_device_has_range = false;         /*!< read from the feature unit, else volume is software only */
+/* Set from the player callback and the sink write path, 64-bit so not written in one store on the S3 */
+static std::atomic<int64_t> s_idle_since_us(0);
+static std::atomic<int64_t> s_resume_us(0);
+static usbaudio_idle_stats_t s_idle_stats = {0};
+
+#ifndef USBAUDIO_RECOVERY_MAX_ATTEMPTS
+#define USBAUDIO_RECOVERY_MAX_ATTEMPTS 8
+#endif
+#define USBAUDIO_RECOVERY_BACKOFF_MIN_MS 2
+#define USBAUDIO_RECOVERY_BACKOFF_MAX_MS 250
+
+/**
+ * @brief In-place stream recovery
+ *
+ * A transfer error or a failed stop/start/resume restarts the stream with the cached
+ * config from uac_lib_task, retrying with exponential backoff. Writers wait on
+ * STREAM_EVENT_READY meanwhile, so the decoded backlog is kept instead of dropped.
+ * After USBAUDIO_RECOVERY_MAX_ATTEMPTS the output falls back to I2S when the fallback sink
+ * is built in. A usb_headset build has nowhere else to play: the player is paused and the
+ * attempts go on every USBAUDIO_RECOVERY_BACKOFF_MAX_MS until the stream is back, or the
+ * headset is unplugged.
+ */
+#define STREAM_EVENT_READY      BIT0
+#define STREAM_EVENT_RELEASED   BIT1    /*!< last reference on a cleared speaker handle dropped */
+
+static EventGroupHandle_t s_stream_events = NULL;
+static std::atomic<bool> s_recovering(false);    /*!< read without s_stream_lock by the writers */
+static uint32_t s_recovery_attempt = 0;
+static int64_t s_recovery_start_us = 0;
+static int64_t s_recovery_next_us = 0;
+static usbaudio_recovery_stats_t s_recovery_stats = {0};
+
+/**
+ * @brief Boot sequencing
+ *
+ * USB host and UAC driver are brought up first so that headset enumeration runs while
+ * the display and SPIFFS are initialized in parallel. The UI waits for BOOT_READY_FILES,
+ * uac_lib_task for BOOT_READY_FILES and BOOT_READY_PLAYER before starting playback on a
+ * connected device. Nothing waits for the display.
+ */
+#define BOOT_READY_FILES    BIT0
+#define BOOT_READY_PLAYER   BIT1
+
+static EventGroupHandle_t s_boot_events = NULL;
+static boot_stage_record_t s_boot_timeline[BOOT_STAGE_MAX] = {
+    {"usb_host", 0, 0},
+    {"uac_driver", 0, 0},
+    {"i2c", 0, 0},
+    {"display", 0, 0},
+    {"spiffs", 0, 0},
+    {"board", 0, 0},
+    {"player", 0, 0},
+    {"ui", 0, 0},
+    {"first_audio", 0, 0},
+};
+
+static inline void _boot_stage_begin(boot_stage_t stage)
+{
+    s_boot_timeline[stage].start_us = esp_timer_get_time();
+}
+
+static inline void _boot_stage_end(boot_stage_t stage)
+{
+    s_boot_timeline[stage].end_us = esp_timer_get_time();
+}
+
+#ifdef USBAUDIO_SINK_PROFILE
+static usbaudio_sink_profile_t s_sink_profile = {0};
+#endif
+
+/* PCM format currently configured on the sink, as reported through clk_set_fn */
+static std::atomic<uint32_t> s_sink_rate(48000);
+static std::atomic<uint32_t> s_sink_bits(16);
+static std::atomic<uint32_t> s_sink_ch(2);
+
+/* UAC speaker driver buffering, configurable to compare round-trip latencies */
+#ifndef USBAUDIO_UAC_BUFFER_SIZE
+#define USBAUDIO_UAC_BUFFER_SIZE 16000
+#endif
+#ifndef USBAUDIO_UAC_BUFFER_THRESHOLD
+#define USBAUDIO_UAC_BUFFER_THRESHOLD 4000
+#endif
+
+#ifdef USBAUDIO_SCHEDULE
+#ifndef USBAUDIO_SCHEDULE_LATENCY_US
+#define USBAUDIO_SCHEDULE_LATENCY_US 0
+#endif
+/* The player and the scheduler idle feeder both write to the sink */
+static SemaphoreHandle_t s_sink_write_lock = NULL;
+#endif
+
+#ifdef USBAUDIO_ASSETS
+#ifndef USBAUDIO_SCHEDULE
+#error "asset clips are played through the scheduler, define USBAUDIO_SCHEDULE"
+#endif
+#ifndef USBAUDIO_ASSETS_PARTITION
+#define USBAUDIO_ASSETS_PARTITION "assets"
+#endif
+#endif
+
+#ifdef USBAUDIO_LATENCY
+#ifndef USBAUDIO_LATENCY_THRESHOLD
+#define USBAUDIO_LATENCY_THRESHOLD 0.1f
+#endif
+#ifndef USBAUDIO_LATENCY_INTERVAL_MS
+#define USBAUDIO_LATENCY_INTERVAL_MS 1000
+#endif
+#ifndef USBAUDIO_LATENCY_TIMEOUT_MS
+#define USBAUDIO_LATENCY_TIMEOUT_MS 500
+#endif
+
+/*
+ * Playback format of the codec, as bsp_board_init() leaves it and then as the I2S sink sets
+ * it. Restored when a measurement that took the codec over for its capture stops. All of
+ * it under s_stream_lock.
+ */
+static uint32_t s_codec_rate = 16000;
+static uint32_t s_codec_bits = 32;
+static i2s_slot_mode_t s_codec_ch = I2S_SLOT_MODE_STEREO;
+static bool s_latency_codec_taken = false;
+#endif
+
+#ifdef USBAUDIO_MIC_FEED
+/*
+ * Headset microphone, captured at 48 kHz 16-bit and fed to audio_mic_feed. Same
+ * ownership as the speaker: uac_lib_task opens and closes, the capture task only reads
+ * while holding a reference.
+ */
+#define USBAUDIO_MIC_READ_FRAMES    480     /*!< 10 ms per read */
+static std::atomic<uac_host_device_handle_t> s_mic_handle(NULL);
+static std::atomic<int> s_mic_users(0);
+static uac_host_device_handle_t s_mic_open_handle = NULL;
+/* Microphone still read from after USBAUDIO_CLOSE_TIMEOUT_MS, closed on a later pass */
+static uac_host_device_handle_t s_mic_close_pending = NULL;
+static uint8_t s_mic_channels = 1;
+static TaskHandle_t s_mic_task = NULL;
+static int16_t s_mic_buf[USBAUDIO_MIC_READ_FRAMES * 2];
+#endif
+
+#ifndef USBAUDIO_CODEC_MIN_DB
+#define USBAUDIO_CODEC_MIN_DB       -50     /*!< bsp_codec_volume_set() maps 0-100 linearly in dB up to 0 dB */
+#endif
+#ifndef USBAUDIO_VOLUME_STEP
+#define USBAUDIO_VOLUME_STEP        5       /*!< per volume key press, out of 100 */
+#endif
+
+static const audio_volume_range_t s_codec_range = {
+    .min_db = AUDIO_VOLUME_DB(USBAUDIO_CODEC_MIN_DB),
+    .max_db = 0,
+    .res_db = AUDIO_VOLUME_DB(-USBAUDIO_CODEC_MIN_DB) / 100,
+};
+
+/*
+ * Volume, mute and transport requests from the headset keys and the component. Callers
+ * only record what they want, uac_lib_task applies it: a burst of key presses turns into
+ * a single volume control transfer.
+ */
+static std::atomic<int> s_volume(-1);                   /*!< 0-100, -1 follows get_sys_volume() */
+static std::atomic<bool> s_user_muted(false);
+static std::atomic<bool> s_play_stopped(false);         /*!< stop() was called, don't loop the file */
+static std::atomic<int> s_pending_volume_steps(0);
+static std::atomic<int> s_pending_mute_toggles(0);
+static std::atomic<int> s_pending_play_toggles(0);
+static std::atomic<int64_t> s_pending_since_us(0);      /*!< oldest request not applied yet, 0 if none */
+static std::atomic<bool> s_control_queued(false);
+static std::atomic<uint32_t> s_control_requests(0);
+static std::atomic<int> s_codec_volume(-1);             /*!< bsp_codec_volume_set() value last sent */
+/* Software part of the volume per output, applied in the sink write path */
+static std::atomic<int32_t> s_usb_gain_q15(AUDIO_VOLUME_UNITY_Q15);
+static std::atomic<int32_t> s_codec_gain_q15(AUDIO_VOLUME_UNITY_Q15);
+static usbaudio_control_stats_t s_control_stats = {0};
+
+/*
+ * Playback position: the frame the current run of MP3_FILE_NAME was opened at, plus what
+ * the decoder has written since, counted in the source format.
+ */
+static std::atomic<uint32_t> s_play_offset(0);          /*!< byte offset the source starts at */
+static std::atomic<uint32_t> s_play_base_ms(0);
+static std::atomic<uint32_t> s_play_frames(0);
+static uint32_t s_play_file_size = 0;
+static std::atomic<uint32_t> s_source_rate(0);          /*!< as set by the player, 0 before the first file */
+static std::atomic<uint8_t> s_source_bits(16);
+static std::atomic<uint8_t> s_source_ch(2);
+/* Paused on unplug or a failed recovery because there is no other output, played on once the headset is back */
+static std::atomic<bool> s_unplug_paused(false);
+
+#ifndef USBAUDIO_SEEK_INTERVAL_MS
+#define USBAUDIO_SEEK_INTERVAL_MS   1000
+#endif
+/*
+ * Seek index of MP3_FILE_NAME, published once by seek_index_task. A start at a position
+ * opens the file at the indexed frame before it and drops the decoded frames up to the
+ * position, at most USBAUDIO_SEEK_INTERVAL_MS of audio.
+ */
+static std::atomic<audio_seek_index_t *> s_seek_index(NULL);
+static std::atomic<uint32_t> s_skip_frames(0);
+static std::atomic<int64_t> s_seek_start_us(0);         /*!< seek() call, 0 once the new position is heard */
+static usbaudio_seek_stats_t s_seek_stats = {0};
+/* Runs of MP3_FILE_NAME started by uac_lib_task, and the one the player reads */
+static uint32_t s_play_runs = 0;
+static std::atomic<uint32_t> s_play_run(0);
+
+#ifdef USBAUDIO_RESUME
+#ifndef USBAUDIO_STATE_INTERVAL_S
+#define USBAUDIO_STATE_INTERVAL_S   30
+#endif
+#define USBAUDIO_STATE_MIN_INTERVAL_MS  5000
+
+/*
+ * Checkpoint read at boot. While s_resume_pending, the next start from idle begins at its
+ * frame instead of the start of the file.
+ */
+static audio_state_t s_resume_state;
+static std::atomic<bool> s_resume_pending(false);
+static std::atomic<bool> s_state_urgent(false);
+#endif
+
+/* Add n to a counter of one of the stats structs */
+static void _stats_add(uint32_t *counter, uint32_t n)
+{
+    xSemaphoreTake(s_stats_lock, portMAX_DELAY);
+    *counter += n;
+    xSemaphoreGive(s_stats_lock);
+}
+
+/**
+ * @brief Record the time elapsed since since_us in a last / max pair of one of the stats structs
+ *
+ * @return the latency in us
+ */
+static uint32_t _stats_latency(uint32_t *last_us, uint32_t *max_us, int64_t since_us)
+{
+    uint32_t latency_us = (uint32_t)(esp_timer_get_time() - since_us);
+    xSemaphoreTake(s_stats_lock, portMAX_DELAY);
+    *last_us = latency_us;
+    if (latency_us > *max_us) {
+        *max_us = latency_us;
+    }
+    xSemaphoreGive(s_stats_lock);
+    return latency_us;
+}
+
+/* Copy one of the stats structs out, all zeros before app_main */
+static void _stats_copy(void *dst, const void *src, size_t size)
+{
+    if (s_stats_lock == NULL) {
+        memset(dst, 0, size);
+        return;
+    }
+    xSemaphoreTake(s_stats_lock, portMAX_DELAY);
+    memcpy(dst, src, size);
+    xSemaphoreGive(s_stats_lock);
+}
+
+static inline int _usbaudio_volume(void)
+{
+    int volume = s_volume;
+    return volume >= 0 ? volume : get_sys_volume();
+}
+
+/*
+ * Format the UAC speaker streams in, picked from its alt settings on connect and set with
+ * s_stream_lock held. When the source format differs, the USB write path converts through
+ * s_convert_buf.
+ */
+static uint8_t s_device_bits = 16;
+static uint8_t s_device_ch = 2;
+static pcm_dither_t s_sink_dither;
+static uint32_t s_convert_buf[1024] __attribute__((aligned(16)));   /*!< aligned for the vector kernels */
+
 /**
  * @brief event group
  *
  * APP_EVENT            - General control event
  * UAC_DRIVER_EVENT     - UAC Host Driver event, such as device connection
  * UAC_DEVICE_EVENT     - UAC Host Device event, such as rx/tx completion, device disconnection
+ * CONTROL_EVENT        - Volume, mute or transport request pending, from HID keys or the component
+ * PLAY_EVENT           - Start, pause, stop or seek of MP3_FILE_NAME, from the component or the player
  */
 typedef enum {
     APP_EVENT = 0,
     UAC_DRIVER_EVENT,
     UAC_DEVICE_EVENT,
+    CONTROL_EVENT,
+    PLAY_EVENT,
 } event_group_t;
 
+/*
+ * MP3_FILE_NAME is only opened, paused and stopped by uac_lib_task: the component and the
+ * player's end of file send their request, applied in the order sent.
+ */
+typedef enum {
+    PLAY_REQUEST_PLAY = 0,      /*!< play(): resume a pause, else start */
+    PLAY_REQUEST_PAUSE,
+    PLAY_REQUEST_STOP,
+    PLAY_REQUEST_SEEK,
+    PLAY_REQUEST_LOOP,          /*!< the player reached the end of the file */
+} play_request_t;
+
 typedef struct {
     event_group_t event_group;
     union {
@@ -49,148 +416,1552 @@ typedef struct {
         } driver_evt;
         struct {
             uac_host_device_handle_t handle;
-            uac_host_driver_event_t event;
+            uac_host_device_event_t event;
             void *arg;
         } device_evt;
+        struct {
+            play_request_t request;
+            uint32_t position_ms;       /*!< seek */
+            uint32_t run;               /*!< loop: the run that ended */
+            int64_t since_us;
+        } play_evt;
     };
 } s_event_queue_t;
 
-static esp_err_t _audio_player_mute_fn(AUDIO_PLAYER_MUTE_SETTING setting)
+/*
+ * The player reads the file from its start, a source opened at a frame offset is a window
+ * that starts there: the player's rewind lands on the frame, not on the file header.
+ *
+ * A source also carries where its run starts. The player task publishes that to the
+ * position counters on the first read, once it is done with the previous run's buffers.
+ */
+typedef struct {
+    uint32_t offset;            /*!< byte offset of the indexed frame the run starts at */
+    uint32_t time_ms;           /*!< time of that frame */
+    uint32_t skip_frames;       /*!< decoded frames dropped up to the position */
+    int64_t seek_us;            /*!< seek() call, 0 for other starts */
+    uint32_t run;
+} audio_play_start_t;
+
+typedef struct {
+    FILE *fp;
+    uint32_t base;
+    audio_play_start_t start;
+    bool started;
+} audio_source_t;
+
+/* Player task, first read of a new run */
+static void _play_position_start(const audio_play_start_t *start)
 {
-    esp_err_t ret = ESP_OK;
-    if (audio_player_type == AUDIO_PLAYER_I2S) {
-        // Volume saved when muting and restored when unmuting. Restoring volume is necessary
-        // as es8311_set_voice_mute(true) results in voice volume (REG32) being set to zero.
-        uint8_t volume = get_sys_volume();
+    s_play_offset = start->offset;
+    s_play_base_ms = start->time_ms;
+    s_play_frames = 0;
+    s_skip_frames = start->skip_frames;
+    s_seek_start_us = start->seek_us;
+    s_play_run = start->run;
+}
+
+static ssize_t _audio_source_read(void *cookie, char *buf, size_t size)
+{
+    audio_source_t *source = (audio_source_t *)cookie;
+    if (!source->started) {
+        source->started = true;
+        _play_position_start(&source->start);
+    }
+    AUDIO_TRACE_BEGIN(AUDIO_TRACE_FILE_READ, size);
+    size_t n = fread(buf, 1, size, source->fp);
+    AUDIO_TRACE_END(AUDIO_TRACE_FILE_READ, n);
+    return n;
+}
+
+static int _audio_source_seek(void *cookie, off_t *offset, int whence)
+{
+    audio_source_t *source = (audio_source_t *)cookie;
+    off_t pos = whence == SEEK_SET ? *offset + source->base : *offset;
+    if (fseek(source->fp, pos, whence) != 0) {
+        return -1;
+    }
+    long now = ftell(source->fp);
+    if (now < (long)source->base) {
+        // SEEK_CUR / SEEK_END before the window
+        fseek(source->fp, source->base, SEEK_SET);
+        now = source->base;
+    }
+    *offset = now - source->base;
+    return 0;
+}
+
+static int _audio_source_close(void *cookie)
+{
+    audio_source_t *source = (audio_source_t *)cookie;
+    int ret = fclose(source->fp);
+    free(source);
+    return ret;
+}
+
+/**
+ * @brief Open a file for the player at the start of a run
+ *
+ * Always goes through a cookie, its first read is where the run's position takes over.
+ */
+static FILE *_audio_source_open(const char *path, const audio_play_start_t *start)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return NULL;
+    }
+    audio_source_t *source = (audio_source_t *)malloc(sizeof(audio_source_t));
+    if (source != NULL && fseek(fp, start->offset, SEEK_SET) == 0) {
+        source->fp = fp;
+        source->base = start->offset;
+        source->start = *start;
+        source->started = false;
+        static const cookie_io_functions_t s_source_io = {
+            .read = _audio_source_read,
+            .write = NULL,
+            .seek = _audio_source_seek,
+            .close = _audio_source_close,
+        };
+        FILE *window = fopencookie(source, "rb", s_source_io);
+        if (window != NULL) {
+            return window;
+        }
+    }
+    free(source);
+    fclose(fp);
+    return NULL;
+}
 
-        bsp_codec_mute_set(setting == AUDIO_PLAYER_MUTE ? true : false);
+static pcm_format_t _pcm_format_from_bits(uint32_t bits)
+{
+    switch (bits) {
+    case 24:
+        return PCM_FORMAT_S24_PACKED;
+    case 32:
+        return PCM_FORMAT_S32;
+    default:
+        return PCM_FORMAT_S16;
+    }
+}
 
-        // restore the voice volume upon unmuting
-        if (setting == AUDIO_PLAYER_UNMUTE) {
-            bsp_codec_volume_set(volume, NULL);
+/**
+ * @brief Pick the stream format of a speaker, 16-bit stereo if supported, else the closest
+ *
+ * Only 16, 24 and 32-bit settings are used, the write path doesn't convert to 8-bit.
+ */
+static void _uac_pick_device_format(uac_host_device_handle_t handle, const uac_host_dev_info_t *dev_info,
+                                    uint8_t *bits, uint8_t *channels)
+{
+    *bits = 0;
+    *channels = 2;
+    for (uint8_t alt = 1; alt <= dev_info->iface_alt_num; alt++) {
+        uac_host_dev_alt_param_t param;
+        if (uac_host_get_device_alt_param(handle, alt, &param) != ESP_OK ||
+                (param.bit_resolution != 16 && param.bit_resolution != 24 && param.bit_resolution != 32)) {
+            continue;
         }
-        ret = ESP_OK;
+        bool better = *bits == 0 ||
+                      (param.bit_resolution == 16 && *bits != 16) ||
+                      (*bits != 16 && param.bit_resolution < *bits) ||
+                      (param.bit_resolution == *bits && param.channels == 2);
+        if (better) {
+            *bits = param.bit_resolution;
+            *channels = param.channels >= 2 ? 2 : 1;
+        }
+    }
+    if (*bits == 0) {
+        // the start fails and the stream goes through recovery
+        ESP_LOGW(TAG, "UAC speaker has no 16, 24 or 32-bit setting, trying 16-bit");
+        *bits = 16;
+    }
+}
+
+/**
+ * @brief Whether a streaming setting takes this sample rate, from its list or its range
+ */
+static bool _uac_alt_supports_rate(const uac_host_dev_alt_param_t *param, uint32_t rate)
+{
+    if (param->sample_freq_type == 0) {
+        // continuous range
+        return rate >= param->sample_freq_lower && rate <= param->sample_freq_upper;
+    }
+    for (uint8_t i = 0; i < param->sample_freq_type && i < UAC_FREQ_NUM_MAX; i++) {
+        if (param->sample_freq[i] == rate) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Sample rate to start a speaker at
+ *
+ * The rate the player is in, or the one of the checkpoint about to be resumed, so that
+ * playing on after a reconnect doesn't need a re-config. 48 kHz if the speaker can't.
+ */
+static uint32_t _uac_start_rate(uac_host_device_handle_t handle, const uac_host_dev_info_t *dev_info,
+                                uint8_t bits, uint8_t channels)
+{
+    uint32_t rate = s_sink_rate;
+#ifdef USBAUDIO_RESUME
+    if (s_resume_pending && s_resume_state.sample_rate != 0) {
+        rate = s_resume_state.sample_rate;
+    }
+#endif
+    for (uint8_t alt = 1; alt <= dev_info->iface_alt_num; alt++) {
+        uac_host_dev_alt_param_t param;
+        if (uac_host_get_device_alt_param(handle, alt, &param) == ESP_OK && param.bit_resolution == bits &&
+                (param.channels >= 2 ? 2 : 1) == channels && _uac_alt_supports_rate(&param, rate)) {
+            return rate;
+        }
+    }
+    return 48000;
+}
+
+/**
+ * @brief Write source PCM to the speaker, converting bit depth and channel layout
+ *
+ * @param src_bits, src_ch: format of src, as set through clk_set_fn
+ * @param stream: format the speaker streams in
+ */
+static esp_err_t _uac_write_converted(uac_host_device_handle_t handle, const uint8_t *src, size_t len,
+                                      uint32_t src_bits, uint32_t src_ch, const uac_host_stream_config_t *stream,
+                                      uint32_t timeout_ms)
+{
+    pcm_format_t src_format = _pcm_format_from_bits(src_bits);
+    pcm_format_t dst_format = _pcm_format_from_bits(stream->bit_resolution);
+    uint8_t dst_ch = stream->channels;
+    size_t src_frame = pcm_format_bytes(src_format) * src_ch;
+    size_t dst_sample = pcm_format_bytes(dst_format);
+    // the buffer holds the converted frame before the up/downmix
+    size_t chunk_frames = sizeof(s_convert_buf) / (dst_sample * (src_ch > dst_ch ? src_ch : dst_ch));
+    size_t frames = len / src_frame;
+
+    while (frames > 0) {
+        size_t n = frames < chunk_frames ? frames : chunk_frames;
+        pcm_convert(s_convert_buf, dst_format, src, src_format, n * src_ch, (uint8_t)src_ch, &s_sink_dither);
+        if (src_ch == 1 && dst_ch == 2) {
+            pcm_mono_to_stereo(s_convert_buf, s_convert_buf, n, dst_format);
+        } else if (src_ch == 2 && dst_ch == 1) {
+            pcm_stereo_to_mono(s_convert_buf, s_convert_buf, n, dst_format);
+        }
+        esp_err_t ret = uac_host_device_write(handle, (uint8_t *)s_convert_buf, n * dst_sample * dst_ch, timeout_ms);
+        if (ret != ESP_OK) {
+            return ret;
+        }
+        src += n * src_frame;
+        frames -= n;
+    }
+    return ESP_OK;
+}
+
+/* Must be called with s_stream_lock held */
+static void _uac_recovery_start_locked(const char *reason)
+{
+    _stats_add(&s_recovery_stats.error_count, 1);
+    if (s_recovering) {
+        return;
+    }
+    ESP_LOGW(TAG, "UAC stream fault (%s), restarting the stream", reason);
+    s_recovering = true;
+    s_recovery_attempt = 0;
+    s_recovery_start_us = esp_timer_get_time();
+    s_recovery_next_us = s_recovery_start_us;
+    xEventGroupClearBits(s_stream_events, STREAM_EVENT_READY);
+}
+
+/* Must be called with s_stream_lock held */
+static void _uac_recovery_end_locked(void)
+{
+    s_recovering = false;
+    xEventGroupSetBits(s_stream_events, STREAM_EVENT_READY);
+}
+
+static inline void _uac_handle_release(void)
+{
+    if (--s_handle_users == 0 && s_audio_player_handle == NULL) {
+        // uac_lib_task may be waiting in _uac_device_close()
+        xEventGroupSetBits(s_stream_events, STREAM_EVENT_RELEASED);
+    }
+}
+
+/**
+ * @brief Take a reference on the speaker handle for use outside s_stream_lock
+ *
+ * @return the handle, NULL if no speaker is attached (nothing to release then)
+ */
+static uac_host_device_handle_t _uac_handle_acquire(void)
+{
+    s_handle_users++;
+    uac_host_device_handle_t handle = s_audio_player_handle;
+    if (handle == NULL) {
+        _uac_handle_release();
+    }
+    return handle;
+}
+
+/**
+ * @brief Wait until no writer holds a reference on the cleared speaker handle
+ *
+ * @return false if one still does after timeout_ms
+ */
+static bool _uac_handle_wait_released(uint32_t timeout_ms)
+{
+    int64_t deadline_us = esp_timer_get_time() + (int64_t)timeout_ms * 1000;
+    while (s_handle_users > 0) {
+        int64_t remaining_ms = (deadline_us - esp_timer_get_time() + 999) / 1000;
+        if (remaining_ms <= 0) {
+            return false;
+        }
+        // a stale bit from an earlier close only costs one more check
+        xEventGroupWaitBits(s_stream_events, STREAM_EVENT_RELEASED, pdTRUE, pdTRUE, pdMS_TO_TICKS(remaining_ms));
+    }
+    return true;
+}
+
+static void _uac_stream_reset(void)
+{
+    _uac_recovery_end_locked();
+    s_stream_started = false;
+    s_stream_suspended = false;
+    s_device_volume = INT32_MIN;
+    s_idle_since_us = 0;
+    s_resume_us = 0;
+}
+
+/* Must be called with s_stream_lock held */
+static esp_err_t _uac_stream_resume_locked(void)
+{
+    if (!s_stream_suspended) {
+        return ESP_OK;
+    }
+    esp_err_t ret = uac_host_device_resume(s_audio_player_handle);
+    if (ret == ESP_OK) {
+        s_stream_suspended = false;
+        s_resume_us = esp_timer_get_time();
+        _stats_add(&s_idle_stats.resume_count, 1);
+    }
+    return ret;
+}
+
+/**
+ * @brief Bring the speaker volume and the USB software gain to the user volume
+ *
+ * Must be called with s_stream_lock held. The hardware part only changes on the device's
+ * own grid, so most volume changes send one control transfer and some none.
+ *
+ * @return true when a control transfer was sent
+ */
+static bool _uac_stream_sync_volume_locked(void)
+{
+    audio_volume_split_t split;
+    audio_volume_split(_usbaudio_volume(), s_device_has_range ? &s_device_range : NULL, &split);
+    s_usb_gain_q15 = split.sw_gain_q15;
+    if (!s_device_has_range || split.hw_db == s_device_volume) {
+        return false;
+    }
+    if (uac_host_device_set_volume_db(s_audio_player_handle, split.hw_db) == ESP_OK) {
+        s_device_volume = split.hw_db;
+    }
+    return true;
+}
+
+/* Same for the codec on the I2S output, returns true when the codec volume was written */
+static bool _codec_sync_volume(void)
+{
+    audio_volume_split_t split;
+    audio_volume_split(_usbaudio_volume(), &s_codec_range, &split);
+    s_codec_gain_q15 = split.sw_gain_q15;
+    int percent = (split.hw_db - s_codec_range.min_db) / s_codec_range.res_db;
+    if (percent == s_codec_volume) {
+        return false;
+    }
+    s_codec_volume = percent;
+    bsp_codec_volume_set(percent, NULL);
+    return true;
+}
+
+/**
+ * @brief Suspend the speaker once it has been idle for the configured quiet period
+ *
+ * Called periodically from uac_lib_task.
+ */
+static void _uac_stream_idle_check(void)
+{
+    if (s_audio_player_handle == NULL || s_idle_since_us == 0) {
+        return;
+    }
+    xSemaphoreTake(s_stream_lock, portMAX_DELAY);
+    int64_t idle_since_us = s_idle_since_us;
+    if (s_audio_player_handle != NULL && idle_since_us != 0 && !s_stream_suspended &&
+            esp_timer_get_time() - idle_since_us >= (int64_t)USBAUDIO_IDLE_SUSPEND_MS * 1000) {
+        if (uac_host_device_suspend(s_audio_player_handle) == ESP_OK) {
+            s_stream_suspended = true;
+            _stats_add(&s_idle_stats.suspend_count, 1);
+            ESP_LOGI(TAG, "Idle for %d ms, UAC device suspended", USBAUDIO_IDLE_SUSPEND_MS);
+        }
+    }
+    xSemaphoreGive(s_stream_lock);
+}
+
+/**
+ * @brief Run the next recovery attempt once its backoff has elapsed
+ *
+ * Called periodically from uac_lib_task.
+ */
+static void _uac_recovery_poll(void)
+{
+    if (!s_recovering) {
+        return;
+    }
+    xSemaphoreTake(s_stream_lock, portMAX_DELAY);
+    int64_t now = esp_timer_get_time();
+    uac_host_device_handle_t handle = s_audio_player_handle;
+    if (!s_recovering || handle == NULL || now < s_recovery_next_us) {
+        xSemaphoreGive(s_stream_lock);
+        return;
+    }
+    bool pause = false;
+    bool resume = false;
+    // the stream may already be stopped, only the start result matters
+    uac_host_device_stop(handle);
+    s_stream_started = false;
+    s_stream_suspended = false;
+    esp_err_t ret = uac_host_device_start(handle, &s_stream_config);
+    s_recovery_attempt++;
+    if (ret == ESP_OK) {
+        s_stream_started = true;
+        s_device_volume = INT32_MIN;
+        _uac_stream_sync_volume_locked();
+        uint32_t elapsed_us = _stats_latency(&s_recovery_stats.last_recovery_us, &s_recovery_stats.max_recovery_us,
+                                             s_recovery_start_us);
+        _stats_add(&s_recovery_stats.recovered_count, 1);
+        ESP_LOGI(TAG, "UAC stream recovered in %"PRIu32" us, %"PRIu32" attempt(s)", elapsed_us, s_recovery_attempt);
+        _uac_recovery_end_locked();
+        resume = true;
+    } else if (s_recovery_attempt == USBAUDIO_RECOVERY_MAX_ATTEMPTS) {
+        _stats_add(&s_recovery_stats.failed_count, 1);
+#ifndef USBAUDIO_SINK_USB
+        ESP_LOGE(TAG, "UAC stream recovery failed (%s), falling back to I2S", esp_err_to_name(ret));
+        // FallbackSink sets the codec to the playing format before its first write
+        audio_player_type = AUDIO_PLAYER_I2S;
+        _uac_recovery_end_locked();
+#else
+        // no other output, keep trying at the slowest pace with the player paused
+        ESP_LOGE(TAG, "UAC stream recovery failed (%s), paused until the stream is back", esp_err_to_name(ret));
+        s_recovery_next_us = now + (int64_t)USBAUDIO_RECOVERY_BACKOFF_MAX_MS * 1000;
+        pause = true;
+#endif
     } else {
-        if (s_audio_player_handle == NULL) {
-            return ESP_ERR_INVALID_STATE;
+        uint32_t shift = s_recovery_attempt - 1;
+        uint32_t backoff_ms = shift < 8 ? USBAUDIO_RECOVERY_BACKOFF_MIN_MS << shift : USBAUDIO_RECOVERY_BACKOFF_MAX_MS;
+        if (backoff_ms > USBAUDIO_RECOVERY_BACKOFF_MAX_MS) {
+            backoff_ms = USBAUDIO_RECOVERY_BACKOFF_MAX_MS;
         }
-        ESP_LOGI(TAG, "mute setting: %s", setting == 0 ? "mute" : "unmute");
+        s_recovery_next_us = now + (int64_t)backoff_ms * 1000;
+    }
+    xSemaphoreGive(s_stream_lock);
+    // the player task may be waiting in the sink for the stream, not under the lock
+    if (pause && audio_player_get_state() == AUDIO_PLAYER_STATE_PLAYING) {
+        s_unplug_paused = true;
+        audio_player_pause();
+    } else if (resume && s_unplug_paused.exchange(false)) {
+        audio_player_resume();
+    }
+}
+
+/* How long uac_lib_task may block on its queue before the next periodic check */
+static TickType_t _uac_lib_wait_ticks(void)
+{
+    if (!s_recovering) {
+        return pdMS_TO_TICKS(100);
+    }
+    int64_t remaining_ms = (s_recovery_next_us - esp_timer_get_time() + 999) / 1000;
+    if (remaining_ms <= 0) {
+        return 0;
+    }
+    TickType_t ticks = pdMS_TO_TICKS(remaining_ms < 100 ? remaining_ms : 100);
+    return ticks ? ticks : 1;
+}
+
+bool UsbSink::available()
+{
+    return audio_player_type == AUDIO_PLAYER_USB;
+}
+
+/* Output the player is heard on, fixed in a single sink build, else the fallback's choice */
+static inline bool _usb_output_active(void)
+{
+#if defined(USBAUDIO_SINK_USB)
+    return true;
+#elif defined(USBAUDIO_SINK_I2S)
+    return false;
+#else
+    return UsbSink::available();
+#endif
+}
 
-        ret = uac_host_device_set_mute(s_audio_player_handle, (setting == 0 ? true : false));
+esp_err_t UsbSink::mute(AUDIO_PLAYER_MUTE_SETTING setting)
+{
+    uac_host_device_handle_t handle = _uac_handle_acquire();
+    if (handle == NULL) {
+        return ESP_ERR_INVALID_STATE;
     }
+    ESP_LOGI(TAG, "mute setting: %s", setting == 0 ? "mute" : "unmute");
+
+    esp_err_t ret = uac_host_device_set_mute(handle, (setting == 0 ? true : false));
+    _uac_handle_release();
     return ret;
 }
 
-static esp_err_t _audio_player_write_fn(void *audio_buffer, size_t len, size_t *bytes_written, uint32_t timeout_ms)
+esp_err_t UsbSink::write(void *audio_buffer, size_t len, size_t *bytes_written, uint32_t timeout_ms)
+{
+    esp_err_t ret = ESP_OK;
+    if (s_audio_player_handle == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (s_recovering &&
+            !(xEventGroupWaitBits(s_stream_events, STREAM_EVENT_READY, pdFALSE, pdTRUE, pdMS_TO_TICKS(timeout_ms)) & STREAM_EVENT_READY)) {
+        // keep the data, the player retries once the stream is back
+        return ESP_ERR_TIMEOUT;
+    }
+    // the stream state is read under the lock, the transfer runs outside of it on a reference
+    xSemaphoreTake(s_stream_lock, portMAX_DELAY);
+    if (s_recovering) {
+        // faulted again in the meantime
+        xSemaphoreGive(s_stream_lock);
+        return ESP_ERR_TIMEOUT;
+    }
+    if (s_stream_suspended) {
+        // data arrived without a PLAYING event, resume on demand
+        _uac_stream_resume_locked();
+    }
+    const uac_host_stream_config_t stream = s_stream_config;
+    uac_host_device_handle_t handle = _uac_handle_acquire();
+    xSemaphoreGive(s_stream_lock);
+    if (handle == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    uint32_t src_bits = s_sink_bits;
+    uint32_t src_ch = s_sink_ch;
+    if (src_bits == stream.bit_resolution && src_ch == stream.channels) {
+        ret = uac_host_device_write(handle, (uint8_t *)audio_buffer, len, timeout_ms);
+    } else {
+        ret = _uac_write_converted(handle, (const uint8_t *)audio_buffer, len, src_bits, src_ch, &stream, timeout_ms);
+    }
+    _uac_handle_release();
+    if (ret == ESP_OK) {
+        *bytes_written = len;
+        int64_t plug_us = s_plug_us != 0 ? s_plug_us.exchange(0) : 0;
+        if (plug_us != 0) {
+            uint32_t latency_us = _stats_latency(&s_presence_stats.last_switch_us, &s_presence_stats.max_switch_us, plug_us);
+            ESP_LOGI(TAG, "Headset plug-in to first sample: %"PRIu32" us", latency_us);
+        }
+        int64_t resume_us = s_resume_us != 0 ? s_resume_us.exchange(0) : 0;
+        if (resume_us != 0) {
+            uint32_t latency_us = _stats_latency(&s_idle_stats.last_resume_latency_us, &s_idle_stats.max_resume_latency_us,
+                                                 resume_us);
+            ESP_LOGD(TAG, "resume to first sample: %"PRIu32" us", latency_us);
+        }
+    }
+    return ret;
+}
+
+esp_err_t UsbSink::set_clock(uint32_t rate, uint32_t bits_cfg, i2s_slot_mode_t ch)
+{
+    esp_err_t ret = ESP_OK;
+    if (s_audio_player_handle == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    xSemaphoreTake(s_stream_lock, portMAX_DELAY);
+    // the device is only closed under the lock, the handle stays valid until we release it
+    uac_host_device_handle_t handle = s_audio_player_handle;
+    if (handle == NULL) {
+        xSemaphoreGive(s_stream_lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    // the device keeps its native format, the write path converts bit depth and channels
+    const uac_host_stream_config_t stm_config = {
+        .channels = s_device_ch,
+        .bit_resolution = s_device_bits,
+        .sample_freq = rate,
+    };
+    if (s_stream_started && stm_config.channels == s_stream_config.channels &&
+            stm_config.bit_resolution == s_stream_config.bit_resolution &&
+            stm_config.sample_freq == s_stream_config.sample_freq) {
+        // same format as the running stream, keep it open
+        ret = _uac_stream_resume_locked();
+        xSemaphoreGive(s_stream_lock);
+        return ret;
+    }
+    ESP_LOGI(TAG, "Re-config: speaker rate %"PRIu32", bits %"PRIu32", mode %s", rate, bits_cfg, ch == 1 ? "MONO" : (ch == 2 ? "STEREO" : "INVALID"));
+    ret = uac_host_device_stop(handle);
+    s_stream_started = false;
+    s_stream_suspended = false;
+    if (ret == ESP_OK) {
+        ret = uac_host_device_start(handle, &stm_config);
+    }
+    s_stream_config = stm_config;
+    if (ret == ESP_OK) {
+        s_stream_started = true;
+    } else {
+        // writes wait for the recovery, the player can carry on with the new format
+        _uac_recovery_start_locked("re-config");
+        ret = ESP_OK;
+    }
+    xSemaphoreGive(s_stream_lock);
+    return ret;
+}
+
+esp_err_t I2sSink::mute(AUDIO_PLAYER_MUTE_SETTING setting)
+{
+    // Volume saved when muting and restored when unmuting. Restoring volume is necessary
+    // as es8311_set_voice_mute(true) results in voice volume (REG32) being set to zero.
+    bsp_codec_mute_set(setting == AUDIO_PLAYER_MUTE ? true : false);
+
+    // restore the voice volume upon unmuting
+    if (setting == AUDIO_PLAYER_UNMUTE) {
+        s_codec_volume = -1;
+        _codec_sync_volume();
+    }
+    return ESP_OK;
+}
+
+esp_err_t I2sSink::write(void *audio_buffer, size_t len, size_t *bytes_written, uint32_t timeout_ms)
+{
+    return bsp_i2s_write(audio_buffer, len, bytes_written, timeout_ms);
+}
+
+esp_err_t I2sSink::set_clock(uint32_t rate, uint32_t bits_cfg, i2s_slot_mode_t ch)
+{
+#ifdef USBAUDIO_LATENCY
+    // playback wins over a running capture, the format is what stop restores
+    xSemaphoreTake(s_stream_lock, portMAX_DELAY);
+    s_codec_rate = rate;
+    s_codec_bits = bits_cfg;
+    s_codec_ch = ch;
+    esp_err_t ret = bsp_codec_set_fs(rate, bits_cfg, ch);
+    xSemaphoreGive(s_stream_lock);
+    return ret;
+#else
+    return bsp_codec_set_fs(rate, bits_cfg, ch);
+#endif
+}
+
+static esp_err_t _audio_player_mute_fn(AUDIO_PLAYER_MUTE_SETTING setting)
+{
+    // the player unmutes on every track start, a mute from the user wins
+    if (s_user_muted) {
+        setting = AUDIO_PLAYER_MUTE;
+    }
+    return ActiveSink::mute(setting);
+}
+
+#ifdef USBAUDIO_METER
+#define METER_CHUNK_SAMPLES     512
+/* Sink samples narrowed to 16-bit for the meter, only used under the sink write path */
+static int16_t s_meter_buf[METER_CHUNK_SAMPLES];
+
+/* Feed the meter whatever the sink format, 24 and 32-bit go through pcm_convert in chunks */
+static void _audio_meter_tap(const void *audio_buffer, size_t len)
+{
+    uint8_t channels = (uint8_t)s_sink_ch;
+    pcm_format_t format = _pcm_format_from_bits(s_sink_bits);
+    size_t sample_bytes = pcm_format_bytes(format);
+    if (!audio_meter_is_enabled() || channels == 0) {
+        return;
+    }
+    if (format == PCM_FORMAT_S16) {
+        audio_meter_feed((const int16_t *)audio_buffer, len / (sample_bytes * channels), channels);
+        return;
+    }
+    const uint8_t *src = (const uint8_t *)audio_buffer;
+    size_t samples = len / sample_bytes;
+    samples -= samples % channels;
+    while (samples > 0) {
+        // a whole number of frames, mono or stereo
+        size_t n = samples < METER_CHUNK_SAMPLES ? samples : METER_CHUNK_SAMPLES;
+        pcm_convert(s_meter_buf, PCM_FORMAT_S16, src, format, n, channels, NULL);
+        audio_meter_feed(s_meter_buf, n / channels, channels);
+        src += n * sample_bytes;
+        samples -= n;
+    }
+}
+#endif
+
+/**
+ * @brief Sink write path of the player and of the scheduler's silence feeder
+ *
+ * @param feeder: audio_buffer is the feeder's silence, content only once a clip is mixed in
+ */
+static esp_err_t _audio_sink_write(void *audio_buffer, size_t len, size_t *bytes_written, uint32_t timeout_ms, bool feeder)
+{
+    bool content = !feeder;
+#ifdef USBAUDIO_SINK_PROFILE
+    uint32_t start_cycles = esp_cpu_get_cycle_count();
+#endif
+    AUDIO_TRACE_BEGIN(AUDIO_TRACE_SINK_WRITE, len);
+#ifdef USBAUDIO_SCHEDULE
+    xSemaphoreTake(s_sink_write_lock, portMAX_DELAY);
+    if (audio_schedule_process(audio_buffer, len, s_sink_bits, s_sink_ch, s_sink_rate)) {
+        content = true;
+    }
+#endif
+    // attenuation the output's volume control can't give
+    int32_t gain_q15 = _usb_output_active() ? s_usb_gain_q15 : s_codec_gain_q15;
+    if (gain_q15 != AUDIO_VOLUME_UNITY_Q15) {
+        pcm_format_t format = _pcm_format_from_bits(s_sink_bits);
+        pcm_apply_gain(audio_buffer, len / pcm_format_bytes(format), format, gain_q15);
+    }
+#ifdef USBAUDIO_LATENCY
+    audio_latency_process(audio_buffer, len, s_sink_bits, s_sink_ch, s_sink_rate);
+#endif
+#ifdef USBAUDIO_METER
+    _audio_meter_tap(audio_buffer, len);
+#endif
+    *bytes_written = 0;
+    esp_err_t ret = ActiveSink::write(audio_buffer, len, bytes_written, timeout_ms);
+
+    if (ret == ESP_OK && content && s_boot_timeline[BOOT_STAGE_FIRST_AUDIO].end_us == 0) {
+        _boot_stage_end(BOOT_STAGE_FIRST_AUDIO);
+        ESP_LOGI(TAG, "First audio %lld us after app_main, %lld us after esp_timer start",
+                 s_boot_timeline[BOOT_STAGE_FIRST_AUDIO].end_us - s_boot_timeline[BOOT_STAGE_FIRST_AUDIO].start_us,
+                 s_boot_timeline[BOOT_STAGE_FIRST_AUDIO].end_us);
+    }
+#ifdef USBAUDIO_SCHEDULE
+    xSemaphoreGive(s_sink_write_lock);
+#endif
+    AUDIO_TRACE_END(AUDIO_TRACE_SINK_WRITE, *bytes_written);
+#ifdef USBAUDIO_SINK_PROFILE
+    uint32_t cycles = esp_cpu_get_cycle_count() - start_cycles;
+    s_sink_profile.write_calls++;
+    s_sink_profile.write_cycles_total += cycles;
+    if (s_sink_profile.write_cycles_min == 0 || cycles < s_sink_profile.write_cycles_min) {
+        s_sink_profile.write_cycles_min = cycles;
+    }
+#endif
+    return ret;
+}
+
+static esp_err_t _audio_player_write_fn(void *audio_buffer, size_t len, size_t *bytes_written, uint32_t timeout_ms)
+{
+    return _audio_sink_write(audio_buffer, len, bytes_written, timeout_ms, false);
+}
+
+#ifdef USBAUDIO_SCHEDULE
+static esp_err_t _audio_schedule_write_fn(void *audio_buffer, size_t len, size_t *bytes_written, uint32_t timeout_ms)
+{
+    return _audio_sink_write(audio_buffer, len, bytes_written, timeout_ms, true);
+}
+#endif
+
+static esp_err_t _audio_player_std_clock(uint32_t rate, uint32_t bits_cfg, i2s_slot_mode_t ch)
+{
+#ifdef USBAUDIO_SCHEDULE
+    // not while the scheduler feeds the sink in the old format
+    xSemaphoreTake(s_sink_write_lock, portMAX_DELAY);
+#endif
+    s_sink_rate = rate;
+    s_sink_bits = bits_cfg;
+    s_sink_ch = ch;
+    AUDIO_TRACE_INSTANT(AUDIO_TRACE_CLK_SET, rate / 100);
+    esp_err_t ret = ActiveSink::set_clock(rate, bits_cfg, ch);
+#ifdef USBAUDIO_SCHEDULE
+    xSemaphoreGive(s_sink_write_lock);
+#endif
+    return ret;
+}
+
+#ifdef USBAUDIO_MIXER
+#ifndef USBAUDIO_MIXER_DUCK_DB
+#define USBAUDIO_MIXER_DUCK_DB -12.0f
+#endif
+#ifndef USBAUDIO_MIXER_ATTACK_MS
+#define USBAUDIO_MIXER_ATTACK_MS 50
+#endif
+#ifndef USBAUDIO_MIXER_RELEASE_MS
+#define USBAUDIO_MIXER_RELEASE_MS 300
+#endif
+
+/* The audio player feeds the lowest priority mixer stream, announcements open their own */
+static audio_mixer_stream_t s_music_stream = -1;
+/* Player task: the sink got its first clock, s_sink_* only hold the defaults before */
+static bool s_mixer_sink_set = false;
+
+static esp_err_t _audio_player_mixer_write_fn(void *audio_buffer, size_t len, size_t *bytes_written, uint32_t timeout_ms)
+{
+    return audio_mixer_stream_write(s_music_stream, audio_buffer, len, bytes_written, timeout_ms);
+}
+
+/**
+ * @brief Source format change, the sink is only re-configured when the sample rate changes
+ *
+ * The mixer always outputs 16-bit stereo, so a new file in another bit depth or channel
+ * layout only changes the input conversion and the USB stream stays open. The first clock
+ * always reaches the sink: the codec boots in another format than the mixer's 48 kHz.
+ */
+static esp_err_t _audio_player_mixer_clock(uint32_t rate, uint32_t bits_cfg, i2s_slot_mode_t ch)
+{
+    esp_err_t ret = ESP_OK;
+    if (!s_mixer_sink_set || rate != s_sink_rate || s_sink_bits != 16 || s_sink_ch != I2S_SLOT_MODE_STEREO) {
+        // the mixer doesn't resample, follow the source rate
+        ret = _audio_player_std_clock(rate, 16, I2S_SLOT_MODE_STEREO);
+        audio_mixer_set_sample_rate(rate);
+        s_mixer_sink_set = ret == ESP_OK;
+    }
+    if (ret == ESP_OK) {
+        ret = audio_mixer_stream_set_format(s_music_stream, (uint8_t)ch, (uint8_t)bits_cfg);
+    }
+    return ret;
+}
+#endif
+
+/*
+ * Player side of the output: drops the frames decoded before a seek position and counts
+ * the rest for the playback position.
+ */
+static esp_err_t _audio_player_source_write_fn(void *audio_buffer, size_t len, size_t *bytes_written, uint32_t timeout_ms)
+{
+    // the player task decodes between two of its writes, whichever task writes to the sink
+    AUDIO_TRACE_END(AUDIO_TRACE_DECODE, 0);
+    size_t frame_bytes = pcm_format_bytes(_pcm_format_from_bits(s_source_bits)) * s_source_ch;
+    size_t skipped = 0;
+    uint32_t skip = s_skip_frames;
+    if (skip > 0) {
+        size_t frames = len / frame_bytes;
+        skipped = frames < skip ? frames : skip;
+        s_skip_frames -= skipped;
+        s_play_frames += skipped;
+        skipped *= frame_bytes;
+        if (skipped == len) {
+            *bytes_written = len;
+            AUDIO_TRACE_BEGIN(AUDIO_TRACE_DECODE, 0);
+            return ESP_OK;
+        }
+    }
+#ifdef USBAUDIO_MIXER
+    esp_err_t ret = _audio_player_mixer_write_fn((uint8_t *)audio_buffer + skipped, len - skipped, bytes_written, timeout_ms);
+#else
+    esp_err_t ret = _audio_player_write_fn((uint8_t *)audio_buffer + skipped, len - skipped, bytes_written, timeout_ms);
+#endif
+    s_play_frames += *bytes_written / frame_bytes;
+    if (*bytes_written > 0 && s_seek_start_us != 0) {
+        // first audio of the run a seek started
+        _stats_latency(&s_seek_stats.last_latency_us, &s_seek_stats.max_latency_us, s_seek_start_us.exchange(0));
+    }
+    *bytes_written += skipped;
+    AUDIO_TRACE_BEGIN(AUDIO_TRACE_DECODE, 0);
+    return ret;
+}
+
+static esp_err_t _audio_player_source_clock(uint32_t rate, uint32_t bits_cfg, i2s_slot_mode_t ch)
+{
+    s_source_rate = rate;
+    s_source_bits = (uint8_t)bits_cfg;
+    s_source_ch = (uint8_t)ch;
+#ifdef USBAUDIO_MIXER
+    return _audio_player_mixer_clock(rate, bits_cfg, ch);
+#else
+    return _audio_player_std_clock(rate, bits_cfg, ch);
+#endif
+}
+
+static uint32_t _play_position_ms(void)
+{
+    uint32_t rate = s_source_rate;
+    uint32_t elapsed_ms = rate ? (uint32_t)((uint64_t)s_play_frames * 1000 / rate) : 0;
+    return s_play_base_ms + elapsed_ms;
+}
+
+static void _play_position_reset(void)
+{
+    s_play_offset = 0;
+    s_play_base_ms = 0;
+    s_play_frames = 0;
+}
+
+/**
+ * @brief Start MP3_FILE_NAME at a position
+ *
+ * Called from uac_lib_task only, the other tasks ask for a start through _play_request().
+ * The position counters keep following the previous run until the player reads the new one.
+ *
+ * @param point: indexed frame at or before the position, NULL for the start of the file
+ * @param position_ms: where playback is heard from, the frames before it are dropped
+ * @param sample_rate: of the file, to count the frames to drop
+ * @param seek_us: seek() call the start is for, 0 if none
+ */
+static esp_err_t _audio_play_at(const audio_seek_point_t *point, uint32_t position_ms, uint32_t sample_rate,
+                                int64_t seek_us)
+{
+    audio_play_start_t start = {
+        .offset = point ? point->offset : 0,
+        .time_ms = point ? point->time_ms : 0,
+        .skip_frames = 0,
+        .seek_us = seek_us,
+        .run = ++s_play_runs,
+    };
+    position_ms = position_ms > start.time_ms ? position_ms : start.time_ms;
+    start.skip_frames = (uint32_t)((uint64_t)(position_ms - start.time_ms) * sample_rate / 1000);
+    struct stat st;
+    s_play_file_size = stat(SPIFFS_BASE MP3_FILE_NAME, &st) == 0 ? (uint32_t)st.st_size : 0;
+    s_fp = _audio_source_open(SPIFFS_BASE MP3_FILE_NAME, &start);
+    if (s_fp == NULL) {
+        ESP_LOGE(TAG, "unable to open filename '%s'", MP3_FILE_NAME);
+        return ESP_ERR_NOT_FOUND;
+    }
+    ESP_LOGI(TAG, "Playing '%s' from %"PRIu32" ms", MP3_FILE_NAME, position_ms);
+    audio_player_play(s_fp);
+    return ESP_OK;
+}
+
+/* Start from the checkpoint read at boot if it wasn't used yet, else from the beginning */
+static void _audio_play_resume(void)
+{
+#ifdef USBAUDIO_RESUME
+    _state_restore_once();
+    if (s_resume_pending.exchange(false)) {
+        audio_seek_point_t point = {
+            .offset = s_resume_state.offset,
+            .frame = 0,
+            .time_ms = s_resume_state.offset_ms,
+        };
+        uint32_t position_ms = s_resume_state.position_ms;
+        const audio_seek_index_t *index = s_seek_index;
+        if (index != NULL && index->header.file_size == s_resume_state.file_size) {
+            audio_seek_lookup(index, position_ms, &point);
+        } else if (position_ms - point.time_ms > USBAUDIO_SEEK_INTERVAL_MS) {
+            // checkpoint made before the index existed, don't decode the whole way up to it
+            position_ms = point.time_ms;
+        }
+        _audio_play_at(&point, position_ms, s_resume_state.sample_rate, 0);
+        return;
+    }
+#endif
+    _audio_play_at(NULL, 0, 0, 0);
+}
+
+/**
+ * @brief Send a start, pause, stop or seek to uac_lib_task
+ *
+ * Any task, never blocks.
+ *
+ * @return ESP_ERR_TIMEOUT when the event queue is full, the request is dropped
+ */
+static esp_err_t _play_request(play_request_t request, uint32_t position_ms, uint32_t run)
+{
+    s_event_queue_t evt_queue = {};
+    evt_queue.event_group = PLAY_EVENT;
+    evt_queue.play_evt.request = request;
+    evt_queue.play_evt.position_ms = position_ms;
+    evt_queue.play_evt.run = run;
+    evt_queue.play_evt.since_us = esp_timer_get_time();
+    if (xQueueSend(s_event_queue, &evt_queue, 0) != pdTRUE) {
+        s_dropped_events++;
+        ESP_LOGW(TAG, "Play request %d dropped, event queue full", request);
+        return ESP_ERR_TIMEOUT;
+    }
+    return ESP_OK;
+}
+
+static void _audio_player_callback(audio_player_cb_ctx_t *ctx)
+{
+    ESP_LOGI(TAG, "ctx->audio_event = %d", ctx->audio_event);
+    switch (ctx->audio_event) {
+    case audio_player_cb_ctx_t::AUDIO_PLAYER_CALLBACK_EVENT_IDLE: {
+        ESP_LOGI(TAG, "AUDIO_PLAYER_REQUEST_IDLE");
+        if (s_play_stopped) {
+            // the next play starts over
+            _play_position_reset();
+        }
+        if (s_audio_player_handle == NULL) {
+            break;
+        }
+        // don't suspend here, uac_lib_task suspends after the quiet period
+        s_idle_since_us = esp_timer_get_time();
+        if (s_play_stopped) {
+            break;
+        }
+        _play_request(PLAY_REQUEST_LOOP, 0, s_play_run);
+        break;
+    }
+    case audio_player_cb_ctx_t::AUDIO_PLAYER_CALLBACK_EVENT_PLAYING:
+        ESP_LOGI(TAG, "AUDIO_PLAYER_REQUEST_PLAY");
+        if (s_audio_player_handle == NULL) {
+            break;
+        }
+        xSemaphoreTake(s_stream_lock, portMAX_DELAY);
+        s_idle_since_us = 0;
+        if (_uac_stream_resume_locked() != ESP_OK) {
+            _uac_recovery_start_locked("resume");
+        }
+        _uac_stream_sync_volume_locked();
+        xSemaphoreGive(s_stream_lock);
+        break;
+    case audio_player_cb_ctx_t::AUDIO_PLAYER_CALLBACK_EVENT_PAUSE:
+        ESP_LOGI(TAG, "AUDIO_PLAYER_REQUEST_PAUSE");
+        break;
+    default:
+        break;
+    }
+}
+
+static void _usbaudio_play(void)
+{
+    s_play_stopped = false;
+    audio_player_state_t state = audio_player_get_state();
+    if (state == AUDIO_PLAYER_STATE_PAUSE) {
+        audio_player_resume();
+    } else if (state == AUDIO_PLAYER_STATE_IDLE) {
+        _audio_play_resume();
+    }
+}
+
+/* uac_lib_task: apply a PLAY_EVENT */
+static void _play_apply(play_request_t request, uint32_t position_ms, uint32_t run, int64_t since_us)
+{
+    switch (request) {
+    case PLAY_REQUEST_PLAY:
+        _usbaudio_play();
+        break;
+    case PLAY_REQUEST_PAUSE:
+        audio_player_pause();
+        break;
+    case PLAY_REQUEST_STOP:
+        s_play_stopped = true;
+        s_unplug_paused = false;
+#ifdef USBAUDIO_RESUME
+        s_resume_pending = false;
+#endif
+        audio_player_stop();
+        break;
+    case PLAY_REQUEST_SEEK: {
+        // checked by seek(), the index is never unpublished
+        const audio_seek_index_t *index = s_seek_index;
+        audio_seek_point_t point;
+        audio_seek_lookup(index, position_ms, &point);
+        s_play_stopped = false;
+        s_unplug_paused = false;
+#ifdef USBAUDIO_RESUME
+        s_resume_pending = false;
+#endif
+        if (_audio_play_at(&point, position_ms, index->header.sample_rate, since_us) != ESP_OK) {
+            _stats_add(&s_seek_stats.failed, 1);
+        }
+        break;
+    }
+    case PLAY_REQUEST_LOOP:
+        // not when a start, a seek or a stop came after the run that ended
+        if (run != s_play_runs || s_play_stopped) {
+            break;
+        }
+        ESP_LOGI(TAG, "Play in loop");
+        _audio_play_at(NULL, 0, 0, 0);
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * @brief Record that a control request is pending and wake uac_lib_task
+ *
+ * Any task. Only the first request of a burst posts an event, the rest are folded into it.
+ *
+ * @param since_us: esp_timer time of the request, e.g. when the key report arrived
+ */
+static void _control_request(int64_t since_us)
+{
+    int64_t expected = 0;
+    s_pending_since_us.compare_exchange_strong(expected, since_us);
+    s_control_requests++;
+    if (s_control_queued.exchange(true)) {
+        return;
+    }
+    s_event_queue_t evt_queue = {};
+    evt_queue.event_group = CONTROL_EVENT;
+    if (xQueueSend(s_event_queue, &evt_queue, 0) != pdTRUE) {
+        // picked up by the periodic check instead
+        s_control_queued = false;
+    }
+}
+
+/* uac_lib_task: bring the active output to the user volume, returns the transfers sent */
+static uint32_t _volume_sync(void)
+{
+    uint32_t transfers = 0;
+    if (_usb_output_active()) {
+        xSemaphoreTake(s_stream_lock, portMAX_DELAY);
+        // a suspended speaker gets the volume when it resumes
+        if (s_audio_player_handle != NULL && s_stream_started && !s_stream_suspended) {
+            transfers += _uac_stream_sync_volume_locked();
+        }
+        xSemaphoreGive(s_stream_lock);
+    } else {
+        transfers += _codec_sync_volume();
+    }
+    return transfers;
+}
+
+/**
+ * @brief Apply the pending control requests
+ *
+ * Called from uac_lib_task. Volume presses are summed into one volume change, mute and
+ * play/pause presses only count by their parity. The latency recorded runs from the oldest
+ * request to the last control transfer returning, after which the change is audible.
+ */
+static void _control_apply(void)
+{
+    s_control_queued = false;
+    int64_t since_us = s_pending_since_us.exchange(0);
+    if (since_us == 0) {
+        return;
+    }
+    int steps = s_pending_volume_steps.exchange(0);
+    int mute_toggles = s_pending_mute_toggles.exchange(0);
+    int play_toggles = s_pending_play_toggles.exchange(0);
+    uint32_t transfers = 0;
+
+    if (steps != 0) {
+        int volume = _usbaudio_volume() + steps * USBAUDIO_VOLUME_STEP;
+        s_volume = volume < 0 ? 0 : (volume > 100 ? 100 : volume);
+    }
+    transfers += _volume_sync();
+    if (mute_toggles & 1) {
+        s_user_muted = !s_user_muted;
+        ESP_LOGI(TAG, "User %s", s_user_muted ? "mute" : "unmute");
+        _audio_player_mute_fn(s_user_muted ? AUDIO_PLAYER_MUTE : AUDIO_PLAYER_UNMUTE);
+        transfers++;
+    }
+    if (play_toggles & 1) {
+        if (audio_player_get_state() == AUDIO_PLAYER_STATE_PLAYING) {
+            audio_player_pause();
+        } else {
+            _usbaudio_play();
+        }
+    }
+
+    _stats_add(&s_control_stats.transfers, transfers);
+    _stats_latency(&s_control_stats.last_latency_us, &s_control_stats.max_latency_us, since_us);
+}
+
+#ifdef USBAUDIO_HID
+/* HID driver task, on key press */
+static void _hid_key_cb(audio_hid_key_t key, int64_t pressed_us)
+{
+    switch (key) {
+    case AUDIO_HID_KEY_VOLUME_UP:
+        s_pending_volume_steps++;
+        break;
+    case AUDIO_HID_KEY_VOLUME_DOWN:
+        s_pending_volume_steps--;
+        break;
+    case AUDIO_HID_KEY_MUTE:
+        s_pending_mute_toggles++;
+        break;
+    case AUDIO_HID_KEY_PLAY_PAUSE:
+        s_pending_play_toggles++;
+        break;
+    default:
+        return;
+    }
+    _control_request(pressed_us);
+}
+#endif
+
+/**
+ * @brief Index MP3_FILE_NAME for seeks and checkpoints, built once and stored next to the file
+ *
+ * Low priority, the first build reads the whole file unless tools/mkseek.py made the index
+ * on the host. Until the index is published seek() fails and the checkpoints fall back to
+ * the frame the current run was opened at.
+ */
+static void seek_index_task(void *arg)
+{
+    const char *path = SPIFFS_BASE MP3_FILE_NAME;
+    char index_path[128];
+    snprintf(index_path, sizeof(index_path), "%s" AUDIO_SEEK_SUFFIX, path);
+    struct stat st;
+    audio_seek_index_t *index = (audio_seek_index_t *)malloc(sizeof(audio_seek_index_t));
+    esp_err_t ret = index == NULL ? ESP_ERR_NO_MEM : (stat(path, &st) == 0 ? ESP_OK : ESP_ERR_NOT_FOUND);
+    if (ret == ESP_OK && audio_seek_load(index_path, (uint32_t)st.st_size, index) != ESP_OK) {
+        int64_t start_us = esp_timer_get_time();
+        FILE *fp = fopen(path, "rb");
+        ret = fp == NULL ? ESP_ERR_NOT_FOUND : audio_seek_build(fp, USBAUDIO_SEEK_INTERVAL_MS, index);
+        if (fp != NULL) {
+            fclose(fp);
+        }
+        if (ret == ESP_OK) {
+            ESP_LOGI(TAG, "Seek index of '%s': %"PRIu32" entries in %lld ms", MP3_FILE_NAME,
+                     index->header.count, (esp_timer_get_time() - start_us) / 1000);
+            if (audio_seek_save(index_path, index) != ESP_OK) {
+                ESP_LOGW(TAG, "Seek index not saved, built again on next boot");
+            }
+        }
+    }
+    if (ret == ESP_OK) {
+        s_seek_index = index;
+    } else {
+        ESP_LOGW(TAG, "No seek index for '%s': %s", MP3_FILE_NAME, esp_err_to_name(ret));
+        free(index);
+    }
+    vTaskDelete(NULL);
+}
+
+#ifdef USBAUDIO_RESUME
+/**
+ * @brief Read the checkpoint at boot: volume and mute right away, the position on next start
+ *
+ * A checkpoint of another file, or of this one before it was replaced, only keeps the
+ * volume and mute state.
+ */
+static void _state_restore(void)
+{
+    const audio_state_config_t config = {
+        .checkpoint_interval_ms = USBAUDIO_STATE_INTERVAL_S * 1000,
+        .min_interval_ms = USBAUDIO_STATE_MIN_INTERVAL_MS,
+    };
+    audio_state_t state;
+    if (audio_state_init(&config, &state) != ESP_OK) {
+        return;
+    }
+    if (state.volume != AUDIO_STATE_VOLUME_SYSTEM) {
+        s_volume = state.volume > 100 ? 100 : state.volume;
+    }
+    s_user_muted = state.muted != 0;
+    // paused or stopped stays so until play()
+    s_play_stopped = state.play != AUDIO_STATE_PLAYING;
+    struct stat st;
+    if (state.play != AUDIO_STATE_STOPPED && state.offset_ms > 0 && strcmp(state.source, MP3_FILE_NAME) == 0 &&
+            stat(SPIFFS_BASE MP3_FILE_NAME, &st) == 0 && (uint32_t)st.st_size == state.file_size &&
+            state.offset < state.file_size) {
+        s_resume_state = state;
+        s_resume_pending = true;
+    }
+    ESP_LOGI(TAG, "Restored: volume %d, %s, %s at %"PRIu32" ms", _usbaudio_volume(),
+             s_user_muted ? "muted" : "unmuted", state.play == AUDIO_STATE_PLAYING ? "playing" :
+             (state.play == AUDIO_STATE_PAUSED ? "paused" : "stopped"), s_resume_pending ? state.position_ms : 0);
+}
+
+/**
+ * @brief Restore once the files are mounted, before the first start and checkpoint
+ *
+ * uac_lib_task owns the playback state and audio_state, so the restore runs there: from
+ * its loop, or from the first start if that comes earlier.
+ */
+static void _state_restore_once(void)
+{
+    static bool s_restored = false;
+    if (s_restored || !(xEventGroupGetBits(s_boot_events) & BOOT_READY_FILES)) {
+        return;
+    }
+    s_restored = true;
+    _state_restore();
+    _volume_sync();
+}
+
+/**
+ * @brief Hand the current state to audio_state, which decides whether it is written
+ *
+ * Called from uac_lib_task on every wake-up. The position is stored as the indexed frame
+ * at or before it, so the resume needs neither the index nor a scan.
+ */
+static void _state_checkpoint(void)
+{
+    audio_state_t state;
+    audio_player_state_t player = audio_player_get_state();
+    if (player == AUDIO_PLAYER_STATE_IDLE && s_resume_pending) {
+        // not started since boot, keep the stored point
+        state = s_resume_state;
+    } else {
+        memset(&state, 0, sizeof(state));
+        strlcpy(state.source, MP3_FILE_NAME, sizeof(state.source));
+        state.file_size = s_play_file_size;
+        state.position_ms = _play_position_ms();
+        const audio_seek_index_t *index = s_seek_index;
+        if (index != NULL && index->header.file_size == state.file_size) {
+            audio_seek_point_t point;
+            audio_seek_lookup(index, state.position_ms, &point);
+            state.offset = point.offset;
+            state.offset_ms = point.time_ms;
+        } else {
+            state.offset = s_play_offset;
+            state.offset_ms = s_play_base_ms;
+        }
+        state.sample_rate = s_source_rate;
+        state.bits = s_source_bits;
+        state.channels = s_source_ch;
+    }
+    state.version = AUDIO_STATE_VERSION;
+    if (player == AUDIO_PLAYER_STATE_PLAYING || (player == AUDIO_PLAYER_STATE_IDLE && !s_play_stopped)) {
+        state.play = AUDIO_STATE_PLAYING;
+    } else if (player == AUDIO_PLAYER_STATE_PAUSE || s_resume_pending) {
+        state.play = AUDIO_STATE_PAUSED;
+    } else {
+        state.play = AUDIO_STATE_STOPPED;
+    }
+    int volume = s_volume;
+    state.volume = volume < 0 ? AUDIO_STATE_VOLUME_SYSTEM : (uint8_t)volume;
+    state.muted = s_user_muted;
+    audio_state_save(&state, s_state_urgent.exchange(false));
+}
+#endif
+
+static void uac_device_callback(uac_host_device_handle_t uac_device_handle, const uac_host_device_event_t event, void *arg)
+{
+    if (event == UAC_HOST_DRIVER_EVENT_DISCONNECTED) {
+        // stop feeding the device right away, uac_lib_task closes it
+        uac_host_device_handle_t expected = uac_device_handle;
+        if (s_audio_player_handle.compare_exchange_strong(expected, NULL)) {
+            audio_player_type = AUDIO_PLAYER_I2S;
+        }
+#ifdef USBAUDIO_MIC_FEED
+        expected = uac_device_handle;
+        s_mic_handle.compare_exchange_strong(expected, NULL);
+#endif
+    }
+    if (event == UAC_HOST_DEVICE_EVENT_TX_DONE) {
+        AUDIO_TRACE_INSTANT(AUDIO_TRACE_USB_TX_DONE, 0);
+    } else if (event == UAC_HOST_DEVICE_EVENT_TRANSFER_ERROR) {
+        AUDIO_TRACE_INSTANT(AUDIO_TRACE_USB_ERROR, 0);
+    }
+    // Send uac device event to the event queue
+    s_event_queue_t evt_queue = {};
+    evt_queue.event_group = UAC_DEVICE_EVENT;
+    evt_queue.device_evt.handle = uac_device_handle;
+    evt_queue.device_evt.event = event;
+    evt_queue.device_evt.arg = arg;
+    // should not block here
+    if (xQueueSend(s_event_queue, &evt_queue, 0) != pdTRUE) {
+        s_dropped_events++;
+        if (event == UAC_HOST_DRIVER_EVENT_DISCONNECTED) {
+            // the device must still be closed, uac_lib_task picks it up from here
+            s_lost_disconnect = uac_device_handle;
+        }
+    }
+}
+
+static void uac_host_lib_callback(uint8_t addr, uint8_t iface_num, const uac_host_driver_event_t event, void *arg)
+{
+    if (event == UAC_HOST_DRIVER_EVENT_TX_CONNECTED) {
+        s_plug_us = esp_timer_get_time();
+    }
+    // Send uac driver event to the event queue
+    s_event_queue_t evt_queue = {};
+    evt_queue.event_group = UAC_DRIVER_EVENT;
+    evt_queue.driver_evt.addr = addr;
+    evt_queue.driver_evt.iface_num = iface_num;
+    evt_queue.driver_evt.event = event;
+    evt_queue.driver_evt.arg = arg;
+    if (xQueueSend(s_event_queue, &evt_queue, 0) != pdTRUE) {
+        s_dropped_events++;
+    }
+}
+
+#ifdef USBAUDIO_MIC_FEED
+/**
+ * @brief Close the microphone once the capture task doesn't read from it anymore
+ *
+ * Bounded like the speaker close: a read still in the driver after USBAUDIO_CLOSE_TIMEOUT_MS
+ * keeps the microphone open, uac_lib_task closes it on a later pass.
+ */
+static void _uac_mic_close(uac_host_device_handle_t handle)
 {
-    esp_err_t ret = ESP_OK;
-    if (audio_player_type == AUDIO_PLAYER_I2S) {
-        ret = bsp_i2s_write(audio_buffer, len, bytes_written, timeout_ms);
-    } else {
-        if (s_audio_player_handle == NULL) {
-            return ESP_ERR_INVALID_STATE;
-        }
-        *bytes_written = 0;
-        esp_err_t ret = uac_host_device_write(s_audio_player_handle, audio_buffer, len, timeout_ms);
-        if (ret == ESP_OK) {
-            *bytes_written = len;
+    if (handle == NULL || handle != s_mic_open_handle) {
+        return;
+    }
+    uac_host_device_handle_t expected = handle;
+    s_mic_handle.compare_exchange_strong(expected, NULL);
+    bool retry = handle == s_mic_close_pending;
+    int64_t deadline_us = esp_timer_get_time() + (retry ? 0 : (int64_t)USBAUDIO_CLOSE_TIMEOUT_MS * 1000);
+    while (s_mic_users > 0) {
+        if (esp_timer_get_time() >= deadline_us) {
+            if (!retry) {
+                ESP_LOGE(TAG, "UAC MIC still read from after %d ms, close deferred", USBAUDIO_CLOSE_TIMEOUT_MS);
+                s_mic_close_pending = handle;
+            }
+            return;
         }
+        vTaskDelay(1);
     }
-
-    return ret;
+    s_mic_close_pending = NULL;
+    esp_err_t ret = uac_host_device_close(handle);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "UAC MIC close failed: %s", esp_err_to_name(ret));
+    }
+    s_mic_open_handle = NULL;
+    ESP_LOGI(TAG, "UAC MIC closed");
 }
 
-static esp_err_t _audio_player_std_clock(uint32_t rate, uint32_t bits_cfg, i2s_slot_mode_t ch)
+/**
+ * @brief Open a headset microphone in 48 kHz 16-bit, mono or stereo
+ *
+ * Only settings that take 48 kHz count, the feed doesn't resample.
+ */
+static void _uac_mic_open(uint8_t addr, uint8_t iface_num)
 {
-    esp_err_t ret = ESP_OK;
-
-    if (audio_player_type == AUDIO_PLAYER_I2S) {
-        ret = bsp_codec_set_fs(rate, bits_cfg, ch);
-    } else {
-        if (s_audio_player_handle == NULL) {
-            return ESP_ERR_INVALID_STATE;
-        }
-        ESP_LOGI(TAG, "Re-config: speaker rate %"PRIu32", bits %"PRIu32", mode %s", rate, bits_cfg, ch == 1 ? "MONO" : (ch == 2 ? "STEREO" : "INVALID"));
-        ESP_ERROR_CHECK(uac_host_device_stop(s_audio_player_handle));
-        const uac_host_stream_config_t stm_config = {
-            .channels = ch,
-            .bit_resolution = bits_cfg,
-            .sample_freq = rate,
-        };
-        ret = uac_host_device_start(s_audio_player_handle, &stm_config);
+    uac_host_device_handle_t handle = NULL;
+    const uac_host_device_config_t dev_config = {
+        .addr = addr,
+        .iface_num = iface_num,
+        .buffer_size = sizeof(s_mic_buf) * 4,
+        .buffer_threshold = 0,
+        .callback = uac_device_callback,
+        .callback_arg = NULL,
+    };
+    _uac_mic_close(s_mic_open_handle);
+    if (s_mic_open_handle != NULL) {
+        ESP_LOGE(TAG, "UAC MIC connect ignored, the previous one is not closed yet");
+        return;
     }
-    return ret;
+    esp_err_t ret = uac_host_device_open(&dev_config, &handle);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "UAC MIC open failed: %s", esp_err_to_name(ret));
+        return;
+    }
+    s_mic_open_handle = handle;
+    uac_host_dev_info_t dev_info;
+    if (uac_host_get_device_info(handle, &dev_info) != ESP_OK) {
+        _uac_mic_close(handle);
+        return;
+    }
+    uint8_t channels = 0;
+    for (uint8_t alt = 1; alt <= dev_info.iface_alt_num; alt++) {
+        uac_host_dev_alt_param_t param;
+        if (uac_host_get_device_alt_param(handle, alt, &param) == ESP_OK && param.bit_resolution == 16 &&
+                param.channels >= 1 && param.channels <= 2 && param.channels > channels &&
+                _uac_alt_supports_rate(&param, AUDIO_MIC_FEED_INPUT_RATE)) {
+            channels = param.channels;
+        }
+    }
+    if (channels == 0) {
+        ESP_LOGW(TAG, "UAC MIC has no 48 kHz 16-bit mono/stereo setting, not captured");
+        _uac_mic_close(handle);
+        return;
+    }
+    const uac_host_stream_config_t stm_config = {
+        .channels = channels,
+        .bit_resolution = 16,
+        .sample_freq = AUDIO_MIC_FEED_INPUT_RATE,
+    };
+    ret = uac_host_device_start(handle, &stm_config);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "UAC MIC start failed: %s", esp_err_to_name(ret));
+        _uac_mic_close(handle);
+        return;
+    }
+    s_mic_channels = channels;
+    s_mic_handle = handle;
+    xTaskNotifyGive(s_mic_task);
+    ESP_LOGI(TAG, "UAC MIC capturing, %u channel(s)", channels);
 }
 
-static void _audio_player_callback(audio_player_cb_ctx_t *ctx)
+/**
+ * @brief Read the headset microphone and turn it into the 16 kHz mono feed
+ */
+static void mic_capture_task(void *arg)
 {
-    ESP_LOGI(TAG, "ctx->audio_event = %d", ctx->audio_event);
-    switch (ctx->audio_event) {
-    case AUDIO_PLAYER_CALLBACK_EVENT_IDLE: {
-        ESP_LOGI(TAG, "AUDIO_PLAYER_REQUEST_IDLE");
-        if (s_audio_player_handle == NULL) {
-            break;
+    bool streaming = false;
+    while (true) {
+        s_mic_users++;
+        uac_host_device_handle_t handle = s_mic_handle;
+        if (handle == NULL) {
+            s_mic_users--;
+            streaming = false;
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+            continue;
         }
-        ESP_ERROR_CHECK(uac_host_device_suspend(s_audio_player_handle));
-        ESP_LOGI(TAG, "Play in loop");
-        s_fp = fopen(SPIFFS_BASE MP3_FILE_NAME, "rb");
-        if (s_fp) {
-            ESP_LOGI(TAG, "Playing '%s'", MP3_FILE_NAME);
-            audio_player_play(s_fp);
-        } else {
-            ESP_LOGE(TAG, "unable to open filename '%s'", MP3_FILE_NAME);
+        if (!streaming) {
+            // new stream, no history from the previous device
+            audio_mic_feed_reset();
+            streaming = true;
         }
-        break;
-    }
-    case AUDIO_PLAYER_CALLBACK_EVENT_PLAYING:
-        ESP_LOGI(TAG, "AUDIO_PLAYER_REQUEST_PLAY");
-        if (s_audio_player_handle == NULL) {
-            break;
+        uint8_t channels = s_mic_channels;
+        uint32_t bytes_read = 0;
+        esp_err_t ret = uac_host_device_read(handle, (uint8_t *)s_mic_buf,
+                                             USBAUDIO_MIC_READ_FRAMES * channels * sizeof(int16_t), &bytes_read, 20);
+        s_mic_users--;
+        size_t frames = bytes_read / (channels * sizeof(int16_t));
+        if (ret == ESP_OK && frames > 0) {
+            // the last frame was captured about now
+            int64_t capture_us = esp_timer_get_time() - (int64_t)frames * 1000000 / AUDIO_MIC_FEED_INPUT_RATE;
+            audio_mic_feed_process(s_mic_buf, frames, channels, capture_us);
+        } else if (ret != ESP_OK && ret != ESP_ERR_TIMEOUT) {
+            vTaskDelay(pdMS_TO_TICKS(10));
         }
-        ESP_ERROR_CHECK(uac_host_device_resume(s_audio_player_handle));
-        uac_host_device_set_volume(s_audio_player_handle, get_sys_volume());
-        break;
-    case AUDIO_PLAYER_CALLBACK_EVENT_PAUSE:
-        ESP_LOGI(TAG, "AUDIO_PLAYER_REQUEST_PAUSE");
-        break;
-    default:
-        break;
     }
 }
+#endif
 
-static void uac_device_callback(uac_host_device_handle_t uac_device_handle, const uac_host_device_event_t event, void *arg)
+/**
+ * @brief Close a speaker once no writer uses its handle anymore
+ *
+ * Writers blocked in uac_host_device_write return once the device is gone. One still in
+ * the driver after USBAUDIO_CLOSE_TIMEOUT_MS keeps the device open, uac_lib_task closes it
+ * on a later pass instead of waiting any longer.
+ */
+static void _uac_device_close(uac_host_device_handle_t handle)
 {
-    if (event == UAC_HOST_DRIVER_EVENT_DISCONNECTED) {
+#ifdef USBAUDIO_MIC_FEED
+    if (handle != NULL && handle == s_mic_open_handle) {
+        _uac_mic_close(handle);
+        return;
+    }
+#endif
+    if (handle == NULL || handle != s_open_handle) {
+        return;
+    }
+    xSemaphoreTake(s_stream_lock, portMAX_DELAY);
+    uac_host_device_handle_t expected = handle;
+    if (s_audio_player_handle.compare_exchange_strong(expected, NULL)) {
         audio_player_type = AUDIO_PLAYER_I2S;
-        // stop audio player first
-        s_audio_player_handle = NULL;
-        // audio_player_stop();
-        ESP_LOGI(TAG, "UAC Device disconnected");
-        ESP_ERROR_CHECK(uac_host_device_close(uac_device_handle));
+    }
+    _uac_stream_reset();
+    xSemaphoreGive(s_stream_lock);
+    if (!_usb_output_active()) {
+        // volume changes made while the headset played only went to the headset
+        _codec_sync_volume();
+    }
+    bool retry = handle == s_close_pending;
+    if (!_uac_handle_wait_released(retry ? 0 : USBAUDIO_CLOSE_TIMEOUT_MS)) {
+        if (!retry) {
+            ESP_LOGE(TAG, "UAC Device still written to after %d ms, close deferred", USBAUDIO_CLOSE_TIMEOUT_MS);
+            s_close_pending = handle;
+        }
         return;
     }
-    // Send uac device event to the event queue
-    s_event_queue_t evt_queue = {
-        .event_group = UAC_DEVICE_EVENT,
-        .device_evt.handle = uac_device_handle,
-        .device_evt.event = event,
-        .device_evt.arg = arg
-    };
-    // should not block here
-    xQueueSend(s_event_queue, &evt_queue, 0);
+    s_close_pending = NULL;
+    esp_err_t ret = uac_host_device_close(handle);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "UAC Device close failed: %s", esp_err_to_name(ret));
+    }
+    s_open_handle = NULL;
+    _stats_add(&s_hotplug_stats.closed_count, 1);
+    ESP_LOGI(TAG, "UAC Device closed");
+#ifdef USBAUDIO_SINK_USB
+    // nowhere else to play, hold the position until the headset is back
+    if (audio_player_get_state() == AUDIO_PLAYER_STATE_PLAYING) {
+        s_unplug_paused = true;
+        audio_player_pause();
+    }
+#endif
+#ifdef USBAUDIO_RESUME
+    s_state_urgent = true;
+#endif
+    _presence_set(false);
 }
 
-static void uac_host_lib_callback(uint8_t addr, uint8_t iface_num, const uac_host_driver_event_t event, void *arg)
+/* uac_lib_task: tell the listeners when the headset comes or goes */
+static void _presence_set(bool present)
 {
-    // Send uac driver event to the event queue
-    s_event_queue_t evt_queue = {
-        .event_group = UAC_DRIVER_EVENT,
-        .driver_evt.addr = addr,
-        .driver_evt.iface_num = iface_num,
-        .driver_evt.event = event,
-        .driver_evt.arg = arg
-    };
-    xQueueSend(s_event_queue, &evt_queue, 0);
+    if (s_headset_present.exchange(present) == present) {
+        return;
+    }
+    _stats_add(present ? &s_presence_stats.connect_count : &s_presence_stats.disconnect_count, 1);
+    int count = s_presence_listener_count;
+    for (int i = 0; i < count; i++) {
+        s_presence_listeners[i].cb(present, s_presence_listeners[i].arg);
+    }
 }
 
 /**
@@ -205,9 +1976,11 @@ static void usb_lib_task(void *arg)
         .intr_flags = ESP_INTR_FLAG_LEVEL2,
     };
 
+    _boot_stage_begin(BOOT_STAGE_USB_HOST);
     ESP_ERROR_CHECK(usb_host_install(&host_config));
+    _boot_stage_end(BOOT_STAGE_USB_HOST);
     ESP_LOGI(TAG, "USB Host installed");
-    xTaskNotifyGive(arg);
+    xTaskNotifyGive((TaskHandle_t)arg);
 
     while (true) {
         uint32_t event_flags;
@@ -239,52 +2012,123 @@ static void uac_lib_task(void *arg)
         .callback_arg = NULL
     };
 
+    _boot_stage_begin(BOOT_STAGE_UAC_DRIVER);
     ESP_ERROR_CHECK(uac_host_install(&uac_config));
+    _boot_stage_end(BOOT_STAGE_UAC_DRIVER);
     ESP_LOGI(TAG, "UAC Class Driver installed");
-    s_event_queue_t evt_queue = {0};
+#ifdef USBAUDIO_HID
+    /* Headset keys come on a HID interface of the same device. hid_host is a second USB host
+       client: both drivers open the device but each claims only its own class of interface,
+       uac_host the audio streaming ones as a stream starts, hid_host the HID one as it opens. */
+    const audio_hid_config_t hid_config = {
+        .key_cb = _hid_key_cb,
+        .task_priority = UAC_TASK_PRIORITY,
+        .task_core = 0,
+    };
+    if (audio_hid_start(&hid_config) != ESP_OK) {
+        ESP_LOGW(TAG, "Headset keys not available");
+    }
+#endif
+    s_event_queue_t evt_queue = {};
     while (1) {
-        if (xQueueReceive(s_event_queue, &evt_queue, pdMS_TO_TICKS(100))) {
+        if (xQueueReceive(s_event_queue, &evt_queue, _uac_lib_wait_ticks())) {
             if (UAC_DRIVER_EVENT ==  evt_queue.event_group) {
                 uac_host_driver_event_t event = evt_queue.driver_evt.event;
                 uint8_t addr = evt_queue.driver_evt.addr;
                 uint8_t iface_num = evt_queue.driver_evt.iface_num;
                 switch (event) {
                 case UAC_HOST_DRIVER_EVENT_TX_CONNECTED: {
-                    audio_player_type = AUDIO_PLAYER_USB;
+#ifdef USBAUDIO_SINK_I2S
+                    // speaker build, the headset is not claimed
+                    ESP_LOGI(TAG, "UAC Device connected: SPK, not used, the output is the I2S speaker");
+                    s_plug_us = 0;
+#else
                     uac_host_dev_info_t dev_info;
                     uac_host_device_handle_t uac_device_handle = NULL;
                     const uac_host_device_config_t dev_config = {
                         .addr = addr,
                         .iface_num = iface_num,
-                        .buffer_size = 16000,
-                        .buffer_threshold = 4000,
+                        .buffer_size = USBAUDIO_UAC_BUFFER_SIZE,
+                        .buffer_threshold = USBAUDIO_UAC_BUFFER_THRESHOLD,
                         .callback = uac_device_callback,
                         .callback_arg = NULL,
                     };
-                    ESP_ERROR_CHECK(uac_host_device_open(&dev_config, &uac_device_handle));
-                    ESP_ERROR_CHECK(uac_host_get_device_info(uac_device_handle, &dev_info));
+                    // a connect without a disconnect in between, don't leak the old handle
+                    _uac_device_close(s_open_handle);
+                    if (s_open_handle != NULL) {
+                        // a writer still holds the previous speaker, see _uac_device_close()
+                        ESP_LOGE(TAG, "UAC Device connect ignored, the previous one is not closed yet");
+                        s_plug_us = 0;
+                        break;
+                    }
+                    esp_err_t open_ret = uac_host_device_open(&dev_config, &uac_device_handle);
+                    if (open_ret != ESP_OK) {
+                        // e.g. unplugged again before we got here
+                        ESP_LOGE(TAG, "UAC Device open failed: %s", esp_err_to_name(open_ret));
+                        s_plug_us = 0;
+                        break;
+                    }
+                    s_open_handle = uac_device_handle;
+                    _stats_add(&s_hotplug_stats.opened_count, 1);
+                    if (uac_host_get_device_info(uac_device_handle, &dev_info) != ESP_OK) {
+                        _uac_device_close(uac_device_handle);
+                        break;
+                    }
                     ESP_LOGI(TAG, "UAC Device connected: SPK");
                     uac_host_printf_device_param(uac_device_handle);
+                    uint8_t bits;
+                    uint8_t channels;
+                    _uac_pick_device_format(uac_device_handle, &dev_info, &bits, &channels);
+                    audio_volume_range_t range;
+                    esp_err_t range_ret = audio_volume_read_range(addr, &range);
+                    if (range_ret != ESP_OK) {
+                        ESP_LOGW(TAG, "No speaker volume range (%s), volume in software only", esp_err_to_name(range_ret));
+                    }
                     const uac_host_stream_config_t stm_config = {
-                        .channels = 2,
-                        .bit_resolution = 16,
-                        .sample_freq = 48000,
+                        .channels = channels,
+                        .bit_resolution = bits,
+                        .sample_freq = _uac_start_rate(uac_device_handle, &dev_info, bits, channels),
                     };
-                    ESP_ERROR_CHECK(uac_host_device_start(uac_device_handle, &stm_config));
+                    esp_err_t start_ret = uac_host_device_start(uac_device_handle, &stm_config);
+                    xSemaphoreTake(s_stream_lock, portMAX_DELAY);
+                    _uac_stream_reset();
+                    s_device_bits = bits;
+                    s_device_ch = channels;
+                    pcm_dither_init(&s_sink_dither, true);
+                    s_device_range = range;
+                    s_device_has_range = range_ret == ESP_OK;
                     s_audio_player_handle = uac_device_handle;
-                    uac_host_device_set_volume(s_audio_player_handle, get_sys_volume());
-                    s_fp = fopen(SPIFFS_BASE MP3_FILE_NAME, "rb");
-                    if (s_fp) {
-                        ESP_LOGI(TAG, "Playing '%s'", MP3_FILE_NAME);
-                        audio_player_play(s_fp);
+                    audio_player_type = AUDIO_PLAYER_USB;
+                    s_stream_config = stm_config;
+                    if (start_ret == ESP_OK) {
+                        s_stream_started = true;
+                        _uac_stream_sync_volume_locked();
                     } else {
-                        ESP_LOGE(TAG, "unable to open filename '%s'", MP3_FILE_NAME);
+                        _uac_recovery_start_locked("start");
                     }
+                    xSemaphoreGive(s_stream_lock);
+                    // the mixer keeps the source rate, the stream was started in it when the device has it
+                    _presence_set(true);
+                    // the device can enumerate before SPIFFS and the player are ready
+                    xEventGroupWaitBits(s_boot_events, BOOT_READY_FILES | BOOT_READY_PLAYER, pdFALSE, pdTRUE, portMAX_DELAY);
+#ifdef USBAUDIO_RESUME
+                    // a stop or a pause in the checkpoint holds
+                    _state_restore_once();
+#endif
+                    // a track playing on the speaker carries on in the headset, a pause by the user stays
+                    if (s_unplug_paused.exchange(false)) {
+                        audio_player_resume();
+                    } else if (!s_play_stopped && audio_player_get_state() == AUDIO_PLAYER_STATE_IDLE) {
+                        _audio_play_resume();
+                    }
+#endif
                     break;
                 }
                 case UAC_HOST_DRIVER_EVENT_RX_CONNECTED: {
-                    // we don't support MIC in this example
                     ESP_LOGI(TAG, "UAC Device connected: MIC");
+#ifdef USBAUDIO_MIC_FEED
+                    _uac_mic_open(addr, iface_num);
+#endif
                     break;
                 }
                 default:
@@ -295,20 +2139,49 @@ static void uac_lib_task(void *arg)
                 switch (event) {
                 case UAC_HOST_DRIVER_EVENT_DISCONNECTED:
                     ESP_LOGI(TAG, "UAC Device disconnected");
+                    _uac_device_close(evt_queue.device_evt.handle);
                     break;
                 case UAC_HOST_DEVICE_EVENT_RX_DONE:
                     break;
                 case UAC_HOST_DEVICE_EVENT_TX_DONE:
                     break;
                 case UAC_HOST_DEVICE_EVENT_TRANSFER_ERROR:
+                    xSemaphoreTake(s_stream_lock, portMAX_DELAY);
+                    if (evt_queue.device_evt.handle == s_audio_player_handle) {
+                        _uac_recovery_start_locked("transfer error");
+                    }
+                    xSemaphoreGive(s_stream_lock);
                     break;
                 default:
                     break;
                 }
+            } else if (PLAY_EVENT == evt_queue.event_group) {
+                _play_apply(evt_queue.play_evt.request, evt_queue.play_evt.position_ms, evt_queue.play_evt.run,
+                            evt_queue.play_evt.since_us);
+            } else if (CONTROL_EVENT == evt_queue.event_group) {
+                // applied below, with everything requested until now
             } else if (APP_EVENT == evt_queue.event_group) {
                 break;
             }
         }
+        _control_apply();
+#ifdef USBAUDIO_RESUME
+        _state_restore_once();
+        _state_checkpoint();
+#endif
+        if (s_lost_disconnect != NULL) {
+            _uac_device_close(s_lost_disconnect.exchange(NULL));
+        }
+        if (s_close_pending != NULL) {
+            _uac_device_close(s_close_pending);
+        }
+#ifdef USBAUDIO_MIC_FEED
+        if (s_mic_close_pending != NULL) {
+            _uac_mic_close(s_mic_close_pending);
+        }
+#endif
+        _uac_recovery_poll();
+        _uac_stream_idle_check();
     }
 
     ESP_LOGI(TAG, "UAC Driver uninstall");
@@ -320,19 +2193,269 @@ audio_player_t get_audio_player_type(void)
     return audio_player_type;
 }
 
-uac_host_device_handle_t get_audio_player_handle(void)
+void *get_audio_player_handle(void)
 {
     return s_audio_player_handle;
 }
 
-void app_main(void)
+void get_idle_stats(usbaudio_idle_stats_t *stats)
 {
-    s_event_queue = xQueueCreate(10, sizeof(s_event_queue_t));
-    assert(s_event_queue != NULL);
-    /* Initialize I2C (for touch and audio) */
-    bsp_i2c_init();
+    _stats_copy(stats, &s_idle_stats, sizeof(*stats));
+}
+
+void get_recovery_stats(usbaudio_recovery_stats_t *stats)
+{
+    _stats_copy(stats, &s_recovery_stats, sizeof(*stats));
+}
+
+void get_hotplug_stats(usbaudio_hotplug_stats_t *stats)
+{
+    _stats_copy(stats, &s_hotplug_stats, sizeof(*stats));
+    stats->dropped_events = s_dropped_events;
+}
+
+bool is_headset_connected(void)
+{
+    return s_headset_present;
+}
+
+esp_err_t register_presence_callback(usbaudio_presence_cb_t cb, void *arg)
+{
+    int index = s_presence_listener_count;
+    if (cb == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (index >= USBAUDIO_PRESENCE_MAX_LISTENERS) {
+        return ESP_ERR_NO_MEM;
+    }
+    s_presence_listeners[index].cb = cb;
+    s_presence_listeners[index].arg = arg;
+    // the slot is complete before uac_lib_task can see it
+    s_presence_listener_count = index + 1;
+    return ESP_OK;
+}
+
+void get_presence_stats(usbaudio_presence_stats_t *stats)
+{
+    _stats_copy(stats, &s_presence_stats, sizeof(*stats));
+}
+
+void get_seek_stats(usbaudio_seek_stats_t *stats)
+{
+    _stats_copy(stats, &s_seek_stats, sizeof(*stats));
+}
+
+void get_control_stats(usbaudio_control_stats_t *stats)
+{
+    _stats_copy(stats, &s_control_stats, sizeof(*stats));
+    stats->requests = s_control_requests;
+}
+
+void USBAudioComponent::play()
+{
+    _play_request(PLAY_REQUEST_PLAY, 0, 0);
+}
 
+void USBAudioComponent::pause()
+{
+    _play_request(PLAY_REQUEST_PAUSE, 0, 0);
+}
+
+void USBAudioComponent::stop()
+{
+    _play_request(PLAY_REQUEST_STOP, 0, 0);
+}
+
+esp_err_t USBAudioComponent::seek(uint32_t position_ms)
+{
+    const audio_seek_index_t *index = s_seek_index;
+    _stats_add(&s_seek_stats.count, 1);
+    esp_err_t ret = ESP_OK;
+    if (index == NULL) {
+        // no scan on the playback path, the index task is still at it or failed
+        ESP_LOGW(TAG, "Seek index of '%s' not available", MP3_FILE_NAME);
+        ret = ESP_ERR_INVALID_STATE;
+    } else if (position_ms >= audio_seek_duration_ms(index)) {
+        ret = ESP_ERR_INVALID_ARG;
+    } else {
+        // opened by uac_lib_task, a failure there is counted but not returned
+        ret = _play_request(PLAY_REQUEST_SEEK, position_ms, 0);
+    }
+    if (ret != ESP_OK) {
+        _stats_add(&s_seek_stats.failed, 1);
+    }
+    return ret;
+}
+
+uint32_t USBAudioComponent::get_position_ms()
+{
+    return _play_position_ms();
+}
+
+uint32_t USBAudioComponent::get_duration_ms()
+{
+    const audio_seek_index_t *index = s_seek_index;
+    return index != NULL ? audio_seek_duration_ms(index) : 0;
+}
+
+void USBAudioComponent::dump_trace(FILE *out)
+{
+#ifndef USBAUDIO_TRACE
+    ESP_LOGW(TAG, "Built without trace: true, the trace is empty");
+#endif
+    ESP_LOGI(TAG, "Trace begin");
+    audio_trace_dump(out);
+    fflush(out);
+    ESP_LOGI(TAG, "Trace end");
+}
+
+void USBAudioComponent::set_volume(float volume)
+{
+    volume = volume < 0.0f ? 0.0f : (volume > 1.0f ? 1.0f : volume);
+    this->current_volume_ = volume;
+    s_volume = (int)lrintf(volume * 100.0f);
+    _control_request(esp_timer_get_time());
+}
+
+void get_sink_profile(usbaudio_sink_profile_t *profile)
+{
+#ifdef USBAUDIO_SINK_PROFILE
+    *profile = s_sink_profile;
+#else
+    // not built in, nothing counted
+    *profile = usbaudio_sink_profile_t();
+#endif
+}
+
+#ifdef USBAUDIO_LATENCY
+/**
+ * @brief Capture on the codec microphone
+ *
+ * While the headset plays, the codec is free and is set to 48 kHz 16-bit stereo until
+ * stop_latency_measurement(). When the speaker itself is the output the codec runs in the
+ * playback format and is read as is.
+ */
+esp_err_t start_latency_measurement(void)
+{
+    audio_latency_config_t config = {
+        .read_fn = bsp_i2s_read,
+        .capture_rate = 48000,
+        .capture_bits = 16,
+        .capture_channels = 2,
+        .threshold = USBAUDIO_LATENCY_THRESHOLD,
+        .interval_ms = USBAUDIO_LATENCY_INTERVAL_MS,
+        .timeout_ms = USBAUDIO_LATENCY_TIMEOUT_MS,
+        .task_priority = USER_TASK_PRIORITY + 1,
+        .task_core = 1,
+    };
+    if (audio_latency_is_running()) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (_usb_output_active()) {
+        xSemaphoreTake(s_stream_lock, portMAX_DELAY);
+        esp_err_t ret = bsp_codec_set_fs(config.capture_rate, config.capture_bits, I2S_SLOT_MODE_STEREO);
+        s_latency_codec_taken = ret == ESP_OK;
+        xSemaphoreGive(s_stream_lock);
+        if (ret != ESP_OK) {
+            return ret;
+        }
+    } else {
+        config.capture_rate = s_sink_rate;
+        config.capture_bits = (uint8_t)s_sink_bits;
+        config.capture_channels = (uint8_t)s_sink_ch;
+    }
+    ESP_LOGI(TAG, "Latency measurement on %s, UAC buffer %d / threshold %d bytes",
+             _usb_output_active() ? "USB" : "I2S",
+             USBAUDIO_UAC_BUFFER_SIZE, USBAUDIO_UAC_BUFFER_THRESHOLD);
+    esp_err_t ret = audio_latency_start(&config);
+    if (ret != ESP_OK) {
+        stop_latency_measurement();
+    }
+    return ret;
+}
+
+void stop_latency_measurement(void)
+{
+    audio_latency_stop();
+    xSemaphoreTake(s_stream_lock, portMAX_DELAY);
+    if (s_latency_codec_taken) {
+        s_latency_codec_taken = false;
+        esp_err_t ret = bsp_codec_set_fs(s_codec_rate, s_codec_bits, s_codec_ch);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Codec format not restored: %s", esp_err_to_name(ret));
+        }
+    }
+    xSemaphoreGive(s_stream_lock);
+}
+#endif
+
+#ifdef USBAUDIO_ASSETS
+/**
+ * @brief Play a clip from the asset partition
+ *
+ * PCM clips are mixed into the sink buffers straight from the mapped flash. ADPCM clips
+ * are decoded to PSRAM first and freed once played.
+ *
+ * @param name: clip name in the asset image
+ * @param start_us: esp_timer time the clip should be heard, 0 for as soon as possible
+ */
+esp_err_t play_asset(const char *name, int64_t start_us)
+{
+    audio_asset_t asset;
+    esp_err_t ret = audio_assets_find(name, &asset);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "No asset clip '%s'", name);
+        return ret;
+    }
+    uint32_t sink_rate = s_sink_rate;
+    if (asset.sample_rate != sink_rate) {
+        ESP_LOGW(TAG, "Clip '%s' is %"PRIu32" Hz, the sink runs at %"PRIu32" Hz", name, asset.sample_rate, sink_rate);
+    }
+    audio_clip_t clip = {
+        .pcm = (const int16_t *)asset.data,
+        .frames = asset.frames,
+        .channels = asset.channels,
+        .sample_rate = asset.sample_rate,
+        .done_cb = NULL,
+        .done_arg = NULL,
+    };
+    if (asset.codec == AUDIO_ASSET_IMA_ADPCM) {
+        int16_t *pcm = (int16_t *)heap_caps_malloc(asset.frames * asset.channels * sizeof(int16_t),
+                                                   MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (pcm == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+        audio_asset_decode(&asset, pcm);
+        clip.pcm = pcm;
+        clip.done_cb = heap_caps_free;
+        clip.done_arg = pcm;
+    }
+    if (start_us == 0) {
+        start_us = esp_timer_get_time() + USBAUDIO_SCHEDULE_LATENCY_US;
+    }
+    ret = audio_schedule_clip_at_time(&clip, start_us, NULL);
+    if (ret != ESP_OK && clip.done_cb) {
+        clip.done_cb(clip.done_arg);
+    }
+    return ret;
+}
+#endif
+
+const boot_stage_record_t *get_boot_timeline(size_t *count)
+{
+    *count = BOOT_STAGE_MAX;
+    return s_boot_timeline;
+}
+
+/**
+ * @brief Bring up the display in parallel with SPIFFS and the audio player
+ *
+ * @param[in] arg  Not used
+ */
+static void display_init_task(void *arg)
+{
     /* Initialize display and LVGL */
+    _boot_stage_begin(BOOT_STAGE_DISPLAY);
     bsp_display_cfg_t cfg = {
         .lvgl_port_cfg = ESP_LVGL_PORT_INIT_CONFIG(),
         .buffer_size = BSP_LCD_H_RES * CONFIG_BSP_LCD_DRAW_BUF_HEIGHT,
@@ -345,55 +2468,135 @@ void app_main(void)
 
     /* Set display brightness to 100% */
     bsp_display_backlight_on();
+    _boot_stage_end(BOOT_STAGE_DISPLAY);
 
-    bsp_spiffs_mount();
-
-    file_iterator = file_iterator_new(SPIFFS_BASE);
-    assert(file_iterator != NULL);
-
-    /* Configure I2S peripheral and Power Amplifier */
-    bsp_board_init();
-
-    /* Initialize audio player, the default configuration is set to play through the USB headset. */
-    player_config.mute_fn = _audio_player_mute_fn;
-    player_config.write_fn = _audio_player_write_fn;
-    player_config.clk_set_fn = _audio_player_std_clock;
-    player_config.priority = 1;
-
-    ESP_ERROR_CHECK(audio_player_new(player_config));
+    /* The UI lists the files, wait for SPIFFS */
+    xEventGroupWaitBits(s_boot_events, BOOT_READY_FILES, pdFALSE, pdTRUE, portMAX_DELAY);
+    _boot_stage_begin(BOOT_STAGE_UI);
+    bsp_display_lock(0);
+    ui_audio_start(file_iterator);
+    bsp_display_unlock();
+    _boot_stage_end(BOOT_STAGE_UI);
+    vTaskDelete(NULL);
+}
 
-    ESP_ERROR_CHECK(audio_player_callback_register(_audio_player_callback, NULL));
+void app_main(void)
+{
+    s_boot_timeline[BOOT_STAGE_FIRST_AUDIO].start_us = esp_timer_get_time();
+    s_event_queue = xQueueCreate(32, sizeof(s_event_queue_t));
+    assert(s_event_queue != NULL);
+    s_stream_lock = xSemaphoreCreateMutex();
+    assert(s_stream_lock != NULL);
+    s_stats_lock = xSemaphoreCreateMutex();
+    assert(s_stats_lock != NULL);
+    s_boot_events = xEventGroupCreate();
+    assert(s_boot_events != NULL);
+    s_stream_events = xEventGroupCreate();
+    assert(s_stream_events != NULL);
+    xEventGroupSetBits(s_stream_events, STREAM_EVENT_READY);
+#ifdef USBAUDIO_METER
+    audio_meter_init();
+#endif
+#ifdef USBAUDIO_MIC_FEED
+    audio_mic_feed_init();
+#endif
+#ifdef USBAUDIO_SCHEDULE
+    s_sink_write_lock = xSemaphoreCreateMutex();
+    assert(s_sink_write_lock != NULL);
+#endif
 
+    /* Start USB host and UAC driver first, enumeration runs while the rest boots */
     static TaskHandle_t uac_task_handle = NULL;
     BaseType_t ret = xTaskCreatePinnedToCore(uac_lib_task, "uac_events", 4096, NULL,
                                              USER_TASK_PRIORITY, &uac_task_handle, 1);
     assert(ret == pdTRUE);
+#ifdef USBAUDIO_MIC_FEED
+    ret = xTaskCreatePinnedToCore(mic_capture_task, "mic_capture", 3072, NULL,
+                                  USER_TASK_PRIORITY + 1, &s_mic_task, 1);
+    assert(ret == pdTRUE);
+#endif
     ret = xTaskCreatePinnedToCore(usb_lib_task, "usb_events", 4096, (void *)uac_task_handle,
                                   USB_HOST_TASK_PRIORITY, NULL, 1);
     assert(ret == pdTRUE);
 
-    bsp_display_lock(0);
-    ui_audio_start(file_iterator);
-    bsp_display_unlock();
-}
-};
-
-}  // namespace usbaudio
-}  // namespace esphome
-
-
-
-
-
-
+    /* Initialize I2C (for touch and audio) */
+    _boot_stage_begin(BOOT_STAGE_I2C);
+    bsp_i2c_init();
+    _boot_stage_end(BOOT_STAGE_I2C);
 
+    ret = xTaskCreatePinnedToCore(display_init_task, "display_init", 6144, NULL,
+                                  USER_TASK_PRIORITY, NULL, 0);
+    assert(ret == pdTRUE);
 
+    _boot_stage_begin(BOOT_STAGE_SPIFFS);
+    bsp_spiffs_mount();
 
+    file_iterator = file_iterator_new(SPIFFS_BASE);
+    assert(file_iterator != NULL);
+    _boot_stage_end(BOOT_STAGE_SPIFFS);
+#ifdef USBAUDIO_ASSETS
+    /* Clips are used in place from the mapped partition, playback works without it */
+    if (audio_assets_mount(USBAUDIO_ASSETS_PARTITION) != ESP_OK) {
+        ESP_LOGW(TAG, "Asset clips not available");
+    }
+#endif
+    xEventGroupSetBits(s_boot_events, BOOT_READY_FILES);
+    ret = xTaskCreatePinnedToCore(seek_index_task, "seek_index", 3072, NULL, tskIDLE_PRIORITY + 1, NULL, 0);
+    assert(ret == pdTRUE);
 
+    /* Configure I2S peripheral and Power Amplifier */
+    _boot_stage_begin(BOOT_STAGE_BOARD);
+    bsp_board_init();
+    _boot_stage_end(BOOT_STAGE_BOARD);
 
+    /* Initialize audio player, the default configuration is set to play through the USB headset. */
+    _boot_stage_begin(BOOT_STAGE_PLAYER);
+    player_config.mute_fn = _audio_player_mute_fn;
+    player_config.write_fn = _audio_player_source_write_fn;
+    player_config.clk_set_fn = _audio_player_source_clock;
+    player_config.priority = 1;
 
+#ifdef USBAUDIO_MIXER
+    /* Route the player through the mixer, the mixer writes to the sink */
+    const audio_mixer_config_t mixer_config = {
+        .write_fn = _audio_player_write_fn,
+        .sample_rate = 48000,
+        .duck_level_db = USBAUDIO_MIXER_DUCK_DB,
+        .attack_ms = USBAUDIO_MIXER_ATTACK_MS,
+        .release_ms = USBAUDIO_MIXER_RELEASE_MS,
+        .task_priority = USER_TASK_PRIORITY,
+        .task_core = 0,
+    };
+    ESP_ERROR_CHECK(audio_mixer_new(&mixer_config));
+    const audio_mixer_stream_config_t music_config = {
+        .priority = 0,
+        .gain = 1.0f,
+        .channels = 2,
+        .bits = 16,
+        .buffer_size = 8192,
+    };
+    ESP_ERROR_CHECK(audio_mixer_stream_open(&music_config, &s_music_stream));
+#endif
 
+    ESP_ERROR_CHECK(audio_player_new(player_config));
 
+    ESP_ERROR_CHECK(audio_player_callback_register(_audio_player_callback, NULL));
 
+#ifdef USBAUDIO_SCHEDULE
+    /* Scheduled clips are placed by the sink stage, after the mixer */
+    const audio_schedule_config_t schedule_config = {
+        .write_fn = _audio_schedule_write_fn,
+        .output_latency_us = USBAUDIO_SCHEDULE_LATENCY_US,
+        .task_priority = USER_TASK_PRIORITY,
+        .task_core = 0,
+    };
+    ESP_ERROR_CHECK(audio_schedule_init(&schedule_config));
+#endif
+    _boot_stage_end(BOOT_STAGE_PLAYER);
+    xEventGroupSetBits(s_boot_events, BOOT_READY_PLAYER);
+}
 
+}  // namespace usbaudio
+}  // namespace esphome
 
+#endif // CONFIG_ESP32_S3_USB_OTG
@@ -1,7 +1,8 @@
-usbaudio.h Header File
+// usbaudio.h Header File
 
 #pragma once
 
+#include <stdio.h>
 #include "esphome/core/component.h"
 #include "esphome/components/media_player/media_player.h"
 
@@ -31,10 +32,108 @@ enum AUDIO_PLAYER_MUTE_SETTING {
     AUDIO_PLAYER_MUTE = 0
 };
 
+// Idle suspend / resume statistics of the UAC speaker
+struct usbaudio_idle_stats_t {
+    uint32_t suspend_count;
+    uint32_t resume_count;
+    uint32_t last_resume_latency_us;    // resume request to first sample accepted by the device
+    uint32_t max_resume_latency_us;
+};
+
+// In-place recovery of the UAC speaker stream after transfer errors
+struct usbaudio_recovery_stats_t {
+    uint32_t error_count;       // faults seen, including ones during a recovery
+    uint32_t recovered_count;
+    uint32_t failed_count;      // recoveries given up: the output fell back to I2S, or with no
+                                // I2S fallback built in, the player is paused while it retries
+    uint32_t last_recovery_us;  // fault to stream restarted
+    uint32_t max_recovery_us;
+};
+
+// Speaker handle bookkeeping across hotplug, opened_count - closed_count is 0 or 1
+struct usbaudio_hotplug_stats_t {
+    uint32_t opened_count;
+    uint32_t closed_count;
+    uint32_t dropped_events;    // driver events that did not fit in the event queue
+};
+
+// Headset plug / unplug and how long the output takes to follow
+struct usbaudio_presence_stats_t {
+    uint32_t connect_count;
+    uint32_t disconnect_count;
+    uint32_t last_switch_us;    // speaker connect event to first sample accepted by the headset
+    uint32_t max_switch_us;
+};
+
+// Called from uac_lib_task when the headset comes (true) or goes (false), keep it short
+typedef void (*usbaudio_presence_cb_t)(bool connected, void *arg);
+
+// Volume, mute and play/pause requests from the headset keys or the component
+struct usbaudio_control_stats_t {
+    uint32_t requests;          // key presses and set_volume() calls
+    uint32_t transfers;         // volume / mute changes sent, the rest were coalesced
+    uint32_t last_latency_us;   // oldest pending request to the change applied
+    uint32_t max_latency_us;
+};
+
+// seek() through the MP3 seek index: a lookup, a reopen at the indexed frame and at most
+// one index interval of decoded audio dropped, whatever the position in the file
+struct usbaudio_seek_stats_t {
+    uint32_t count;
+    uint32_t failed;            // index not built yet, past the end, or the file didn't open
+    uint32_t last_latency_us;   // seek() to first sample at the new position written to the output
+    uint32_t max_latency_us;
+};
+
+// CPU cycles spent per sink write call, built with USBAUDIO_SINK_PROFILE, all zero otherwise
+struct usbaudio_sink_profile_t {
+    uint32_t write_calls;
+    uint64_t write_cycles_total;
+    uint32_t write_cycles_min;  // closest to the pure dispatch + copy cost
+};
+
+// Boot stages, in the order they are started
+enum boot_stage_t {
+    BOOT_STAGE_USB_HOST = 0,
+    BOOT_STAGE_UAC_DRIVER,
+    BOOT_STAGE_I2C,
+    BOOT_STAGE_DISPLAY,
+    BOOT_STAGE_SPIFFS,
+    BOOT_STAGE_BOARD,
+    BOOT_STAGE_PLAYER,
+    BOOT_STAGE_UI,
+    BOOT_STAGE_FIRST_AUDIO,     // app_main entry to first sample written to the output
+    BOOT_STAGE_MAX
+};
+
+// Start / end of a boot stage in esp_timer microseconds, 0 if not reached yet. esp_timer
+// starts during app startup: the ROM and second stage bootloader time is not included.
+struct boot_stage_record_t {
+    const char *name;
+    int64_t start_us;
+    int64_t end_us;
+};
+
 // Function declarations
 audio_player_t get_audio_player_type(void);
 void *get_audio_player_handle(void);
 uint8_t get_sys_volume(void);
+void get_idle_stats(usbaudio_idle_stats_t *stats);
+void get_recovery_stats(usbaudio_recovery_stats_t *stats);
+void get_hotplug_stats(usbaudio_hotplug_stats_t *stats);
+void get_control_stats(usbaudio_control_stats_t *stats);
+void get_seek_stats(usbaudio_seek_stats_t *stats);
+bool is_headset_connected(void);
+// Up to 4 listeners, register from setup()
+esp_err_t register_presence_callback(usbaudio_presence_cb_t cb, void *arg);
+void get_presence_stats(usbaudio_presence_stats_t *stats);
+void get_sink_profile(usbaudio_sink_profile_t *profile);
+const boot_stage_record_t *get_boot_timeline(size_t *count);
+// Impulse round-trip measurement, built with USBAUDIO_LATENCY, results from audio_latency_get_result()
+esp_err_t start_latency_measurement(void);
+void stop_latency_measurement(void);
+// Clip from the asset partition at an esp_timer time (0: now), built with USBAUDIO_ASSETS
+esp_err_t play_asset(const char *name, int64_t start_us);
 
 // USB Audio Component
 class USBAudioComponent : public Component {
@@ -43,11 +142,17 @@ public:
     void loop() override;
     void dump_config() override;
 
-    // Optional: Media player interface methods
+    // Optional: Media player interface methods, applied in order by the USB event task
     void play();
     void pause();
     void stop();
     void set_volume(float volume);
+    // Play from a position in ms, ESP_ERR_INVALID_STATE until the seek index is built
+    esp_err_t seek(uint32_t position_ms);
+    uint32_t get_position_ms();
+    uint32_t get_duration_ms();     // 0 until the seek index is built
+    // Trace ring as Chrome trace-event JSON, between the "Trace begin" and "Trace end" log lines
+    void dump_trace(FILE *out = stdout);
 
 private:
     // Internal state tracking